@@ -0,0 +1,420 @@
+#ifndef ANALYZE_H
+#define ANALYZE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chip8_def.h"
+#include "decode.h"
+#include "memory.h"
+#include "instructions.h"
+#include "quirks.h"
+#include "jit.h"
+
+/*
+Static rom analysis. Starting at PC_START with a rom loaded, follows every
+static edge (jumps, calls and the return sites they come back to, both sides
+of skips, fall-through) and cuts the code it reaches into basic blocks the way
+the block compiler does (jit_ends_block), so a block found here is the block
+jit_compile would build at the same address. Ret and Bnnn leave a block to
+wherever the run-time state says: ret comes back to a return site queued by
+its call, Bnnn targets are not followed and are flagged as indirect jumps.
+
+A second pass follows I through each block from the last Annn (or F000 nnnn)
+before it: sprites drawn and registers loaded from a known I mark their bytes
+as data, stores to a known I that hit code are flagged as self-modifying, and
+stores through an I that isn't known in the block are flagged as such.
+
+Loop depth, the number of backward edges whose range covers a block, is the
+hotness hint: code in loops runs most, code outside any runs once or per call.
+
+The result is what chip8-analyze prints and what chip8-aot compiles, and
+chip8_jit_prewarm compiles the blocks found at load time, hottest first,
+instead of on first execution. The decode cache needs nothing of it, pages
+are decoded whole when loaded (chip8_load_ram).
+*/
+#define ANALYZE_MAX_BLOCKS 8192
+#define ANALYZE_MAX_NEXT 3               // both sides of a skip, and one spare
+
+// Per-byte flags in Chip8_Analysis.map
+#define ANALYZE_CODE          0x001      // byte of a reachable instruction
+#define ANALYZE_INSTR         0x002      // first byte of one
+#define ANALYZE_BLOCK         0x004      // a block starts here
+#define ANALYZE_JUMP_TARGET   0x008
+#define ANALYZE_CALL_TARGET   0x010
+#define ANALYZE_DATA          0x020      // read by a sprite draw or register load from a known I
+#define ANALYZE_INDIRECT      0x040      // instruction is a Bnnn jump
+#define ANALYZE_SMC           0x080      // instruction stores into code
+#define ANALYZE_STORE_UNKNOWN 0x100      // instruction stores through an I not known statically
+
+typedef struct {
+    uint16_t start;                  // address of the first instruction
+    uint16_t end;                    // one past the last byte of the last instruction
+    uint16_t count;                  // number of instructions
+    uint16_t next[ANALYZE_MAX_NEXT]; // pcs execution can be at right after the block
+    uint8_t num_next;
+    uint8_t dynamic;                 // or anywhere: ret, Bnnn, an invalid op, exit
+    uint16_t loop_depth;             // backward edges around the block, 0 outside loops
+} Chip8_AnalysisBlock;
+
+typedef struct {
+    uint8_t quirks;                  // profile the rom was analyzed under
+    uint16_t map[TOTAL_RAM];         // ANALYZE_* flags per byte
+    Chip8_AnalysisBlock blocks[ANALYZE_MAX_BLOCKS];
+    uint32_t num_blocks;
+    uint32_t block_at[TOTAL_RAM];    // block index + 1 of the block starting at each address, 0 = none
+    uint8_t complete;                // FALSE if discovery stopped at ANALYZE_MAX_BLOCKS
+
+    // totals
+    uint32_t num_instrs;
+    uint32_t num_data_bytes;
+    uint32_t num_indirect;
+    uint32_t num_smc;
+    uint32_t num_store_unknown;
+
+    // scratch
+    uint8_t queued[TOTAL_RAM];
+    uint16_t worklist[TOTAL_RAM];
+    uint32_t num_work;
+    int32_t depth_delta[TOTAL_RAM + 1];
+} Chip8_Analysis;
+
+static void analyze_push(Chip8_Analysis* a, const Chip8* chip8, uint32_t addr) {
+    addr &= chip8->ram_mask;
+    if (!a->queued[addr]) {
+        a->queued[addr] = TRUE;
+        a->worklist[a->num_work++] = (uint16_t)addr;
+    }
+}
+
+static void analyze_next(Chip8_Analysis* a, const Chip8* chip8, Chip8_AnalysisBlock* block, uint32_t pc, uint16_t flag) {
+    pc &= chip8->ram_mask;
+    block->next[block->num_next++] = (uint16_t)pc;
+    a->map[pc] |= flag;
+    analyze_push(a, chip8, pc);
+}
+
+/*
+Where execution goes after the last instruction of a block, at last_pc
+*/
+static void analyze_successors(Chip8_Analysis* a, const Chip8* chip8, Chip8_AnalysisBlock* block,
+                               Chip8_Instr last, uint16_t last_pc) {
+    Chip8_Handler handler = QUIRK_HANDLERS[chip8->quirks][last.id];
+
+    if (handler == op_invalid || handler == exit_interpreter) {
+        block->dynamic = TRUE;
+        return;
+    }
+    switch (last.id) {
+        case OP_JP_ADDR:
+            analyze_next(a, chip8, block, last.nnn, ANALYZE_JUMP_TARGET);
+            break;
+        case OP_CALL_ADDR:
+            analyze_next(a, chip8, block, last.nnn, ANALYZE_CALL_TARGET);
+            analyze_push(a, chip8, last_pc + 2);  // where its ret comes back to
+            break;
+        case OP_RET:
+            block->dynamic = TRUE;
+            break;
+        case OP_JP_V0_ADDR:
+            a->map[last_pc] |= ANALYZE_INDIRECT;
+            a->num_indirect++;
+            block->dynamic = TRUE;
+            break;
+        case OP_SE_VX_BYTE:
+        case OP_SNE_VX_BYTE:
+        case OP_SE_VX_VY:
+        case OP_SNE_VX_VY:
+        case OP_SKP_VX:
+        case OP_SKNP_VX: {
+            // an XO-CHIP skip steps over F000 nnnn whole
+            uint8_t long_skip = handler != QUIRK_HANDLERS[QUIRKS_DEFAULT][last.id] &&
+                                chip8_instr_at(chip8, last_pc + 2).opcode == 0xF000;
+            analyze_next(a, chip8, block, last_pc + 2, 0);
+            analyze_next(a, chip8, block, last_pc + (long_skip ? 6 : 4), ANALYZE_JUMP_TARGET);
+            break;
+        }
+        case OP_LD_VX_K:
+            analyze_next(a, chip8, block, last_pc, 0);      // still waiting
+            analyze_next(a, chip8, block, last_pc + 2, 0);
+            break;
+        case OP_LD_I_LONG:
+            analyze_next(a, chip8, block, last_pc + 4, 0);
+            break;
+        default:
+            analyze_next(a, chip8, block, last_pc + 2, 0);
+            break;
+    }
+}
+
+/*
+Pass 1: finds the blocks reachable from PC_START and marks their bytes as code
+*/
+static void analyze_discover(Chip8_Analysis* a, const Chip8* chip8) {
+    analyze_push(a, chip8, PC_START);
+
+    while (a->num_work > 0) {
+        uint16_t start = a->worklist[--a->num_work];
+        if (a->num_blocks == ANALYZE_MAX_BLOCKS) {
+            a->complete = FALSE;
+            return;
+        }
+
+        Chip8_AnalysisBlock* block = &a->blocks[a->num_blocks];
+        block->start = start;
+        uint32_t addr = start;
+        Chip8_Instr instr = {0};
+        uint8_t ended = FALSE;
+        while (block->count < JIT_MAX_BLOCK_LEN && addr + 1 <= chip8->ram_mask) {
+            instr = chip8_instr_at(chip8, addr);
+            a->map[addr] |= ANALYZE_CODE | ANALYZE_INSTR;
+            a->map[addr + 1] |= ANALYZE_CODE;
+            if (instr.id == OP_LD_I_LONG && QUIRK_HANDLERS[chip8->quirks][instr.id] != op_invalid) {
+                a->map[(addr + 2) & chip8->ram_mask] |= ANALYZE_CODE;
+                a->map[(addr + 3) & chip8->ram_mask] |= ANALYZE_CODE;
+            }
+            block->count++;
+            addr += 2;
+            // an instruction the machine doesn't have runs as op_invalid (quirks.h)
+            if (jit_ends_block(instr.id) || QUIRK_HANDLERS[chip8->quirks][instr.id] == op_invalid) {
+                ended = TRUE;
+                break;
+            }
+        }
+        // the last byte of ram can't start a block, the interpreter takes it
+        if (block->count == 0) {
+            continue;
+        }
+        block->end = addr;
+        a->num_blocks++;
+        a->block_at[start] = a->num_blocks;
+        a->map[start] |= ANALYZE_BLOCK;
+        a->num_instrs += block->count;
+
+        if (ended) {
+            analyze_successors(a, chip8, block, instr, addr - 2);
+        } else {
+            analyze_next(a, chip8, block, addr, 0);
+        }
+    }
+}
+
+static void analyze_mark_data(Chip8_Analysis* a, const Chip8* chip8, uint32_t i, uint32_t len) {
+    for (uint32_t k = 0; k < len; k++) {
+        a->map[(i + k) & chip8->ram_mask] |= ANALYZE_DATA;
+    }
+}
+
+static void analyze_store(Chip8_Analysis* a, const Chip8* chip8, uint16_t pc, uint8_t i_known, uint32_t i, uint32_t len) {
+    if (!i_known) {
+        a->map[pc] |= ANALYZE_STORE_UNKNOWN;
+        a->num_store_unknown++;
+        return;
+    }
+    for (uint32_t k = 0; k < len; k++) {
+        if (a->map[(i + k) & chip8->ram_mask] & ANALYZE_CODE) {
+            a->map[pc] |= ANALYZE_SMC;
+            a->num_smc++;
+            return;
+        }
+    }
+}
+
+/*
+Pass 2: follows I through every block, see the comment at the top
+*/
+static void analyze_data(Chip8_Analysis* a, const Chip8* chip8) {
+    for (uint32_t b = 0; b < a->num_blocks; b++) {
+        const Chip8_AnalysisBlock* block = &a->blocks[b];
+        uint8_t i_known = FALSE;
+        uint32_t i = 0;
+
+        for (uint32_t k = 0; k < block->count; k++) {
+            uint16_t pc = (block->start + 2 * k) & chip8->ram_mask;
+            Chip8_Instr instr = chip8_instr_at(chip8, pc);
+            if (QUIRK_HANDLERS[chip8->quirks][instr.id] == op_invalid) {
+                continue;
+            }
+            uint32_t range = (instr.x > instr.y ? instr.x - instr.y : instr.y - instr.x) + 1;
+            switch (instr.id) {
+                case OP_LD_I_ADDR:
+                    i_known = TRUE;
+                    i = instr.nnn;
+                    break;
+                case OP_LD_I_LONG:
+                    i_known = TRUE;
+                    i = (chip8_read_ram(chip8, pc + 2) << 8) | chip8_read_ram(chip8, pc + 3);
+                    break;
+                case OP_ADD_I_VX:
+                case OP_LD_F_VX:
+                case OP_LD_HF_VX:
+                    i_known = FALSE;
+                    break;
+                case OP_DRW:
+                    if (i_known) {
+                        analyze_mark_data(a, chip8, i, instr.n);
+                    }
+                    break;
+                case OP_DRW_16:
+                    if (i_known) {
+                        analyze_mark_data(a, chip8, i, 32);
+                    }
+                    break;
+                case OP_LD_V_REGS:
+                    if (i_known) {
+                        analyze_mark_data(a, chip8, i, instr.x + 1);
+                    }
+                    i_known = FALSE;     // i_after moves I on some profiles
+                    break;
+                case OP_LD_V_RANGE:
+                    if (i_known) {
+                        analyze_mark_data(a, chip8, i, range);
+                    }
+                    break;
+                case OP_ST_BCD_VX:
+                    analyze_store(a, chip8, pc, i_known, i, 3);
+                    break;
+                case OP_ST_V_REGS:
+                    analyze_store(a, chip8, pc, i_known, i, instr.x + 1);
+                    i_known = FALSE;
+                    break;
+                case OP_ST_V_RANGE:
+                    analyze_store(a, chip8, pc, i_known, i, range);
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+
+    for (uint32_t addr = 0; addr <= chip8->ram_mask; addr++) {
+        a->num_data_bytes += (a->map[addr] & ANALYZE_DATA) != 0;
+    }
+}
+
+/*
+Pass 3: loop depth of every block, from the backward edges (a successor at or
+before the block's start) and the address ranges they span
+*/
+static void analyze_loops(Chip8_Analysis* a) {
+    for (uint32_t b = 0; b < a->num_blocks; b++) {
+        const Chip8_AnalysisBlock* block = &a->blocks[b];
+        for (int k = 0; k < block->num_next; k++) {
+            if (block->next[k] <= block->start) {
+                a->depth_delta[block->next[k]]++;
+                a->depth_delta[block->start + 1]--;
+            }
+        }
+    }
+    int32_t depth = 0;
+    for (uint32_t addr = 0; addr < TOTAL_RAM; addr++) {
+        depth += a->depth_delta[addr];
+        if (a->block_at[addr] != 0) {
+            a->blocks[a->block_at[addr] - 1].loop_depth = (uint16_t)depth;
+        }
+    }
+}
+
+/*
+Analyzes the rom loaded into chip8 under chip8's quirk profile. Returns FALSE
+if the rom has more than ANALYZE_MAX_BLOCKS blocks, analyzing only that many.
+*/
+int chip8_analyze(Chip8_Analysis* a, const Chip8* chip8) {
+    memset(a, 0, sizeof(*a));
+    a->quirks = chip8->quirks;
+    a->complete = TRUE;
+
+    analyze_discover(a, chip8);
+    analyze_data(a, chip8);
+    analyze_loops(a);
+    return a->complete;
+}
+
+static int analyze_by_depth(const void* l, const void* r) {
+    const Chip8_AnalysisBlock* a = *(const Chip8_AnalysisBlock* const*)l;
+    const Chip8_AnalysisBlock* b = *(const Chip8_AnalysisBlock* const*)r;
+    if (a->loop_depth != b->loop_depth) {
+        return (a->loop_depth < b->loop_depth) ? 1 : -1;
+    }
+    return (a->start > b->start) - (a->start < b->start);
+}
+
+/*
+Start addresses of the blocks chip8_analyze finds in the rom loaded into chip8,
+deepest loops first: the order chip8_jit_prewarm compiles them in. It depends
+on the rom and quirk profile only, so one list serves every instance running
+them (romcache.h keeps one per rom image). Returns the number of blocks, the
+list in *starts for the caller to free, or -1 if out of memory.
+*/
+long chip8_prewarm_order(const Chip8* chip8, uint16_t** starts) {
+    Chip8_Analysis* a = malloc(sizeof(Chip8_Analysis));
+    const Chip8_AnalysisBlock** order = malloc(ANALYZE_MAX_BLOCKS * sizeof(*order));
+    *starts = malloc(ANALYZE_MAX_BLOCKS * sizeof(**starts));
+    if (a == NULL || order == NULL || *starts == NULL) {
+        free(a);
+        free(order);
+        free(*starts);
+        *starts = NULL;
+        return -1;
+    }
+
+    chip8_analyze(a, chip8);
+    for (uint32_t b = 0; b < a->num_blocks; b++) {
+        order[b] = &a->blocks[b];
+    }
+    qsort(order, a->num_blocks, sizeof(*order), analyze_by_depth);
+    for (uint32_t b = 0; b < a->num_blocks; b++) {
+        (*starts)[b] = order[b]->start;
+    }
+
+    long count = a->num_blocks;
+    free(a);
+    free(order);
+    uint16_t* fit = realloc(*starts, (count ? count : 1) * sizeof(**starts));
+    if (fit != NULL) {
+        *starts = fit;
+    }
+    return count;
+}
+
+/*
+Compiles the blocks at starts, a chip8_prewarm_order of the rom chip8 runs, with
+the block compiler (which must be enabled), as far as the block arena goes
+without a flush. Returns how many were compiled.
+*/
+int chip8_jit_prewarm_blocks(Chip8* chip8, const uint16_t* starts, uint32_t count) {
+    Chip8_Jit* jit = chip8->jit;
+    int compiled = 0;
+    for (uint32_t b = 0; b < count; b++) {
+        if (jit->block_count == JIT_MAX_BLOCKS || jit->op_count + JIT_MAX_BLOCK_LEN > JIT_MAX_OPS) {
+            break;
+        }
+        if (jit->block_at[starts[b]] == 0 && jit_compile(chip8, starts[b]) != NULL) {
+            compiled++;
+        }
+    }
+    return compiled;
+}
+
+/*
+Compiles the blocks chip8_analyze finds in chip8's rom with the block compiler
+(which must be enabled), deepest loops first. Call after loading the rom.
+Analyzes the rom anew, instances of a cached rom image share one analysis with
+chip8_rom_prewarm instead. Returns how many were compiled, -1 if the analysis
+can't be allocated.
+*/
+int chip8_jit_prewarm(Chip8* chip8) {
+    uint16_t* starts;
+    if (chip8->jit == NULL) {
+        return -1;
+    }
+    long count = chip8_prewarm_order(chip8, &starts);
+    if (count < 0) {
+        return -1;
+    }
+    int compiled = chip8_jit_prewarm_blocks(chip8, starts, (uint32_t)count);
+    free(starts);
+    return compiled;
+}
+
+#endif
@@ -0,0 +1,170 @@
+#ifndef AOT_H
+#define AOT_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chip8_def.h"
+#include "decode.h"
+#include "memory.h"
+#include "instructions.h"
+#include "quirks.h"
+#include "idle.h"
+#include "profile.h"
+#include "trace.h"
+
+/*
+Runtime side of the ahead-of-time compiler. chip8-aot (chip8_aot.c) takes the
+blocks static analysis (analyze.h) finds in a rom and writes out C: one run
+function per rom and quirk profile, with a label per basic block and the
+block's instructions as direct calls of the profile's handlers on constant
+operands, so the C compiler inlines and folds them like hand-written code.
+Static successors (jumps, calls, fall-through, both sides of a skip) are
+jumped to directly, everything else goes through a switch on pc.
+
+Whatever the compiled code doesn't cover runs through the interpreter one
+instruction at a time: pcs no block starts at (Bnnn targets, returns into
+code not found statically, code the rom writes into ram), a block that doesn't
+fit in what is left of the cycle budget, and blocks gone stale. A block is
+stale once a store lands on one of its bytes (code_map / code_write_hook as
+for the block compiler), which stays the case for the rest of the instance's
+life.
+
+The generated file is included into a binary's .c, which picks an image by the
+loaded rom's hash (chip8_rom_hash) and profile, see chip8-batch --aot. An
+instance runs compiled code or the block compiler, not both.
+*/
+
+typedef struct {
+    uint16_t start;                  // address of the first instruction
+    uint16_t end;                    // one past the last byte of the last instruction
+} Chip8_AotBlock;
+
+typedef struct {
+    const char* name;                // rom path it was compiled from
+    uint64_t rom_hash;               // chip8_rom_hash of the rom image
+    uint32_t rom_size;
+    uint8_t quirks;                  // quirk profile it was compiled for
+    uint32_t num_blocks;
+    const Chip8_AotBlock* blocks;    // block k is label b_k of run
+    uint64_t (*run)(Chip8* chip8, uint64_t n); // chip8_run_cycles for instances of this rom
+} Chip8_AotImage;
+
+struct Chip8_Aot_t {
+    const Chip8_AotImage* image;
+    uint8_t code_map[TOTAL_RAM / 8]; // bit per ram byte covered by a compiled block
+    uint64_t invalidations;          // blocks gone stale
+    uint8_t stale[];                 // per block, TRUE once its code was written to
+};
+
+// One compiled instruction: the same as a dispatch loop iteration, on constants.
+// Tracing records the whole block before its first one (CHIP8_TRACE_BLOCK).
+#define CHIP8_AOT_OP(profile, op_id, opcode_, x_, y_, n_, kk_, nnn_)                              \
+    chip8->op = (Chip8_Instr){ .opcode = opcode_, .nnn = nnn_, .id = op_id, .x = x_, .y = y_, .n = n_, .kk = kk_ }; \
+    chip8->current_op = opcode_;                                                                   \
+    CHIP8_PROFILE_OP(chip8, chip8->op);                                                            \
+    QUIRK_HANDLERS[profile][op_id](chip8)
+
+// Skips the idle loop at the start of a block, see the interpreter's IDLE_CHECK;
+// budget is what is left after the block's first instruction
+#define CHIP8_AOT_IDLE(op_id, opcode_, x_, y_, n_, kk_, nnn_, budget)                             \
+    if (CHIP8_MAY_IDLE(op_id)) {                                                                   \
+        Chip8_Instr idle_instr = { .opcode = opcode_, .nnn = nnn_, .id = op_id, .x = x_, .y = y_, .n = n_, .kk = kk_ }; \
+        uint64_t idle = chip8_idle_skip(chip8, idle_instr, budget);                                \
+        executed += idle;                                                                          \
+        chip8->idle_cycles += idle;                                                                \
+        CHIP8_TRACE_IDLE(chip8, idle);                                                             \
+    }
+
+/*
+Runs the instruction at pc through the interpreter, the compiled code's way out.
+budget is what is left after it. Returns the cycles used, idle ones included.
+*/
+static inline uint64_t chip8_aot_interpret(Chip8* chip8, const uint8_t profile, uint64_t budget) {
+    uint64_t idle = 0;
+
+    chip8->op = chip8_instr_at(chip8, chip8->pc_reg);
+    chip8->current_op = chip8->op.opcode;
+    if (CHIP8_MAY_IDLE(chip8->op.id)) {
+        idle = chip8_idle_skip(chip8, chip8->op, budget);
+        chip8->idle_cycles += idle;
+        CHIP8_TRACE_IDLE(chip8, idle);
+    }
+    CHIP8_PROFILE_OP(chip8, chip8->op);
+    CHIP8_TRACE_OP(chip8, chip8->op);
+    QUIRK_HANDLERS[profile][chip8->op.id](chip8);
+    return idle + 1;
+}
+
+/*
+The image compiled from the rom with rom_hash under profile among count
+images, NULL if none
+*/
+const Chip8_AotImage* chip8_aot_find(const Chip8_AotImage* images, size_t count, uint64_t rom_hash,
+                                     size_t rom_size, uint8_t profile) {
+    for (size_t i = 0; i < count; i++) {
+        if (images[i].rom_hash == rom_hash && images[i].rom_size == rom_size && images[i].quirks == profile) {
+            return &images[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+code_write_hook: a store hit compiled code, every block covering addr goes stale
+*/
+void chip8_aot_invalidate(Chip8* chip8, uint16_t addr) {
+    Chip8_Aot* aot = chip8->aot;
+
+    for (uint32_t k = 0; k < aot->image->num_blocks; k++) {
+        const Chip8_AotBlock* block = &aot->image->blocks[k];
+        if (!aot->stale[k] && addr >= block->start && addr < block->end) {
+            aot->stale[k] = TRUE;
+            aot->invalidations++;
+        }
+    }
+}
+
+/*
+Switches chip8, with the image's rom loaded under the image's profile, to the
+compiled code. Returns FALSE if the state can't be allocated or the block
+compiler is on.
+*/
+int chip8_aot_enable(Chip8* chip8, const Chip8_AotImage* image) {
+    if (chip8->jit != NULL || chip8->quirks != image->quirks) {
+        return FALSE;
+    }
+    if (chip8->aot != NULL) {
+        return chip8->aot->image == image;
+    }
+
+    Chip8_Aot* aot = calloc(1, sizeof(Chip8_Aot) + image->num_blocks);
+    if (aot == NULL) {
+        return FALSE;
+    }
+    aot->image = image;
+    for (uint32_t k = 0; k < image->num_blocks; k++) {
+        for (uint32_t addr = image->blocks[k].start; addr < image->blocks[k].end; addr++) {
+            aot->code_map[addr >> 3] |= 1 << (addr & 7);
+        }
+    }
+    chip8->aot = aot;
+    chip8->code_map = aot->code_map;
+    chip8->code_write_hook = chip8_aot_invalidate;
+    return TRUE;
+}
+
+/*
+Back to the plain interpreter
+*/
+void chip8_aot_disable(Chip8* chip8) {
+    if (chip8->aot == NULL) {
+        return;
+    }
+    free(chip8->aot);
+    chip8->aot = NULL;
+    chip8->code_map = NULL;
+    chip8->code_write_hook = NULL;
+}
+
+#endif
@@ -0,0 +1,374 @@
+#ifndef AUDIO_H
+#define AUDIO_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "chip8_def.h"
+#include "quirks.h"
+#include "snapshot.h"
+
+/*
+The buzzer. Once a frame, right before the timers tick, an instance with a sink
+attached (chip8->audio) hands it the frame's buzzer state: on while the sound
+timer is running, and the waveform to play, XO-CHIP's pattern and pitch (F002,
+Fx3A) or, on machines without them, a fixed beep. A frame sounds for exactly
+1/60 s of samples, so the buzzer starts and stops on the sample its frame
+boundary falls on whatever the output's rate.
+
+Sinks:
+    ring    for a live device: frames go into a lock-free single-producer,
+            single-consumer ring that the device's callback drains at its own
+            pace (speaker.h). Neither side ever waits on the other. Each time
+            a frame's samples run out the callback starts the newest frame
+            waiting, so a state change is heard at most a frame plus the
+            device's buffer after the emulator makes it. Frames skipped over
+            still sound, their buzzer on carries into the one played, so a
+            one-frame beep is never lost; with no frame waiting the last one
+            holds for up to a frame, then goes quiet (the emulator paused). A
+            full ring drops the frame.
+    wav     headless: each frame is synthesized straight into a WAV file as it
+            is published, every frame and nothing else, so a replay dumps the
+            same file every time and audio can be checked without a device.
+
+The waveform is the pattern's 128 bits, MSB first, looped at 4000 * 2^((pitch
+- 64) / 48) bits per second, high bits +1 and low ones -1. Point sampling that
+aliases badly, so it is band-limited: each step between bits is smoothed with
+a polyBLEP residual, and at rates above the output's, where steps come closer
+than a sample apart, every sample is the average of the bits it covers. The
+level ramps over about a millisecond when the buzzer starts or stops to keep
+it from clicking.
+*/
+#define AUDIO_SAMPLE_RATE 48000          // samples per second, of the WAV dump and what devices are asked for
+#define AUDIO_RING_FRAMES 16             // frames in flight to a device, power of two
+#define AUDIO_PATTERN_BITS (AUDIO_PATTERN_SIZE * 8)
+#define AUDIO_PITCH_DEFAULT 64           // pitch playing the pattern at AUDIO_BASE_RATE
+#define AUDIO_BASE_RATE 4000.0           // pattern bits per second at AUDIO_PITCH_DEFAULT
+#define AUDIO_SEMITONE_48 1.0145453349375237 // 2^(1/48), one pitch step
+#define AUDIO_AMPLITUDE 6000.0f          // peak sample value, of 32767
+#define AUDIO_RAMP_HZ 1000               // the level ramps 0 to 1 in 1/AUDIO_RAMP_HZ s
+
+// The beep of machines without F002: 4 bits high, 4 low, a 500 Hz square at the default pitch
+static const uint8_t AUDIO_BEEP_PATTERN[AUDIO_PATTERN_SIZE] = {
+    0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0, 0xF0
+};
+
+// What the buzzer does for one frame
+typedef struct {
+    uint8_t on;                      // sound timer running
+    uint8_t pitch;
+    uint8_t pattern[AUDIO_PATTERN_SIZE];
+} Chip8_AudioFrame;
+
+struct Chip8_AudioSink_t {
+    void (*frame)(void* ctx, const Chip8_AudioFrame* frame); // called on the emulation thread
+    void* ctx;
+};
+
+/*
+The buzzer state of the frame chip8 just ran
+*/
+static inline void chip8_audio_frame(const Chip8* chip8, Chip8_AudioFrame* frame) {
+    frame->on = chip8->sound_timer != 0;
+    if (QUIRK_HANDLERS[chip8->quirks][OP_AUDIO] != op_invalid) {
+        frame->pitch = chip8->audio_pitch;
+        memcpy(frame->pattern, chip8->audio_pattern, AUDIO_PATTERN_SIZE);
+    } else {
+        frame->pitch = AUDIO_PITCH_DEFAULT;
+        memcpy(frame->pattern, AUDIO_BEEP_PATTERN, AUDIO_PATTERN_SIZE);
+    }
+}
+
+/*
+Hands the frame's buzzer state to chip8's sink, if it has one (chip8_tick_timers)
+*/
+static inline void chip8_audio_publish(Chip8* chip8) {
+    if (chip8->audio != NULL) {
+        Chip8_AudioFrame frame;
+        chip8_audio_frame(chip8, &frame);
+        chip8->audio->frame(chip8->audio->ctx, &frame);
+    }
+}
+
+/*
+Synthesizer: turns frames into samples, keeping the waveform's phase and the
+level going from one frame to the next
+*/
+typedef struct {
+    uint32_t sample_rate;
+    uint32_t frame_remainder;        // sample_rate * frames so far % FRAME_RATE
+    double phase;                    // position in the pattern, in bits
+    double step;                     // bits per sample at pitch
+    uint8_t pitch;                   // pitch step was worked out for
+    float level;                     // 0 silent to 1, ramping toward the frame's on
+    float ramp;                      // level change per sample
+} Chip8_AudioSynth;
+
+/*
+Bits per sample of pitch at sample_rate: 2^(1/48) stepped from the default
+pitch rather than pow, which would take libm along
+*/
+static double audio_step(uint8_t pitch, uint32_t sample_rate) {
+    double rate = AUDIO_BASE_RATE;
+    for (int p = AUDIO_PITCH_DEFAULT; p < pitch; p++) {
+        rate *= AUDIO_SEMITONE_48;
+    }
+    for (int p = AUDIO_PITCH_DEFAULT; p > pitch; p--) {
+        rate /= AUDIO_SEMITONE_48;
+    }
+    return rate / sample_rate;
+}
+
+void chip8_audio_synth_init(Chip8_AudioSynth* synth, uint32_t sample_rate) {
+    synth->sample_rate = sample_rate;
+    synth->frame_remainder = 0;
+    synth->phase = 0;
+    synth->pitch = AUDIO_PITCH_DEFAULT;
+    synth->step = audio_step(AUDIO_PITCH_DEFAULT, sample_rate);
+    synth->level = 0;
+    synth->ramp = (sample_rate > AUDIO_RAMP_HZ) ? (float)AUDIO_RAMP_HZ / sample_rate : 1.0f;
+}
+
+/*
+Samples in the next frame: sample_rate / FRAME_RATE, the remainders carried
+over so frames add up to exactly sample_rate a second
+*/
+static inline uint32_t chip8_audio_frame_samples(Chip8_AudioSynth* synth) {
+    uint32_t total = synth->frame_remainder + synth->sample_rate;
+    synth->frame_remainder = total % FRAME_RATE;
+    return total / FRAME_RATE;
+}
+
+// Bit b of the looped pattern as +1 or -1
+static inline float audio_bit(const uint8_t* pattern, uint32_t b) {
+    b %= AUDIO_PATTERN_BITS;
+    return ((pattern[b >> 3] >> (7 - (b & 7))) & 1) ? 1.0f : -1.0f;
+}
+
+/*
+The band-limited waveform over the sample starting at phase
+*/
+static inline float audio_sample(const uint8_t* pattern, double phase, double step) {
+    uint32_t b = (uint32_t)phase;
+    double frac = phase - b;
+
+    if (step >= 1.0) {
+        // more than a bit per sample: the average of the bits covered
+        double sum = (1.0 - frac) * audio_bit(pattern, b);
+        double left = step - (1.0 - frac);
+        for (b++; left > 1.0; b++, left -= 1.0) {
+            sum += audio_bit(pattern, b);
+        }
+        return (float)((sum + left * audio_bit(pattern, b)) / step);
+    }
+
+    // polyBLEP: the step between two bits is spread over the sample on either side of it
+    float value = audio_bit(pattern, b);
+    if (frac < step) {
+        double x = frac / step;
+        value -= (float)((value - audio_bit(pattern, b + AUDIO_PATTERN_BITS - 1)) * 0.5 * (1.0 - x) * (1.0 - x));
+    }
+    if (frac > 1.0 - step) {
+        double x = (frac - 1.0) / step;
+        value += (float)((audio_bit(pattern, b + 1) - audio_bit(pattern, b)) * 0.5 * (1.0 + x) * (1.0 + x));
+    }
+    return value;
+}
+
+/*
+Renders count samples of frame into out, signed 16-bit mono
+*/
+void chip8_audio_synth_render(Chip8_AudioSynth* synth, const Chip8_AudioFrame* frame, int16_t* out, uint32_t count) {
+    if (frame->pitch != synth->pitch) {
+        synth->pitch = frame->pitch;
+        synth->step = audio_step(frame->pitch, synth->sample_rate);
+    }
+    float target = frame->on ? 1.0f : 0.0f;
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (synth->level == 0.0f && target == 0.0f) {
+            // silent: the rest of it is too, and the phase can wait
+            memset(out + i, 0, (count - i) * sizeof(*out));
+            return;
+        }
+        if (synth->level < target) {
+            synth->level = (synth->level + synth->ramp < target) ? synth->level + synth->ramp : target;
+        } else if (synth->level > target) {
+            synth->level = (synth->level - synth->ramp > target) ? synth->level - synth->ramp : target;
+        }
+        out[i] = (int16_t)(audio_sample(frame->pattern, synth->phase, synth->step) * synth->level * AUDIO_AMPLITUDE);
+        synth->phase += synth->step;
+        while (synth->phase >= AUDIO_PATTERN_BITS) {
+            synth->phase -= AUDIO_PATTERN_BITS;
+        }
+    }
+}
+
+/*
+Ring sink for a live device: the emulation thread pushes, the device's callback
+renders with chip8_audio_ring_render
+*/
+typedef struct {
+    Chip8_AudioFrame frames[AUDIO_RING_FRAMES];
+    Chip8_AudioSink sink;            // to point chip8->audio at
+
+    // producer side
+    _Atomic uint32_t head;           // next slot written
+    uint64_t frames_dropped;         // published while the ring was full
+    char pad[64];                    // producer and consumer fields on separate cache lines
+
+    // consumer side
+    _Atomic uint32_t tail;           // next slot read
+    Chip8_AudioSynth synth;
+    Chip8_AudioFrame playing;
+    uint32_t playing_left;           // samples of playing still to render
+    uint32_t held;                   // samples playing has been held past its end for want of a next frame
+    uint64_t frames_played;
+    uint64_t frames_skipped;         // passed over for a newer one
+    uint64_t underruns;              // times a frame ran out with none waiting
+} Chip8_AudioRing;
+
+static void audio_ring_push(void* ctx, const Chip8_AudioFrame* frame) {
+    Chip8_AudioRing* ring = ctx;
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == AUDIO_RING_FRAMES) {
+        ring->frames_dropped++;
+        return;
+    }
+    ring->frames[head % AUDIO_RING_FRAMES] = *frame;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/*
+Sets up an empty ring rendering at sample_rate, before either side uses it
+*/
+void chip8_audio_ring_init(Chip8_AudioRing* ring, uint32_t sample_rate) {
+    memset(ring, 0, sizeof(*ring));
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    ring->sink.frame = audio_ring_push;
+    ring->sink.ctx = ring;
+    chip8_audio_synth_init(&ring->synth, sample_rate);
+    memcpy(ring->playing.pattern, AUDIO_BEEP_PATTERN, AUDIO_PATTERN_SIZE);
+    ring->playing.pitch = AUDIO_PITCH_DEFAULT;
+}
+
+/*
+Consumer: renders the next count samples into out from the frames waiting.
+Never waits: with none waiting the last frame holds, then fades out.
+*/
+void chip8_audio_ring_render(Chip8_AudioRing* ring, int16_t* out, uint32_t count) {
+    while (count > 0) {
+        if (ring->playing_left == 0) {
+            uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+            uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+            if (head == tail) {
+                // hold until the next callback looks again, a frame's worth at most
+                ring->underruns += (ring->held == 0);
+                if (ring->held >= ring->synth.sample_rate / FRAME_RATE) {
+                    ring->playing.on = FALSE;
+                }
+                ring->held += count;
+                chip8_audio_synth_render(&ring->synth, &ring->playing, out, count);
+                return;
+            }
+            uint8_t on = FALSE;
+            for (; tail + 1 != head; tail++) {
+                on |= ring->frames[tail % AUDIO_RING_FRAMES].on;
+                ring->frames_skipped++;
+            }
+            ring->playing = ring->frames[tail % AUDIO_RING_FRAMES];
+            ring->playing.on |= on;
+            atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+            ring->playing_left = chip8_audio_frame_samples(&ring->synth);
+            ring->held = 0;
+            ring->frames_played++;
+        }
+        uint32_t n = (count < ring->playing_left) ? count : ring->playing_left;
+        chip8_audio_synth_render(&ring->synth, &ring->playing, out, n);
+        ring->playing_left -= n;
+        out += n;
+        count -= n;
+    }
+}
+
+/*
+WAV sink: 16-bit mono PCM at AUDIO_SAMPLE_RATE, synthesized as frames are
+published
+*/
+#define AUDIO_WAV_HEADER_SIZE 44
+
+typedef struct {
+    Chip8_AudioSink sink;            // to point chip8->audio at
+    FILE* file;
+    Chip8_AudioSynth synth;
+    uint64_t samples;                // written so far
+    uint8_t failed;                  // a write failed
+    int16_t buf[AUDIO_SAMPLE_RATE / FRAME_RATE + 1];
+} Chip8_AudioWav;
+
+static void audio_wav_header(uint8_t* header, uint64_t samples) {
+    uint32_t data_size = (uint32_t)(samples * sizeof(int16_t));
+    memcpy(header, "RIFF", 4);
+    put_u32(header + 4, 36 + data_size);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    put_u32(header + 16, 16);                           // fmt chunk size
+    put_u16(header + 20, 1);                            // PCM
+    put_u16(header + 22, 1);                            // mono
+    put_u32(header + 24, AUDIO_SAMPLE_RATE);
+    put_u32(header + 28, AUDIO_SAMPLE_RATE * sizeof(int16_t)); // bytes per second
+    put_u16(header + 32, sizeof(int16_t));              // bytes per sample frame
+    put_u16(header + 34, 16);                           // bits per sample
+    memcpy(header + 36, "data", 4);
+    put_u32(header + 40, data_size);
+}
+
+static void audio_wav_push(void* ctx, const Chip8_AudioFrame* frame) {
+    Chip8_AudioWav* wav = ctx;
+    uint8_t bytes[sizeof(wav->buf)];
+    uint32_t n = chip8_audio_frame_samples(&wav->synth);
+    chip8_audio_synth_render(&wav->synth, frame, wav->buf, n);
+    for (uint32_t i = 0; i < n; i++) {
+        put_u16(bytes + 2 * i, (uint16_t)wav->buf[i]);
+    }
+    if (fwrite(bytes, sizeof(int16_t), n, wav->file) != n) {
+        wav->failed = TRUE;
+    }
+    wav->samples += n;
+}
+
+/*
+Creates the WAV file at path. Returns FALSE if it can't be.
+*/
+int chip8_audio_wav_open(Chip8_AudioWav* wav, const char* path) {
+    uint8_t header[AUDIO_WAV_HEADER_SIZE];
+    wav->sink.frame = audio_wav_push;
+    wav->sink.ctx = wav;
+    wav->samples = 0;
+    wav->failed = FALSE;
+    chip8_audio_synth_init(&wav->synth, AUDIO_SAMPLE_RATE);
+    wav->file = fopen(path, "wb");
+    if (wav->file == NULL) {
+        return FALSE;
+    }
+    audio_wav_header(header, 0);
+    wav->failed = fwrite(header, 1, sizeof(header), wav->file) != sizeof(header);
+    return TRUE;
+}
+
+/*
+Fills in the header's sizes and closes the file. Returns FALSE if any of it
+failed to be written.
+*/
+int chip8_audio_wav_close(Chip8_AudioWav* wav) {
+    uint8_t header[AUDIO_WAV_HEADER_SIZE];
+    audio_wav_header(header, wav->samples);
+    int ok = !wav->failed && fseek(wav->file, 0, SEEK_SET) == 0 &&
+             fwrite(header, 1, sizeof(header), wav->file) == sizeof(header);
+    ok = (fclose(wav->file) == 0) && ok;
+    wav->file = NULL;
+    return ok;
+}
+
+#endif
@@ -0,0 +1,232 @@
+// Handler and rom benchmark: ns per call of every opcode handler and whole-rom MIPS, as JSON
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "chip8_def.h"
+#include "decode.h"
+#include "instructions.h"
+#include "cpu.h"
+#include "rng.h"
+#include "helperMethods.h"
+
+#define DEFAULT_HANDLER_CALLS 2000000
+#define DEFAULT_ROM_CYCLES 20000000ull
+#define DEFAULT_REPEAT 3                   // best of, for both kinds of run
+#define BENCH_IPF 1000                     // instructions per frame for rom runs, timers still tick
+
+typedef struct {
+    const char* name;
+    uint16_t opcode;
+} Handler_Case;
+
+// One representative opcode per handler; drw at several sprite heights since its
+// cost grows with n, and once across both screen edges. Registers: see bench_regs.
+static const Handler_Case HANDLER_CASES[] = {
+    { "cls", 0x00E0 },          { "ret", 0x00EE },          { "jp_addr", 0x1200 },
+    { "call_addr", 0x2200 },    { "se_vx_byte", 0x3105 },   { "sne_vx_byte", 0x4105 },
+    { "se_vx_vy", 0x5120 },     { "ld_vx_byte", 0x6142 },   { "add_vx", 0x7101 },
+    { "ld_vx_vy", 0x8120 },     { "or_vx_vy", 0x8121 },     { "and_vx_vy", 0x8122 },
+    { "xor_vx_vy", 0x8123 },    { "add_Vx_Vy", 0x8124 },    { "sub_vx_vy", 0x8125 },
+    { "shr_vx_vy", 0x8126 },    { "subn_vx_vy", 0x8127 },   { "shl_vx_vy", 0x812E },
+    { "sne_vx_vy", 0x9120 },    { "ld_i_addr", 0xA300 },    { "jp_v0_addr", 0xB200 },
+    { "rnd", 0xC1FF },          { "drw_n1", 0xD121 },       { "drw_n5", 0xD125 },
+    { "drw_n15", 0xD12F },      { "drw_n15_wrap", 0xD56F }, { "skp_vx", 0xE19E },
+    { "sknp_vx", 0xE1A1 },      { "ld_vx_dt", 0xF107 },     { "ld_Vx_k", 0xF10A },
+    { "ld_dt_vx", 0xF115 },     { "ld_st_vx", 0xF118 },     { "add_i_vx", 0xF11E },
+    { "ld_F_Vx", 0xF129 },      { "st_bcd_Vx", 0xF133 },    { "st_V_regs", 0xFF55 },
+    { "ld_V_regs", 0xFF65 },
+    // SCHIP and XO-CHIP, in the 64x32 mode; 00FD-00FF switch modes or halt, left out
+    { "scd", 0x00C4 },          { "scr", 0x00FB },          { "scl", 0x00FC },
+    { "drw_16", 0xD120 },       { "ld_HF_Vx", 0xF130 },     { "st_R_Vx", 0xF775 },
+    { "ld_Vx_R", 0xF785 },      { "scu", 0x00D4 },          { "st_V_range", 0x5162 },
+    { "ld_V_range", 0x5163 },   { "ld_i_long", 0xF000 },    { "plane", 0xF101 },
+    { "audio", 0xF002 },        { "pitch_Vx", 0xF13A },
+};
+
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+Puts back what handlers move between calls, so every call does the same work:
+pc (jumps, skips), sp (call, ret) and I (add_i_vx, ld_F_Vx)
+*/
+static inline void bench_reset(Chip8* chip8) {
+    chip8->pc_reg = PROGRAM_START_ADDR;
+    chip8->sp_reg = 1;
+    chip8->I_reg = 0x300;
+}
+
+/*
+Register values every case starts from: small distinct values, key V1 down so
+skp takes its branch and Fx0A finds a key, V5/V6 a sprite position that wraps
+*/
+void bench_regs(Chip8* chip8) {
+    for (int i = 0; i < NUM_V_REGISTERS; i++) {
+        chip8->V[i] = (uint8_t)(i * 3);
+    }
+    chip8->V[5] = SCREEN_WIDTH - 4;
+    chip8->V[6] = SCREEN_HEIGHT - 4;
+    memset(chip8->keyboard, FALSE, sizeof(chip8->keyboard));
+    chip8->keyboard[chip8->V[1]] = TRUE;
+    chip8->is_running_flag = TRUE;
+}
+
+void bench_nop(Chip8* chip8) {
+    (void)chip8;
+}
+
+/*
+Seconds for calls calls of handler on chip8 with op set to instr, best of repeat
+*/
+double bench_handler(Chip8* chip8, void (*handler)(Chip8*), Chip8_Instr instr, uint32_t calls, int repeat) {
+    // called through a volatile pointer so the call is never inlined or hoisted
+    void (*volatile call)(Chip8*) = handler;
+    double best = 1e30;
+
+    for (int r = 0; r < repeat; r++) {
+        chip8->op = instr;
+        chip8->current_op = instr.opcode;
+        double start = now_seconds();
+        for (uint32_t i = 0; i < calls; i++) {
+            bench_reset(chip8);
+            call(chip8);
+        }
+        double elapsed = now_seconds() - start;
+        best = (elapsed < best) ? elapsed : best;
+    }
+    return best;
+}
+
+void bench_handlers(uint32_t calls, int repeat) {
+    static Chip8 chip8;
+    initialize(&chip8);
+    chip8_seed_rng(&chip8, 1);
+
+    // the loop's own cost (reset plus an indirect call), taken off every handler
+    Chip8_Instr nop = chip8_decode(0x0000);
+    double baseline = bench_handler(&chip8, bench_nop, nop, calls, repeat) / calls * 1e9;
+    printf("  \"baseline_ns\": %.3f,\n", baseline);
+
+    printf("  \"handlers\": [\n");
+    size_t num_cases = sizeof(HANDLER_CASES) / sizeof(HANDLER_CASES[0]);
+    for (size_t c = 0; c < num_cases; c++) {
+        Chip8_Instr instr = chip8_decode(HANDLER_CASES[c].opcode);
+        bench_regs(&chip8);
+        double ns = bench_handler(&chip8, OP_HANDLERS[instr.id], instr, calls, repeat) / calls * 1e9 - baseline;
+        printf("    {\"name\": \"%s\", \"op\": \"%s\", \"opcode\": \"%04X\", \"ns\": %.3f}%s\n",
+               HANDLER_CASES[c].name, OP_NAMES[instr.id], instr.opcode, ns > 0 ? ns : 0,
+               c + 1 < num_cases ? "," : "");
+    }
+    printf("  ],\n");
+    chip8_release(&chip8);
+}
+
+/*
+Runs rom for cycles cycles in frames of BENCH_IPF, best of repeat, and prints
+one JSON object, with an "error" in place of the timings if it couldn't run.
+Built with CHIP8_NO_IDLE_SKIP (see the Makefile) so roms parked in a wait loop
+still execute every instruction and MIPS stays comparable.
+*/
+int bench_rom(const char* path, int use_jit, uint64_t cycles, int repeat) {
+    static uint8_t rom[MAX_ROM_SIZE];
+    static Chip8 chip8;
+    const char* engine = use_jit ? "jit" : "interp";
+
+    long size = read_rom_file(path, rom);
+    if (size < 0) {
+        fprintf(stderr, "%s: can't read rom\n", path);
+        printf("    {\"rom\": \"%s\", \"engine\": \"%s\", \"error\": \"can't read rom\"}", path, engine);
+        return FALSE;
+    }
+
+    double best = 1e30;
+    uint64_t ran = 0;
+    for (int r = 0; r < repeat; r++) {
+        initialize(&chip8);
+        chip8_seed_rng(&chip8, 0);
+        load_rom_image(&chip8, rom, size);
+        if (use_jit && !chip8_jit_enable(&chip8)) {
+            fprintf(stderr, "%s: failed to allocate the block compiler\n", path);
+            printf("    {\"rom\": \"%s\", \"engine\": \"%s\", \"error\": \"out of memory\"}", path, engine);
+            chip8_release(&chip8);
+            return FALSE;
+        }
+
+        double start = now_seconds();
+        while (chip8.cycle_count < cycles && chip8.is_running_flag) {
+            chip8_run_frame(&chip8, BENCH_IPF);
+        }
+        double elapsed = now_seconds() - start;
+        if (elapsed < best) {
+            best = elapsed;
+            ran = chip8.cycle_count;
+        }
+        chip8_release(&chip8);
+    }
+
+    printf("    {\"rom\": \"%s\", \"engine\": \"%s\", \"cycles\": %llu, \"seconds\": %.6f, \"mips\": %.2f}",
+           path, engine, (unsigned long long)ran, best, ran / best / 1e6);
+    return TRUE;
+}
+
+void bench_usage(void) {
+    printf("Usage: ./handler-bench [options] [path/to/rom...]\n");
+    printf("  --calls N     calls per handler (default %d)\n", DEFAULT_HANDLER_CALLS);
+    printf("  --cycles N    cycles per rom run (default %llu)\n", DEFAULT_ROM_CYCLES);
+    printf("  --repeat N    runs of each, the fastest is reported (default %d)\n", DEFAULT_REPEAT);
+    printf("  --label TEXT  recorded in the output, e.g. the commit benchmarked\n");
+}
+
+int main(int argc, char* argv[]) {
+    uint32_t calls = DEFAULT_HANDLER_CALLS;
+    uint64_t cycles = DEFAULT_ROM_CYCLES;
+    int repeat = DEFAULT_REPEAT;
+    const char* label = "";
+    int first_rom = argc;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--calls") == 0 && i + 1 < argc) {
+            calls = (uint32_t)strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--cycles") == 0 && i + 1 < argc) {
+            cycles = strtoull(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+            repeat = (int)strtol(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--label") == 0 && i + 1 < argc) {
+            label = argv[++i];
+        } else if (argv[i][0] == '-') {
+            bench_usage();
+            return 1;
+        } else {
+            first_rom = i;
+            break;
+        }
+    }
+    if (calls == 0 || repeat < 1) {
+        bench_usage();
+        return 1;
+    }
+
+    printf("{\n");
+    printf("  \"label\": \"%s\",\n", label);
+    printf("  \"handler_calls\": %u,\n", calls);
+    printf("  \"rom_cycles\": %llu,\n", (unsigned long long)cycles);
+    bench_handlers(calls, repeat);
+
+    int ok = TRUE;
+    printf("  \"roms\": [");
+    // every entry, failed ones too, prints one object; the separators go in between
+    for (int i = first_rom; i < argc; i++) {
+        printf(i == first_rom ? "\n" : ",\n");
+        ok &= bench_rom(argv[i], FALSE, cycles, repeat);
+        printf(",\n");
+        ok &= bench_rom(argv[i], TRUE, cycles, repeat);
+    }
+    printf("\n  ]\n");
+    printf("}\n");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,142 @@
+// Rewind benchmark: history size per frame and the cost of going back, per rom
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "chip8_def.h"
+#include "cpu.h"
+#include "screen.h"
+#include "rewind.h"
+#include "helperMethods.h"
+
+#define DEFAULT_FRAMES 3600                // a minute at 60 Hz
+
+typedef struct {
+    uint64_t cycle_count;
+    uint64_t screen_hash;
+} Frame_Check;
+
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+Rewinds `frames` and checks the state against what was recorded for that frame
+on the way forward. *latest is the index of the latest push, moved back to the
+frame rewound to. Returns the time taken in microseconds, or -1 on a mismatch.
+*/
+double bench_rewind(Chip8_Rewind* rw, Chip8* chip8, const Frame_Check* checks, uint32_t* latest, uint32_t frames) {
+    double start = now_seconds();
+    uint32_t done = chip8_rewind(rw, chip8, frames);
+    double elapsed = now_seconds() - start;
+
+    *latest -= done - 1;
+    if (chip8->cycle_count != checks[*latest].cycle_count || screen_hash(chip8) != checks[*latest].screen_hash) {
+        return -1;
+    }
+    return elapsed * 1e6;
+}
+
+int bench_rom(const char* path, uint32_t frames, uint32_t ipf, size_t capacity) {
+    static uint8_t rom[MAX_ROM_SIZE];
+    static Chip8 chip8;
+    static Chip8_Rewind rw;
+
+    long size = read_rom_file(path, rom);
+    if (size < 0) {
+        fprintf(stderr, "%s: can't read rom\n", path);
+        return FALSE;
+    }
+    Frame_Check* checks = malloc(frames * sizeof(Frame_Check));
+    if (checks == NULL || !chip8_rewind_init(&rw, capacity)) {
+        fprintf(stderr, "%s: out of memory\n", path);
+        free(checks);
+        return FALSE;
+    }
+
+    initialize(&chip8);
+    load_rom_image(&chip8, rom, size);
+
+    double push_time = 0;
+    double run_start = now_seconds();
+    for (uint32_t f = 0; f < frames; f++) {
+        chip8_run_frame(&chip8, ipf);
+        checks[f].cycle_count = chip8.cycle_count;
+        checks[f].screen_hash = screen_hash(&chip8);
+
+        double start = now_seconds();
+        chip8_rewind_push(&rw, &chip8);
+        push_time += now_seconds() - start;
+    }
+    double run_time = now_seconds() - run_start - push_time;
+
+    uint32_t held = chip8_rewind_frames(&rw);
+    printf("%s frames=%u ipf=%u bytes/frame=%.1f held=%u ring=%zu/%zu push=%.2fus",
+           path, frames, ipf, (double)rw.bytes_pushed / (frames > 1 ? frames - 1 : 1),
+           held, rw.used, rw.capacity, push_time / frames * 1e6);
+
+    // what rewinding saves: replaying from initialize() to the frame rewound to
+    double frame_us = run_time / frames * 1e6;
+
+    int ok = TRUE;
+    uint32_t latest = frames - 1;
+    uint32_t steps[] = { 1, 60, 600, held };
+    for (size_t i = 0; i < sizeof(steps) / sizeof(steps[0]); i++) {
+        uint32_t n = steps[i] < chip8_rewind_frames(&rw) ? steps[i] : chip8_rewind_frames(&rw);
+        double us = bench_rewind(&rw, &chip8, checks, &latest, n);
+        if (us < 0) {
+            ok = FALSE;
+            break;
+        }
+        printf(" rewind%u=%.1fus(replay %.1fus)", n, us, (latest + 1) * frame_us);
+    }
+    printf(" %s\n", ok ? "verified" : "MISMATCH");
+
+    chip8_rewind_free(&rw);
+    chip8_release(&chip8);
+    free(checks);
+    return ok;
+}
+
+void bench_usage(void) {
+    printf("Usage: ./rewind-bench [options] path/to/rom...\n");
+    printf("  --frames N    frames to run and record (default %d)\n", DEFAULT_FRAMES);
+    printf("  --ipf N       instructions per frame (default %d)\n", DEFAULT_INSTRUCTIONS_PER_FRAME);
+    printf("  --capacity N  history ring size in bytes (default %d)\n", REWIND_DEFAULT_CAPACITY);
+}
+
+int main(int argc, char* argv[]) {
+    uint32_t frames = DEFAULT_FRAMES;
+    uint32_t ipf = DEFAULT_INSTRUCTIONS_PER_FRAME;
+    size_t capacity = REWIND_DEFAULT_CAPACITY;
+    int first_rom = argc;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            frames = (uint32_t)strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--ipf") == 0 && i + 1 < argc) {
+            ipf = (uint32_t)strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--capacity") == 0 && i + 1 < argc) {
+            capacity = strtoull(argv[++i], NULL, 0);
+        } else if (argv[i][0] == '-') {
+            bench_usage();
+            return 1;
+        } else {
+            first_rom = i;
+            break;
+        }
+    }
+    if (first_rom == argc || frames == 0 || capacity == 0) {
+        bench_usage();
+        return 1;
+    }
+
+    int ok = TRUE;
+    for (int i = first_rom; i < argc; i++) {
+        ok &= bench_rom(argv[i], frames, ipf, capacity);
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,200 @@
+// Trace benchmark: speed of the interpreter, the block compiler and compiled roms with and without the trace, as JSON
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "chip8_def.h"
+#include "cpu.h"
+#include "jit.h"
+#include "aot.h"
+#include "trace.h"
+#include "movie.h"
+#include "helperMethods.h"
+
+#ifndef CHIP8_TRACE
+#error "trace-bench needs the trace compiled in, build it with make trace-bench"
+#endif
+
+// roms compiled ahead of time by chip8-aot (make trace-bench)
+#ifdef CHIP8_AOT_FILE
+#include CHIP8_AOT_FILE
+#else
+static const Chip8_AotImage CHIP8_AOT_IMAGES[1];
+#define CHIP8_AOT_IMAGE_COUNT 0
+#endif
+
+#define DEFAULT_ROM_CYCLES 50000000ull
+#define DEFAULT_REPEAT 7                   // best of, for both kinds of run
+#define DEFAULT_MIN_RATIO 0.5              // traced speed over untraced speed an engine must keep
+#define BENCH_IPF 1000                     // instructions per frame, timers still tick
+#define BENCH_TRACE_PATH "trace-bench.c8t"
+
+enum { ENGINE_INTERPRETER, ENGINE_JIT, ENGINE_AOT, ENGINE_COUNT };
+
+static const char* const ENGINE_NAMES[ENGINE_COUNT] = { "interpreter", "jit", "aot" };
+
+// an engine's seconds over every rom it ran, so its speed over the whole set
+typedef struct {
+    int roms;
+    double untraced;
+    double traced;
+} Bench_Total;
+
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+Seconds for cycles cycles of the rom on engine, traced or not. Only the run is
+timed: starting the trace's writer and draining it at the end are not
+emulation. Built with CHIP8_NO_IDLE_SKIP (see the Makefile), so a rom parked
+in a wait loop still runs, and is traced, every instruction. Returns -1,
+printing why, if it couldn't run.
+*/
+double bench_run(const char* path, const uint8_t* rom, long size, int engine, int traced, uint64_t cycles) {
+    static Chip8 chip8;
+
+    initialize(&chip8);
+    chip8_seed_rng(&chip8, 0);
+    load_rom_image(&chip8, rom, size);
+    int ok = (engine == ENGINE_INTERPRETER) ? TRUE :
+             (engine == ENGINE_JIT) ? chip8_jit_enable(&chip8) :
+             chip8_aot_enable(&chip8, chip8_aot_find(CHIP8_AOT_IMAGES, CHIP8_AOT_IMAGE_COUNT,
+                                                     chip8_rom_hash(rom, size), size, chip8.quirks));
+    if (!ok || (traced && !chip8_trace_enable(&chip8, BENCH_TRACE_PATH))) {
+        fprintf(stderr, "%s: failed to set up the %s run\n", path, traced ? "traced" : "untraced");
+        chip8_release(&chip8);
+        return -1;
+    }
+
+    double start = now_seconds();
+    while (chip8.cycle_count < cycles && chip8.is_running_flag) {
+        chip8_run_frame(&chip8, BENCH_IPF);
+    }
+    double elapsed = now_seconds() - start;
+    if (traced && !chip8_trace_disable(&chip8)) {
+        fprintf(stderr, "%s: failed to write %s\n", path, BENCH_TRACE_PATH);
+        elapsed = -1;
+    }
+    chip8_release(&chip8);
+    return elapsed;
+}
+
+/*
+Times rom on engine with and without the trace, adds the times to total and
+prints one JSON object, with an "error" in place of the timings if it couldn't
+run. Returns FALSE if it couldn't.
+*/
+int bench_rom(const char* path, int engine, uint64_t cycles, int repeat, Bench_Total* total) {
+    static uint8_t rom[MAX_ROM_SIZE];
+    const char* name = ENGINE_NAMES[engine];
+
+    long size = read_rom_file(path, rom);
+    if (size < 0) {
+        fprintf(stderr, "%s: can't read rom\n", path);
+        printf("    {\"rom\": \"%s\", \"engine\": \"%s\", \"error\": \"can't read rom\"}", path, name);
+        return FALSE;
+    }
+    // taken in turns, so both kinds of run see the machine in the same state
+    double plain = 1e30, traced = 1e30;
+    for (int r = 0; r < repeat; r++) {
+        double p = bench_run(path, rom, size, engine, FALSE, cycles);
+        double t = (p < 0) ? -1 : bench_run(path, rom, size, engine, TRUE, cycles);
+        if (t < 0) {
+            printf("    {\"rom\": \"%s\", \"engine\": \"%s\", \"error\": \"couldn't run\"}", path, name);
+            return FALSE;
+        }
+        plain = (p < plain) ? p : plain;
+        traced = (t < traced) ? t : traced;
+    }
+
+    // both runs stop at the same cycle, halted or not
+    printf("    {\"rom\": \"%s\", \"engine\": \"%s\", \"untraced_seconds\": %.6f, \"traced_seconds\": %.6f, "
+           "\"ratio\": %.3f}", path, name, plain, traced, plain / traced);
+    total->roms++;
+    total->untraced += plain;
+    total->traced += traced;
+    return TRUE;
+}
+
+void bench_usage(void) {
+    printf("Usage: ./trace-bench [options] [path/to/rom...]\n");
+    printf("  --cycles N     cycles per run (default %llu)\n", DEFAULT_ROM_CYCLES);
+    printf("  --repeat N     runs of each, the fastest is taken (default %d)\n", DEFAULT_REPEAT);
+    printf("  --min-ratio R  traced over untraced speed each engine must keep (default %.2f)\n", DEFAULT_MIN_RATIO);
+    printf("Roms compiled into the binary (%d here) are timed as compiled code as well.\n",
+           (int)CHIP8_AOT_IMAGE_COUNT);
+    printf("An engine's speed is over all the roms it ran: halted roms only time the per-frame\n");
+    printf("bookkeeping, and are reported on their own.\n");
+    printf("Exit status 1 if any rom fails or an engine falls under the ratio.\n");
+}
+
+int main(int argc, char* argv[]) {
+    static uint8_t rom[MAX_ROM_SIZE];
+    uint64_t cycles = DEFAULT_ROM_CYCLES;
+    int repeat = DEFAULT_REPEAT;
+    double min_ratio = DEFAULT_MIN_RATIO;
+    int first_rom = argc;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--cycles") == 0 && i + 1 < argc) {
+            cycles = strtoull(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+            repeat = (int)strtol(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--min-ratio") == 0 && i + 1 < argc) {
+            min_ratio = strtod(argv[++i], NULL);
+        } else if (argv[i][0] == '-') {
+            bench_usage();
+            return 1;
+        } else {
+            first_rom = i;
+            break;
+        }
+    }
+    if (cycles == 0 || repeat < 1) {
+        bench_usage();
+        return 1;
+    }
+
+    Bench_Total totals[ENGINE_COUNT] = {{0}};
+    int ok = TRUE;
+    printf("{\n");
+    printf("  \"rom_cycles\": %llu,\n", (unsigned long long)cycles);
+    printf("  \"min_ratio\": %.3f,\n", min_ratio);
+    printf("  \"roms\": [");
+    // every entry, failed ones too, prints one object; the separators go in between
+    for (int i = first_rom; i < argc; i++) {
+        printf(i == first_rom ? "\n" : ",\n");
+        ok &= bench_rom(argv[i], ENGINE_INTERPRETER, cycles, repeat, &totals[ENGINE_INTERPRETER]);
+        printf(",\n");
+        ok &= bench_rom(argv[i], ENGINE_JIT, cycles, repeat, &totals[ENGINE_JIT]);
+        long size = read_rom_file(argv[i], rom);
+        if (size >= 0 && chip8_aot_find(CHIP8_AOT_IMAGES, CHIP8_AOT_IMAGE_COUNT, chip8_rom_hash(rom, size), size,
+                                        QUIRKS_DEFAULT) != NULL) {
+            printf(",\n");
+            ok &= bench_rom(argv[i], ENGINE_AOT, cycles, repeat, &totals[ENGINE_AOT]);
+        }
+    }
+    printf("\n  ],\n");
+    printf("  \"engines\": [");
+    int first = TRUE;
+    for (int e = 0; e < ENGINE_COUNT; e++) {
+        const Bench_Total* total = &totals[e];
+        if (total->roms == 0) {
+            continue;
+        }
+        double ratio = total->untraced / total->traced;
+        printf("%s    {\"engine\": \"%s\", \"roms\": %d, \"untraced_seconds\": %.6f, \"traced_seconds\": %.6f, "
+               "\"ratio\": %.3f, \"ok\": %s}", first ? "\n" : ",\n", ENGINE_NAMES[e], total->roms, total->untraced,
+               total->traced, ratio, ratio >= min_ratio ? "true" : "false");
+        ok &= (ratio >= min_ratio);
+        first = FALSE;
+    }
+    printf("\n  ]\n");
+    printf("}\n");
+    remove(BENCH_TRACE_PATH);
+    return ok ? 0 : 1;
+}
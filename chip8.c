@@ -1,42 +1,298 @@
-#include "/opt/homebrew/Cellar/sdl2/2.30.5/include/SDL2/SDL.h"
+#include <SDL.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <math.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include "chip8_def.h"
 #include "instructions.h"
-#include "chip8_def.h"
+#include "cpu.h"
+#include "quirks.h"
+#include "snapshot.h"
+#include "input.h"
+#include "scheduler.h"
+#include "movie.h"
+#include "romcache.h"
+#include "framebuffer.h"
+#include "analyze.h"
+#include "display.h"
+#include "speaker.h"
 #include "helperMethods.h"
 
-#define CPU_CLOCK_DELAY 1000 //1ms delay between each cycle
+#define RENDER_IDLE_WAIT_MS 4         // render thread wait for events when no frame is new
+
+// Host keys for chip8 keys 0x0 - 0xF: the 4x4 block at the left of a qwerty
+// keyboard, laid out like the COSMAC VIP keypad. Scancodes, so the position
+// is the same on any layout.
+static const SDL_Scancode KEYMAP[NUM_KEYS] = {
+    SDL_SCANCODE_X, SDL_SCANCODE_1, SDL_SCANCODE_2, SDL_SCANCODE_3,   // 0 1 2 3
+    SDL_SCANCODE_Q, SDL_SCANCODE_W, SDL_SCANCODE_E, SDL_SCANCODE_A,   // 4 5 6 7
+    SDL_SCANCODE_S, SDL_SCANCODE_D, SDL_SCANCODE_Z, SDL_SCANCODE_C,   // 8 9 A B
+    SDL_SCANCODE_4, SDL_SCANCODE_R, SDL_SCANCODE_F, SDL_SCANCODE_V    // C D E F
+};
+
+typedef struct {
+    Chip8* chip8;
+    Chip8_Scheduler sched;
+    Chip8_TripleBuffer* frames;
+    Chip8_Movie* movie;              // session being recorded, NULL if none
+    _Atomic int quit;
+} Emulation_Thread;
+
+/*
+Runs frames on the scheduler's clock and publishes the screen after each step
+that ran any. Nothing here waits on the render thread.
+*/
+void* emulation_thread(void* arg) {
+    Emulation_Thread* emu = arg;
+    while (!atomic_load_explicit(&emu->quit, memory_order_relaxed)) {
+        if (chip8_sched_step(&emu->sched, emu->chip8) > 0) {
+            chip8_frames_publish(emu->frames, emu->chip8);
+            if (emu->movie != NULL && !chip8_movie_record_step(emu->movie, emu->chip8)) {
+                fprintf(stderr, "Out of memory, recording stopped\n");
+                emu->sched.input->on_apply = NULL;
+                emu->movie = NULL;
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+Queues a chip8 key event for a host key press or release, ignoring keys outside
+the keypad and auto-repeat
+*/
+void push_key_event(Chip8_InputQueue* input, const SDL_KeyboardEvent* key) {
+    if (key->repeat) {
+        return;
+    }
+    for (int i = 0; i < NUM_KEYS; i++) {
+        if (KEYMAP[i] == key->keysym.scancode) {
+            Chip8_KeyEvent event = { 0, chip8_now_ns(), (uint8_t)i, key->type == SDL_KEYDOWN };
+            chip8_input_push(input, event);
+            return;
+        }
+    }
+}
+
+void usage(void) {
+    printf("Usage: ./chip8 [--jit] [--seed N] [--load-state FILE | --record FILE] [--ipf N] [--quirks PROFILE] [--turbo | --fixed-step] [--mute] path/to/rom\n");
+    printf("  PROFILE: default, vip, chip48, schip or xochip\n");
+}
 
 int main(int argc, char* argv[]) {
-    //seed the random number generator
-    srand(time(NULL));
-    // Check if the correct number of arguments is provided
-    if (argc != 2) {
-        printf("Usage: ./chip8 path/to/rom\n");
+    int use_jit = FALSE;
+    int mute = FALSE;
+    Chip8_SchedMode sched_mode = SCHED_REALTIME;
+    uint32_t instructions_per_frame = DEFAULT_INSTRUCTIONS_PER_FRAME;
+    // Random seed unless one is given, runs with the same seed are identical
+    uint64_t seed = (uint64_t)time(NULL);
+    int quirks = QUIRKS_DEFAULT;
+    char* romPath = NULL;
+    char* statePath = NULL;
+    char* moviePath = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--jit") == 0) {
+            use_jit = TRUE;
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = strtoull(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--load-state") == 0 && i + 1 < argc) {
+            statePath = argv[++i];
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            moviePath = argv[++i];
+        } else if (strcmp(argv[i], "--ipf") == 0 && i + 1 < argc) {
+            instructions_per_frame = (uint32_t)strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--quirks") == 0 && i + 1 < argc) {
+            quirks = chip8_quirks_by_name(argv[++i]);
+            if (quirks < 0) {
+                usage();
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--turbo") == 0) {
+            sched_mode = SCHED_TURBO;
+        } else if (strcmp(argv[i], "--fixed-step") == 0) {
+            sched_mode = SCHED_FIXED_STEP;
+        } else if (strcmp(argv[i], "--mute") == 0) {
+            mute = TRUE;
+        } else if (argv[i][0] != '-' && romPath == NULL) {
+            // Store the path to the ROM in a variable
+            romPath = argv[i];
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    // Check if a rom was provided; a movie replays from power-on, not from a snapshot
+    if (romPath == NULL || (statePath != NULL && moviePath != NULL)) {
+        usage();
         return 1;
     }
 
-    // Store the path to the ROM in a variable
-    char* romPath = argv[1];
-
     //intialize the chip8 system
     Chip8 user_chip8;
     initialize(&user_chip8);
+    chip8_seed_rng(&user_chip8, seed);
+    chip8_set_quirks(&user_chip8, (uint8_t)quirks);
 
-    //loading the rom
-    FILE* rom = fopen(romPath, "rb");
+    //loading the rom, mapped rather than read
+    Chip8_RomCache roms;
+    chip8_rom_cache_init(&roms);
+    const Chip8_RomImage* rom = chip8_rom_cache_open(&roms, romPath);
     if (rom == NULL) {
-        printf("Failed to open ROM file\n");
+        printf("Failed to load ROM file %s\n", romPath);
+        return 1;
+    }
+    if (!chip8_load_rom(&user_chip8, rom)) {
+        printf("ROM too big for the %s machine\n", QUIRK_NAMES[quirks]);
         return 1;
     }
-    fread(&user_chip8.ram[PROGRAM_START_ADDR], 1, TOTAL_RAM - PROGRAM_START_ADDR, rom);
-    fclose(rom);
 
-    
+    // resume from the first snapshot in the file instead of the start of the rom
+    if (statePath != NULL) {
+        Chip8_SnapshotFile snapshot;
+        if (!chip8_snapshot_map(&snapshot, statePath) || !chip8_snapshot_load(&user_chip8, &snapshot, 0)) {
+            printf("Failed to load state file\n");
+            return 1;
+        }
+        chip8_snapshot_unmap(&snapshot);
+    }
+
+#ifdef CHIP8_PROFILE
+    if (!chip8_profile_enable(&user_chip8)) {
+        printf("Failed to allocate the profile\n");
+        return 1;
+    }
+#endif
+#ifdef CHIP8_TRACE
+    if (!chip8_trace_enable(&user_chip8, TRACE_PATH)) {
+        printf("Failed to create %s\n", TRACE_PATH);
+        return 1;
+    }
+#endif
+
+    // compile the rom into threaded code blocks instead of interpreting it,
+    // the ones static analysis finds up front
+    if (use_jit && (!chip8_jit_enable(&user_chip8) || chip8_jit_prewarm(&user_chip8) < 0)) {
+        printf("Failed to allocate the block compiler\n");
+        return 1;
+    }
+
+    if (SDL_Init(SDL_INIT_VIDEO) != 0) {
+        printf("Failed to initialize SDL: %s\n", SDL_GetError());
+        return 1;
+    }
+    Chip8_Display display;
+    if (!display_init(&display, "CHIP-8", DISPLAY_SCALE)) {
+        printf("Failed to open the window: %s\n", SDL_GetError());
+        SDL_Quit();
+        return 1;
+    }
+
+    // the buzzer, played from the frames the emulator pushes each tick; no
+    // device just means no sound
+    static Chip8_Speaker speaker;
+    speaker.device = 0;
+    if (!mute) {
+        if (speaker_open(&speaker)) {
+            user_chip8.audio = &speaker.ring.sink;
+        } else {
+            printf("No sound: %s\n", SDL_GetError());
+        }
+    }
+
+    // emulation runs on its own thread, publishing frames; this thread handles
+    // window events and draws the latest frame at the display's refresh rate
+    static Chip8_TripleBuffer frames;
+    static Chip8_InputQueue input;
+    chip8_frames_init(&frames);
+    chip8_input_init(&input);
+    Emulation_Thread emu = { .chip8 = &user_chip8, .frames = &frames };
+    atomic_init(&emu.quit, FALSE);
+    chip8_sched_init(&emu.sched, sched_mode, instructions_per_frame);
+    emu.sched.input = &input;
+
+    // record the session's key presses and checkpoints, saved on exit
+    static Chip8_Movie movie;
+    if (moviePath != NULL) {
+        chip8_movie_init(&movie, rom->bytes, rom->size, seed, user_chip8.quirks, instructions_per_frame);
+        input.on_apply = chip8_movie_on_apply;
+        input.on_apply_ctx = &movie;
+        emu.movie = &movie;
+    }
+    pthread_t emu_thread;
+    if (pthread_create(&emu_thread, NULL, emulation_thread, &emu) != 0) {
+        printf("Failed to start the emulation thread\n");
+        speaker_close(&speaker);
+        display_destroy(&display);
+        SDL_Quit();
+        return 1;
+    }
+
+    int quit = FALSE;
+    while (!quit) {
+        SDL_Event event;
+        // nothing new drawn last time round: sleep until an event or a little
+        // while, the emulator publishes at most once per 1/60 s
+        int have_event = !display.needs_present && SDL_WaitEventTimeout(&event, RENDER_IDLE_WAIT_MS);
+        while (have_event || SDL_PollEvent(&event)) {
+            if (event.type == SDL_QUIT) {
+                quit = TRUE;
+            } else if (event.type == SDL_KEYDOWN || event.type == SDL_KEYUP) {
+                push_key_event(&input, &event.key);
+            }
+            display_handle_event(&display, &event);
+            have_event = FALSE;
+        }
+
+        const Chip8_Frame* frame = chip8_frames_acquire(&frames);
+        if (frame != NULL) {
+            display_upload(&display, frame);
+        }
+        display_present(&display);
+    }
+
+    atomic_store_explicit(&emu.quit, TRUE, memory_order_relaxed);
+    pthread_join(emu_thread, NULL);
+    speaker_close(&speaker);
+
+    if (moviePath != NULL) {
+        if (!chip8_movie_save(&movie, moviePath)) {
+            printf("Failed to write %s\n", moviePath);
+        }
+        chip8_movie_free(&movie);
+    }
+
+    if (input.latency_count > 0) {
+        printf("input: %llu key events, latency mean %.2f ms, max %.2f ms, %llu dropped\n",
+               (unsigned long long)input.events_applied, input.latency_total_ns / 1e6 / input.latency_count,
+               input.latency_max_ns / 1e6, (unsigned long long)input.events_dropped);
+    }
+    if (speaker.ring.frames_played > 0) {
+        printf("audio: %llu frames played, %llu skipped, %llu dropped, %llu underruns\n",
+               (unsigned long long)speaker.ring.frames_played, (unsigned long long)speaker.ring.frames_skipped,
+               (unsigned long long)speaker.ring.frames_dropped, (unsigned long long)speaker.ring.underruns);
+    }
+
+#ifdef CHIP8_PROFILE
+    chip8_profile_report(&user_chip8, stderr);
+    if (!chip8_profile_write_collapsed(&user_chip8, PROFILE_COLLAPSED_PATH)) {
+        printf("Failed to write %s\n", PROFILE_COLLAPSED_PATH);
+    }
+#endif
+#ifdef CHIP8_TRACE
+    if (!chip8_trace_disable(&user_chip8)) {
+        printf("Failed to write %s\n", TRACE_PATH);
+    }
+#endif
+
+    chip8_rom_cache_free(&roms);
+    display_destroy(&display);
+    SDL_Quit();
+    return 0;
 }
 
  
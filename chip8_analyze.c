@@ -0,0 +1,254 @@
+// Static rom analyzer: disassembly with code and data told apart, or the control-flow graph
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "chip8_def.h"
+#include "decode.h"
+#include "memory.h"
+#include "quirks.h"
+#include "analyze.h"
+#include "helperMethods.h"
+
+#define ANALYZE_DATA_PER_LINE 8
+
+/*
+Formats the operands of instr at pc in the usual CHIP-8 assembler syntax
+*/
+void analyze_operands(char* buf, size_t size, const Chip8* chip8, Chip8_Instr instr, uint16_t pc) {
+    switch (instr.id) {
+        case OP_JP_ADDR:
+        case OP_CALL_ADDR:
+            snprintf(buf, size, "0x%03X", instr.nnn);
+            break;
+        case OP_SE_VX_BYTE:
+        case OP_SNE_VX_BYTE:
+        case OP_LD_VX_BYTE:
+        case OP_ADD_VX:
+        case OP_RND:
+            snprintf(buf, size, "V%X, 0x%02X", instr.x, instr.kk);
+            break;
+        case OP_SE_VX_VY:
+        case OP_SNE_VX_VY:
+        case OP_LD_VX_VY:
+        case OP_OR_VX_VY:
+        case OP_AND_VX_VY:
+        case OP_XOR_VX_VY:
+        case OP_ADD_VX_VY:
+        case OP_SUB_VX_VY:
+        case OP_SHR_VX_VY:
+        case OP_SUBN_VX_VY:
+        case OP_SHL_VX_VY:
+        case OP_ST_V_RANGE:
+        case OP_LD_V_RANGE:
+            snprintf(buf, size, "V%X, V%X", instr.x, instr.y);
+            break;
+        case OP_LD_I_ADDR:
+            snprintf(buf, size, "I, 0x%03X", instr.nnn);
+            break;
+        case OP_LD_I_LONG:
+            snprintf(buf, size, "I, 0x%04X", (chip8_read_ram(chip8, pc + 2) << 8) | chip8_read_ram(chip8, pc + 3));
+            break;
+        case OP_JP_V0_ADDR:
+            snprintf(buf, size, "V0, 0x%03X", instr.nnn);
+            break;
+        case OP_DRW:
+        case OP_DRW_16:
+            snprintf(buf, size, "V%X, V%X, %u", instr.x, instr.y, instr.n);
+            break;
+        case OP_SKP_VX:
+        case OP_SKNP_VX:
+        case OP_PITCH_VX:
+            snprintf(buf, size, "V%X", instr.x);
+            break;
+        case OP_LD_VX_DT:  snprintf(buf, size, "V%X, DT", instr.x);   break;
+        case OP_LD_VX_K:   snprintf(buf, size, "V%X, K", instr.x);    break;
+        case OP_LD_DT_VX:  snprintf(buf, size, "DT, V%X", instr.x);   break;
+        case OP_LD_ST_VX:  snprintf(buf, size, "ST, V%X", instr.x);   break;
+        case OP_ADD_I_VX:  snprintf(buf, size, "I, V%X", instr.x);    break;
+        case OP_LD_F_VX:   snprintf(buf, size, "F, V%X", instr.x);    break;
+        case OP_LD_HF_VX:  snprintf(buf, size, "HF, V%X", instr.x);   break;
+        case OP_ST_BCD_VX: snprintf(buf, size, "B, V%X", instr.x);    break;
+        case OP_ST_V_REGS: snprintf(buf, size, "[I], V%X", instr.x);  break;
+        case OP_LD_V_REGS: snprintf(buf, size, "V%X, [I]", instr.x);  break;
+        case OP_ST_R_VX:   snprintf(buf, size, "R, V%X", instr.x);    break;
+        case OP_LD_VX_R:   snprintf(buf, size, "V%X, R", instr.x);    break;
+        case OP_SCD:
+        case OP_SCU:
+            snprintf(buf, size, "%u", instr.n);
+            break;
+        case OP_PLANE:
+            snprintf(buf, size, "%u", instr.x);
+            break;
+        default:
+            buf[0] = '\0';
+            break;
+    }
+}
+
+/*
+Prints the bytes from start to end that aren't code, ANALYZE_DATA_PER_LINE a line
+*/
+void analyze_print_bytes(const Chip8_Analysis* a, const Chip8* chip8, uint32_t start, uint32_t end) {
+    for (uint32_t line = start; line < end; line += ANALYZE_DATA_PER_LINE) {
+        uint32_t line_end = (line + ANALYZE_DATA_PER_LINE < end) ? line + ANALYZE_DATA_PER_LINE : end;
+        printf("    0x%04X  db  ", line);
+        for (uint32_t addr = line; addr < line_end; addr++) {
+            printf("0x%02X%s", chip8_read_ram(chip8, addr), (addr + 1 < line_end) ? ", " : "");
+        }
+        printf("%*s; %s\n", (int)(ANALYZE_DATA_PER_LINE - (line_end - line)) * 6, "",
+               (a->map[line] & ANALYZE_DATA) ? "data" : "unreached");
+    }
+}
+
+/*
+The rom from PC_START to its end (or the last code past it) as assembler, blocks
+labeled and flagged instructions commented
+*/
+void analyze_print_listing(const Chip8_Analysis* a, const Chip8* chip8, uint32_t rom_end) {
+    uint32_t end = rom_end;
+    for (uint32_t addr = rom_end; addr <= chip8->ram_mask; addr++) {
+        if (a->map[addr] & ANALYZE_CODE) {
+            end = addr + 1;
+        }
+    }
+
+    uint32_t addr = PC_START;
+    while (addr < end) {
+        uint16_t flags = a->map[addr];
+        if (!(flags & ANALYZE_INSTR)) {
+            // a run of bytes that are all data or all unreached
+            uint32_t run_end = addr + 1;
+            while (run_end < end && !(a->map[run_end] & ANALYZE_INSTR) &&
+                   (a->map[run_end] & ANALYZE_DATA) == (flags & ANALYZE_DATA) &&
+                   !(a->map[run_end] & ANALYZE_CODE) == !(flags & ANALYZE_CODE)) {
+                run_end++;
+            }
+            analyze_print_bytes(a, chip8, addr, run_end);
+            addr = run_end;
+            continue;
+        }
+
+        if (flags & ANALYZE_BLOCK) {
+            const Chip8_AnalysisBlock* block = &a->blocks[a->block_at[addr] - 1];
+            printf("\n%s_%04X:", (flags & ANALYZE_CALL_TARGET) ? "sub" : "block", addr);
+            if (block->loop_depth > 0) {
+                printf("  ; loop depth %u", block->loop_depth);
+            }
+            printf("\n");
+        }
+
+        Chip8_Instr instr = chip8_instr_at(chip8, addr);
+        char operands[32];
+        const char* name = OP_NAMES[instr.id];
+        uint8_t valid = QUIRK_HANDLERS[chip8->quirks][instr.id] != op_invalid;
+        if (!valid) {
+            name = OP_NAMES[OP_INVALID];
+            operands[0] = '\0';
+        } else {
+            analyze_operands(operands, sizeof(operands), chip8, instr, (uint16_t)addr);
+        }
+        char text[48];
+        char comment[96] = "";
+        if (operands[0] != '\0') {
+            snprintf(text, sizeof(text), "%-5s %s", name, operands);
+        } else {
+            snprintf(text, sizeof(text), "%s", name);
+        }
+        if (flags & ANALYZE_INDIRECT) {
+            strcat(comment, " ; indirect jump");
+        }
+        if (flags & ANALYZE_SMC) {
+            strcat(comment, " ; stores into code");
+        }
+        if (flags & ANALYZE_STORE_UNKNOWN) {
+            strcat(comment, " ; stores through unknown I");
+        }
+        if (flags & ANALYZE_DATA) {
+            strcat(comment, " ; also read as data");
+        }
+        printf("    0x%04X  %04X  %-*s%s\n", addr, instr.opcode, comment[0] ? 18 : 0, text, comment);
+        addr += (instr.id == OP_LD_I_LONG && valid) ? 4 : 2;
+    }
+}
+
+/*
+The control-flow graph in graphviz dot: a node per block, an edge per static
+successor, dashed edges to a "dynamic" node for ret, Bnnn and stops
+*/
+void analyze_print_dot(const Chip8_Analysis* a, const char* rom_path) {
+    printf("digraph \"%s\" {\n", rom_path);
+    printf("    node [shape=box fontname=monospace];\n");
+    printf("    dynamic [shape=ellipse];\n");
+    for (uint32_t b = 0; b < a->num_blocks; b++) {
+        const Chip8_AnalysisBlock* block = &a->blocks[b];
+        printf("    b%04X [label=\"0x%04X-0x%04X\\n%u instructions\"%s];\n", block->start, block->start,
+               block->end - 1, block->count, block->loop_depth > 0 ? " style=bold" : "");
+        for (int k = 0; k < block->num_next; k++) {
+            if (a->block_at[block->next[k]] != 0) {
+                printf("    b%04X -> b%04X;\n", block->start, block->next[k]);
+            }
+        }
+        if (block->dynamic) {
+            printf("    b%04X -> dynamic [style=dashed];\n", block->start);
+        }
+    }
+    printf("}\n");
+}
+
+void analyze_usage(void) {
+    printf("Usage: ./chip8-analyze [--quirks PROFILE] [--dot] path/to/rom\n");
+    printf("  --quirks P    quirk profile to analyze for: default, vip, chip48, schip or xochip\n");
+    printf("  --dot         print the control-flow graph for graphviz instead of the listing\n");
+}
+
+int main(int argc, char* argv[]) {
+    static Chip8_Analysis analysis;
+    static Chip8 chip8;
+    static uint8_t rom[MAX_ROM_SIZE];
+    int quirks = QUIRKS_DEFAULT;
+    int dot = FALSE;
+    const char* rom_path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--quirks") == 0 && i + 1 < argc) {
+            quirks = chip8_quirks_by_name(argv[++i]);
+        } else if (strcmp(argv[i], "--dot") == 0) {
+            dot = TRUE;
+        } else if (argv[i][0] != '-' && rom_path == NULL) {
+            rom_path = argv[i];
+        } else {
+            analyze_usage();
+            return 1;
+        }
+    }
+    if (rom_path == NULL || quirks < 0) {
+        analyze_usage();
+        return 1;
+    }
+
+    long rom_size = read_rom_file(rom_path, rom);
+    initialize(&chip8);
+    chip8_set_quirks(&chip8, (uint8_t)quirks);
+    if (rom_size < 0 || !load_rom_image(&chip8, rom, rom_size)) {
+        printf("Failed to load ROM file %s\n", rom_path);
+        chip8_release(&chip8);
+        return 1;
+    }
+
+    if (!chip8_analyze(&analysis, &chip8)) {
+        fprintf(stderr, "%s: more than %d blocks, analyzed the first ones\n", rom_path, ANALYZE_MAX_BLOCKS);
+    }
+    if (dot) {
+        analyze_print_dot(&analysis, rom_path);
+    } else {
+        printf("; %s, %s profile: %u blocks, %u instructions, %u data bytes, %u indirect jumps, "
+               "%u stores into code, %u stores through unknown I\n",
+               rom_path, QUIRK_NAMES[quirks], analysis.num_blocks, analysis.num_instrs, analysis.num_data_bytes,
+               analysis.num_indirect, analysis.num_smc, analysis.num_store_unknown);
+        analyze_print_listing(&analysis, &chip8, PC_START + (uint32_t)rom_size);
+    }
+
+    chip8_release(&chip8);
+    return 0;
+}
@@ -0,0 +1,194 @@
+// Ahead-of-time compiler: translates roms into C run functions for aot.h
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "chip8_def.h"
+#include "decode.h"
+#include "instructions.h"
+#include "quirks.h"
+#include "jit.h"
+#include "analyze.h"
+#include "aot.h"
+#include "movie.h"
+#include "helperMethods.h"
+
+#define AOT_ENUM_NAME(id, handler, name) [id] = #id,
+static const char* const AOT_OP_ENUMS[OP_COUNT] = { CHIP8_OPCODES(AOT_ENUM_NAME) };
+#undef AOT_ENUM_NAME
+
+#define AOT_PROFILE_ENUM(profile, suffix, name, machine, vf_reset, shift_vy, i_after, jump_vx, clip) [profile] = #profile,
+static const char* const AOT_PROFILE_ENUMS[QUIRK_PROFILE_COUNT] = {
+    [QUIRKS_DEFAULT] = "QUIRKS_DEFAULT",
+    CHIP8_QUIRK_PROFILES(AOT_PROFILE_ENUM)
+};
+#undef AOT_PROFILE_ENUM
+
+/*
+The operands of a CHIP8_AOT_OP / CHIP8_AOT_IDLE after the profile: id, opcode, x, y, n, kk, nnn
+*/
+static void aot_emit_instr(FILE* out, Chip8_Instr instr) {
+    fprintf(out, "%s, 0x%04X, 0x%X, 0x%X, 0x%X, 0x%02X, 0x%03X", AOT_OP_ENUMS[instr.id],
+            instr.opcode, instr.x, instr.y, instr.n, instr.kk, instr.nnn);
+}
+
+/*
+Writes the run function and block table of image `index` for the rom in chip8
+*/
+void aot_emit_image(FILE* out, const Chip8_Analysis* analysis, const Chip8* chip8, int index) {
+    const char* profile = AOT_PROFILE_ENUMS[chip8->quirks];
+
+    fprintf(out, "static const Chip8_AotBlock aot_blocks_%d[] = {\n", index);
+    for (uint32_t k = 0; k < analysis->num_blocks; k++) {
+        fprintf(out, "    { 0x%04X, 0x%04X },\n", analysis->blocks[k].start, analysis->blocks[k].end);
+    }
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "static uint64_t aot_run_%d(Chip8* chip8, uint64_t n) {\n", index);
+    fprintf(out, "    const uint8_t* stale = chip8->aot->stale;\n");
+    fprintf(out, "    uint64_t executed = 0;\n\n");
+    fprintf(out, "dispatch:\n");
+    fprintf(out, "    if (executed >= n || !chip8->is_running_flag) {\n        goto done;\n    }\n");
+    fprintf(out, "    switch (chip8->pc_reg & chip8->ram_mask) {\n");
+    for (uint32_t k = 0; k < analysis->num_blocks; k++) {
+        fprintf(out, "        case 0x%04X: goto b_%u;\n", analysis->blocks[k].start, k);
+    }
+    fprintf(out, "        default: break;\n    }\n");
+    fprintf(out, "interpret:\n");
+    fprintf(out, "    executed += chip8_aot_interpret(chip8, %s, n - executed - 1);\n", profile);
+    fprintf(out, "    goto dispatch;\n");
+    fprintf(out, "slow:\n");
+    fprintf(out, "    if (executed >= n) {\n        goto done;\n    }\n    goto interpret;\n");
+
+    for (uint32_t k = 0; k < analysis->num_blocks; k++) {
+        const Chip8_AnalysisBlock* block = &analysis->blocks[k];
+        Chip8_Instr first = chip8_instr_at(chip8, block->start);
+
+        fprintf(out, "\nb_%u: // 0x%04X-0x%04X\n", k, block->start, block->end - 1);
+        fprintf(out, "    if (stale[%u] || n - executed < %u) {\n        goto slow;\n    }\n", k, block->count);
+        if (CHIP8_MAY_IDLE(first.id)) {
+            fprintf(out, "    CHIP8_AOT_IDLE(");
+            aot_emit_instr(out, first);
+            fprintf(out, ", n - executed - 1)\n    if (n - executed < %u) {\n        goto slow;\n    }\n", block->count);
+        }
+        fprintf(out, "    CHIP8_TRACE_BLOCK(chip8, 0x%04X, %u);\n", block->start, block->count);
+        for (uint32_t i = 0; i < block->count; i++) {
+            Chip8_Instr instr = chip8_instr_at(chip8, block->start + i * 2);
+            fprintf(out, "    CHIP8_AOT_OP(%s, ", profile);
+            aot_emit_instr(out, instr);
+            fprintf(out, "); // %s\n", OP_NAMES[instr.id]);
+        }
+        fprintf(out, "    executed += %u;\n", block->count);
+
+        // straight to the next block where it is known, the switch otherwise. Only dispatch
+        // looks at is_running_flag, so a chained block checks it first: a halting call or
+        // ret leaves pc alone, and the block after it must not run
+        int chained = FALSE;
+        for (int i = 0; i < block->num_next && !block->dynamic; i++) {
+            chained |= (analysis->block_at[block->next[i]] != 0);
+        }
+        if (chained) {
+            fprintf(out, "    if (!chip8->is_running_flag) {\n        goto done;\n    }\n");
+        }
+        if (!block->dynamic && block->num_next == 1 && analysis->block_at[block->next[0]] != 0) {
+            fprintf(out, "    goto b_%u;\n", analysis->block_at[block->next[0]] - 1);
+            continue;
+        }
+        for (int i = 0; i < block->num_next && !block->dynamic; i++) {
+            if (analysis->block_at[block->next[i]] != 0) {
+                fprintf(out, "    if (chip8->pc_reg == 0x%04X) {\n        goto b_%u;\n    }\n",
+                        block->next[i], analysis->block_at[block->next[i]] - 1);
+            }
+        }
+        fprintf(out, "    goto dispatch;\n");
+    }
+
+    fprintf(out, "\ndone:\n");
+    fprintf(out, "    CHIP8_PROFILE_PAUSE(chip8);\n");
+    fprintf(out, "    CHIP8_TRACE_PAUSE(chip8);\n");
+    fprintf(out, "    chip8->cycle_count += executed;\n");
+    fprintf(out, "    return executed;\n}\n\n");
+}
+
+void aot_usage(void) {
+    printf("Usage: ./chip8-aot [--quirks PROFILE] [-o FILE] path/to/rom...\n");
+    printf("  --quirks P    quirk profile to compile for: default, vip, chip48, schip or xochip\n");
+    printf("  -o FILE       where to write the C source (default: stdout), include it with\n");
+    printf("                -DCHIP8_AOT_FILE='\"FILE\"', see aot.h\n");
+}
+
+int main(int argc, char* argv[]) {
+    static Chip8_Analysis analysis;
+    static Chip8 chip8;
+    static uint8_t rom[MAX_ROM_SIZE];
+    const char* out_path = NULL;
+    int quirks = QUIRKS_DEFAULT;
+    int first_rom = argc;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--quirks") == 0 && i + 1 < argc) {
+            quirks = chip8_quirks_by_name(argv[++i]);
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            out_path = argv[++i];
+        } else if (argv[i][0] == '-') {
+            aot_usage();
+            return 1;
+        } else {
+            first_rom = i;
+            break;
+        }
+    }
+    if (first_rom == argc || quirks < 0) {
+        aot_usage();
+        return 1;
+    }
+
+    FILE* out = (out_path != NULL) ? fopen(out_path, "w") : stdout;
+    if (out == NULL) {
+        printf("Failed to open %s\n", out_path);
+        return 1;
+    }
+    fprintf(out, "// Generated by chip8-aot, do not edit. Compiled for the %s quirk profile from:\n", QUIRK_NAMES[quirks]);
+    for (int r = first_rom; r < argc; r++) {
+        fprintf(out, "//   %s\n", argv[r]);
+    }
+    fprintf(out, "#include \"cpu.h\"\n#include \"aot.h\"\n\n");
+
+    int ok = TRUE;
+    int num_images = 0;
+    uint64_t hashes[argc];
+    long sizes[argc];
+    for (int r = first_rom; r < argc && ok; r++) {
+        long rom_size = read_rom_file(argv[r], rom);
+        initialize(&chip8);
+        chip8_set_quirks(&chip8, (uint8_t)quirks);
+        if (rom_size < 0 || !load_rom_image(&chip8, rom, rom_size)) {
+            printf("Failed to load ROM file %s\n", argv[r]);
+            ok = FALSE;
+        } else if (!chip8_analyze(&analysis, &chip8)) {
+            printf("%s: more than %d blocks\n", argv[r], ANALYZE_MAX_BLOCKS);
+            ok = FALSE;
+        } else {
+            fprintf(stderr, "%s: %u blocks, %u instructions\n", argv[r], analysis.num_blocks, analysis.num_instrs);
+            fprintf(out, "// %s\n", argv[r]);
+            aot_emit_image(out, &analysis, &chip8, num_images);
+            hashes[num_images] = chip8_rom_hash(rom, rom_size);
+            sizes[num_images] = rom_size;
+            num_images++;
+        }
+        chip8_release(&chip8);
+    }
+
+    fprintf(out, "static const Chip8_AotImage CHIP8_AOT_IMAGES[] = {\n");
+    for (int i = 0; i < num_images; i++) {
+        fprintf(out, "    { \"%s\", 0x%016llXull, %ld, %s, sizeof(aot_blocks_%d) / sizeof(Chip8_AotBlock), aot_blocks_%d, aot_run_%d },\n",
+                argv[first_rom + i], (unsigned long long)hashes[i], sizes[i], AOT_PROFILE_ENUMS[quirks], i, i, i);
+    }
+    fprintf(out, "};\n#define CHIP8_AOT_IMAGE_COUNT (sizeof(CHIP8_AOT_IMAGES) / sizeof(CHIP8_AOT_IMAGES[0]))\n");
+
+    ok = (fflush(out) == 0) && ok;
+    if (out != stdout) {
+        ok = (fclose(out) == 0) && ok;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,457 @@
+// Headless batch runner: runs many independent Chip8 instances across all cores
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include "chip8_def.h"
+#include "instructions.h"
+#include "cpu.h"
+#include "quirks.h"
+#include "lockstep.h"
+#include "input.h"
+#include "snapshot.h"
+#include "movie.h"
+#include "romcache.h"
+#include "analyze.h"
+#include "aot.h"
+#include "helperMethods.h"
+
+// roms compiled ahead of time by chip8-aot, for --aot (make chip8-batch-aot)
+#ifdef CHIP8_AOT_FILE
+#include CHIP8_AOT_FILE
+#else
+static const Chip8_AotImage CHIP8_AOT_IMAGES[1];
+#define CHIP8_AOT_IMAGE_COUNT 0
+#endif
+
+#define DEFAULT_CYCLE_BUDGET 10000000ull
+#define HALT_CHECK_INTERVAL 4096     // cycles between halt condition checks, rounded to whole frames
+#define MAX_WORKERS 256
+
+typedef struct {
+    const char* rom_path;
+    const Chip8_RomImage* rom;       // shared by every job of the rom
+    uint64_t seed;
+
+    // results
+    uint64_t cycles;
+    uint64_t idle_cycles;            // part of cycles skipped as idle loops
+    uint8_t halted;
+    uint16_t pc_reg;
+    uint16_t I_reg;
+    uint8_t V[NUM_V_REGISTERS];
+    uint64_t screen_hash;
+} Batch_Job;
+
+// What a worker takes off a queue: one job, or up to --lockstep jobs of the same rom
+typedef struct {
+    uint32_t first_job;
+    uint32_t num_jobs;
+} Batch_Unit;
+
+// Each worker owns a contiguous slice of the units and pops from its front.
+// Idle workers steal from the front of other workers' slices.
+typedef struct {
+    _Atomic uint32_t next;
+    uint32_t end;
+    char pad[64 - sizeof(_Atomic uint32_t) - sizeof(uint32_t)];  // one queue per cache line
+} Batch_Queue;
+
+typedef struct {
+    Batch_Job* jobs;
+    Batch_Unit* units;
+    Batch_Queue queues[MAX_WORKERS];
+    int num_workers;
+    uint64_t cycle_budget;
+    uint32_t instructions_per_frame; // instructions between 60 Hz timer ticks
+    uint32_t frames_per_check;       // frames between halt condition checks
+    int use_jit;
+    int use_aot;                     // run roms compiled into the binary ahead of time where there are
+    uint8_t quirks;                  // quirk profile every instance runs (quirks.h)
+    int lockstep_lanes;              // 0 runs every job on its own
+    const Chip8_KeyEvent* script;    // key events every job replays, NULL for none
+    size_t script_len;
+    uint8_t* states;                 // final state of every job (state_size each), only for --save-states
+    size_t state_size;               // snapshot record size of the profile's machine (snapshot.h)
+} Batch_Pool;
+
+typedef struct {
+    Batch_Pool* pool;
+    int id;
+} Batch_Worker;
+
+/*
+The rom is done when it stops itself (invalid opcode) or parks on a jump to itself,
+the usual way test roms signal they are finished
+*/
+int batch_is_halted(const Chip8* chip8) {
+    if (!chip8->is_running_flag) {
+        return TRUE;
+    }
+    Chip8_Instr instr = chip8_instr_at(chip8, chip8->pc_reg);
+    return instr.id == OP_JP_ADDR && instr.nnn == chip8->pc_reg;
+}
+
+void batch_store_result(Batch_Pool* pool, Batch_Job* job, Chip8* chip8, uint8_t halted) {
+    if (pool->states != NULL) {
+        chip8_save_state(chip8, &pool->states[(job - pool->jobs) * pool->state_size], pool->state_size);
+    }
+    job->halted = halted;
+    job->cycles = chip8->cycle_count;
+    job->idle_cycles = chip8->idle_cycles;
+    job->pc_reg = chip8->pc_reg;
+    job->I_reg = chip8->I_reg;
+    memcpy(job->V, chip8->V, sizeof(job->V));
+    job->screen_hash = screen_hash(chip8);
+}
+
+void batch_run_job(Batch_Pool* pool, Batch_Job* job, Chip8* chip8) {
+    uint8_t halted = FALSE;
+    Chip8_InputQueue input;
+    Chip8_InputQueue* q = NULL;
+    size_t next_event = 0;
+
+    if (pool->script != NULL) {
+        chip8_input_init(&input);
+        q = &input;
+    }
+
+    initialize(chip8);
+    chip8_seed_rng(chip8, job->seed);
+    chip8_set_quirks(chip8, pool->quirks);
+    chip8_load_rom(chip8, job->rom);
+    if (pool->use_aot) {
+        const Chip8_AotImage* image = chip8_aot_find(CHIP8_AOT_IMAGES, CHIP8_AOT_IMAGE_COUNT, job->rom->hash,
+                                                     job->rom->size, pool->quirks);
+        if (image == NULL || !chip8_aot_enable(chip8, image)) {
+            fprintf(stderr, "%s: not compiled ahead of time for this profile, %s\n", job->rom_path,
+                    pool->use_jit ? "using the block compiler" : "interpreting");
+        }
+    }
+    if (pool->use_jit && chip8->aot == NULL && (!chip8_jit_enable(chip8) || chip8_rom_prewarm(chip8, job->rom) < 0)) {
+        fprintf(stderr, "%s: failed to allocate the block compiler, interpreting\n", job->rom_path);
+        chip8_jit_disable(chip8);
+    }
+
+    while (chip8->cycle_count < pool->cycle_budget) {
+        // whole frames, the last one cut short (no timer tick) by the budget
+        for (uint32_t f = 0; f < pool->frames_per_check && chip8->cycle_count < pool->cycle_budget; f++) {
+            uint64_t left = pool->cycle_budget - chip8->cycle_count;
+            if (q != NULL) {
+                // the script's events up to and including the end of this frame
+                chip8_input_feed(q, pool->script, pool->script_len, &next_event,
+                                 chip8->cycle_count + pool->instructions_per_frame + 1);
+            }
+            if (left < pool->instructions_per_frame) {
+                chip8_input_run_cycles(chip8, q, left);
+                break;
+            }
+            chip8_input_run_frame(chip8, q, pool->instructions_per_frame);
+        }
+        if (batch_is_halted(chip8)) {
+            halted = TRUE;
+            break;
+        }
+    }
+
+    batch_store_result(pool, job, chip8, halted);
+    chip8_release(chip8);
+}
+
+/*
+Runs the jobs of a unit as lanes of one lockstep engine
+*/
+void batch_run_lockstep(Batch_Pool* pool, Batch_Unit* unit, Chip8* lanes, Chip8_Lockstep* ls) {
+    uint8_t halted[LOCKSTEP_MAX_LANES] = {0};
+    uint64_t done = 0;
+
+    // a unit runs one rom, so every lane is a fork of the first sharing its ram
+    Batch_Job* first = &pool->jobs[unit->first_job];
+    initialize(&lanes[0]);
+    chip8_set_quirks(&lanes[0], pool->quirks);
+    chip8_load_rom(&lanes[0], first->rom);
+    for (uint32_t k = 1; k < unit->num_jobs; k++) {
+        chip8_fork(&lanes[k], &lanes[0]);
+    }
+    for (uint32_t k = 0; k < unit->num_jobs; k++) {
+        chip8_seed_rng(&lanes[k], pool->jobs[unit->first_job + k].seed);
+    }
+    chip8_lockstep_init(ls, lanes, unit->num_jobs);
+
+    while (done < pool->cycle_budget) {
+        // the same frames as batch_run_job, for every lane at once
+        for (uint32_t f = 0; f < pool->frames_per_check && done < pool->cycle_budget; f++) {
+            uint64_t chunk = pool->cycle_budget - done;
+            if (chunk > pool->instructions_per_frame) {
+                chunk = pool->instructions_per_frame;
+            }
+            chip8_lockstep_run_cycles(ls, chunk);
+            done += chunk;
+            if (chunk == pool->instructions_per_frame) {
+                chip8_lockstep_tick_timers(ls);
+            }
+        }
+
+        chip8_lockstep_sync(ls);
+        int running = 0;
+        for (uint32_t k = 0; k < unit->num_jobs; k++) {
+            if (!halted[k] && batch_is_halted(&lanes[k])) {
+                halted[k] = TRUE;
+                chip8_lockstep_halt_lane(ls, k);
+            }
+            running += !halted[k];
+        }
+        if (running == 0) {
+            break;
+        }
+    }
+
+    chip8_lockstep_sync(ls);
+    for (uint32_t k = 0; k < unit->num_jobs; k++) {
+        batch_store_result(pool, &pool->jobs[unit->first_job + k], &lanes[k], halted[k]);
+        chip8_release(&lanes[k]);
+    }
+}
+
+/*
+Takes the next job from queue q, returns -1 if it is empty
+*/
+int64_t batch_pop(Batch_Queue* q) {
+    if (atomic_load_explicit(&q->next, memory_order_relaxed) >= q->end) {
+        return -1;
+    }
+    uint32_t i = atomic_fetch_add_explicit(&q->next, 1, memory_order_relaxed);
+    return (i < q->end) ? (int64_t)i : -1;
+}
+
+void* batch_worker(void* arg) {
+    Batch_Worker* worker = arg;
+    Batch_Pool* pool = worker->pool;
+    int num_lanes = pool->lockstep_lanes ? pool->lockstep_lanes : 1;
+    Chip8* chip8 = malloc(num_lanes * sizeof(Chip8));
+    Chip8_Lockstep* ls = pool->lockstep_lanes ? malloc(sizeof(Chip8_Lockstep)) : NULL;
+    if (chip8 == NULL || (pool->lockstep_lanes && ls == NULL)) {
+        fprintf(stderr, "worker %d: out of memory\n", worker->id);
+        free(chip8);
+        return NULL;
+    }
+
+    for (;;) {
+        int64_t unit = batch_pop(&pool->queues[worker->id]);
+
+        // own slice is empty, steal from the others
+        for (int i = 1; unit < 0 && i < pool->num_workers; i++) {
+            unit = batch_pop(&pool->queues[(worker->id + i) % pool->num_workers]);
+        }
+        if (unit < 0) {
+            break;
+        }
+        if (ls != NULL) {
+            batch_run_lockstep(pool, &pool->units[unit], chip8, ls);
+        } else {
+            batch_run_job(pool, &pool->jobs[pool->units[unit].first_job], chip8);
+        }
+    }
+
+    free(ls);
+    free(chip8);
+    return NULL;
+}
+
+void batch_usage(void) {
+    printf("Usage: ./chip8-batch [options] path/to/rom...\n");
+    printf("  --cycles N    cycle budget per instance (default %llu)\n", DEFAULT_CYCLE_BUDGET);
+    printf("  --seeds N     run every rom N times, with seeds 0..N-1\n");
+    printf("  --threads N   worker threads (default: number of cores)\n");
+    printf("  --ipf N       instructions per 60 Hz frame, timers tick once per frame (default %d)\n", DEFAULT_INSTRUCTIONS_PER_FRAME);
+    printf("  --jit         run instances with the block compiler\n");
+    printf("  --aot         run roms compiled into this binary by chip8-aot (%d here), others as without\n",
+           (int)CHIP8_AOT_IMAGE_COUNT);
+    printf("  --quirks P    quirk profile: default, vip, chip48, schip or xochip\n");
+    printf("  --save-states FILE  append the final state of every job to a snapshot file\n");
+    printf("  --lockstep K  run the seeds of a rom K at a time as lanes of the lockstep engine (K <= %d)\n", LOCKSTEP_MAX_LANES);
+    printf("  --input FILE  replay the key events of an input script in every job (lines: cycle key down|up)\n");
+}
+
+int main(int argc, char* argv[]) {
+    static Batch_Pool pool;
+    uint64_t num_seeds = 1;
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int first_rom = argc;
+    const char* states_path = NULL;
+    const char* script_path = NULL;
+
+    pool.cycle_budget = DEFAULT_CYCLE_BUDGET;
+    pool.instructions_per_frame = DEFAULT_INSTRUCTIONS_PER_FRAME;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--cycles") == 0 && i + 1 < argc) {
+            pool.cycle_budget = strtoull(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--seeds") == 0 && i + 1 < argc) {
+            num_seeds = strtoull(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            num_threads = strtol(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--ipf") == 0 && i + 1 < argc) {
+            pool.instructions_per_frame = (uint32_t)strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--jit") == 0) {
+            pool.use_jit = TRUE;
+        } else if (strcmp(argv[i], "--aot") == 0) {
+            pool.use_aot = TRUE;
+        } else if (strcmp(argv[i], "--quirks") == 0 && i + 1 < argc) {
+            int quirks = chip8_quirks_by_name(argv[++i]);
+            if (quirks < 0) {
+                batch_usage();
+                return 1;
+            }
+            pool.quirks = (uint8_t)quirks;
+        } else if (strcmp(argv[i], "--save-states") == 0 && i + 1 < argc) {
+            states_path = argv[++i];
+        } else if (strcmp(argv[i], "--lockstep") == 0 && i + 1 < argc) {
+            pool.lockstep_lanes = (int)strtol(argv[++i], NULL, 0);
+            if (pool.lockstep_lanes < 1 || pool.lockstep_lanes > LOCKSTEP_MAX_LANES) {
+                batch_usage();
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--input") == 0 && i + 1 < argc) {
+            script_path = argv[++i];
+        } else if (argv[i][0] == '-') {
+            batch_usage();
+            return 1;
+        } else {
+            first_rom = i;
+            break;
+        }
+    }
+    int num_roms = argc - first_rom;
+    if (num_roms == 0 || num_seeds == 0 || pool.instructions_per_frame == 0) {
+        batch_usage();
+        return 1;
+    }
+    pool.frames_per_check = HALT_CHECK_INTERVAL / pool.instructions_per_frame;
+    if (pool.frames_per_check < 1) {
+        pool.frames_per_check = 1;
+    }
+    // the lockstep engine has no per-lane keyboard events
+    if (script_path != NULL && pool.lockstep_lanes) {
+        printf("--input can't be combined with --lockstep\n");
+        return 1;
+    }
+    Chip8_KeyEvent* script = NULL;
+    if (script_path != NULL) {
+        long script_len = chip8_input_load_script(script_path, &script);
+        if (script_len < 0) {
+            return 1;
+        }
+        pool.script = script;
+        pool.script_len = (size_t)script_len;
+    }
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+    if (num_threads > MAX_WORKERS) {
+        num_threads = MAX_WORKERS;
+    }
+
+    // map every rom once, all instances of it share the image
+    Chip8_RomCache roms;
+    chip8_rom_cache_init(&roms);
+    uint64_t num_jobs = num_roms * num_seeds;
+    pool.jobs = calloc(num_jobs, sizeof(Batch_Job));
+    pool.units = calloc(num_jobs, sizeof(Batch_Unit));
+    if (states_path != NULL) {
+        pool.state_size = CHIP8_STATE_RECORD_SIZE(QUIRK_RAM_MASKS[pool.quirks] + 1u);
+        pool.states = malloc(num_jobs * pool.state_size);
+    }
+    if (pool.jobs == NULL || pool.units == NULL || (states_path != NULL && pool.states == NULL)) {
+        printf("Out of memory\n");
+        return 1;
+    }
+    for (int r = 0; r < num_roms; r++) {
+        const Chip8_RomImage* rom = chip8_rom_cache_open(&roms, argv[first_rom + r]);
+        if (rom == NULL || rom->size > QUIRK_RAM_MASKS[pool.quirks] + 1u - PROGRAM_START_ADDR) {
+            printf("Failed to load ROM file %s\n", argv[first_rom + r]);
+            return 1;
+        }
+        for (uint64_t s = 0; s < num_seeds; s++) {
+            Batch_Job* job = &pool.jobs[r * num_seeds + s];
+            job->rom_path = argv[first_rom + r];
+            job->rom = rom;
+            job->seed = s;
+        }
+    }
+
+    // the block compiler's prewarm analysis, once per rom rather than per job
+    if (pool.use_jit && !chip8_rom_cache_analyze(&roms, pool.quirks)) {
+        printf("Out of memory\n");
+        return 1;
+    }
+
+    // lockstep units never mix roms
+    uint64_t num_units = 0;
+    uint32_t unit_lanes = pool.lockstep_lanes ? pool.lockstep_lanes : 1;
+    for (int r = 0; r < num_roms; r++) {
+        for (uint64_t s = 0; s < num_seeds; s += unit_lanes) {
+            pool.units[num_units].first_job = (uint32_t)(r * num_seeds + s);
+            pool.units[num_units].num_jobs = (uint32_t)((num_seeds - s < unit_lanes) ? num_seeds - s : unit_lanes);
+            num_units++;
+        }
+    }
+
+    // split the units evenly, stealing balances out roms that halt early
+    pool.num_workers = (int)num_threads;
+    for (int w = 0; w < pool.num_workers; w++) {
+        atomic_init(&pool.queues[w].next, (uint32_t)(num_units * w / pool.num_workers));
+        pool.queues[w].end = (uint32_t)(num_units * (w + 1) / pool.num_workers);
+    }
+
+    pthread_t threads[MAX_WORKERS];
+    Batch_Worker workers[MAX_WORKERS];
+    for (int w = 0; w < pool.num_workers; w++) {
+        workers[w].pool = &pool;
+        workers[w].id = w;
+        if (pthread_create(&threads[w], NULL, batch_worker, &workers[w]) != 0) {
+            printf("Failed to start worker thread\n");
+            return 1;
+        }
+    }
+    for (int w = 0; w < pool.num_workers; w++) {
+        pthread_join(threads[w], NULL);
+    }
+
+    // one line per job, in job order so runs can be diffed
+    uint64_t total_cycles = 0;
+    uint64_t total_idle = 0;
+    for (uint64_t j = 0; j < num_jobs; j++) {
+        Batch_Job* job = &pool.jobs[j];
+        total_cycles += job->cycles;
+        total_idle += job->idle_cycles;
+        printf("%s seed=%llu cycles=%llu halted=%d pc=%03X I=%03X V=",
+               job->rom_path, (unsigned long long)job->seed, (unsigned long long)job->cycles,
+               job->halted, job->pc_reg, job->I_reg);
+        for (int i = 0; i < NUM_V_REGISTERS; i++) {
+            printf("%02X", job->V[i]);
+        }
+        printf(" screen=%016llx\n", (unsigned long long)job->screen_hash);
+    }
+    // on stderr: the count depends on the engine, stdout must not
+    fprintf(stderr, "%llu cycles, %llu skipped as idle loops\n",
+            (unsigned long long)total_cycles, (unsigned long long)total_idle);
+
+    // snapshot file: the job records back to back, same order as the output
+    if (states_path != NULL) {
+        FILE* file = fopen(states_path, "ab");
+        if (file == NULL || fwrite(pool.states, pool.state_size, num_jobs, file) != num_jobs || fclose(file) != 0) {
+            printf("Failed to write %s\n", states_path);
+            return 1;
+        }
+    }
+
+    free(script);
+    free(pool.states);
+    free(pool.units);
+    free(pool.jobs);
+    chip8_rom_cache_free(&roms);
+    return 0;
+}
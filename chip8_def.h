@@ -1,9 +1,18 @@
+#ifndef CHIP8_DEF_H
+#define CHIP8_DEF_H
+
 #include <stdint.h>
+#include <stdatomic.h>
 #define NUM_KEYS 16
 #define NUM_V_REGISTERS 16
-#define TOTAL_RAM 4096
+#define TOTAL_RAM 65536               // address space of the largest machine (XO-CHIP), see ram_mask
+#define CHIP8_RAM_SIZE 4096             // ram of CHIP-8 and SCHIP
 #define STACK_SIZE 16
 #define FONTSET_SIZE 80
+#define BIG_FONT_ADDR FONTSET_SIZE      // SCHIP / XO-CHIP 8x10 digits (Fx30), right after the small ones
+#define BIG_FONTSET_SIZE 160
+#define NUM_RPL_FLAGS 16               // SCHIP flag registers (Fx75 / Fx85), XO-CHIP has all 16
+#define AUDIO_PATTERN_SIZE 16           // XO-CHIP audio pattern buffer, 128 one-bit samples
 #define PC_START 0x200
 #define TIMER_MAX 255
 
@@ -12,15 +21,55 @@
 #define PROGRAM_START_ADDR 0x200
 #define PROGRAM_END_ADDR 0xFFF
 
+// ram is split into refcounted pages shared copy-on-write between forked instances
+#define RAM_PAGE_SIZE 256
+#define RAM_PAGE_COUNT (TOTAL_RAM / RAM_PAGE_SIZE)
+
+// the timers tick at 60 Hz, frames run a fixed number of instructions between ticks
+#define FRAME_RATE 60
+#define DEFAULT_INSTRUCTIONS_PER_FRAME 10   // ~600 instructions per second
+
+// 64x32 is CHIP-8's screen and SCHIP's low-res mode, the high-res mode is twice
+// that each way. Arrays are sized for high-res, low-res uses their top-left part.
 #define SCREEN_WIDTH 64
 #define SCREEN_HEIGHT 32
+#define SCREEN_HIRES_WIDTH 128
+#define SCREEN_HIRES_HEIGHT 64
+#define SCREEN_ROW_WORDS (SCREEN_HIRES_WIDTH / 64)   // 64-bit words per screen row
+#define SCREEN_PLANES 2                 // XO-CHIP bitplanes, CHIP-8 and SCHIP only draw to the first
 
 #define TRUE 1
 #define FALSE 0
 
 typedef struct Chip8_t Chip8;
+typedef struct Chip8_Jit_t Chip8_Jit;
+typedef struct Chip8_Aot_t Chip8_Aot;
+typedef struct Chip8_Profile_t Chip8_Profile;
+typedef struct Chip8_Trace_t Chip8_Trace;
+typedef struct Chip8_AudioSink_t Chip8_AudioSink;
 
-const static uint8_t FONTSET[FONTSET_SIZE] = { 
+// An opcode decoded once into its handler id and operands, so handlers never
+// have to mask current_op themselves
+typedef struct {
+    uint16_t opcode;                 // raw opcode
+    uint16_t nnn;                    // lowest 12 bits, address
+    uint8_t id;                      // handler id (Chip8_OpId)
+    uint8_t x;                       // lower 4 bits of the high byte, register index
+    uint8_t y;                       // upper 4 bits of the low byte, register index
+    uint8_t n;                       // lowest 4 bits, nibble
+    uint8_t kk;                      // lowest 8 bits, byte
+} Chip8_Instr;
+
+// One page of ram plus the predecoded instruction at each of its even addresses.
+// Pages are immutable while shared (refcount > 1): a store copies the page first,
+// see memory.h.
+typedef struct {
+    atomic_uint refcount;            // instances pointing at the page, 0 for the static zero page
+    uint8_t bytes[RAM_PAGE_SIZE];
+    Chip8_Instr decoded[RAM_PAGE_SIZE / 2]; // decoded instruction at every even address, kept in sync with bytes
+} Chip8_RamPage;
+
+static const uint8_t FONTSET[FONTSET_SIZE] = { 
         0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
         0x20, 0x60, 0x20, 0x20, 0x70, // 1
         0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
@@ -39,8 +88,28 @@ const static uint8_t FONTSET[FONTSET_SIZE] = {
         0xF0, 0x80, 0xF0, 0x80, 0x80  // F
 };
 
+static const uint8_t BIG_FONTSET[BIG_FONTSET_SIZE] = {
+        0xFF, 0xFF, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, // 0
+        0x18, 0x78, 0x78, 0x18, 0x18, 0x18, 0x18, 0x18, 0xFF, 0xFF, // 1
+        0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // 2
+        0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 3
+        0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0x03, 0x03, // 4
+        0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 5
+        0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, // 6
+        0xFF, 0xFF, 0x03, 0x03, 0x06, 0x0C, 0x18, 0x18, 0x18, 0x18, // 7
+        0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, // 8
+        0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 9
+        0x7E, 0xFF, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3, // A
+        0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, // B
+        0x3C, 0xFF, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0xFF, 0x3C, // C
+        0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC, // D
+        0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // E
+        0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xC0, 0xC0  // F
+};
+
 struct Chip8_t {
-    uint8_t ram[TOTAL_RAM];          // 4k of memory
+    Chip8_RamPage* ram[RAM_PAGE_COUNT]; // up to 64k of memory, read and written through memory.h
+    uint16_t ram_mask;               // ram size - 1: 4k, or 64k on XO-CHIP; addresses wrap at it
     uint16_t stack[STACK_SIZE];      // stack, stores up to 16 levels
 
     // registers 
@@ -49,21 +118,53 @@ struct Chip8_t {
     uint16_t pc_reg;                 // pc register
     uint16_t sp_reg;                 // stack pointer register
 
+    // random number generator used by Cxkk, see rng.h
+    uint32_t rng_state[4];
+    uint64_t rng_seed;               // seed the generator was last seeded with
+
     // timers
     uint8_t delay_timer;
     uint8_t sound_timer;
 
     uint16_t current_op;             // current opcode being executed by the system
+    Chip8_Instr op;                  // decoded form of current_op
+    uint64_t cycle_count;            // instructions executed since initialize()
+    uint64_t idle_cycles;            // of those, skipped as idle loop iterations (idle.h)
+    uint8_t quirks;                  // quirk profile (Chip8_QuirkProfile, quirks.h), 0 is the default
 
     // screen
-    uint8_t screen[SCREEN_HEIGHT][SCREEN_WIDTH]; 
+    uint64_t screen[SCREEN_PLANES][SCREEN_HIRES_HEIGHT][SCREEN_ROW_WORDS]; // one bit per pixel, see screen.h
+    uint8_t hires;                   // TRUE in the 128x64 mode (SCHIP 00FF), FALSE in 64x32
+    uint8_t planes;                  // bit p: drw, cls and scrolls act on plane p (XO-CHIP Fn01), 1 otherwise
+    uint64_t dirty_rows;             // bit y: row y changed since the frontend last took the screen
+    uint64_t dirty_cols[SCREEN_ROW_WORDS]; // columns drawn to since then, bit order of a screen row
+
+    // SCHIP / XO-CHIP extras
+    uint8_t rpl[NUM_RPL_FLAGS];      // flag registers (Fx75 / Fx85)
+    uint8_t audio_pattern[AUDIO_PATTERN_SIZE]; // XO-CHIP buzzer waveform (F002), MSB first
+    uint8_t audio_pitch;             // XO-CHIP Fx3A: playback rate 4000 * 2^((pitch - 64) / 48) Hz
 
     // keys (16)
     uint8_t keyboard[NUM_KEYS];
     uint8_t was_key_pressed;
 
+    // translated code (block compiler) watching ram for self-modifying writes
+    uint8_t* code_map;               // one bit per ram byte covered by translated code, NULL when unused
+    void (*code_write_hook)(Chip8* chip8, uint16_t addr); // called when a store hits code_map
+    Chip8_Jit* jit;                  // block compiler state, NULL runs the plain interpreter
+    Chip8_Aot* aot;                  // ahead-of-time compiled rom (aot.h), NULL when not running one
+    Chip8_AudioSink* audio;          // gets the buzzer state every frame (audio.h), NULL when nothing listens
+#ifdef CHIP8_PROFILE
+    Chip8_Profile* profile;          // execution profile (profile.h), NULL when not collecting
+#endif
+#ifdef CHIP8_TRACE
+    Chip8_Trace* trace;              // execution trace (trace.h), NULL when not tracing
+#endif
+
     // Status flags for the emulator
     uint8_t is_running_flag;
     uint8_t draw_screen_flag;
     uint8_t is_paused_flag;
-};
\ No newline at end of file
+};
+
+#endif
@@ -0,0 +1,234 @@
+// Headless movie replay: reruns a recorded session at full speed and checks its screen checkpoints
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "chip8_def.h"
+#include "cpu.h"
+#include "quirks.h"
+#include "input.h"
+#include "movie.h"
+#include "audio.h"
+#include "analyze.h"
+#include "helperMethods.h"
+
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+Replays a movie on rom, prints the outcome. With wav_path the replay's sound
+is written there too. Returns FALSE if it didn't replay exactly.
+*/
+int replay_movie(const char* movie_path, const uint8_t* rom, long rom_size, int use_jit, const char* wav_path) {
+    static Chip8 chip8;
+    static Chip8_AudioWav wav;
+    Chip8_Movie movie;
+    Chip8_MovieResult result;
+
+    if (!chip8_movie_load(&movie, movie_path)) {
+        printf("%s: not a movie file\n", movie_path);
+        return FALSE;
+    }
+    if (movie.rom_hash != chip8_rom_hash(rom, rom_size)) {
+        printf("%s: recorded with a different rom\n", movie_path);
+        chip8_movie_free(&movie);
+        return FALSE;
+    }
+
+    initialize(&chip8);
+    chip8_seed_rng(&chip8, movie.seed);
+    chip8_set_quirks(&chip8, movie.quirks);
+    if (!load_rom_image(&chip8, rom, rom_size)) {
+        printf("%s: rom too big for the movie's machine\n", movie_path);
+        chip8_release(&chip8);
+        chip8_movie_free(&movie);
+        return FALSE;
+    }
+    if (use_jit && (!chip8_jit_enable(&chip8) || chip8_jit_prewarm(&chip8) < 0)) {
+        fprintf(stderr, "failed to allocate the block compiler, interpreting\n");
+        chip8_jit_disable(&chip8);
+    }
+#ifdef CHIP8_PROFILE
+    if (!chip8_profile_enable(&chip8)) {
+        fprintf(stderr, "failed to allocate the profile\n");
+    }
+#endif
+#ifdef CHIP8_TRACE
+    if (!chip8_trace_enable(&chip8, TRACE_PATH)) {
+        fprintf(stderr, "failed to create %s\n", TRACE_PATH);
+    }
+#endif
+    if (wav_path != NULL) {
+        if (!chip8_audio_wav_open(&wav, wav_path)) {
+            printf("%s: can't create %s\n", movie_path, wav_path);
+            chip8_release(&chip8);
+            chip8_movie_free(&movie);
+            return FALSE;
+        }
+        chip8.audio = &wav.sink;
+    }
+
+    double start = now_seconds();
+    int ok = chip8_movie_replay(&movie, &chip8, &result);
+    double elapsed = now_seconds() - start;
+
+    printf("%s: %llu frames, %llu cycles, %llu/%zu checkpoints, %.3f s (%.1fx realtime, %.1f MIPS)",
+           movie_path, (unsigned long long)result.frames, (unsigned long long)result.cycles,
+           (unsigned long long)result.checkpoints_passed, movie.num_checkpoints, elapsed,
+           result.frames / (double)FRAME_RATE / elapsed, result.cycles / elapsed / 1e6);
+    if (result.mismatch) {
+        printf(" MISMATCH at cycle %llu\n", (unsigned long long)result.mismatch_cycle);
+    } else if (!ok) {
+        printf(" out of memory\n");
+    } else {
+        printf(" ok\n");
+    }
+    if (wav_path != NULL && !chip8_audio_wav_close(&wav)) {
+        printf("%s: failed to write %s\n", movie_path, wav_path);
+        ok = FALSE;
+    }
+
+#ifdef CHIP8_PROFILE
+    if (chip8.profile != NULL) {
+        chip8_profile_report(&chip8, stderr);
+        if (!chip8_profile_write_collapsed(&chip8, PROFILE_COLLAPSED_PATH)) {
+            fprintf(stderr, "failed to write %s\n", PROFILE_COLLAPSED_PATH);
+        }
+    }
+#endif
+#ifdef CHIP8_TRACE
+    if (!chip8_trace_disable(&chip8)) {
+        fprintf(stderr, "failed to write %s\n", TRACE_PATH);
+    }
+#endif
+    chip8_release(&chip8);
+    chip8_movie_free(&movie);
+    return ok;
+}
+
+/*
+Records a movie headlessly from an input script, the same way the frontend
+records a live session
+*/
+int make_movie(const char* movie_path, const char* script_path, const uint8_t* rom, long rom_size,
+               uint64_t frames, uint64_t seed, uint8_t quirks, uint32_t ipf) {
+    static Chip8 chip8;
+    Chip8_Movie movie;
+    Chip8_InputQueue input;
+    Chip8_KeyEvent* script;
+    size_t next_event = 0;
+
+    long script_len = chip8_input_load_script(script_path, &script);
+    if (script_len < 0) {
+        return FALSE;
+    }
+
+    initialize(&chip8);
+    chip8_seed_rng(&chip8, seed);
+    chip8_set_quirks(&chip8, quirks);
+    if (!load_rom_image(&chip8, rom, rom_size)) {
+        printf("%s: rom too big for the %s machine\n", movie_path, QUIRK_NAMES[quirks]);
+        chip8_release(&chip8);
+        free(script);
+        return FALSE;
+    }
+    chip8_movie_init(&movie, rom, rom_size, seed, quirks, ipf);
+    chip8_input_init(&input);
+    input.on_apply = chip8_movie_on_apply;
+    input.on_apply_ctx = &movie;
+
+    int ok = TRUE;
+    for (uint64_t f = 0; f < frames && chip8.is_running_flag && ok; f++) {
+        chip8_input_feed(&input, script, script_len, &next_event, chip8.cycle_count + ipf + 1);
+        chip8_input_run_frame(&chip8, &input, ipf);
+        ok = chip8_movie_record_step(&movie, &chip8);
+    }
+    ok = ok && chip8_movie_save(&movie, movie_path);
+    printf("%s: %llu cycles, %zu key changes, %zu checkpoints%s\n", movie_path,
+           (unsigned long long)movie.end_cycle, movie.num_inputs, movie.num_checkpoints,
+           ok ? "" : ", failed to write");
+
+    chip8_release(&chip8);
+    chip8_movie_free(&movie);
+    free(script);
+    return ok;
+}
+
+void replay_usage(void) {
+    printf("Usage: ./chip8-replay [--jit] [--wav FILE] movie path/to/rom\n");
+    printf("       ./chip8-replay --make movie --input SCRIPT [--frames N] [--seed N] [--ipf N] [--quirks PROFILE] path/to/rom\n");
+    printf("  --jit         replay with the block compiler\n");
+    printf("  --wav FILE    write the replay's sound to FILE, 48 kHz 16-bit mono\n");
+    printf("  --make FILE   record a movie from an input script instead (lines: cycle key down|up)\n");
+    printf("  --frames N    frames to record (default %d)\n", FRAME_RATE * 60);
+    printf("  --seed N      rng seed to record with (default 0)\n");
+    printf("  --ipf N       instructions per frame to record with (default %d)\n", DEFAULT_INSTRUCTIONS_PER_FRAME);
+    printf("  --quirks P    quirk profile to record with: default, vip, chip48, schip or xochip\n");
+}
+
+int main(int argc, char* argv[]) {
+    static uint8_t rom[MAX_ROM_SIZE];
+    int use_jit = FALSE;
+    const char* wav_path = NULL;
+    const char* make_path = NULL;
+    const char* script_path = NULL;
+    uint64_t frames = FRAME_RATE * 60;
+    uint64_t seed = 0;
+    uint32_t ipf = DEFAULT_INSTRUCTIONS_PER_FRAME;
+    int quirks = QUIRKS_DEFAULT;
+    const char* paths[2];
+    int num_paths = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--jit") == 0) {
+            use_jit = TRUE;
+        } else if (strcmp(argv[i], "--wav") == 0 && i + 1 < argc) {
+            wav_path = argv[++i];
+        } else if (strcmp(argv[i], "--make") == 0 && i + 1 < argc) {
+            make_path = argv[++i];
+        } else if (strcmp(argv[i], "--input") == 0 && i + 1 < argc) {
+            script_path = argv[++i];
+        } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            frames = strtoull(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = strtoull(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--ipf") == 0 && i + 1 < argc) {
+            ipf = (uint32_t)strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--quirks") == 0 && i + 1 < argc) {
+            quirks = chip8_quirks_by_name(argv[++i]);
+        } else if (argv[i][0] != '-' && num_paths < 2) {
+            paths[num_paths++] = argv[i];
+        } else {
+            replay_usage();
+            return 1;
+        }
+    }
+
+    if (make_path != NULL) {
+        if (num_paths != 1 || script_path == NULL || ipf == 0 || quirks < 0) {
+            replay_usage();
+            return 1;
+        }
+        long rom_size = read_rom_file(paths[0], rom);
+        if (rom_size < 0) {
+            printf("Failed to load ROM file %s\n", paths[0]);
+            return 1;
+        }
+        return make_movie(make_path, script_path, rom, rom_size, frames, seed, (uint8_t)quirks, ipf) ? 0 : 1;
+    }
+
+    if (num_paths != 2) {
+        replay_usage();
+        return 1;
+    }
+    long rom_size = read_rom_file(paths[1], rom);
+    if (rom_size < 0) {
+        printf("Failed to load ROM file %s\n", paths[1]);
+        return 1;
+    }
+    return replay_movie(paths[0], rom, rom_size, use_jit, wav_path) ? 0 : 1;
+}
@@ -0,0 +1,526 @@
+// Execution trace decoder: prints a trace written with CHIP8_TRACE, or finds where two traces part
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "chip8_def.h"
+#include "decode.h"
+#include "quirks.h"
+#include "trace.h"
+#include "snapshot.h"
+
+#define TRACE_MAX_CHANGES 64             // per step: 20 registers, a store of all 16, and slack
+#define TRACE_DIFF_CONTEXT 8             // steps shown before the first difference
+
+typedef struct {
+    uint8_t is_mem;
+    uint16_t where;                      // register (TRACE_REG_*, 0-15 for V) or address
+    uint16_t value;
+} Trace_Change;
+
+// One instruction and what it changed, or (sync) what changed between two runs.
+// The changes of a compiled block all go with its last instruction.
+typedef struct {
+    uint8_t sync;
+    uint8_t regs_known;                  // regs are set: the trace looked at them after this step
+    uint64_t cycle;
+    uint64_t idle_before;                // idle loop iterations skipped right before it
+    uint16_t pc;
+    uint16_t opcode;
+    int num_changes;
+    Trace_Change changes[TRACE_MAX_CHANGES];
+    uint16_t regs[TRACE_NUM_REGS];       // every register after it, V0-VF first
+} Trace_Step;
+
+typedef struct {
+    const char* path;
+    uint8_t* data;
+    size_t size;
+    size_t pos;
+    uint8_t quirks;
+    uint64_t cycle;                      // of the next instruction
+    uint16_t pc;                         // of the last one
+    uint16_t blocks[2];                  // pcs of the last two blocks, the last first
+    uint8_t* ram;                        // as the trace showed it: blocks' opcodes and stores, TOTAL_RAM bytes
+    uint8_t* shown;                      // count of the last block recorded with its opcodes at each pc
+    const uint8_t* block;                // opcodes of the block being stepped through
+    uint32_t block_left;                 // its instructions not yet stepped
+    uint8_t loop_k;                      // blocks the TRACE_BLOCK_LOOP being stepped through cycles through
+    uint64_t loop_left;                  // its blocks not yet started
+    uint16_t regs[TRACE_NUM_REGS];       // as of the last change read
+    uint8_t error;                       // stopped at a malformed record
+} Trace_Reader;
+
+void trace_close(Trace_Reader* r) {
+    free(r->data);
+    free(r->ram);
+    r->data = NULL;
+    r->ram = NULL;
+}
+
+/*
+Reads a whole trace file and checks its header. Returns FALSE, printing why,
+if it isn't a trace.
+*/
+int trace_open(Trace_Reader* r, const char* path) {
+    memset(r, 0, sizeof(*r));
+    r->path = path;
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        printf("%s: can't open\n", path);
+        return FALSE;
+    }
+    size_t capacity = 1 << 20;
+    r->data = malloc(capacity);
+    size_t got;
+    while (r->data != NULL && (got = fread(r->data + r->size, 1, capacity - r->size, file)) > 0) {
+        r->size += got;
+        if (r->size == capacity) {
+            capacity *= 2;
+            uint8_t* data = realloc(r->data, capacity);
+            if (data == NULL) {
+                free(r->data);
+            }
+            r->data = data;
+        }
+    }
+    r->ram = calloc(2, TOTAL_RAM);
+    r->shown = r->ram ? r->ram + TOTAL_RAM : NULL;
+    int failed = ferror(file) || r->data == NULL || r->ram == NULL;
+    fclose(file);
+
+    if (failed || r->size < TRACE_HEADER_SIZE || memcmp(r->data, TRACE_MAGIC, 4) != 0 ||
+        get_u16(r->data + 4) != TRACE_VERSION) {
+        printf("%s: not a version %d trace file\n", path, TRACE_VERSION);
+        trace_close(r);
+        return FALSE;
+    }
+    r->quirks = r->data[6] < QUIRK_PROFILE_COUNT ? r->data[6] : QUIRKS_DEFAULT;
+    r->cycle = get_u64(r->data + 8);
+    r->pc = 0;
+    for (int i = 0; i < NUM_V_REGISTERS; i++) {
+        r->regs[i] = r->data[16 + i];
+    }
+    r->regs[TRACE_REG_I] = get_u16(r->data + 32);
+    r->regs[TRACE_REG_SP] = r->data[34];
+    r->regs[TRACE_REG_DT] = r->data[35];
+    r->regs[TRACE_REG_ST] = r->data[36];
+    r->pos = TRACE_HEADER_SIZE;
+    return TRUE;
+}
+
+
+static int trace_operands(const Trace_Reader* r, size_t len) {
+    return r->pos + 1 + len <= r->size;
+}
+
+/*
+The varint at p + at, in the operands of the record at p, into value. Returns
+its length in bytes, 0 if it is cut off or too long.
+*/
+static size_t trace_varint(const Trace_Reader* r, const uint8_t* p, size_t at, uint64_t* value) {
+    size_t len = 0;
+    *value = 0;
+    do {
+        if (!trace_operands(r, at + len) || len == 10) {
+            return 0;
+        }
+        *value |= (uint64_t)(p[at + len] & 0x7F) << (7 * len);
+    } while (p[at + len++] & 0x80);
+    return len;
+}
+
+/*
+Starts stepping through the block at pc, its opcodes as the trace last showed them
+*/
+static void trace_start_block(Trace_Reader* r, uint16_t pc) {
+    r->blocks[1] = r->blocks[0];
+    r->blocks[0] = pc;
+    r->pc = (uint16_t)(pc - 2);
+    r->block = r->ram + pc;
+    r->block_left = r->shown[pc];
+}
+
+/*
+The next instruction of the block being stepped through
+*/
+static void trace_block_step(Trace_Reader* r, Trace_Step* step) {
+    step->sync = FALSE;
+    step->cycle = r->cycle++;
+    step->pc = (uint16_t)(r->pc + 2);
+    step->opcode = (uint16_t)((r->block[0] << 8) | r->block[1]);
+    r->pc = step->pc;
+    r->block += 2;
+    r->block_left--;
+}
+
+static int trace_is_block(uint8_t tag) {
+    return tag == TRACE_BLOCK || tag == TRACE_BLOCK_AGAIN || tag == TRACE_BLOCK_NEXT || tag == TRACE_BLOCK_SKIP ||
+           tag == TRACE_BLOCK_LOOP;
+}
+
+/*
+Reads the next step. Returns FALSE at the end of the trace, with error set if
+it ended in a malformed or cut off record.
+*/
+int trace_next(Trace_Reader* r, Trace_Step* step) {
+    int started = FALSE;
+    int in_block = FALSE;                // the step is a block's last instruction
+    int looked = FALSE;                  // a register change was recorded after it
+    step->idle_before = 0;
+    step->num_changes = 0;
+    step->regs_known = FALSE;
+
+    // the next block of a TRACE_BLOCK_LOOP, nothing was recorded between them
+    if (r->block_left == 0 && r->loop_left > 0) {
+        r->loop_left--;
+        trace_start_block(r, r->blocks[r->loop_k - 1]);
+    }
+    // inside a block, its changes come after the last instruction
+    if (r->block_left > 0) {
+        trace_block_step(r, step);
+        if (r->block_left > 0 || r->loop_left > 0) {
+            return TRUE;
+        }
+        started = TRUE;
+        in_block = TRUE;
+    }
+
+    while (r->pos < r->size) {
+        const uint8_t* p = r->data + r->pos;
+        uint8_t tag = p[0];
+        if (started && (tag == TRACE_OP || tag == TRACE_OP_NEXT || trace_is_block(tag) || tag == TRACE_SYNC ||
+                        tag == TRACE_RUN || tag == TRACE_IDLE)) {
+            break;
+        }
+        switch (tag) {
+            case TRACE_OP:
+            case TRACE_OP_NEXT:
+                if (!trace_operands(r, tag == TRACE_OP ? 4 : 2)) {
+                    r->error = TRUE;
+                    return FALSE;
+                }
+                step->sync = FALSE;
+                step->cycle = r->cycle++;
+                step->pc = (tag == TRACE_OP) ? get_u16(p + 1) : (uint16_t)(r->pc + 2);
+                step->opcode = get_u16(p + (tag == TRACE_OP ? 3 : 1));
+                r->pc = step->pc;
+                r->pos += (tag == TRACE_OP) ? 5 : 3;
+                started = TRUE;
+                break;
+            case TRACE_BLOCK:
+            case TRACE_BLOCK_AGAIN:
+            case TRACE_BLOCK_NEXT:
+            case TRACE_BLOCK_SKIP: {
+                // the opcodes come with a block the first time, after that from ram as last shown
+                size_t len = (tag == TRACE_BLOCK) ? 3 : (tag == TRACE_BLOCK_AGAIN) ? 2 : 0;
+                if (!trace_operands(r, len)) {
+                    r->error = TRUE;
+                    return FALSE;
+                }
+                uint16_t pc = (tag == TRACE_BLOCK || tag == TRACE_BLOCK_AGAIN) ? get_u16(p + 1) :
+                              (uint16_t)(r->pc + (tag == TRACE_BLOCK_NEXT ? 2 : 4));
+                uint8_t count = (tag == TRACE_BLOCK) ? p[3] : r->shown[pc];
+                if (count == 0 || pc + 2u * count > TOTAL_RAM ||
+                    (tag == TRACE_BLOCK && !trace_operands(r, len + 2 * count))) {
+                    r->error = TRUE;
+                    return FALSE;
+                }
+                if (tag == TRACE_BLOCK) {
+                    memcpy(r->ram + pc, p + 4, 2 * count);
+                    r->shown[pc] = count;
+                    len += 2 * count;
+                }
+                trace_start_block(r, pc);
+                r->pos += 1 + len;
+                trace_block_step(r, step);
+                if (r->block_left > 0) {
+                    return TRUE;
+                }
+                started = TRUE;
+                in_block = TRUE;
+                break;
+            }
+            case TRACE_BLOCK_LOOP: {
+                // runs blocks round the last k again, starting with the one k back
+                uint64_t runs = 0;
+                uint8_t k = trace_operands(r, 1) ? p[1] : 0;
+                size_t len = (k == 1 || k == 2) ? trace_varint(r, p, 2, &runs) : 0;
+                if (len == 0 || runs == 0 || r->shown[r->blocks[0]] == 0 || r->shown[r->blocks[k - 1]] == 0) {
+                    r->error = TRUE;
+                    return FALSE;
+                }
+                r->loop_k = k;
+                r->loop_left = runs - 1;
+                trace_start_block(r, r->blocks[k - 1]);
+                r->pos += 2 + len;
+                trace_block_step(r, step);
+                if (r->block_left > 0 || r->loop_left > 0) {
+                    return TRUE;
+                }
+                started = TRUE;
+                in_block = TRUE;
+                break;
+            }
+            case TRACE_SYNC:
+            case TRACE_RUN:
+                if (tag == TRACE_SYNC && !trace_operands(r, 8)) {
+                    r->error = TRUE;
+                    return FALSE;
+                }
+                step->sync = TRUE;
+                if (tag == TRACE_SYNC) {
+                    r->cycle = get_u64(p + 1);
+                }
+                step->cycle = r->cycle;
+                step->pc = 0;
+                step->opcode = 0;
+                r->pos += (tag == TRACE_SYNC) ? 9 : 1;
+                started = TRUE;
+                break;
+            case TRACE_IDLE: {
+                uint64_t count;
+                size_t len = trace_varint(r, p, 1, &count);
+                if (len == 0) {
+                    r->error = TRUE;
+                    return FALSE;
+                }
+                step->idle_before += count;
+                r->cycle += count;
+                r->pos += 1 + len;
+                break;
+            }
+            case TRACE_REG:
+            case TRACE_MEM:
+                if (!started || !trace_operands(r, 3) || step->num_changes == TRACE_MAX_CHANGES ||
+                    (tag == TRACE_REG && (p[1] < NUM_V_REGISTERS || p[1] >= TRACE_NUM_REGS))) {
+                    r->error = TRUE;
+                    return FALSE;
+                }
+                Trace_Change* change = &step->changes[step->num_changes++];
+                change->is_mem = (tag == TRACE_MEM);
+                change->where = (tag == TRACE_MEM) ? get_u16(p + 1) : p[1];
+                change->value = (tag == TRACE_MEM) ? p[3] : get_u16(p + 2);
+                if (tag == TRACE_REG) {
+                    r->regs[change->where] = change->value;
+                    looked = TRUE;
+                } else {
+                    r->ram[change->where] = (uint8_t)change->value;
+                }
+                r->pos += 4;
+                break;
+            default:
+                if (tag < TRACE_V || tag >= TRACE_V + NUM_V_REGISTERS || !started || !trace_operands(r, 1) ||
+                    step->num_changes == TRACE_MAX_CHANGES) {
+                    r->error = TRUE;
+                    return FALSE;
+                }
+                step->changes[step->num_changes++] = (Trace_Change){ FALSE, tag - TRACE_V, p[1] };
+                r->regs[tag - TRACE_V] = p[1];
+                looked = TRUE;
+                r->pos += 2;
+                break;
+        }
+    }
+    // the registers are looked at after every instruction run on its own and at
+    // the end of every run, but not between two blocks
+    if (started && (!in_block || looked || r->pos == r->size || !trace_is_block(r->data[r->pos]))) {
+        step->regs_known = TRUE;
+        memcpy(step->regs, r->regs, sizeof(step->regs));
+    }
+    return started;
+}
+
+void trace_print_changes(const Trace_Step* step) {
+    static const char* const REG_NAMES[TRACE_NUM_REGS] = {
+        "V0", "V1", "V2", "V3", "V4", "V5", "V6", "V7", "V8", "V9", "VA", "VB", "VC", "VD", "VE", "VF",
+        [TRACE_REG_I] = "I", [TRACE_REG_SP] = "SP", [TRACE_REG_DT] = "DT", [TRACE_REG_ST] = "ST"
+    };
+    for (int i = 0; i < step->num_changes; i++) {
+        const Trace_Change* c = &step->changes[i];
+        if (c->is_mem) {
+            printf(" [%04X]=%02X", c->where, c->value);
+        } else if (c->where < NUM_V_REGISTERS) {
+            printf(" %s=%02X", REG_NAMES[c->where], c->value);
+        } else {
+            printf(" %s=%03X", REG_NAMES[c->where], c->value);
+        }
+    }
+}
+
+void trace_print_step(const Trace_Step* step, const char* prefix) {
+    if (step->idle_before != 0) {
+        printf("%s%14s  %llu idle loop iterations skipped\n", prefix, "--",
+               (unsigned long long)step->idle_before);
+    }
+    if (step->sync) {
+        printf("%s%14llu  -- between runs:", prefix, (unsigned long long)step->cycle);
+    } else {
+        Chip8_Instr instr = chip8_decode(step->opcode);
+        printf("%s%14llu  %04X  %04X  %-*s", prefix, (unsigned long long)step->cycle, step->pc, step->opcode,
+               step->num_changes ? 5 : 0, OP_NAMES[instr.id]);
+    }
+    trace_print_changes(step);
+    printf("\n");
+}
+
+/*
+Stores are compared step by step. Registers are compared where both traces
+looked at them: the interpreter's after every instruction, compiled blocks'
+only where a run ended or the interpreter took over.
+*/
+static int trace_same_step(const Trace_Step* a, const Trace_Step* b) {
+    if (a->sync != b->sync || a->cycle != b->cycle || a->idle_before != b->idle_before || a->pc != b->pc ||
+        a->opcode != b->opcode) {
+        return FALSE;
+    }
+    int i = 0, j = 0;
+    for (;;) {
+        while (i < a->num_changes && !a->changes[i].is_mem) {
+            i++;
+        }
+        while (j < b->num_changes && !b->changes[j].is_mem) {
+            j++;
+        }
+        if (i == a->num_changes || j == b->num_changes) {
+            break;
+        }
+        if (a->changes[i].where != b->changes[j].where || a->changes[i].value != b->changes[j].value) {
+            return FALSE;
+        }
+        i++;
+        j++;
+    }
+    if (i != a->num_changes || j != b->num_changes) {
+        return FALSE;
+    }
+    return !a->regs_known || !b->regs_known || memcmp(a->regs, b->regs, sizeof(a->regs)) == 0;
+}
+
+/*
+Prints the steps of a trace from cycle from on, at most count of them
+*/
+int trace_print(const char* path, uint64_t from, uint64_t count) {
+    Trace_Reader r;
+    static Trace_Step step;
+    if (!trace_open(&r, path)) {
+        return FALSE;
+    }
+    printf("; %s: %s profile, from cycle %llu\n", path, QUIRK_NAMES[r.quirks], (unsigned long long)r.cycle);
+    printf("%14s  %-4s  %-4s  %-5s changes\n", "cycle", "pc", "code", "op");
+
+    uint64_t printed = 0;
+    while (printed < count && trace_next(&r, &step)) {
+        if (step.cycle >= from) {
+            trace_print_step(&step, "");
+            printed++;
+        }
+    }
+    if (r.error) {
+        printf("%s: malformed record at byte %zu, trace cut off?\n", path, r.pos);
+    }
+    trace_close(&r);
+    return !r.error;
+}
+
+/*
+Steps through two traces side by side and reports the first step they differ
+at, with the TRACE_DIFF_CONTEXT steps before it. Returns TRUE if they are the same.
+*/
+int trace_diff(const char* path_a, const char* path_b) {
+    Trace_Reader a, b;
+    static Trace_Step step_a, step_b;
+    static Trace_Step context[TRACE_DIFF_CONTEXT];
+    uint64_t steps = 0;
+
+    if (!trace_open(&a, path_a)) {
+        return FALSE;
+    }
+    if (!trace_open(&b, path_b)) {
+        trace_close(&a);
+        return FALSE;
+    }
+
+    int same = TRUE;
+    for (;;) {
+        int more_a = trace_next(&a, &step_a);
+        int more_b = trace_next(&b, &step_b);
+        if (!more_a && !more_b) {
+            break;
+        }
+        if (more_a && more_b && trace_same_step(&step_a, &step_b)) {
+            context[steps % TRACE_DIFF_CONTEXT] = step_a;
+            steps++;
+            continue;
+        }
+
+        same = FALSE;
+        printf("traces part after %llu steps\n", (unsigned long long)steps);
+        uint64_t first = steps > TRACE_DIFF_CONTEXT ? steps - TRACE_DIFF_CONTEXT : 0;
+        for (uint64_t s = first; s < steps; s++) {
+            trace_print_step(&context[s % TRACE_DIFF_CONTEXT], "  ");
+        }
+        if (more_a) {
+            trace_print_step(&step_a, "< ");
+        } else {
+            printf("< %14s  end of %s\n", "--", path_a);
+        }
+        if (more_b) {
+            trace_print_step(&step_b, "> ");
+        } else {
+            printf("> %14s  end of %s\n", "--", path_b);
+        }
+        break;
+    }
+    if (same) {
+        printf("same %llu steps\n", (unsigned long long)steps);
+    }
+    if (a.error || b.error) {
+        printf("%s: malformed record at byte %zu, trace cut off?\n", a.error ? path_a : path_b,
+               a.error ? a.pos : b.pos);
+        same = FALSE;
+    }
+    trace_close(&a);
+    trace_close(&b);
+    return same;
+}
+
+void trace_usage(void) {
+    printf("Usage: ./chip8-trace [--from CYCLE] [--count N] trace.c8t\n");
+    printf("       ./chip8-trace --diff a.c8t b.c8t\n");
+    printf("  --from CYCLE  start printing at this cycle\n");
+    printf("  --count N     print at most N steps\n");
+    printf("  --diff        show where two traces first differ, exit status 1 if they do\n");
+    printf("Traces are written to %s by chip8 and chip8-replay built with make TRACE=1.\n", TRACE_PATH);
+}
+
+int main(int argc, char* argv[]) {
+    uint64_t from = 0;
+    uint64_t count = UINT64_MAX;
+    int diff = FALSE;
+    const char* paths[2];
+    int num_paths = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--from") == 0 && i + 1 < argc) {
+            from = strtoull(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--count") == 0 && i + 1 < argc) {
+            count = strtoull(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--diff") == 0) {
+            diff = TRUE;
+        } else if (argv[i][0] != '-' && num_paths < 2) {
+            paths[num_paths++] = argv[i];
+        } else {
+            trace_usage();
+            return 1;
+        }
+    }
+    if (num_paths != (diff ? 2 : 1)) {
+        trace_usage();
+        return 1;
+    }
+    if (diff) {
+        return trace_diff(paths[0], paths[1]) ? 0 : 1;
+    }
+    return trace_print(paths[0], from, count) ? 0 : 1;
+}
@@ -0,0 +1,119 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include <stdint.h>
+#include "chip8_def.h"
+#include "decode.h"
+#include "instructions.h"
+#include "quirks.h"
+#include "idle.h"
+#include "profile.h"
+#include "trace.h"
+#include "jit.h"
+#include "aot.h"
+#include "audio.h"
+
+// Use the computed-goto dispatch loop where the compiler supports labels as values
+#if defined(__GNUC__) && !defined(CHIP8_NO_COMPUTED_GOTO)
+#define CHIP8_COMPUTED_GOTO 1
+#endif
+
+/*
+Fetch: loads the instruction at pc_reg into chip8->op. Even addresses come straight
+from the decode cache, odd ones (rare, but legal) are read from ram and decoded.
+*/
+static inline void chip8_fetch(Chip8* chip8) {
+    chip8->op = chip8_instr_at(chip8, chip8->pc_reg);
+    chip8->current_op = chip8->op.opcode;
+}
+
+/*
+chip8_fetch for the dispatch loop, reading through the page cached in *page
+while pc stays on it
+*/
+static inline void chip8_fetch_from(Chip8* chip8, const Chip8_RamPage** page) {
+    uint16_t pc = chip8->pc_reg & chip8->ram_mask;
+    if ((pc & 1) == 0 && chip8->ram[pc / RAM_PAGE_SIZE] == *page) {
+        chip8->op = (*page)->decoded[(pc % RAM_PAGE_SIZE) >> 1];
+    } else {
+        *page = chip8->ram[pc / RAM_PAGE_SIZE];
+        chip8->op = chip8_instr_at(chip8, pc);
+    }
+    chip8->current_op = chip8->op.opcode;
+}
+
+/*
+Executes a single fetch/decode/execute cycle
+*/
+void chip8_step(Chip8* chip8) {
+    chip8_fetch(chip8);
+    CHIP8_PROFILE_OP(chip8, chip8->op);
+    CHIP8_TRACE_OP(chip8, chip8->op);
+    QUIRK_HANDLERS[chip8->quirks][chip8->op.id](chip8);
+    CHIP8_PROFILE_PAUSE(chip8);
+    CHIP8_TRACE_PAUSE(chip8);
+    chip8->cycle_count++;
+}
+
+// One dispatch loop per quirk profile, chip8_run_cycles_default, _vip, ... An
+// #include can't come out of a macro, so this list follows CHIP8_QUIRK_PROFILES
+// by hand (chip8_run_cycles doesn't compile if one is missing)
+#define CHIP8_LOOP_NAME chip8_run_cycles_default
+#define CHIP8_LOOP_PROFILE QUIRKS_DEFAULT
+#include "cpu_loop.h"
+#define CHIP8_LOOP_NAME chip8_run_cycles_vip
+#define CHIP8_LOOP_PROFILE QUIRKS_VIP
+#include "cpu_loop.h"
+#define CHIP8_LOOP_NAME chip8_run_cycles_chip48
+#define CHIP8_LOOP_PROFILE QUIRKS_CHIP48
+#include "cpu_loop.h"
+#define CHIP8_LOOP_NAME chip8_run_cycles_schip
+#define CHIP8_LOOP_PROFILE QUIRKS_SCHIP
+#include "cpu_loop.h"
+#define CHIP8_LOOP_NAME chip8_run_cycles_xochip
+#define CHIP8_LOOP_PROFILE QUIRKS_XOCHIP
+#include "cpu_loop.h"
+
+/*
+Runs up to n instructions, stopping early if the system halts (is_running_flag cleared).
+Returns the number of instructions executed, idle loop iterations skipped included.
+*/
+uint64_t chip8_run_cycles(Chip8* chip8, uint64_t n) {
+    if (chip8->aot != NULL) {
+        return chip8->aot->image->run(chip8, n);
+    }
+    if (chip8->jit != NULL) {
+        return chip8_jit_run_cycles(chip8, n);
+    }
+
+    #define QUIRK_RUN(profile, suffix, name, machine, vf_reset, shift_vy, i_after, jump_vx, clip) \
+        case profile: return chip8_run_cycles_##suffix(chip8, n);
+    switch (chip8->quirks) {
+        CHIP8_QUIRK_PROFILES(QUIRK_RUN)
+        default: return chip8_run_cycles_default(chip8, n);
+    }
+    #undef QUIRK_RUN
+}
+
+/*
+One 60 Hz tick: the frame's buzzer state goes to the audio sink, if any, then
+the delay and sound timers count down to 0
+*/
+static inline void chip8_tick_timers(Chip8* chip8) {
+    chip8_audio_publish(chip8);
+    chip8->delay_timer -= (chip8->delay_timer != 0);
+    chip8->sound_timer -= (chip8->sound_timer != 0);
+}
+
+/*
+Runs one frame: instructions_per_frame instructions, then one tick of the timers.
+A halted instance's timers stay where they stopped.
+*/
+void chip8_run_frame(Chip8* chip8, uint32_t instructions_per_frame) {
+    chip8_run_cycles(chip8, instructions_per_frame);
+    if (chip8->is_running_flag) {
+        chip8_tick_timers(chip8);
+    }
+}
+
+#endif
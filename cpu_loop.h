@@ -0,0 +1,74 @@
+/*
+The interpreter's dispatch loop, instantiated once per quirk profile by cpu.h:
+no include guard, define before including
+    CHIP8_LOOP_NAME      name of the function to define
+    CHIP8_LOOP_PROFILE   quirk profile (Chip8_QuirkProfile) it runs
+Both are undefined again at the end.
+
+Every call goes through QUIRK_HANDLERS[CHIP8_LOOP_PROFILE] at a constant index,
+which the compiler resolves to a direct call of the profile's own handler, so a
+loop is as specialized as if it had been written out by hand for its profile.
+
+Runs up to n instructions, stopping early if the system halts (is_running_flag
+cleared). Returns the number of instructions executed, idle loop iterations
+skipped included.
+*/
+static uint64_t CHIP8_LOOP_NAME(Chip8* chip8, uint64_t n) {
+    uint64_t executed = 0;
+
+#ifdef CHIP8_COMPUTED_GOTO
+    #define CHIP8_OP_LABEL(id, handler, name) [id] = &&do_##id,
+    static void* const dispatch_labels[OP_COUNT] = { CHIP8_OPCODES(CHIP8_OP_LABEL) };
+    #undef CHIP8_OP_LABEL
+
+    // Skips the idle loop starting at the fetched instruction, if any; the
+    // instruction itself still runs
+    #define IDLE_CHECK(id)                                                  \
+        if (CHIP8_MAY_IDLE(id)) {                                           \
+            uint64_t idle = chip8_idle_skip(chip8, chip8->op, n - executed); \
+            executed += idle;                                               \
+            chip8->idle_cycles += idle;                                     \
+            CHIP8_TRACE_IDLE(chip8, idle);                                  \
+        }
+
+    // The page pc is in, kept in a local: the compare against chip8->ram is
+    // predicted, so the fetch does not wait on loading the page pointer first
+    const Chip8_RamPage* code_page = chip8->ram[0];
+
+    #define DISPATCH()                                                      \
+        if (executed == n || !chip8->is_running_flag) goto done;            \
+        chip8_fetch_from(chip8, &code_page);                                \
+        executed++;                                                         \
+        goto *dispatch_labels[chip8->op.id]
+
+    DISPATCH();
+    #define CHIP8_OP_CASE(id, handler, name) do_##id: IDLE_CHECK(id); CHIP8_PROFILE_OP(chip8, chip8->op); CHIP8_TRACE_OP(chip8, chip8->op); QUIRK_HANDLERS[CHIP8_LOOP_PROFILE][id](chip8); DISPATCH();
+    CHIP8_OPCODES(CHIP8_OP_CASE)
+    #undef CHIP8_OP_CASE
+    #undef DISPATCH
+    #undef IDLE_CHECK
+done:
+#else
+    while (executed < n && chip8->is_running_flag) {
+        chip8_fetch(chip8);
+        if (CHIP8_MAY_IDLE(chip8->op.id)) {
+            uint64_t idle = chip8_idle_skip(chip8, chip8->op, n - executed - 1);
+            executed += idle;
+            chip8->idle_cycles += idle;
+            CHIP8_TRACE_IDLE(chip8, idle);
+        }
+        CHIP8_PROFILE_OP(chip8, chip8->op);
+        CHIP8_TRACE_OP(chip8, chip8->op);
+        QUIRK_HANDLERS[CHIP8_LOOP_PROFILE][chip8->op.id](chip8);
+        executed++;
+    }
+#endif
+
+    CHIP8_PROFILE_PAUSE(chip8);
+    CHIP8_TRACE_PAUSE(chip8);
+    chip8->cycle_count += executed;
+    return executed;
+}
+
+#undef CHIP8_LOOP_NAME
+#undef CHIP8_LOOP_PROFILE
@@ -0,0 +1,188 @@
+#ifndef DECODE_H
+#define DECODE_H
+
+#include <stdint.h>
+#include "chip8_def.h"
+
+/*
+Every instruction the core knows about: id, handler in instructions.h and mnemonic.
+The id of an instruction is its position in this list, OP_INVALID must stay first
+so a zeroed Chip8_Instr decodes to it.
+
+The SCHIP and XO-CHIP additions are decoded whatever the machine; the quirk
+profile's handler table (quirks.h) turns them back into what CHIP-8 did with
+those opcodes on machines that don't have them.
+*/
+#define CHIP8_OPCODES(X) CHIP8_BASE_OPCODES(X) CHIP8_SCHIP_OPCODES(X) CHIP8_XOCHIP_OPCODES(X)
+
+#define CHIP8_BASE_OPCODES(X)              \
+    X(OP_INVALID,     op_invalid,  "???")  \
+    X(OP_CLS,         cls,         "CLS")  \
+    X(OP_RET,         ret,         "RET")  \
+    X(OP_JP_ADDR,     jp_addr,     "JP")   \
+    X(OP_CALL_ADDR,   call_addr,   "CALL") \
+    X(OP_SE_VX_BYTE,  se_vx_byte,  "SE")   \
+    X(OP_SNE_VX_BYTE, sne_vx_byte, "SNE")  \
+    X(OP_SE_VX_VY,    se_vx_vy,    "SE")   \
+    X(OP_LD_VX_BYTE,  ld_vx_byte,  "LD")   \
+    X(OP_ADD_VX,      add_vx,      "ADD")  \
+    X(OP_LD_VX_VY,    ld_vx_vy,    "LD")   \
+    X(OP_OR_VX_VY,    or_vx_vy,    "OR")   \
+    X(OP_AND_VX_VY,   and_vx_vy,   "AND")  \
+    X(OP_XOR_VX_VY,   xor_vx_vy,   "XOR")  \
+    X(OP_ADD_VX_VY,   add_Vx_Vy,   "ADD")  \
+    X(OP_SUB_VX_VY,   sub_vx_vy,   "SUB")  \
+    X(OP_SHR_VX_VY,   shr_vx_vy,   "SHR")  \
+    X(OP_SUBN_VX_VY,  subn_vx_vy,  "SUBN") \
+    X(OP_SHL_VX_VY,   shl_vx_vy,   "SHL")  \
+    X(OP_SNE_VX_VY,   sne_vx_vy,   "SNE")  \
+    X(OP_LD_I_ADDR,   ld_i_addr,   "LD")   \
+    X(OP_JP_V0_ADDR,  jp_v0_addr,  "JP")   \
+    X(OP_RND,         rnd,         "RND")  \
+    X(OP_DRW,         drw,         "DRW")  \
+    X(OP_SKP_VX,      skp_vx,      "SKP")  \
+    X(OP_SKNP_VX,     sknp_vx,     "SKNP") \
+    X(OP_LD_VX_DT,    ld_vx_dt,    "LD")   \
+    X(OP_LD_VX_K,     ld_Vx_k,     "LD")   \
+    X(OP_LD_DT_VX,    ld_dt_vx,    "LD")   \
+    X(OP_LD_ST_VX,    ld_st_vx,    "LD")   \
+    X(OP_ADD_I_VX,    add_i_vx,    "ADD")  \
+    X(OP_LD_F_VX,     ld_F_Vx,     "LD")   \
+    X(OP_ST_BCD_VX,   st_bcd_Vx,   "LD")   \
+    X(OP_ST_V_REGS,   st_V_regs,   "LD")   \
+    X(OP_LD_V_REGS,   ld_V_regs,   "LD")
+
+#define CHIP8_SCHIP_OPCODES(X)             \
+    X(OP_SCD,         scd,         "SCD")  \
+    X(OP_SCR,         scr,         "SCR")  \
+    X(OP_SCL,         scl,         "SCL")  \
+    X(OP_EXIT,        exit_interpreter, "EXIT") \
+    X(OP_LOW,         low,         "LOW")  \
+    X(OP_HIGH,        high,        "HIGH") \
+    X(OP_DRW_16,      drw_16,      "DRW")  \
+    X(OP_LD_HF_VX,    ld_HF_Vx,    "LD")   \
+    X(OP_ST_R_VX,     st_R_Vx,     "LD")   \
+    X(OP_LD_VX_R,     ld_Vx_R,     "LD")
+
+#define CHIP8_XOCHIP_OPCODES(X)            \
+    X(OP_SCU,         scu,         "SCU")  \
+    X(OP_ST_V_RANGE,  st_V_range,  "SAVE") \
+    X(OP_LD_V_RANGE,  ld_V_range,  "LOAD") \
+    X(OP_LD_I_LONG,   ld_i_long,   "LD")   \
+    X(OP_PLANE,       plane,       "PLANE") \
+    X(OP_AUDIO,       audio,       "AUDIO") \
+    X(OP_PITCH_VX,    pitch_Vx,    "PITCH")
+
+#define CHIP8_OP_ENUM(id, handler, name) id,
+typedef enum {
+    CHIP8_OPCODES(CHIP8_OP_ENUM)
+    OP_COUNT
+} Chip8_OpId;
+#undef CHIP8_OP_ENUM
+
+#define CHIP8_OP_NAME(id, handler, name) [id] = name,
+static const char* const OP_NAMES[OP_COUNT] = { CHIP8_OPCODES(CHIP8_OP_NAME) };
+#undef CHIP8_OP_NAME
+
+/*
+Decode tables. DECODE_HIGH is indexed by the high nibble of the opcode, groups
+that share a high nibble point into a sub-opcode table instead.
+*/
+#define DECODE_GROUP_0  0xF0             // 00kk, sub-opcode is kk (x must be 0)
+#define DECODE_GROUP_5  0xF1             // 5xyn, sub-opcode is n
+#define DECODE_GROUP_8  0xF2             // 8xyn, sub-opcode is n
+#define DECODE_GROUP_9  0xF3             // 9xy0, n must be 0
+#define DECODE_GROUP_D  0xF4             // Dxyn, n = 0 is the 16x16 sprite
+#define DECODE_GROUP_E  0xF5             // Ex9E / ExA1, sub-opcode is kk
+#define DECODE_GROUP_F  0xF6             // Fxkk, sub-opcode is kk
+
+static const uint8_t DECODE_HIGH[16] = {
+    DECODE_GROUP_0, OP_JP_ADDR, OP_CALL_ADDR, OP_SE_VX_BYTE,
+    OP_SNE_VX_BYTE, DECODE_GROUP_5, OP_LD_VX_BYTE, OP_ADD_VX,
+    DECODE_GROUP_8, DECODE_GROUP_9, OP_LD_I_ADDR, OP_JP_V0_ADDR,
+    OP_RND, DECODE_GROUP_D, DECODE_GROUP_E, DECODE_GROUP_F
+};
+
+static const uint8_t DECODE_0[256] = {
+    [0xC0] = OP_SCD, [0xC1] = OP_SCD, [0xC2] = OP_SCD, [0xC3] = OP_SCD,
+    [0xC4] = OP_SCD, [0xC5] = OP_SCD, [0xC6] = OP_SCD, [0xC7] = OP_SCD,
+    [0xC8] = OP_SCD, [0xC9] = OP_SCD, [0xCA] = OP_SCD, [0xCB] = OP_SCD,
+    [0xCC] = OP_SCD, [0xCD] = OP_SCD, [0xCE] = OP_SCD, [0xCF] = OP_SCD,
+    [0xD0] = OP_SCU, [0xD1] = OP_SCU, [0xD2] = OP_SCU, [0xD3] = OP_SCU,
+    [0xD4] = OP_SCU, [0xD5] = OP_SCU, [0xD6] = OP_SCU, [0xD7] = OP_SCU,
+    [0xD8] = OP_SCU, [0xD9] = OP_SCU, [0xDA] = OP_SCU, [0xDB] = OP_SCU,
+    [0xDC] = OP_SCU, [0xDD] = OP_SCU, [0xDE] = OP_SCU, [0xDF] = OP_SCU,
+    [0xE0] = OP_CLS, [0xEE] = OP_RET,
+    [0xFB] = OP_SCR, [0xFC] = OP_SCL, [0xFD] = OP_EXIT, [0xFE] = OP_LOW, [0xFF] = OP_HIGH
+};
+
+static const uint8_t DECODE_5[16] = {
+    [0x0] = OP_SE_VX_VY, [0x2] = OP_ST_V_RANGE, [0x3] = OP_LD_V_RANGE
+};
+
+static const uint8_t DECODE_8[16] = {
+    [0x0] = OP_LD_VX_VY, [0x1] = OP_OR_VX_VY, [0x2] = OP_AND_VX_VY, [0x3] = OP_XOR_VX_VY,
+    [0x4] = OP_ADD_VX_VY, [0x5] = OP_SUB_VX_VY, [0x6] = OP_SHR_VX_VY, [0x7] = OP_SUBN_VX_VY,
+    [0xE] = OP_SHL_VX_VY
+};
+
+static const uint8_t DECODE_E[256] = {
+    [0x9E] = OP_SKP_VX, [0xA1] = OP_SKNP_VX
+};
+
+// F000 and F002 only exist with x = 0, chip8_decode checks
+static const uint8_t DECODE_F[256] = {
+    [0x00] = OP_LD_I_LONG, [0x01] = OP_PLANE, [0x02] = OP_AUDIO,
+    [0x07] = OP_LD_VX_DT, [0x0A] = OP_LD_VX_K, [0x15] = OP_LD_DT_VX, [0x18] = OP_LD_ST_VX,
+    [0x1E] = OP_ADD_I_VX, [0x29] = OP_LD_F_VX, [0x30] = OP_LD_HF_VX, [0x33] = OP_ST_BCD_VX,
+    [0x3A] = OP_PITCH_VX, [0x55] = OP_ST_V_REGS, [0x65] = OP_LD_V_REGS, [0x75] = OP_ST_R_VX,
+    [0x85] = OP_LD_VX_R
+};
+
+/*
+Splits an opcode into its handler id and operands. Done once per instruction so
+the handlers can use chip8->op directly.
+*/
+Chip8_Instr chip8_decode(uint16_t opcode) {
+    Chip8_Instr instr;
+    uint8_t high = opcode >> 12;
+    uint8_t id = DECODE_HIGH[high];
+
+    instr.opcode = opcode;
+    instr.nnn = opcode & 0x0FFF;
+    instr.x = (opcode & 0x0F00) >> 8;
+    instr.y = (opcode & 0x00F0) >> 4;
+    instr.n = opcode & 0x000F;
+    instr.kk = opcode & 0x00FF;
+
+    switch (id) {
+        case DECODE_GROUP_0:
+            id = (instr.x == 0) ? DECODE_0[instr.kk] : OP_INVALID;
+            break;
+        case DECODE_GROUP_5:
+            id = DECODE_5[instr.n];
+            break;
+        case DECODE_GROUP_8:
+            id = DECODE_8[instr.n];
+            break;
+        case DECODE_GROUP_9:
+            id = (instr.n == 0) ? OP_SNE_VX_VY : OP_INVALID;
+            break;
+        case DECODE_GROUP_D:
+            id = (instr.n != 0) ? OP_DRW : OP_DRW_16;
+            break;
+        case DECODE_GROUP_E:
+            id = DECODE_E[instr.kk];
+            break;
+        case DECODE_GROUP_F:
+            id = DECODE_F[instr.kk];
+            if ((id == OP_LD_I_LONG || id == OP_AUDIO) && instr.x != 0) {
+                id = OP_INVALID;
+            }
+            break;
+    }
+    instr.id = id;
+    return instr;
+}
+
+#endif
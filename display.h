@@ -0,0 +1,186 @@
+#ifndef DISPLAY_H
+#define DISPLAY_H
+
+#include <SDL.h>
+#include <stdint.h>
+#include <string.h>
+#include "chip8_def.h"
+#include "framebuffer.h"
+
+/*
+SDL presentation. The screen is a streaming texture of SCREEN_HIRES_WIDTH x
+SCREEN_HIRES_HEIGHT ARGB pixels that the renderer scales to the window; in the
+64x32 mode only its top-left quarter is uploaded and presented. A pixel's color
+is picked by its bits on the planes, DISPLAY_PALETTE[plane 1 << 1 | plane 0].
+
+All of this runs on the render thread, drawing frames the emulation thread
+publishes to a triple buffer (framebuffer.h); nothing here touches the Chip8.
+
+The texture is only touched where the screen changed: drw and cls record dirty
+rows and columns (screen_mark_dirty), frames carry them, and display_upload
+locks, for each run of consecutive dirty rows, the span between the leftmost and
+rightmost dirty column and expands just that from the bit-packed screen. It
+runs once per presented frame however many draws happened in between, so a rom
+redrawing every few instructions still costs one small upload per 60 Hz frame.
+With vsync on, presenting paces the render thread to the display while the
+emulator keeps its own clock.
+*/
+#define DISPLAY_SCALE 10                 // window pixels per chip8 pixel
+
+// ARGB8888: off, plane 0 (the only one before XO-CHIP), plane 1, both
+static const uint32_t DISPLAY_PALETTE[1 << SCREEN_PLANES] = {
+    0xFF000000u, 0xFFFFFFFFu, 0xFFAAAAAAu, 0xFF555555u
+};
+
+typedef struct {
+    SDL_Window* window;
+    SDL_Renderer* renderer;
+    SDL_Texture* texture;
+    uint8_t needs_present;           // the texture changed, or the window needs repainting
+    uint8_t hires;                   // mode of the last uploaded frame, how much of the texture to present
+
+    // statistics
+    uint64_t frames_presented;
+    uint64_t pixels_uploaded;
+} Chip8_Display;
+
+void display_destroy(Chip8_Display* display) {
+    if (display->texture != NULL) {
+        SDL_DestroyTexture(display->texture);
+    }
+    if (display->renderer != NULL) {
+        SDL_DestroyRenderer(display->renderer);
+    }
+    if (display->window != NULL) {
+        SDL_DestroyWindow(display->window);
+    }
+    display->texture = NULL;
+    display->renderer = NULL;
+    display->window = NULL;
+}
+
+/*
+Opens the window, SDL video must be initialized. Returns FALSE on failure.
+*/
+int display_init(Chip8_Display* display, const char* title, int scale) {
+    display->renderer = NULL;
+    display->texture = NULL;
+    display->needs_present = TRUE;
+    display->hires = FALSE;
+    display->frames_presented = 0;
+    display->pixels_uploaded = 0;
+
+    display->window = SDL_CreateWindow(title, SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+                                       SCREEN_WIDTH * scale, SCREEN_HEIGHT * scale, SDL_WINDOW_RESIZABLE);
+    if (display->window != NULL) {
+        display->renderer = SDL_CreateRenderer(display->window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+    }
+    if (display->renderer != NULL) {
+        display->texture = SDL_CreateTexture(display->renderer, SDL_PIXELFORMAT_ARGB8888,
+                                             SDL_TEXTUREACCESS_STREAMING, SCREEN_HIRES_WIDTH, SCREEN_HIRES_HEIGHT);
+    }
+    if (display->texture == NULL) {
+        display_destroy(display);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+Leftmost and rightmost dirty column of the frame's mode, FALSE if none
+*/
+int display_dirty_span(const Chip8_Frame* frame, int* x0, int* x1) {
+    *x0 = -1;
+    for (int w = 0; w < (1 << frame->hires); w++) {
+        uint64_t cols = frame->dirty_cols[w];
+        if (cols == 0) {
+            continue;
+        }
+        if (*x0 < 0) {
+            *x0 = w * 64 + __builtin_clzll(cols);
+        }
+        *x1 = w * 64 + 63 - __builtin_ctzll(cols);
+    }
+    return *x0 >= 0;
+}
+
+/*
+Expands rows y0..y1, columns x0..x1 of the frame into the texture
+*/
+void display_upload_rect(Chip8_Display* display, const Chip8_Frame* frame, int x0, int x1, int y0, int y1) {
+    SDL_Rect rect = { x0, y0, x1 - x0 + 1, y1 - y0 + 1 };
+    void* pixels;
+    int pitch;
+
+    if (SDL_LockTexture(display->texture, &rect, &pixels, &pitch) != 0) {
+        return;
+    }
+    for (int y = y0; y <= y1; y++) {
+        uint32_t* out = (uint32_t*)((uint8_t*)pixels + (y - y0) * pitch);
+        for (int x = x0; x <= x1; x++) {
+            int color = 0;
+            for (int p = 0; p < SCREEN_PLANES; p++) {
+                color |= ((frame->screen[p][y][x / 64] >> (63 - x % 64)) & 1) << p;
+            }
+            out[x - x0] = DISPLAY_PALETTE[color];
+        }
+    }
+    SDL_UnlockTexture(display->texture);
+    display->pixels_uploaded += (uint64_t)rect.w * rect.h;
+}
+
+/*
+Uploads what changed in frame since the frame uploaded before it
+*/
+void display_upload(Chip8_Display* display, const Chip8_Frame* frame) {
+    int height = SCREEN_HEIGHT << frame->hires;
+    uint64_t rows = frame->dirty_rows & (~0ull >> (64 - height));
+    int x0, x1;
+
+    if (frame->hires != display->hires) {
+        display->hires = frame->hires;
+        display->needs_present = TRUE;
+    }
+
+    if (rows != 0 && display_dirty_span(frame, &x0, &x1)) {
+        while (rows != 0) {
+            int y0 = __builtin_ctzll(rows);
+            int y1 = y0;
+            while (y1 + 1 < height && ((rows >> (y1 + 1)) & 1)) {
+                y1++;
+            }
+            display_upload_rect(display, frame, x0, x1, y0, y1);
+            for (int y = y0; y <= y1; y++) {
+                rows &= ~(1ull << y);
+            }
+        }
+        display->needs_present = TRUE;
+    }
+}
+
+/*
+Draws the texture to the window if anything changed since the last present
+*/
+void display_present(Chip8_Display* display) {
+    if (!display->needs_present) {
+        return;
+    }
+    SDL_Rect source = { 0, 0, SCREEN_WIDTH << display->hires, SCREEN_HEIGHT << display->hires };
+    SDL_RenderClear(display->renderer);
+    SDL_RenderCopy(display->renderer, display->texture, &source, NULL);
+    SDL_RenderPresent(display->renderer);
+    display->needs_present = FALSE;
+    display->frames_presented++;
+}
+
+/*
+Window events that need the texture presented again
+*/
+void display_handle_event(Chip8_Display* display, const SDL_Event* event) {
+    if (event->type == SDL_WINDOWEVENT &&
+        (event->window.event == SDL_WINDOWEVENT_EXPOSED || event->window.event == SDL_WINDOWEVENT_SIZE_CHANGED)) {
+        display->needs_present = TRUE;
+    }
+}
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "chip8_def.h"
+
+/*
+Triple buffer handing finished frames from the emulation thread to the render
+thread without either one ever waiting on the other.
+
+There are three slots. The producer owns one (back) and fills it with a copy of
+the packed screen, the consumer owns one (front) and draws from it, and the
+third (middle) is the latest published frame. Publishing swaps back and middle,
+acquiring swaps middle and front, each with a single atomic exchange on the
+middle index; a FRESH bit in it says the frame there hasn't been taken yet.
+When the emulator publishes faster than frames are drawn (vsync stall, window
+drag) the untaken frame is simply replaced by the newer one.
+
+Each frame carries the dirty rows and columns since the previous frame, so the
+renderer keeps uploading only what changed. A replaced frame's changes would be
+lost that way, so publishing over an untaken frame ORs its dirty masks into the
+new one: the frame the consumer takes always covers everything since the last
+one it took. Only the producer ever writes into slots, which is what makes
+reading the middle slot's masks from the producer safe.
+*/
+#define FRAME_FRESH 4u                   // middle index flag: published and not yet taken
+
+typedef struct {
+    uint64_t screen[SCREEN_PLANES][SCREEN_HIRES_HEIGHT][SCREEN_ROW_WORDS]; // same layout as Chip8.screen
+    uint8_t hires;                   // the screen is 128x64, else only its top-left 64x32 is in use
+    uint64_t dirty_rows;             // changed since the previous frame the consumer took
+    uint64_t dirty_cols[SCREEN_ROW_WORDS];
+    uint64_t frame_number;           // publish count, for spotting skipped frames
+    char pad[64];                    // the slot being written and the one being read never share a cache line
+} Chip8_Frame;
+
+typedef struct {
+    Chip8_Frame slots[3];
+    _Atomic uint32_t middle;         // slot index | FRAME_FRESH
+    char pad[64];                    // producer and consumer fields on separate cache lines
+
+    // producer side
+    uint32_t back;
+    uint64_t frames_published;
+    uint64_t frames_replaced;        // published over a frame that was never taken
+    char pad2[64];
+
+    // consumer side
+    uint32_t front;
+    uint64_t frames_taken;
+} Chip8_TripleBuffer;
+
+void chip8_frames_init(Chip8_TripleBuffer* tb) {
+    memset(tb, 0, sizeof(*tb));
+    tb->front = 0;
+    atomic_init(&tb->middle, 1);
+    tb->back = 2;
+}
+
+/*
+Emulation thread: copies chip8's screen into the back slot and publishes it,
+taking chip8's dirty state. Never blocks.
+*/
+void chip8_frames_publish(Chip8_TripleBuffer* tb, Chip8* chip8) {
+    Chip8_Frame* frame = &tb->slots[tb->back];
+    memcpy(frame->screen, chip8->screen, sizeof(frame->screen));
+    frame->hires = chip8->hires;
+    frame->dirty_rows = chip8->dirty_rows;
+    memcpy(frame->dirty_cols, chip8->dirty_cols, sizeof(frame->dirty_cols));
+
+    // an untaken frame about to be replaced: keep its changes in this one. If the
+    // consumer takes it in the meantime this only redraws a little more.
+    uint32_t middle = atomic_load_explicit(&tb->middle, memory_order_relaxed);
+    if (middle & FRAME_FRESH) {
+        const Chip8_Frame* pending = &tb->slots[middle & 3];
+        frame->dirty_rows |= pending->dirty_rows;
+        for (int w = 0; w < SCREEN_ROW_WORDS; w++) {
+            frame->dirty_cols[w] |= pending->dirty_cols[w];
+        }
+    }
+    frame->frame_number = ++tb->frames_published;
+
+    middle = atomic_exchange_explicit(&tb->middle, tb->back | FRAME_FRESH, memory_order_acq_rel);
+    tb->back = middle & 3;
+    tb->frames_replaced += (middle & FRAME_FRESH) != 0;
+
+    chip8->dirty_rows = 0;
+    memset(chip8->dirty_cols, 0, sizeof(chip8->dirty_cols));
+    chip8->draw_screen_flag = FALSE;
+}
+
+/*
+Render thread: the latest published frame if there is one it hasn't taken yet,
+else NULL. The frame stays valid until the next call.
+*/
+const Chip8_Frame* chip8_frames_acquire(Chip8_TripleBuffer* tb) {
+    if (!(atomic_load_explicit(&tb->middle, memory_order_relaxed) & FRAME_FRESH)) {
+        return NULL;
+    }
+    uint32_t middle = atomic_exchange_explicit(&tb->middle, tb->front, memory_order_acq_rel);
+    tb->front = middle & 3;
+    tb->frames_taken++;
+    return &tb->slots[tb->front];
+}
+
+#endif
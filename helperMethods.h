@@ -1,35 +1,73 @@
+#ifndef HELPER_METHODS_H
+#define HELPER_METHODS_H
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
 #include "instructions.h"
+#include "quirks.h"
 #include "chip8_def.h"
+#include "memory.h"
+#include "rng.h"
+#include "jit.h"
+#include "aot.h"
 
+/*
+Sets up a fresh instance. chip8 is assumed to own nothing yet: to reuse one that
+has run before, chip8_release it first.
+*/
 void initialize(Chip8* chip8) {
     // Program counter starts at 0x200
     chip8->pc_reg = PC_START;
     chip8->current_op = 0;
+    memset(&chip8->op, 0, sizeof(chip8->op));
+    chip8->cycle_count = 0;
+    chip8->idle_cycles = 0;
+    chip8_set_quirks(chip8, QUIRKS_DEFAULT);
     chip8->I_reg = 0;
+
+    // Start out in the plain interpreter
+    chip8->code_map = NULL;
+    chip8->code_write_hook = NULL;
+    chip8->jit = NULL;
+    chip8->aot = NULL;
+    chip8->audio = NULL;
+#ifdef CHIP8_PROFILE
+    chip8->profile = NULL;
+#endif
+#ifdef CHIP8_TRACE
+    chip8->trace = NULL;
+#endif
     chip8->sp_reg = 0;
 
-    // Clear display
-    memset(chip8->screen, 0, sizeof(chip8->screen));
+    // Clear display, 64x32 with one plane until the rom asks for more
+    chip8->hires = FALSE;
+    chip8->planes = 1;
+    screen_clear(chip8);
     // Clear stack
     memset(chip8->stack, 0, sizeof(chip8->stack));
     // Clear registers V0-VF
     memset(chip8->V, 0, sizeof(chip8->V));
-    // Clear memory
-    memset(chip8->ram, 0, sizeof(chip8->ram));
+    // Clear memory (every page starts out as the shared zero page)
+    chip8_ram_init(chip8);
 
-    // Load fontset into memory
-    for(int i = 0; i < FONTSET_SIZE; i++) {
-        chip8->ram[i] = FONTSET[i];
-    }
+    // Load fontset into memory, the big digits right after the small ones
+    chip8_load_ram(chip8, 0, FONTSET, FONTSET_SIZE);
+    chip8_load_ram(chip8, BIG_FONT_ADDR, BIG_FONTSET, BIG_FONTSET_SIZE);
+
+    // SCHIP flag registers and the XO-CHIP buzzer, silent until F002 loads a pattern
+    memset(chip8->rpl, 0, sizeof(chip8->rpl));
+    memset(chip8->audio_pattern, 0, sizeof(chip8->audio_pattern));
+    chip8->audio_pitch = 64;
 
     // Reset timers
     chip8->delay_timer = 0;
     chip8->sound_timer = 0;
 
+    // Fixed default seed, callers wanting another sequence call chip8_seed_rng
+    chip8_seed_rng(chip8, 0);
+
     // Set status flags
     chip8->is_running_flag = TRUE;
     chip8->draw_screen_flag = FALSE;
@@ -51,20 +89,21 @@ void reset_system(Chip8 *chip8) {
 
     chip8->pc_reg = PC_START;
     chip8->current_op = 0;
+    memset(&chip8->op, 0, sizeof(chip8->op));
+    chip8->cycle_count = 0;
+    chip8->idle_cycles = 0;
     chip8->sp_reg = 0;
     chip8->I_reg = 0;
 
     // Clear display (memory)
-    for (int i = 0; i < SCREEN_HEIGHT; i++) {
-        for (int j = 0; j < SCREEN_WIDTH; j++) {
-            chip8->screen[i][j] = 0;
-        }
-    }
+    chip8->hires = FALSE;
+    chip8->planes = 1;
+    screen_clear(chip8);
 
-    // Clear ram from the fontset end (80) to the Program ram 
-    for (int i = 80; i < PROGRAM_START_ADDR; i++) {
-        chip8->ram[i] = 0;
-    }
+    // Clear ram from the fontsets' end (240) to the Program ram 
+    chip8_load_ram(chip8, BIG_FONT_ADDR + BIG_FONTSET_SIZE, NULL, PROGRAM_START_ADDR - BIG_FONT_ADDR - BIG_FONTSET_SIZE);
+    memset(chip8->audio_pattern, 0, sizeof(chip8->audio_pattern));
+    chip8->audio_pitch = 64;
 
     // Clear registers, keyboard and stack (all 16 each)
     for (int i = 0; i < 16; i++) {
@@ -75,6 +114,87 @@ void reset_system(Chip8 *chip8) {
     // Reset timers to 0
     chip8->delay_timer = 0;
     chip8->sound_timer = 0;
+
+    // Replay the same random sequence as the first run
+    chip8_seed_rng(chip8, chip8->rng_seed);
+}
+
+// Largest rom that fits between PROGRAM_START_ADDR and the end of ram of the
+// largest machine, load_rom_image checks against the instance's own
+#define MAX_ROM_SIZE (TOTAL_RAM - PROGRAM_START_ADDR)
+
+/*
+Reads a rom file into buf (at least MAX_ROM_SIZE bytes).
+Returns the rom size, or -1 if the file can't be read or doesn't fit in ram.
+*/
+long read_rom_file(const char* path, uint8_t* buf) {
+    FILE* rom = fopen(path, "rb");
+    if (rom == NULL) {
+        return -1;
+    }
+
+    // read one byte past the limit so oversized roms are caught
+    size_t size = fread(buf, 1, MAX_ROM_SIZE, rom);
+    int too_big = (size == MAX_ROM_SIZE && fgetc(rom) != EOF);
+    int failed = ferror(rom);
+    fclose(rom);
+
+    if (too_big || failed) {
+        return -1;
+    }
+    return (long)size;
 }
 
+/*
+Copies a rom image already in memory into the program area. Returns FALSE,
+loading nothing, if it doesn't fit in the ram of chip8's machine (quirks.h).
+*/
+int load_rom_image(Chip8* chip8, const uint8_t* rom, size_t size) {
+    if (size > (size_t)chip8->ram_mask + 1 - PROGRAM_START_ADDR) {
+        return FALSE;
+    }
+    chip8_load_ram(chip8, PROGRAM_START_ADDR, rom, size);
+    return TRUE;
+}
+
+/*
+Makes dst a copy of src that shares its ram pages copy-on-write, so forking is
+cheap enough to branch thousands of states off one. dst must not own anything
+(fresh, or chip8_release'd). Compiled blocks are not shared, dst starts in the
+plain interpreter with no audio sink.
+*/
+void chip8_fork(Chip8* dst, const Chip8* src) {
+    *dst = *src;
+    for (int p = 0; p < RAM_PAGE_COUNT; p++) {
+        chip8_page_acquire(dst->ram[p]);
+    }
+    dst->code_map = NULL;
+    dst->code_write_hook = NULL;
+    dst->jit = NULL;
+    dst->aot = NULL;
+    dst->audio = NULL;
+#ifdef CHIP8_PROFILE
+    dst->profile = NULL;
+#endif
+#ifdef CHIP8_TRACE
+    dst->trace = NULL;
+#endif
+}
+
+/*
+Frees what chip8 holds: its references to ram pages, the block compiler and
+the compiled rom state
+*/
+void chip8_release(Chip8* chip8) {
+    chip8_jit_disable(chip8);
+    chip8_aot_disable(chip8);
+#ifdef CHIP8_PROFILE
+    chip8_profile_disable(chip8);
+#endif
+#ifdef CHIP8_TRACE
+    chip8_trace_disable(chip8);
+#endif
+    chip8_ram_release(chip8);
+}
 
+#endif
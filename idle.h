@@ -0,0 +1,69 @@
+#ifndef IDLE_H
+#define IDLE_H
+
+#include <stdint.h>
+#include "chip8_def.h"
+#include "decode.h"
+#include "memory.h"
+
+/*
+Idle loop detection. Roms spend most of their time waiting, and the ways they
+wait repeat the exact same state every iteration until something outside
+the instruction stream changes: the delay timer, which only ticks between
+frames, or the keyboard, which only changes between run_cycles calls. Within
+one run_cycles call such a loop can be fast-forwarded by whole iterations
+with the same result as running it, so runs stay bit-exact and only the
+host time goes away.
+
+    1nnn               jump to itself: nothing ever changes again
+    Fx07 3xkk 1nnn     poll the delay timer until it equals kk (4xkk: until it
+                       doesn't), 1nnn jumping back to the Fx07
+    Fx0A               wait for a key while none is down
+*/
+
+// Ops that can start an idle loop, constant-folded away for every other op.
+// CHIP8_NO_IDLE_SKIP runs every iteration, for benchmarks timing raw execution.
+#ifdef CHIP8_NO_IDLE_SKIP
+#define CHIP8_MAY_IDLE(id) 0
+#else
+#define CHIP8_MAY_IDLE(id) ((id) == OP_JP_ADDR || (id) == OP_LD_VX_DT || (id) == OP_LD_VX_K)
+#endif
+
+/*
+instr is the instruction at pc_reg, about to run, with budget cycles left after
+it. Returns how many of those cycles are iterations of an idle loop starting at
+pc_reg, which leave the state as it is now and can be skipped (counted, not run).
+*/
+static inline uint64_t chip8_idle_skip(const Chip8* chip8, Chip8_Instr instr, uint64_t budget) {
+    switch (instr.id) {
+        case OP_JP_ADDR:
+            return (instr.nnn == chip8->pc_reg) ? budget : 0;
+
+        case OP_LD_VX_K:
+            for (int i = 0; i < NUM_KEYS; i++) {
+                if (chip8->keyboard[i] != FALSE) {
+                    return 0;
+                }
+            }
+            return budget;
+
+        case OP_LD_VX_DT: {
+            uint16_t pc = chip8->pc_reg;
+            Chip8_Instr test = chip8_instr_at(chip8, pc + 2);
+            Chip8_Instr jump = chip8_instr_at(chip8, pc + 4);
+            if (jump.id != OP_JP_ADDR || jump.nnn != pc || test.x != instr.x) {
+                return 0;
+            }
+
+            // Vx is about to be loaded from the timer, would the test leave the loop?
+            uint8_t equal = chip8->delay_timer == test.kk;
+            uint8_t loops = (test.id == OP_SE_VX_BYTE && !equal) || (test.id == OP_SNE_VX_BYTE && equal);
+            return loops ? budget - budget % 3 : 0;
+        }
+
+        default:
+            return 0;
+    }
+}
+
+#endif
@@ -0,0 +1,229 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "chip8_def.h"
+#include "cpu.h"
+#include "clock.h"
+
+/*
+Key input. The keyboard array is only ever written by the thread running the
+instance, at instruction boundaries: key events go through a single-producer,
+single-consumer queue and chip8_input_run_cycles applies each one right before
+the instruction it is timestamped for, so the frontend's input thread never
+touches the Chip8 and skp, sknp and Fx0A see a keyboard that can't change under
+them.
+
+An event's cycle is the cycle_count it takes effect at. Live input uses 0, i.e.
+the first boundary the emulator reaches after it was pushed; scripts use the
+cycle recorded, so a replay presses the same keys at the same instructions and
+runs bit-exact, headless and at full speed. A run of cycles is split at every
+event's cycle, which keeps the keyboard constant within each chip8_run_cycles
+call the way idle loop skipping (idle.h) relies on.
+
+host_ns is when the host saw the key (0 if unknown). Applying it records the
+delay until the guest could see it, the input latency.
+
+on_apply, if set, is called on the consumer thread after events were applied,
+with cycle_count at the instruction they took effect before (movie.h records
+keys this way).
+*/
+#define INPUT_QUEUE_SIZE 256             // events in flight, power of two
+
+typedef struct {
+    uint64_t cycle;                  // cycle_count the event takes effect at, 0 as soon as possible
+    uint64_t host_ns;                // chip8_now_ns() when the host saw it, 0 if not timed
+    uint8_t key;                     // 0x0 - 0xF
+    uint8_t down;                    // TRUE pressed, FALSE released
+} Chip8_KeyEvent;
+
+typedef struct {
+    Chip8_KeyEvent events[INPUT_QUEUE_SIZE];
+
+    // producer side
+    _Atomic uint32_t head;           // next slot written
+    uint64_t events_dropped;         // pushed while the queue was full
+    char pad[64];                    // producer and consumer fields on separate cache lines
+
+    // consumer side
+    _Atomic uint32_t tail;           // next slot read
+    uint64_t events_applied;
+    uint64_t latency_count;          // applied events that had a host timestamp
+    uint64_t latency_total_ns;
+    uint64_t latency_max_ns;
+    void (*on_apply)(void* ctx, const Chip8* chip8);
+    void* on_apply_ctx;
+} Chip8_InputQueue;
+
+void chip8_input_init(Chip8_InputQueue* q) {
+    memset(q, 0, sizeof(*q));
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+}
+
+/*
+Producer: queues an event, FALSE (and counted as dropped) if the queue is full
+*/
+int chip8_input_push(Chip8_InputQueue* q, Chip8_KeyEvent event) {
+    uint32_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&q->tail, memory_order_acquire) == INPUT_QUEUE_SIZE) {
+        q->events_dropped++;
+        return FALSE;
+    }
+    q->events[head % INPUT_QUEUE_SIZE] = event;
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    return TRUE;
+}
+
+/*
+Consumer: the oldest queued event without taking it, NULL if there is none
+*/
+static inline const Chip8_KeyEvent* chip8_input_peek(Chip8_InputQueue* q) {
+    uint32_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    if (tail == atomic_load_explicit(&q->head, memory_order_acquire)) {
+        return NULL;
+    }
+    return &q->events[tail % INPUT_QUEUE_SIZE];
+}
+
+static inline void chip8_input_pop(Chip8_InputQueue* q) {
+    atomic_store_explicit(&q->tail, atomic_load_explicit(&q->tail, memory_order_relaxed) + 1, memory_order_release);
+}
+
+/*
+Applies every queued event due at or before chip8's current cycle. Returns the
+cycle the next queued event is due at, UINT64_MAX if the queue is empty.
+*/
+uint64_t chip8_input_apply(Chip8* chip8, Chip8_InputQueue* q) {
+    const Chip8_KeyEvent* event;
+    uint64_t applied = q->events_applied;
+    while ((event = chip8_input_peek(q)) != NULL && event->cycle <= chip8->cycle_count) {
+        chip8->keyboard[event->key & 0xF] = event->down ? TRUE : FALSE;
+        q->events_applied++;
+        if (event->host_ns != 0) {
+            uint64_t latency = chip8_now_ns() - event->host_ns;
+            q->latency_count++;
+            q->latency_total_ns += latency;
+            q->latency_max_ns = (latency > q->latency_max_ns) ? latency : q->latency_max_ns;
+        }
+        chip8_input_pop(q);
+    }
+    if (q->on_apply != NULL && q->events_applied != applied) {
+        q->on_apply(q->on_apply_ctx, chip8);
+    }
+    return (event != NULL) ? event->cycle : UINT64_MAX;
+}
+
+/*
+chip8_run_cycles with the keyboard driven by q, or not at all if q is NULL.
+Each event is applied exactly at its cycle, live events at the next boundary.
+*/
+uint64_t chip8_input_run_cycles(Chip8* chip8, Chip8_InputQueue* q, uint64_t n) {
+    if (q == NULL) {
+        return chip8_run_cycles(chip8, n);
+    }
+
+    uint64_t executed = 0;
+    while (executed < n && chip8->is_running_flag) {
+        uint64_t next = chip8_input_apply(chip8, q);
+        uint64_t slice = n - executed;
+        if (next - chip8->cycle_count < slice) {
+            slice = next - chip8->cycle_count;
+        }
+        uint64_t ran = chip8_run_cycles(chip8, slice);
+        executed += ran;
+        if (ran < slice) {
+            break;
+        }
+    }
+    // events due right at the end belong before the next instruction, apply them now
+    chip8_input_apply(chip8, q);
+    return executed;
+}
+
+/*
+chip8_run_frame with the keyboard driven by q
+*/
+void chip8_input_run_frame(Chip8* chip8, Chip8_InputQueue* q, uint32_t instructions_per_frame) {
+    chip8_input_run_cycles(chip8, q, instructions_per_frame);
+    if (chip8->is_running_flag) {
+        chip8_tick_timers(chip8);
+    }
+}
+
+/*
+Headless producer for a recorded script: queues events[*next..] due before
+until_cycle, as many as fit, advancing *next. Feeding before each frame lets a
+script of any length go through the fixed-size queue on a single thread.
+*/
+void chip8_input_feed(Chip8_InputQueue* q, const Chip8_KeyEvent* events, size_t count, size_t* next, uint64_t until_cycle) {
+    while (*next < count && events[*next].cycle < until_cycle) {
+        uint32_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+        if (head - atomic_load_explicit(&q->tail, memory_order_acquire) == INPUT_QUEUE_SIZE) {
+            return;
+        }
+        chip8_input_push(q, events[*next]);
+        (*next)++;
+    }
+}
+
+/*
+Reads an input script, one event per line: the cycle (decimal), the key (hex)
+and "down" or "up"; # starts a comment. Cycles must not decrease. Returns the
+number of events, stored in a malloc'ed array at *events, or -1 if the file
+can't be read or a line is malformed (reported on stderr).
+*/
+long chip8_input_load_script(const char* path, Chip8_KeyEvent** events) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "%s: can't open input script\n", path);
+        return -1;
+    }
+
+    size_t count = 0, capacity = 0;
+    char line[256];
+    *events = NULL;
+    for (int line_no = 1; fgets(line, sizeof(line), file) != NULL; line_no++) {
+        char* comment = strchr(line, '#');
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+        unsigned long long cycle;
+        unsigned key;
+        char state[8];
+        int fields = sscanf(line, "%llu %x %7s", &cycle, &key, state);
+        if (fields <= 0) {
+            continue;                // blank or comment only
+        }
+        int down = (fields == 3) && strcmp(state, "down") == 0;
+        if (fields != 3 || key >= NUM_KEYS || (!down && strcmp(state, "up") != 0) ||
+            (count > 0 && cycle < (*events)[count - 1].cycle)) {
+            fprintf(stderr, "%s:%d: expected \"cycle key down|up\" in cycle order\n", path, line_no);
+            free(*events);
+            fclose(file);
+            return -1;
+        }
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            Chip8_KeyEvent* grown = realloc(*events, capacity * sizeof(Chip8_KeyEvent));
+            if (grown == NULL) {
+                fprintf(stderr, "%s: out of memory\n", path);
+                free(*events);
+                fclose(file);
+                return -1;
+            }
+            *events = grown;
+        }
+        Chip8_KeyEvent event = { cycle, 0, (uint8_t)key, (uint8_t)down };
+        (*events)[count++] = event;
+    }
+    fclose(file);
+    return (long)count;
+}
+
+#endif
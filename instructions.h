@@ -1,23 +1,38 @@
+#ifndef INSTRUCTIONS_H
+#define INSTRUCTIONS_H
+
 #include "chip8_def.h"
+#include "memory.h"
+#include "screen.h"
+#include "rng.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+/*
+Any opcode that does not decode to a known instruction (including 0nnn SYS addr).
+Stops the system instead of executing garbage.
+*/
+void op_invalid(Chip8* chip8) {
+    chip8->is_running_flag = FALSE;
+}
 /*
 First Opcode: 00E0
 CLS: Clear the display, set all pixels to 0
 */
 void cls(Chip8* chip8) {
-    for (int i = 0; i < SCREEN_HEIGHT; i++) {
-        for (int j = 0; j < SCREEN_WIDTH; j++) {
-            chip8->screen[i][j] = 0;
-        }
-    }
+    screen_clear_planes(chip8, chip8->planes);
     chip8->draw_screen_flag = TRUE;
     chip8->pc_reg += 2;
 }
 /*
 00EE: RET returns from the subroutine
+A ret with nothing on the stack stops the system, as op_invalid does.
 */
 void ret(Chip8* chip8) {
+    if (chip8->sp_reg == 0) {
+        op_invalid(chip8);
+        return;
+    }
     chip8->sp_reg--;
     chip8->pc_reg = chip8->stack[chip8->sp_reg];
     chip8->pc_reg += 2;
@@ -30,8 +45,7 @@ Set PC to nnn
 NNN: This is a 12-bit address, which can range from 0x000 to 0xFFF. This address is extracted from the opcode by masking the lower 12 bits.
 */
 void jp_addr(Chip8* chip8) {
-    uint16_t addr = chip8->current_op & 0x0FFF;
-    chip8->pc_reg = addr;
+    chip8->pc_reg = chip8->op.nnn;
 }
 
 /*
@@ -39,12 +53,16 @@ void jp_addr(Chip8* chip8) {
 Call subroutine at nnn.
 
 The interpreter increments the stack pointer, then puts the current PC on the top of the stack. The PC is then set to nnn.
+A call with the stack full stops the system, as op_invalid does.
 */
 void call_addr(Chip8* chip8) {
+    if (chip8->sp_reg == STACK_SIZE) {
+        op_invalid(chip8);
+        return;
+    }
     chip8->stack[chip8->sp_reg] = chip8->pc_reg;
     chip8->sp_reg++;
-    uint16_t addr = chip8->current_op & 0x0FFF;
-    chip8->pc_reg = addr;
+    chip8->pc_reg = chip8->op.nnn;
 }
 /*
 3xkk - SE Vx, byte
@@ -53,9 +71,8 @@ Skip next instruction if Vx = kk.
 The interpreter compares register Vx to kk, and if they are equal, increments the program counter by 2.
 */
 void se_vx_byte(Chip8* chip8) {
-    uint16_t targetVreg = (chip8->current_op & 0x0F00);
-    targetVreg = targetVreg >> 8; // Isolate X which is the register index
-    uint8_t kk = chip8->current_op & 0x00FF;
+    uint8_t targetVreg = chip8->op.x;
+    uint8_t kk = chip8->op.kk;
 
     if(chip8->V[targetVreg] == kk) {
         chip8->pc_reg += 4; //skips 2 instructions
@@ -71,9 +88,8 @@ Skip next instruction if Vx != kk.
 The interpreter compares register Vx to kk, and if they are not equal, increments the program counter by 2.
 */
 void sne_vx_byte(Chip8* chip8) {
-    uint16_t targetVreg = (chip8->current_op & 0x0F00);
-    targetVreg = targetVreg >> 8; // Isolate X which is the register index
-    uint8_t kk = chip8->current_op & 0x00FF;
+    uint8_t targetVreg = chip8->op.x;
+    uint8_t kk = chip8->op.kk;
 
     if(chip8->V[targetVreg] != kk) {
         chip8->pc_reg += 4; //skips 2 instructions
@@ -88,10 +104,8 @@ Skip next instruction if Vx = Vy.
 The interpreter compares register Vx to register Vy, and if they are equal, increments the program counter by 2.
 */
 void se_vx_vy(Chip8* chip8) {
-    uint16_t targetVregX = (chip8->current_op & 0x0F00);
-    targetVregX = targetVregX >> 8; // Isolate X which is the register index
-    uint16_t targetVregY = (chip8->current_op & 0x00F0);
-    targetVregY = targetVregY >> 4; // Isolate Y which is the register index
+    uint8_t targetVregX = chip8->op.x;
+    uint8_t targetVregY = chip8->op.y;
 
     if(chip8->V[targetVregX] == chip8->V[targetVregY]) {
         chip8->pc_reg += 4; //skips 2 instructions
@@ -106,9 +120,8 @@ Set Vx = kk.
 The interpreter puts the value kk into register Vx.
 */
 void ld_vx_byte(Chip8* chip8) {
-    uint16_t targetVreg = (chip8->current_op & 0x0F00);
-    targetVreg = targetVreg >> 8; // Isolate X which is the register index
-    uint8_t kk = chip8->current_op & 0x00FF;
+    uint8_t targetVreg = chip8->op.x;
+    uint8_t kk = chip8->op.kk;
 
     chip8->V[targetVreg] = kk;
     chip8->pc_reg += 2;
@@ -120,9 +133,8 @@ Set Vx = Vx + kk.
 Adds the value kk to the value of register Vx, then stores the result in Vx.
  */
 void add_vx(Chip8* chip8) {
-    uint16_t targetVreg = (chip8->current_op & 0x0F00);
-    targetVreg = targetVreg >> 8; // Isolate X which is the register index
-    uint8_t kk = chip8->current_op & 0x00FF;
+    uint8_t targetVreg = chip8->op.x;
+    uint8_t kk = chip8->op.kk;
 
     chip8->V[targetVreg] += kk;
     chip8->pc_reg += 2;
@@ -134,10 +146,8 @@ Set Vx = Vy.
 Stores the value of register Vy in register Vx.
 */
 void ld_vx_vy(Chip8* Chip8) {
-    uint16_t targetVregX = (Chip8->current_op & 0x0F00);
-    targetVregX = targetVregX >> 8; // Isolate X which is the register index
-    uint16_t targetVregY = (Chip8->current_op & 0x00F0);
-    targetVregY = targetVregY >> 4; // Isolate Y which is the register index
+    uint8_t targetVregX = Chip8->op.x;
+    uint8_t targetVregY = Chip8->op.y;
 
     Chip8->V[targetVregX] = Chip8->V[targetVregY];
     Chip8->pc_reg += 2;
@@ -151,10 +161,8 @@ A bitwise OR compares the corrseponding bits from two values, and if either bit
 Otherwise, it is 0.
 */
 void or_vx_vy(Chip8* Chip8) {
-    uint16_t targetVregX = (Chip8->current_op & 0x0F00);
-    targetVregX = targetVregX >> 8; // Isolate X which is the register index
-    uint16_t targetVregY = (Chip8->current_op & 0x00F0);
-    targetVregY = targetVregY >> 4; // Isolate Y which is the register index
+    uint8_t targetVregX = Chip8->op.x;
+    uint8_t targetVregY = Chip8->op.y;
 
     Chip8->V[targetVregX] |= Chip8->V[targetVregY];
     Chip8->pc_reg += 2;
@@ -169,10 +177,8 @@ A bitwise AND compares the corrseponding bits from two values, and if both bits
 Otherwise, it is 0.
 */
 void and_vx_vy(Chip8* Chip8) {
-    uint16_t targetVregX = (Chip8->current_op & 0x0F00);
-    targetVregX = targetVregX >> 8; // Isolate X which is the register index
-    uint16_t targetVregY = (Chip8->current_op & 0x00F0);
-    targetVregY = targetVregY >> 4; // Isolate Y which is the register index
+    uint8_t targetVregX = Chip8->op.x;
+    uint8_t targetVregY = Chip8->op.y;
 
     Chip8->V[targetVregX] &= Chip8->V[targetVregY];
     Chip8->pc_reg += 2;
@@ -186,10 +192,8 @@ An exclusive OR compares the corrseponding bits from two values, and if the bits
 then the corresponding bit in the result is set to 1. Otherwise, it is 0.
 */
 void xor_vx_vy(Chip8* Chip8) {
-    uint16_t targetVregX = (Chip8->current_op & 0x0F00);
-    targetVregX = targetVregX >> 8; // Isolate X which is the register index
-    uint16_t targetVregY = (Chip8->current_op & 0x00F0);
-    targetVregY = targetVregY >> 4; // Isolate Y which is the register index
+    uint8_t targetVregX = Chip8->op.x;
+    uint8_t targetVregY = Chip8->op.y;
 
     Chip8->V[targetVregX] ^= Chip8->V[targetVregY];
     Chip8->pc_reg += 2;
@@ -203,8 +207,8 @@ If the result is greater than 8 bits (i.e., > 255,) VF is set to 1, otherwise 0.
 Only the lowest 8 bits of the result are kept, and stored in Vx.
 */
 void add_Vx_Vy(Chip8 *chip8) {
-    uint8_t target_v_reg_x = (chip8->current_op & 0x0F00) >> 8;
-    uint8_t target_v_reg_y = (chip8->current_op & 0x00F0) >> 4;
+    uint8_t target_v_reg_x = chip8->op.x;
+    uint8_t target_v_reg_y = chip8->op.y;
     uint16_t sum = (chip8->V[target_v_reg_x] + chip8->V[target_v_reg_y]);
 
     if (sum > 255) {
@@ -224,10 +228,8 @@ Set Vx = Vx - Vy, set VF = NOT borrow.
 If Vx > Vy, then VF is set to 1, otherwise 0. Then Vy is subtracted from Vx, and the results stored in Vx.
 */
 void sub_vx_vy(Chip8* chip8) {
-    uint16_t targetVregX = (chip8->current_op & 0x0F00);
-    targetVregX = targetVregX >> 8; // Isolate X which is the register index
-    uint16_t targetVregY = (chip8->current_op & 0x00F0);
-    targetVregY = targetVregY >> 4; // Isolate Y which is the register index
+    uint8_t targetVregX = chip8->op.x;
+    uint8_t targetVregY = chip8->op.y;
 
     if(chip8->V[targetVregX] > chip8->V[targetVregY]) {
         chip8->V[0xF] = 1;
@@ -245,8 +247,7 @@ Set Vx = Vx SHR 1.
 If the least-significant bit of Vx is 1, then VF is set to 1, otherwise 0. Then Vx is divided by 2.
 */
 void shr_vx_vy(Chip8* chip8) {
-    uint16_t targetVregX = (chip8->current_op & 0x0F00);
-    targetVregX = targetVregX >> 8; // Isolate X which is the register index
+    uint8_t targetVregX = chip8->op.x;
 
     chip8->V[0xF] = chip8->V[targetVregX] & 0x1;
     chip8->V[targetVregX] >>= 1;
@@ -259,10 +260,8 @@ Set Vx = Vy - Vx, set VF = NOT borrow.
 If Vy > Vx, then VF is set to 1, otherwise 0. Then Vx is subtracted from Vy, and the results stored in Vx.
 */
 void subn_vx_vy(Chip8* chip8) {
-    uint16_t targetVregX = (chip8->current_op & 0x0F00);
-    targetVregX = targetVregX >> 8; // Isolate X which is the register index
-    uint16_t targetVregY = (chip8->current_op & 0x00F0);
-    targetVregY = targetVregY >> 4; // Isolate Y which is the register index
+    uint8_t targetVregX = chip8->op.x;
+    uint8_t targetVregY = chip8->op.y;
 
     if(chip8->V[targetVregY] > chip8->V[targetVregX]) {
         chip8->V[0xF] = 1;
@@ -280,8 +279,7 @@ Set Vx = Vx SHL 1.
 If the most-significant bit of Vx is 1, then VF is set to 1, otherwise to 0. Then Vx is multiplied by 2.
 */
 void shl_vx_vy(Chip8* chip8) {
-    uint16_t targetVregX = (chip8->current_op & 0x0F00);
-    targetVregX = targetVregX >> 8; // Isolate X which is the register index
+    uint8_t targetVregX = chip8->op.x;
 
     chip8->V[0xF] = chip8->V[targetVregX] >> 7;
     chip8->V[targetVregX] <<= 1;
@@ -294,10 +292,8 @@ Skip next instruction if Vx != Vy.
 The values of Vx and Vy are compared, and if they are not equal, the program counter is increased by 2.
 */
 void sne_vx_vy(Chip8* chip8) {
-    uint16_t targetVregX = (chip8->current_op & 0x0F00);
-    targetVregX = targetVregX >> 8; // Isolate X which is the register index
-    uint16_t targetVregY = (chip8->current_op & 0x00F0);
-    targetVregY = targetVregY >> 4; // Isolate Y which is the register index
+    uint8_t targetVregX = chip8->op.x;
+    uint8_t targetVregY = chip8->op.y;
 
     if(chip8->V[targetVregX] != chip8->V[targetVregY]) {
         chip8->pc_reg += 4; //skips 2 instructions
@@ -312,8 +308,7 @@ Set I = nnn.
 The value of register I is set to nnn.
 */
 void ld_i_addr(Chip8* chip8) {
-    uint16_t addr = chip8->current_op & 0x0FFF;
-    chip8->I_reg = addr;
+    chip8->I_reg = chip8->op.nnn;
     chip8->pc_reg += 2;
 }
 /*
@@ -323,8 +318,7 @@ Jump to location nnn + V0.
 The program counter is set to nnn plus the value of V0.
 */
 void jp_v0_addr(Chip8* chip8) {
-    uint16_t addr = chip8->current_op & 0x0FFF;
-    chip8->pc_reg = addr + chip8->V[0];
+    chip8->pc_reg = chip8->op.nnn + chip8->V[0];
 }
 /*
 Cxkk - RND Vx, byte
@@ -333,9 +327,9 @@ Set Vx = random byte AND kk.
 The interpreter generates a random number from 0 to 255, which is then ANDed with the value kk. The results are stored in Vx.
 */
 void rnd(Chip8 *chip8) {
-    uint8_t target_v_reg = (chip8->current_op & 0x0F00) >> 8;
-    uint8_t kk = chip8->current_op & 0x00FF;
-    uint8_t random_num = rand() % 256;
+    uint8_t target_v_reg = chip8->op.x;
+    uint8_t kk = chip8->op.kk;
+    uint8_t random_num = chip8_rng_next(chip8) >> 24;
 
     chip8->V[target_v_reg] = random_num & kk;
     chip8->pc_reg += 2;
@@ -350,27 +344,70 @@ Sprites are XORed onto the existing screen. If this causes any pixels to be eras
 If the sprite is positioned so part of it is outside the coordinates of the display, it wraps around to the opposite side of the screen.
 */
 void drw(Chip8 *chip8) {
-    uint8_t target_v_reg_x = (chip8->current_op & 0x0F00) >> 8;
-    uint8_t target_v_reg_y = (chip8->current_op & 0x00F0) >> 4;
-    uint8_t sprite_height = chip8->current_op & 0x000F;
-    uint8_t x_location = chip8->V[target_v_reg_x];
-    uint8_t y_location = chip8->V[target_v_reg_y];
-    uint8_t pixel;
-
-    // Reset collision register to FALSE
-    chip8->V[0xF] = FALSE;
+    uint8_t target_v_reg_x = chip8->op.x;
+    uint8_t target_v_reg_y = chip8->op.y;
+    uint8_t sprite_height = chip8->op.n;
+    uint8_t x_location = chip8->V[target_v_reg_x] % SCREEN_WIDTH;
+    uint8_t y_location = chip8->V[target_v_reg_y] % SCREEN_HEIGHT;
+    uint8_t collision = FALSE;
+    uint64_t mask[SCREEN_ROW_WORDS];
+
+    // One shift and one XOR per sprite row, rows past the bottom wrap to the top
     for (int y_coordinate = 0; y_coordinate < sprite_height; y_coordinate++) {
-        pixel = chip8->ram[chip8->I_reg + y_coordinate];
-        for (int x_coordinate = 0; x_coordinate < 8; x_coordinate++) {
-            if ((pixel & (0x80 >> x_coordinate)) != 0) {
-                if (chip8->screen[y_location + y_coordinate][x_location + x_coordinate] == 1) {
-                    chip8->V[0xF] = TRUE;
-                }
-                chip8->screen[y_location + y_coordinate][x_location + x_coordinate] ^= 1;
+        uint8_t pixel = chip8_read_ram(chip8, chip8->I_reg + y_coordinate);
+        uint8_t row = (y_location + y_coordinate) % SCREEN_HEIGHT;
+        screen_sprite_mask(mask, (uint64_t)pixel << 56, 8, x_location, 1, FALSE);
+        collision |= screen_xor_row(chip8->screen[0][row], mask, 1);
+        screen_mark_dirty(chip8, row, mask, 1);
+    }
+
+    chip8->V[0xF] = collision;
+
+    chip8->draw_screen_flag = TRUE;
+    chip8->pc_reg += 2;
+}
+
+/*
+Dxyn / Dxy0 in every mode: draws the sprite at I on each selected plane, the
+data for the second plane following the first's. wide draws 16x16 from 32
+bytes, two per row. Pixels past the right or bottom edge are dropped if clip,
+wrapped around otherwise. VF = 1 if any pixel on any plane was turned off.
+
+drw is this with 64x32, one plane and no clipping, written out for speed.
+*/
+static inline void draw_sprite(Chip8* chip8, uint8_t sprite_height, const int wide, const int clip) {
+    int width = screen_width(chip8);
+    int height = screen_height(chip8);
+    int words = screen_words(chip8);
+    uint8_t x_location = chip8->V[chip8->op.x] & (width - 1);
+    uint8_t y_location = chip8->V[chip8->op.y] & (height - 1);
+    uint8_t row_bytes = wide ? 2 : 1;
+    uint16_t addr = chip8->I_reg;
+    uint8_t collision = FALSE;
+    uint8_t rows = sprite_height;
+    uint64_t mask[SCREEN_ROW_WORDS];
+
+    if (clip && rows > height - y_location) {
+        rows = height - y_location;
+    }
+    for (int p = 0; p < SCREEN_PLANES; p++) {
+        if (!(chip8->planes & (1 << p))) {
+            continue;
+        }
+        for (int y_coordinate = 0; y_coordinate < rows; y_coordinate++) {
+            uint64_t sprite = (uint64_t)chip8_read_ram(chip8, addr + y_coordinate * row_bytes) << 56;
+            if (wide) {
+                sprite |= (uint64_t)chip8_read_ram(chip8, addr + y_coordinate * 2 + 1) << 48;
             }
+            int row = (y_location + y_coordinate) & (height - 1);
+            screen_sprite_mask(mask, sprite, row_bytes * 8, x_location, words, clip);
+            collision |= screen_xor_row(chip8->screen[p][row], mask, words);
+            screen_mark_dirty(chip8, row, mask, words);
         }
+        addr += sprite_height * row_bytes;
     }
 
+    chip8->V[0xF] = collision;
     chip8->draw_screen_flag = TRUE;
     chip8->pc_reg += 2;
 }
@@ -380,12 +417,12 @@ Ex9E - SKP Vx
 Skip next instruction if key with the value of Vx is pressed.
 
 Checks the keyboard, and if the key corresponding to the value of Vx is currently in the down position, PC is increased by 2.
+Only the low nibble of Vx names the key, there are 16.
 */
 void skp_vx(Chip8* chip8) {
-    uint8_t targetVreg = (chip8->current_op & 0x0F00);
-    targetVreg = targetVreg >> 8; // Isolate X which is the register index
+    uint8_t targetVreg = chip8->op.x;
 
-    if(chip8->keyboard[chip8->V[targetVreg]] == TRUE) {
+    if(chip8->keyboard[chip8->V[targetVreg] & 0xF] == TRUE) {
         chip8->pc_reg += 4; //skips 2 instructions
     } else {
         chip8->pc_reg += 2;
@@ -396,12 +433,12 @@ ExA1 - SKNP Vx
 Skip next instruction if key with the value of Vx is not pressed.
 
 Checks the keyboard, and if the key corresponding to the value of Vx is currently in the up position, PC is increased by 2.
+Only the low nibble of Vx names the key, as in skp_vx.
 */
 void sknp_vx(Chip8* chip8) {
-    uint8_t targetVreg = (chip8->current_op & 0x0F00);
-    targetVreg = targetVreg >> 8; // Isolate X which is the register index
+    uint8_t targetVreg = chip8->op.x;
 
-    if(chip8->keyboard[chip8->V[targetVreg]] == FALSE) {
+    if(chip8->keyboard[chip8->V[targetVreg] & 0xF] == FALSE) {
         chip8->pc_reg += 4; //skips 2 instructions
     } else {
         chip8->pc_reg += 2;
@@ -414,8 +451,7 @@ Set Vx = delay timer value.
 The value of DT is placed into Vx.
 */
 void ld_vx_dt(Chip8* chip8) {
-    uint8_t targetVreg = (chip8->current_op & 0x0F00);
-    targetVreg = targetVreg >> 8; // Isolate X which is the register index
+    uint8_t targetVreg = chip8->op.x;
 
     chip8->V[targetVreg] = chip8->delay_timer;
     chip8->pc_reg += 2;
@@ -426,7 +462,7 @@ void ld_vx_dt(Chip8* chip8) {
 * V[X] set to value of key (K) pressed
 */
 void ld_Vx_k(Chip8 *chip8) {
-    uint8_t target_v_reg = (chip8->current_op & 0x0F00) >> 8;
+    uint8_t target_v_reg = chip8->op.x;
 
     chip8->was_key_pressed = FALSE;
 
@@ -451,8 +487,7 @@ Set delay timer = Vx.
 DT is set equal to the value of Vx.
 */
 void ld_dt_vx(Chip8* chip8) {
-    uint8_t targetVreg = (chip8->current_op & 0x0F00);
-    targetVreg = targetVreg >> 8; // Isolate X which is the register index
+    uint8_t targetVreg = chip8->op.x;
 
     chip8->delay_timer = chip8->V[targetVreg];
     chip8->pc_reg += 2;
@@ -465,8 +500,7 @@ Set sound timer = Vx.
 ST is set equal to the value of Vx.
 */
 void ld_st_vx(Chip8* chip8) {
-    uint8_t targetVreg = (chip8->current_op & 0x0F00);
-    targetVreg = targetVreg >> 8; // Isolate X which is the register index
+    uint8_t targetVreg = chip8->op.x;
 
     chip8->sound_timer = chip8->V[targetVreg];
     chip8->pc_reg += 2;
@@ -478,8 +512,7 @@ Set I = I + Vx.
 The values of I and Vx are added, and the results are stored in I.
 */
 void add_i_vx(Chip8* chip8) {
-    uint8_t targetVreg = (chip8->current_op & 0x0F00);
-    targetVreg = targetVreg >> 8; // Isolate X which is the register index
+    uint8_t targetVreg = chip8->op.x;
 
     chip8->I_reg += chip8->V[targetVreg];
     chip8->pc_reg += 2;
@@ -491,7 +524,7 @@ Set I = location of sprite for digit Vx.
 The value of I is set to the location for the hexadecimal sprite corresponding to the value of Vx.
 */
 void ld_F_Vx(Chip8 *chip8) {
-    uint8_t target_v_reg = (chip8->current_op & 0x0F00) >> 8;
+    uint8_t target_v_reg = chip8->op.x;
 
     chip8->I_reg = (chip8->V[target_v_reg] * 0x5);
     chip8->pc_reg += 2;
@@ -503,11 +536,11 @@ Store BCD representation of Vx in memory locations I, I+1, and I+2.
 The interpreter takes the decimal value of Vx, and places the hundreds digit in memory at location in I, the tens digit at location I+1, and the ones digit at location I+2.
 */
 void st_bcd_Vx(Chip8 *chip8) {
-    uint8_t target_v_reg = (chip8->current_op & 0x0F00) >> 8;
+    uint8_t target_v_reg = chip8->op.x;
 
-    chip8->ram[chip8->I_reg] = chip8->V[target_v_reg] / 100;                 // MSb
-    chip8->ram[chip8->I_reg + 1] = (chip8->V[target_v_reg] / 10) % 10;
-    chip8->ram[chip8->I_reg + 2] = (chip8->V[target_v_reg] % 100) % 10;      // LSb
+    chip8_write_ram(chip8, chip8->I_reg, chip8->V[target_v_reg] / 100);                 // MSb
+    chip8_write_ram(chip8, chip8->I_reg + 1, (chip8->V[target_v_reg] / 10) % 10);
+    chip8_write_ram(chip8, chip8->I_reg + 2, (chip8->V[target_v_reg] % 100) % 10);      // LSb
     chip8->pc_reg += 2;
 }
 /*
@@ -517,13 +550,13 @@ Store registers V0 through Vx in memory starting at location I.
 The interpreter copies the values of registers V0 through Vx into memory, starting at the address in I.
 */
 void st_V_regs(Chip8 *chip8) {
-    uint8_t end_ld_v_reg = (chip8->current_op & 0x0F00) >> 8;
+    uint8_t end_ld_v_reg = chip8->op.x;
 
     for (int i = 0; i <= end_ld_v_reg; i++) {
-        chip8->ram[chip8->I_reg + i] = chip8->V[i];
+        chip8_write_ram(chip8, chip8->I_reg + i, chip8->V[i]);
     }
 
-    // TODO: Does I_reg need to change?
+    // I ends up past the last register like on the COSMAC VIP, quirks.h has the alternatives
     chip8->I_reg += (end_ld_v_reg + 1);
 
     chip8->pc_reg += 2;
@@ -533,15 +566,183 @@ void st_V_regs(Chip8 *chip8) {
 * Read values into V[0] - V[X] from memory starting at I_reg value
 */
 void ld_V_regs(Chip8 *chip8) {
-    uint8_t end_ld_v_reg = (chip8->current_op & 0x0F00) >> 8;
+    uint8_t end_ld_v_reg = chip8->op.x;
 
     for (int i = 0; i <= end_ld_v_reg; i++) {
-        chip8->V[i] = chip8->ram[chip8->I_reg + i];
+        chip8->V[i] = chip8_read_ram(chip8, chip8->I_reg + i);
     }
 
-    // TODO: Does I_reg need to change?
+    // I ends up past the last register like on the COSMAC VIP, quirks.h has the alternatives
     chip8->I_reg += (end_ld_v_reg + 1);
 
     chip8->pc_reg += 2;
 }
 // DONE WITH CODING THE INSTRUCTIONS NOT SURE IF THEY ARE CODED CORRECTLY
+
+// SCHIP additions. Which machines have them is up to the quirk profile (quirks.h).
+
+/*
+00Cn - SCD n
+Scroll the display down n pixels of the current mode.
+*/
+void scd(Chip8* chip8) {
+    screen_scroll_down(chip8, chip8->planes, chip8->op.n);
+    chip8->draw_screen_flag = TRUE;
+    chip8->pc_reg += 2;
+}
+/*
+00FB - SCR
+Scroll the display right 4 pixels of the current mode.
+*/
+void scr(Chip8* chip8) {
+    screen_scroll_right(chip8, chip8->planes, 4);
+    chip8->draw_screen_flag = TRUE;
+    chip8->pc_reg += 2;
+}
+/*
+00FC - SCL
+Scroll the display left 4 pixels of the current mode.
+*/
+void scl(Chip8* chip8) {
+    screen_scroll_left(chip8, chip8->planes, 4);
+    chip8->draw_screen_flag = TRUE;
+    chip8->pc_reg += 2;
+}
+/*
+00FD - EXIT
+Stop the interpreter.
+*/
+void exit_interpreter(Chip8* chip8) {
+    chip8->is_running_flag = FALSE;
+}
+/*
+00FE - LOW / 00FF - HIGH
+Switch to the 64x32 / 128x64 mode. The display is cleared, what was on it
+wouldn't line up with the new mode anyway.
+*/
+static inline void set_hires(Chip8* chip8, uint8_t hires) {
+    chip8->hires = hires;
+    screen_clear(chip8);
+    chip8->draw_screen_flag = TRUE;
+    chip8->pc_reg += 2;
+}
+
+void low(Chip8* chip8) {
+    set_hires(chip8, FALSE);
+}
+
+void high(Chip8* chip8) {
+    set_hires(chip8, TRUE);
+}
+/*
+Dxy0 - DRW Vx, Vy, 0
+Draw a 16x16 sprite, two bytes per row, starting at I.
+*/
+void drw_16(Chip8* chip8) {
+    draw_sprite(chip8, 16, TRUE, FALSE);
+}
+/*
+Fx30 - LD HF, Vx
+Set I = location of the 8x10 sprite for digit Vx.
+*/
+void ld_HF_Vx(Chip8* chip8) {
+    chip8->I_reg = BIG_FONT_ADDR + (chip8->V[chip8->op.x] & 0xF) * 10;
+    chip8->pc_reg += 2;
+}
+/*
+Fx75 - LD R, Vx
+Store V0 through Vx in the flag registers.
+*/
+void st_R_Vx(Chip8* chip8) {
+    memcpy(chip8->rpl, chip8->V, chip8->op.x + 1);
+    chip8->pc_reg += 2;
+}
+/*
+Fx85 - LD Vx, R
+Read V0 through Vx from the flag registers.
+*/
+void ld_Vx_R(Chip8* chip8) {
+    memcpy(chip8->V, chip8->rpl, chip8->op.x + 1);
+    chip8->pc_reg += 2;
+}
+
+// XO-CHIP additions
+
+/*
+00Dn - SCU n
+Scroll the display up n pixels of the current mode.
+*/
+void scu(Chip8* chip8) {
+    screen_scroll_up(chip8, chip8->planes, chip8->op.n);
+    chip8->draw_screen_flag = TRUE;
+    chip8->pc_reg += 2;
+}
+/*
+5xy2 - SAVE Vx - Vy
+Store Vx through Vy (in that order, x may be above y) at I. I is unchanged.
+*/
+void st_V_range(Chip8* chip8) {
+    int step = (chip8->op.x <= chip8->op.y) ? 1 : -1;
+    int count = abs(chip8->op.y - chip8->op.x) + 1;
+
+    for (int i = 0; i < count; i++) {
+        chip8_write_ram(chip8, chip8->I_reg + i, chip8->V[chip8->op.x + i * step]);
+    }
+    chip8->pc_reg += 2;
+}
+/*
+5xy3 - LOAD Vx - Vy
+Read Vx through Vy from I, see st_V_range.
+*/
+void ld_V_range(Chip8* chip8) {
+    int step = (chip8->op.x <= chip8->op.y) ? 1 : -1;
+    int count = abs(chip8->op.y - chip8->op.x) + 1;
+
+    for (int i = 0; i < count; i++) {
+        chip8->V[chip8->op.x + i * step] = chip8_read_ram(chip8, chip8->I_reg + i);
+    }
+    chip8->pc_reg += 2;
+}
+/*
+F000 nnnn - LD I, long addr
+Set I = the 16-bit word following the opcode, the only 4-byte instruction.
+*/
+void ld_i_long(Chip8* chip8) {
+    chip8->I_reg = (chip8_read_ram(chip8, chip8->pc_reg + 2) << 8) | chip8_read_ram(chip8, chip8->pc_reg + 3);
+    chip8->pc_reg += 4;
+}
+/*
+Fn01 - PLANE n
+Select the planes drawing, clearing and scrolling act on (bit p: plane p).
+*/
+void plane(Chip8* chip8) {
+    chip8->planes = chip8->op.x & ((1 << SCREEN_PLANES) - 1);
+    chip8->pc_reg += 2;
+}
+/*
+F002 - AUDIO
+Load the 16-byte audio pattern at I into the pattern buffer.
+*/
+void audio(Chip8* chip8) {
+    for (int i = 0; i < AUDIO_PATTERN_SIZE; i++) {
+        chip8->audio_pattern[i] = chip8_read_ram(chip8, chip8->I_reg + i);
+    }
+    chip8->pc_reg += 2;
+}
+/*
+Fx3A - PITCH Vx
+Set the audio pattern's playback rate.
+*/
+void pitch_Vx(Chip8* chip8) {
+    chip8->audio_pitch = chip8->V[chip8->op.x];
+    chip8->pc_reg += 2;
+}
+
+typedef void (*Chip8_Handler)(Chip8* chip8);
+
+// handler for every Chip8_OpId, see CHIP8_OPCODES in decode.h
+#define CHIP8_OP_HANDLER(id, handler, name) [id] = handler,
+static const Chip8_Handler OP_HANDLERS[OP_COUNT] = { CHIP8_OPCODES(CHIP8_OP_HANDLER) };
+#undef CHIP8_OP_HANDLER
+
+#endif
@@ -0,0 +1,298 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chip8_def.h"
+#include "decode.h"
+#include "memory.h"
+#include "instructions.h"
+#include "quirks.h"
+#include "idle.h"
+#include "profile.h"
+#include "trace.h"
+
+/*
+Basic-block compiler. Straight-line runs of instructions are compiled once into
+threaded code: an array of handler pointers with their operands already decoded,
+so running a block is just a loop of indirect calls with no fetch, decode or
+cache lookup. A block ends at the first instruction that can change pc other than
+by +2 (jumps, calls, skips), at drw (so frontends see every draw), at stores
+(so a block never runs past code it just modified) or at JIT_MAX_BLOCK_LEN.
+
+Blocks are compiled the first time pc reaches them, or all at once at load
+time from static analysis (chip8_jit_prewarm, analyze.h). Compiled blocks stay
+valid until a ram write lands on a byte one of them covers.
+*/
+#define JIT_MAX_BLOCK_LEN 64
+#define JIT_MAX_BLOCKS 1024
+#define JIT_MAX_OPS (JIT_MAX_BLOCKS * 16)
+
+typedef struct {
+    Chip8_Handler handler;
+    Chip8_Instr instr;
+} Chip8_ThreadedOp;
+
+typedef struct {
+    uint16_t start;                  // address of the first instruction
+    uint16_t end;                    // one past the last byte of the last instruction
+    uint16_t count;                  // number of instructions
+    uint8_t is_live;                 // cleared when a write invalidates the block
+    uint32_t first_op;               // index of the first instruction in ops[]
+} Chip8_Block;
+
+struct Chip8_Jit_t {
+    uint16_t* block_at;              // block index + 1 of the live block starting at each address, 0 = none
+    uint8_t* code_map;               // bit per ram byte covered by a live block
+    uint32_t ram_size;               // addresses block_at and code_map cover, the machine's ram size
+    Chip8_Block blocks[JIT_MAX_BLOCKS];
+    Chip8_ThreadedOp ops[JIT_MAX_OPS];
+    uint32_t block_count;
+    uint32_t op_count;
+
+    // statistics
+    uint64_t blocks_compiled;
+    uint64_t invalidations;
+    uint64_t flushes;
+};
+
+/*
+True for instructions that must end a block, see the comment at the top
+*/
+uint8_t jit_ends_block(uint8_t id) {
+    switch (id) {
+        case OP_INVALID:
+        case OP_RET:
+        case OP_JP_ADDR:
+        case OP_CALL_ADDR:
+        case OP_SE_VX_BYTE:
+        case OP_SNE_VX_BYTE:
+        case OP_SE_VX_VY:
+        case OP_SNE_VX_VY:
+        case OP_JP_V0_ADDR:
+        case OP_DRW:
+        case OP_SKP_VX:
+        case OP_SKNP_VX:
+        case OP_LD_VX_K:
+        case OP_ST_BCD_VX:
+        case OP_ST_V_REGS:
+        case OP_EXIT:
+        case OP_DRW_16:
+        case OP_ST_V_RANGE:
+        case OP_LD_I_LONG:
+            return TRUE;
+        default:
+            return FALSE;
+    }
+}
+
+void jit_mark_range(Chip8_Jit* jit, uint16_t start, uint16_t end) {
+    for (uint32_t addr = start; addr < end; addr++) {
+        jit->code_map[addr >> 3] |= 1 << (addr & 7);
+    }
+}
+
+/*
+Gives jit empty block_at and code_map tables for ram_size bytes of ram, in one
+allocation. Returns FALSE, keeping the old ones, if out of memory.
+*/
+static int jit_alloc_tables(Chip8_Jit* jit, uint32_t ram_size) {
+    uint16_t* tables = calloc(1, ram_size * sizeof(uint16_t) + ram_size / 8);
+    if (tables == NULL) {
+        return FALSE;
+    }
+    free(jit->block_at);
+    jit->block_at = tables;
+    jit->code_map = (uint8_t*)(tables + ram_size);
+    jit->ram_size = ram_size;
+    return TRUE;
+}
+
+/*
+Drops every compiled block. If chip8's machine changed since (a snapshot of
+another one was loaded), the tables are resized to its ram.
+*/
+void chip8_jit_flush(Chip8* chip8) {
+    Chip8_Jit* jit = chip8->jit;
+
+    if (jit->ram_size != (uint32_t)chip8->ram_mask + 1) {
+        if (!jit_alloc_tables(jit, (uint32_t)chip8->ram_mask + 1)) {
+            fprintf(stderr, "out of memory resizing the block compiler\n");
+            abort();
+        }
+        chip8->code_map = jit->code_map;
+    } else {
+        memset(jit->block_at, 0, jit->ram_size * sizeof(uint16_t));
+        memset(jit->code_map, 0, jit->ram_size / 8);
+    }
+    jit->block_count = 0;
+    jit->op_count = 0;
+    jit->flushes++;
+}
+
+/*
+code_write_hook: a store hit compiled code. Kills every block covering addr and
+rebuilds the code map from the blocks that survive. Their ops stay in the arena
+until the next flush.
+*/
+void chip8_jit_invalidate(Chip8* chip8, uint16_t addr) {
+    Chip8_Jit* jit = chip8->jit;
+
+    for (uint32_t i = 0; i < jit->block_count; i++) {
+        Chip8_Block* block = &jit->blocks[i];
+        if (block->is_live && addr >= block->start && addr < block->end) {
+            block->is_live = FALSE;
+            jit->block_at[block->start] = 0;
+            jit->invalidations++;
+        }
+    }
+
+    memset(jit->code_map, 0, jit->ram_size / 8);
+    for (uint32_t i = 0; i < jit->block_count; i++) {
+        if (jit->blocks[i].is_live) {
+            jit_mark_range(jit, jit->blocks[i].start, jit->blocks[i].end);
+        }
+    }
+}
+
+/*
+Compiles the block starting at pc and returns it
+*/
+Chip8_Block* jit_compile(Chip8* chip8, uint16_t pc) {
+    Chip8_Jit* jit = chip8->jit;
+
+    if (jit->block_count == JIT_MAX_BLOCKS || jit->op_count + JIT_MAX_BLOCK_LEN > JIT_MAX_OPS) {
+        chip8_jit_flush(chip8);
+    }
+
+    Chip8_Block* block = &jit->blocks[jit->block_count];
+    block->start = pc;
+    block->first_op = jit->op_count;
+    block->count = 0;
+    block->is_live = TRUE;
+
+    uint32_t addr = pc;
+    while (block->count < JIT_MAX_BLOCK_LEN && addr + 1 <= chip8->ram_mask) {
+        Chip8_Instr instr = chip8_instr_at(chip8, addr);
+        Chip8_ThreadedOp* op = &jit->ops[jit->op_count++];
+        op->handler = QUIRK_HANDLERS[chip8->quirks][instr.id];
+        op->instr = instr;
+        block->count++;
+        addr += 2;
+        // an instruction the machine doesn't have runs as op_invalid (quirks.h)
+        if (jit_ends_block(instr.id) || op->handler == op_invalid) {
+            break;
+        }
+    }
+    block->end = addr;
+
+    // a block that ran into the end of ram would fetch across the wrap, leave it to the interpreter
+    if (block->count == 0) {
+        return NULL;
+    }
+
+    jit->block_count++;
+    jit->block_at[pc] = jit->block_count;
+    jit_mark_range(jit, block->start, block->end);
+    jit->blocks_compiled++;
+    return block;
+}
+
+/*
+Runs up to n instructions through compiled blocks. A block only runs if it fits in
+the remaining budget, otherwise the tail is single-stepped so n is exact.
+*/
+uint64_t chip8_jit_run_cycles(Chip8* chip8, uint64_t n) {
+    Chip8_Jit* jit = chip8->jit;
+    uint64_t executed = 0;
+
+    while (executed < n && chip8->is_running_flag) {
+        uint16_t pc = chip8->pc_reg & chip8->ram_mask;
+        Chip8_Block* block = NULL;
+
+        if (jit->block_at[pc] != 0) {
+            block = &jit->blocks[jit->block_at[pc] - 1];
+        } else {
+            block = jit_compile(chip8, pc);
+        }
+
+        // idle loops start at jump targets, which are block starts
+        Chip8_Instr first = block ? jit->ops[block->first_op].instr : chip8_instr_at(chip8, pc);
+        if (CHIP8_MAY_IDLE(first.id)) {
+            uint64_t idle = chip8_idle_skip(chip8, first, n - executed - 1);
+            executed += idle;
+            chip8->idle_cycles += idle;
+            CHIP8_TRACE_IDLE(chip8, idle);
+        }
+
+        if (block == NULL || block->count > n - executed) {
+            chip8->op = chip8_instr_at(chip8, pc);
+            chip8->current_op = chip8->op.opcode;
+            CHIP8_PROFILE_OP(chip8, chip8->op);
+            CHIP8_TRACE_OP(chip8, chip8->op);
+            QUIRK_HANDLERS[chip8->quirks][chip8->op.id](chip8);
+            executed++;
+            continue;
+        }
+
+        const Chip8_ThreadedOp* op = &jit->ops[block->first_op];
+        const Chip8_ThreadedOp* last = op + block->count;
+        CHIP8_TRACE_BLOCK(chip8, pc, block->count);
+        for (; op != last; op++) {
+            chip8->op = op->instr;
+            CHIP8_PROFILE_OP(chip8, op->instr);
+            op->handler(chip8);
+        }
+        chip8->current_op = chip8->op.opcode;
+        executed += block->count;
+    }
+
+    CHIP8_PROFILE_PAUSE(chip8);
+    CHIP8_TRACE_PAUSE(chip8);
+    chip8->cycle_count += executed;
+    return executed;
+}
+
+/*
+Switches chip8 to the block compiler. Returns FALSE if the state can't be allocated
+or chip8 runs ahead-of-time compiled code (aot.h).
+*/
+int chip8_jit_enable(Chip8* chip8) {
+    if (chip8->jit != NULL) {
+        return TRUE;
+    }
+    if (chip8->aot != NULL) {
+        return FALSE;                // ahead-of-time code owns code_map
+    }
+
+    // the tables cover this machine's ram only, 4k on most
+    chip8->jit = calloc(1, sizeof(Chip8_Jit));
+    if (chip8->jit == NULL) {
+        return FALSE;
+    }
+    if (!jit_alloc_tables(chip8->jit, (uint32_t)chip8->ram_mask + 1)) {
+        free(chip8->jit);
+        chip8->jit = NULL;
+        return FALSE;
+    }
+    chip8->code_map = chip8->jit->code_map;
+    chip8->code_write_hook = chip8_jit_invalidate;
+    return TRUE;
+}
+
+/*
+Back to the plain interpreter, frees the compiled blocks
+*/
+void chip8_jit_disable(Chip8* chip8) {
+    if (chip8->jit != NULL) {
+        free(chip8->jit->block_at);
+    }
+    free(chip8->jit);
+    chip8->jit = NULL;
+    chip8->code_map = NULL;
+    chip8->code_write_hook = NULL;
+}
+
+#endif
@@ -0,0 +1,394 @@
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+#include <stdint.h>
+#include <string.h>
+#include "chip8_def.h"
+#include "decode.h"
+#include "memory.h"
+#include "instructions.h"
+#include "quirks.h"
+
+/*
+Lockstep engine: runs K instances of the same rom (different seeds / inputs) as
+lanes of one machine. The registers every instruction touches are kept as
+structure of arrays (all the V0s together, all the pcs together, ...) so lanes
+sitting on the same instruction execute it as one loop over the lanes, which the
+compiler turns into SIMD with the lane mask as a blend.
+
+Each cycle the lanes are split into groups sharing pc and opcode. Register-only
+instructions run once for the whole group, everything else (drw, stores, calls,
+keys, rnd, ...) drops back to the normal handlers in instructions.h, one lane at
+a time, on that lane's own Chip8. Diverged lanes just form smaller groups.
+
+ram, stack, screen and keyboard always live in the per-lane Chip8 (lanes[k]).
+Every lane runs lanes[0]'s quirk profile. The lane loops implement the default
+one, under any other the instructions it changes (quirks.h) go scalar.
+*/
+#define LOCKSTEP_MAX_LANES 64
+
+typedef struct {
+    int num_lanes;
+    Chip8* lanes;                                    // per-lane state for everything not below
+
+    uint8_t V[NUM_V_REGISTERS][LOCKSTEP_MAX_LANES];
+    uint16_t pc_reg[LOCKSTEP_MAX_LANES];
+    uint16_t I_reg[LOCKSTEP_MAX_LANES];
+    uint8_t delay_timer[LOCKSTEP_MAX_LANES];
+    uint8_t sound_timer[LOCKSTEP_MAX_LANES];
+    uint8_t is_running[LOCKSTEP_MAX_LANES];          // 0xFF while the lane runs, 0 once it halted
+    uint64_t cycles[LOCKSTEP_MAX_LANES];             // instructions executed per lane
+    uint8_t same_ram;                                // TRUE while every running lane has the same ram
+    uint8_t quirks;                                  // quirk profile of the lanes (quirks.h)
+
+    // statistics
+    uint64_t vector_groups;                          // groups executed with a lane loop
+    uint64_t scalar_lanes;                           // lane-instructions run through the handlers
+} Chip8_Lockstep;
+
+/*
+Copies the registers of lane k from the SoA arrays into its Chip8
+*/
+void lockstep_store_lane(Chip8_Lockstep* ls, int k) {
+    Chip8* chip8 = &ls->lanes[k];
+    for (int r = 0; r < NUM_V_REGISTERS; r++) {
+        chip8->V[r] = ls->V[r][k];
+    }
+    chip8->pc_reg = ls->pc_reg[k];
+    chip8->I_reg = ls->I_reg[k];
+    chip8->delay_timer = ls->delay_timer[k];
+    chip8->sound_timer = ls->sound_timer[k];
+    chip8->is_running_flag = ls->is_running[k] ? TRUE : FALSE;
+    chip8->cycle_count = ls->cycles[k];
+}
+
+/*
+Copies the registers of lane k from its Chip8 into the SoA arrays
+*/
+void lockstep_load_lane(Chip8_Lockstep* ls, int k) {
+    Chip8* chip8 = &ls->lanes[k];
+    for (int r = 0; r < NUM_V_REGISTERS; r++) {
+        ls->V[r][k] = chip8->V[r];
+    }
+    ls->pc_reg[k] = chip8->pc_reg;
+    ls->I_reg[k] = chip8->I_reg;
+    ls->delay_timer[k] = chip8->delay_timer;
+    ls->sound_timer[k] = chip8->sound_timer;
+    ls->is_running[k] = chip8->is_running_flag ? 0xFF : 0;
+    ls->cycles[k] = chip8->cycle_count;
+}
+
+/*
+Sets up the engine over num_lanes already initialized instances (rom loaded)
+*/
+void chip8_lockstep_init(Chip8_Lockstep* ls, Chip8* lanes, int num_lanes) {
+    memset(ls, 0, sizeof(*ls));
+    ls->num_lanes = num_lanes;
+    ls->lanes = lanes;
+    ls->quirks = lanes[0].quirks;
+    for (int k = 0; k < num_lanes; k++) {
+        lockstep_load_lane(ls, k);
+    }
+
+    ls->same_ram = TRUE;
+    for (int k = 1; k < num_lanes && ls->same_ram; k++) {
+        for (int p = 0; p < RAM_PAGE_COUNT && ls->same_ram; p++) {
+            // forked lanes share pages, only pages of their own need comparing
+            ls->same_ram = lanes[k].ram[p] == lanes[0].ram[p] ||
+                           memcmp(lanes[k].ram[p]->bytes, lanes[0].ram[p]->bytes, RAM_PAGE_SIZE) == 0;
+        }
+    }
+}
+
+/*
+Writes the SoA registers back into every lane's Chip8, call before reading lanes[]
+*/
+void chip8_lockstep_sync(Chip8_Lockstep* ls) {
+    for (int k = 0; k < ls->num_lanes; k++) {
+        lockstep_store_lane(ls, k);
+    }
+}
+
+/*
+Stops lane k, it takes no part in later cycles
+*/
+void chip8_lockstep_halt_lane(Chip8_Lockstep* ls, int k) {
+    ls->is_running[k] = 0;
+    ls->lanes[k].is_running_flag = FALSE;
+}
+
+/*
+Runs one instruction on lane k through the regular handler
+*/
+void lockstep_scalar(Chip8_Lockstep* ls, int k, Chip8_Instr instr) {
+    Chip8* chip8 = &ls->lanes[k];
+    lockstep_store_lane(ls, k);
+    chip8->op = instr;
+    chip8->current_op = instr.opcode;
+    QUIRK_HANDLERS[ls->quirks][instr.id](chip8);
+    chip8->cycle_count++;
+    lockstep_load_lane(ls, k);
+}
+
+// Lane loops. m[k] is 0xFF for lanes in the group and 0 otherwise (always 0 past
+// num_lanes). Every loop is branch-free and runs over all LOCKSTEP_MAX_LANES so
+// the trip count is a constant and it vectorizes even at -O2.
+// Lane k only ever touches index k of each array, so the loops carry no
+// dependencies even when vx, vy and vf are the same register.
+#if defined(__clang__)
+#define LANES_NO_ALIAS _Pragma("clang loop vectorize(assume_safety)")
+#elif defined(__GNUC__)
+#define LANES_NO_ALIAS _Pragma("GCC ivdep")
+#else
+#define LANES_NO_ALIAS
+#endif
+#define LANES LANES_NO_ALIAS for (int k = 0; k < LOCKSTEP_MAX_LANES; k++)
+#define BLEND(dst, value) dst = (uint8_t)((m[k] & (value)) | (~m[k] & (dst)))
+
+/*
+Runs instr on all lanes in mask m as one group. Returns FALSE if the instruction
+has no lane loop and has to go through lockstep_scalar.
+*/
+uint8_t lockstep_vector(Chip8_Lockstep* ls, Chip8_Instr instr, const uint8_t* m) {
+    uint8_t* vx = ls->V[instr.x];
+    uint8_t* vy = ls->V[instr.y];
+    uint8_t* vf = ls->V[0xF];
+    uint8_t kk = instr.kk;
+
+    if (chip8_quirk_op(ls->quirks, instr.id)) {
+        return FALSE;
+    }
+    switch (instr.id) {
+        case OP_JP_ADDR:
+            LANES { ls->pc_reg[k] = (m[k] & 1) ? instr.nnn : ls->pc_reg[k]; }
+            return TRUE;
+        case OP_SE_VX_BYTE:
+            LANES { ls->pc_reg[k] += m[k] & ((vx[k] == kk) ? 4 : 2); }
+            return TRUE;
+        case OP_SNE_VX_BYTE:
+            LANES { ls->pc_reg[k] += m[k] & ((vx[k] != kk) ? 4 : 2); }
+            return TRUE;
+        case OP_SE_VX_VY:
+            LANES { ls->pc_reg[k] += m[k] & ((vx[k] == vy[k]) ? 4 : 2); }
+            return TRUE;
+        case OP_SNE_VX_VY:
+            LANES { ls->pc_reg[k] += m[k] & ((vx[k] != vy[k]) ? 4 : 2); }
+            return TRUE;
+        case OP_LD_VX_BYTE:
+            LANES { BLEND(vx[k], kk); }
+            break;
+        case OP_ADD_VX:
+            LANES { BLEND(vx[k], vx[k] + kk); }
+            break;
+        case OP_LD_VX_VY:
+            LANES { BLEND(vx[k], vy[k]); }
+            break;
+        case OP_OR_VX_VY:
+            LANES { BLEND(vx[k], vx[k] | vy[k]); }
+            break;
+        case OP_AND_VX_VY:
+            LANES { BLEND(vx[k], vx[k] & vy[k]); }
+            break;
+        case OP_XOR_VX_VY:
+            LANES { BLEND(vx[k], vx[k] ^ vy[k]); }
+            break;
+        // VF is written before Vx, in the same order as the handlers, so x or y being F
+        // gives the same result
+        case OP_ADD_VX_VY:
+            LANES {
+                uint16_t sum = vx[k] + vy[k];
+                BLEND(vf[k], sum > 255);
+                BLEND(vx[k], sum);
+            }
+            break;
+        case OP_SUB_VX_VY:
+            LANES {
+                uint8_t flag = vx[k] > vy[k];
+                BLEND(vf[k], flag);
+                BLEND(vx[k], vx[k] - vy[k]);
+            }
+            break;
+        case OP_SUBN_VX_VY:
+            LANES {
+                uint8_t flag = vy[k] > vx[k];
+                BLEND(vf[k], flag);
+                BLEND(vx[k], vy[k] - vx[k]);
+            }
+            break;
+        case OP_SHR_VX_VY:
+            LANES {
+                uint8_t flag = vx[k] & 0x1;
+                BLEND(vf[k], flag);
+                BLEND(vx[k], vx[k] >> 1);
+            }
+            break;
+        case OP_SHL_VX_VY:
+            LANES {
+                uint8_t flag = vx[k] >> 7;
+                BLEND(vf[k], flag);
+                BLEND(vx[k], vx[k] << 1);
+            }
+            break;
+        case OP_LD_I_ADDR:
+            LANES { ls->I_reg[k] = (m[k] & 1) ? instr.nnn : ls->I_reg[k]; }
+            break;
+        case OP_ADD_I_VX:
+            LANES { ls->I_reg[k] += (m[k] & 1) ? vx[k] : 0; }
+            break;
+        case OP_LD_F_VX:
+            LANES { ls->I_reg[k] = (m[k] & 1) ? vx[k] * 0x5 : ls->I_reg[k]; }
+            break;
+        case OP_LD_VX_DT:
+            LANES { BLEND(vx[k], ls->delay_timer[k]); }
+            break;
+        case OP_LD_DT_VX:
+            LANES { BLEND(ls->delay_timer[k], vx[k]); }
+            break;
+        case OP_LD_ST_VX:
+            LANES { BLEND(ls->sound_timer[k], vx[k]); }
+            break;
+        default:
+            return FALSE;
+    }
+
+    LANES { ls->pc_reg[k] += m[k] & 2; }
+    return TRUE;
+}
+
+/*
+chip8_tick_timers on every running lane
+*/
+void chip8_lockstep_tick_timers(Chip8_Lockstep* ls) {
+    LANES { ls->delay_timer[k] -= (ls->delay_timer[k] != 0) & ls->is_running[k]; }
+    LANES { ls->sound_timer[k] -= (ls->sound_timer[k] != 0) & ls->is_running[k]; }
+}
+
+#undef LANES
+#undef LANES_NO_ALIAS
+#undef BLEND
+
+/*
+Instructions that store into ram. Running them on a group can leave the lanes
+with different ram, see same_ram.
+*/
+uint8_t lockstep_writes_ram(uint8_t id) {
+    return id == OP_ST_BCD_VX || id == OP_ST_V_REGS || id == OP_ST_V_RANGE;
+}
+
+/*
+After a store ran on the lanes in mask: ram stays identical across the running
+lanes only if every one of them stored the same bytes at the same address
+*/
+void lockstep_check_store(Chip8_Lockstep* ls, Chip8_Instr instr, const uint8_t* mask, uint16_t addr, uint8_t same_addr) {
+    uint16_t len = (instr.id == OP_ST_BCD_VX) ? 3 : instr.x + 1;
+    if (instr.id == OP_ST_V_RANGE) {
+        len = abs(instr.y - instr.x) + 1;
+    }
+    int first = -1;
+
+    for (int k = 0; k < ls->num_lanes && ls->same_ram; k++) {
+        if (ls->is_running[k] && !mask[k]) {
+            ls->same_ram = FALSE;
+        }
+        if (!mask[k]) {
+            continue;
+        }
+        if (first < 0) {
+            first = k;
+            continue;
+        }
+        for (uint16_t i = 0; i < len; i++) {
+            uint16_t a = (addr + i) & ls->lanes[k].ram_mask;
+            if (chip8_read_ram(&ls->lanes[k], a) != chip8_read_ram(&ls->lanes[first], a)) {
+                ls->same_ram = FALSE;
+            }
+        }
+    }
+    if (!same_addr) {
+        ls->same_ram = FALSE;
+    }
+}
+
+/*
+Runs n cycles, each running lane executes one instruction per cycle.
+*/
+void chip8_lockstep_run_cycles(Chip8_Lockstep* ls, uint64_t n) {
+    uint8_t pending[LOCKSTEP_MAX_LANES];
+    uint8_t mask[LOCKSTEP_MAX_LANES] = {0};
+    Chip8_Instr instrs[LOCKSTEP_MAX_LANES];
+
+    for (uint64_t cycle = 0; cycle < n; cycle++) {
+        int leader = 0;
+        while (leader < ls->num_lanes && !ls->is_running[leader]) {
+            leader++;
+        }
+        if (leader == ls->num_lanes) {
+            return;
+        }
+
+        // fast path: every running lane is on the same instruction. With identical
+        // ram that is just a pc compare, otherwise each lane's opcode is checked too
+        uint16_t pc = ls->pc_reg[leader];
+        Chip8_Instr instr = chip8_instr_at(&ls->lanes[leader], pc);
+        uint8_t diverged = 0;
+        for (int k = 0; k < LOCKSTEP_MAX_LANES; k++) {
+            diverged |= ls->is_running[k] & (ls->pc_reg[k] != pc);
+        }
+        for (int k = leader + 1; k < ls->num_lanes && !diverged && !ls->same_ram; k++) {
+            diverged = ls->is_running[k] && chip8_instr_at(&ls->lanes[k], pc).opcode != instr.opcode;
+        }
+        if (!diverged && lockstep_vector(ls, instr, ls->is_running)) {
+            ls->vector_groups++;
+            for (int k = 0; k < LOCKSTEP_MAX_LANES; k++) {
+                ls->cycles[k] += ls->is_running[k] & 1;
+            }
+            continue;
+        }
+
+        for (int k = 0; k < ls->num_lanes; k++) {
+            pending[k] = ls->is_running[k];
+            if (pending[k]) {
+                instrs[k] = chip8_instr_at(&ls->lanes[k], ls->pc_reg[k]);
+            }
+        }
+
+        for (leader = 0; leader < ls->num_lanes; leader++) {
+            if (!pending[leader]) {
+                continue;
+            }
+
+            // group: every pending lane on the same pc with the same opcode in its ram
+            instr = instrs[leader];
+            pc = ls->pc_reg[leader];
+            int group_size = 0;
+            for (int k = 0; k < ls->num_lanes; k++) {
+                mask[k] = (pending[k] && ls->pc_reg[k] == pc && instrs[k].opcode == instr.opcode) ? 0xFF : 0;
+                pending[k] &= ~mask[k];
+                group_size += mask[k] & 1;
+            }
+
+            if (group_size > 1 && lockstep_vector(ls, instr, mask)) {
+                ls->vector_groups++;
+                for (int k = 0; k < ls->num_lanes; k++) {
+                    ls->cycles[k] += mask[k] & 1;
+                }
+                continue;
+            }
+
+            uint16_t store_addr = ls->I_reg[leader];
+            uint8_t same_addr = TRUE;
+            for (int k = leader; k < ls->num_lanes; k++) {
+                if (mask[k]) {
+                    same_addr &= ls->I_reg[k] == store_addr;
+                    lockstep_scalar(ls, k, instr);
+                }
+            }
+            if (ls->same_ram && lockstep_writes_ram(instr.id)) {
+                lockstep_check_store(ls, instr, mask, store_addr, same_addr);
+            }
+            ls->scalar_lanes += group_size;
+        }
+    }
+}
+
+#endif
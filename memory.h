@@ -0,0 +1,221 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chip8_def.h"
+#include "decode.h"
+#include "trace.h"
+
+/*
+Ram is RAM_PAGE_COUNT pointers to refcounted pages. Forked instances point at the
+same pages and only copy one when they store into it, so a fork costs a refcount
+bump per page in use instead of a copy of ram plus the decode cache, and the font
+and rom pages of thousands of instances live in memory once.
+
+Every instance has the 64k of pages XO-CHIP can address. Instructions wrap
+addresses at ram_mask, so a 4k machine never reaches past its first 16 pages and
+the rest stay on the zero page, costing nothing.
+
+A page with refcount 1 belongs to one instance and is written in place. Anything
+else (shared, or the static zero page every untouched page points at) is copied
+before the first store.
+*/
+
+// All zeroes; its decoded entries are chip8_decode(0x0000), which is all zeroes too
+static Chip8_RamPage RAM_ZERO_PAGE;
+
+static inline uint8_t chip8_read_ram(const Chip8* chip8, uint16_t addr) {
+    addr &= chip8->ram_mask;
+    return chip8->ram[addr / RAM_PAGE_SIZE]->bytes[addr % RAM_PAGE_SIZE];
+}
+
+/*
+Decoded instruction at addr: from the page's decode cache for even addresses,
+decoded from ram for odd ones (rare, but legal)
+*/
+static inline Chip8_Instr chip8_instr_at(const Chip8* chip8, uint16_t addr) {
+    addr &= chip8->ram_mask;
+    if ((addr & 1) == 0) {
+        return chip8->ram[addr / RAM_PAGE_SIZE]->decoded[(addr % RAM_PAGE_SIZE) >> 1];
+    }
+    return chip8_decode((chip8_read_ram(chip8, addr) << 8) | chip8_read_ram(chip8, addr + 1));
+}
+
+void chip8_page_acquire(Chip8_RamPage* page) {
+    if (page != &RAM_ZERO_PAGE) {
+        atomic_fetch_add_explicit(&page->refcount, 1, memory_order_relaxed);
+    }
+}
+
+void chip8_page_release(Chip8_RamPage* page) {
+    if (page != &RAM_ZERO_PAGE && atomic_fetch_sub_explicit(&page->refcount, 1, memory_order_acq_rel) == 1) {
+        free(page);
+    }
+}
+
+/*
+Points every page of chip8 at the zero page. Whatever chip8 held before is
+dropped without being released, use on fresh instances only.
+*/
+void chip8_ram_init(Chip8* chip8) {
+    for (int p = 0; p < RAM_PAGE_COUNT; p++) {
+        chip8->ram[p] = &RAM_ZERO_PAGE;
+    }
+}
+
+/*
+Gives back the pages of chip8, which is left with all-zero ram
+*/
+void chip8_ram_release(Chip8* chip8) {
+    for (int p = 0; p < RAM_PAGE_COUNT; p++) {
+        chip8_page_release(chip8->ram[p]);
+        chip8->ram[p] = &RAM_ZERO_PAGE;
+    }
+}
+
+/*
+Page p of chip8, copied first if it is shared, so it can be written in place
+*/
+Chip8_RamPage* chip8_page_for_write(Chip8* chip8, int p) {
+    Chip8_RamPage* page = chip8->ram[p];
+    if (page != &RAM_ZERO_PAGE && atomic_load_explicit(&page->refcount, memory_order_acquire) == 1) {
+        return page;
+    }
+
+    Chip8_RamPage* copy = malloc(sizeof(Chip8_RamPage));
+    if (copy == NULL) {
+        fprintf(stderr, "out of memory copying a ram page\n");
+        abort();
+    }
+    memcpy(copy->bytes, page->bytes, sizeof(copy->bytes));
+    memcpy(copy->decoded, page->decoded, sizeof(copy->decoded));
+    atomic_init(&copy->refcount, 1);
+    chip8->ram[p] = copy;
+    chip8_page_release(page);
+    return copy;
+}
+
+static inline void chip8_page_redecode(Chip8_RamPage* page, uint16_t offset) {
+    offset &= ~1u;
+    page->decoded[offset >> 1] = chip8_decode((page->bytes[offset] << 8) | page->bytes[offset + 1]);
+}
+
+/*
+A new page holding len bytes of src followed by zeroes, decoded, with one
+reference for the caller. The zero page if it would be all zero, NULL if out
+of memory.
+*/
+Chip8_RamPage* chip8_page_new(const uint8_t* src, size_t len) {
+    Chip8_RamPage* page = malloc(sizeof(Chip8_RamPage));
+    if (page == NULL) {
+        return NULL;
+    }
+    memcpy(page->bytes, src, len);
+    memset(page->bytes + len, 0, RAM_PAGE_SIZE - len);
+    if (memcmp(page->bytes, RAM_ZERO_PAGE.bytes, RAM_PAGE_SIZE) == 0) {
+        free(page);
+        return &RAM_ZERO_PAGE;
+    }
+    for (uint32_t i = 0; i < RAM_PAGE_SIZE; i += 2) {
+        chip8_page_redecode(page, i);
+    }
+    atomic_init(&page->refcount, 1);
+    return page;
+}
+
+/*
+Tells translated code, and the trace, that ram from start up to end changed
+behind its back.
+code_map only covers the machine's ram, past ram_mask there is no code.
+*/
+static inline void chip8_code_changed(Chip8* chip8, uint32_t start, uint32_t end) {
+    CHIP8_TRACE_RAM_LOADED(chip8);
+    if (end > (uint32_t)chip8->ram_mask + 1) {
+        end = (uint32_t)chip8->ram_mask + 1;
+    }
+    if (chip8->code_map != NULL) {
+        for (uint32_t a = start; a < end; a++) {
+            if (chip8->code_map[a >> 3] & (1 << (a & 7))) {
+                chip8->code_write_hook(chip8, a);
+            }
+        }
+    }
+}
+
+/*
+Points pages first to first + count - 1 of chip8 at pages, shared read-only
+until the first store into one copies it (chip8_page_for_write)
+*/
+void chip8_share_pages(Chip8* chip8, int first, Chip8_RamPage* const* pages, int count) {
+    for (int k = 0; k < count; k++) {
+        chip8_page_acquire(pages[k]);
+        chip8_page_release(chip8->ram[first + k]);
+        chip8->ram[first + k] = pages[k];
+    }
+    chip8_code_changed(chip8, (uint32_t)first * RAM_PAGE_SIZE, (uint32_t)(first + count) * RAM_PAGE_SIZE);
+}
+
+/*
+Every store into ram made by an instruction must go through here, so the page is
+unshared and the decode cache entry holding the written byte is refreshed
+(self-modifying roms).
+*/
+void chip8_write_ram(Chip8* chip8, uint16_t addr, uint8_t value) {
+    addr &= chip8->ram_mask;
+    // storing the value already there changes nothing and must not unshare the page
+    if (chip8->ram[addr / RAM_PAGE_SIZE]->bytes[addr % RAM_PAGE_SIZE] == value) {
+        return;
+    }
+
+    CHIP8_TRACE_STORE(chip8, addr, value);
+    Chip8_RamPage* page = chip8_page_for_write(chip8, addr / RAM_PAGE_SIZE);
+    page->bytes[addr % RAM_PAGE_SIZE] = value;
+    chip8_page_redecode(page, addr % RAM_PAGE_SIZE);
+
+    // translated code covering this byte is now stale
+    if (chip8->code_map != NULL && (chip8->code_map[addr >> 3] & (1 << (addr & 7)))) {
+        chip8->code_write_hook(chip8, addr);
+    }
+}
+
+/*
+Copies len bytes of src into ram at addr (src NULL clears them instead) and
+redecodes the range. Pages that end up all zero go back to the zero page.
+For bulk loads (fontset, roms, snapshots), instructions use chip8_write_ram.
+*/
+void chip8_load_ram(Chip8* chip8, uint16_t addr, const uint8_t* src, size_t len) {
+    uint32_t end = addr + len;
+    if (end > TOTAL_RAM) {
+        end = TOTAL_RAM;
+    }
+
+    for (uint32_t start = addr; start < end; ) {
+        int p = start / RAM_PAGE_SIZE;
+        uint32_t offset = start % RAM_PAGE_SIZE;
+        uint32_t count = RAM_PAGE_SIZE - offset;
+        if (count > end - start) {
+            count = end - start;
+        }
+        const uint8_t* bytes = src ? src + (start - addr) : RAM_ZERO_PAGE.bytes;
+
+        if (count == RAM_PAGE_SIZE && memcmp(bytes, RAM_ZERO_PAGE.bytes, RAM_PAGE_SIZE) == 0) {
+            chip8_page_release(chip8->ram[p]);
+            chip8->ram[p] = &RAM_ZERO_PAGE;
+        } else if (memcmp(chip8->ram[p]->bytes + offset, bytes, count) != 0) {
+            Chip8_RamPage* page = chip8_page_for_write(chip8, p);
+            memcpy(page->bytes + offset, bytes, count);
+            for (uint32_t i = offset & ~1u; i < offset + count; i += 2) {
+                chip8_page_redecode(page, i);
+            }
+        }
+        start += count;
+    }
+
+    // translated code over the range is stale as well
+    chip8_code_changed(chip8, addr, end);
+}
+
+#endif
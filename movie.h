@@ -0,0 +1,394 @@
+#ifndef MOVIE_H
+#define MOVIE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "chip8_def.h"
+#include "screen.h"
+#include "snapshot.h"
+#include "input.h"
+#include "quirks.h"
+
+/*
+Input movies: everything needed to replay a session exactly, which for a
+deterministic core is only what came from outside it. The rom (by hash), the
+rng seed, the quirk profile, the instructions per frame and the keyboard each
+time it changed, as (cycle, 16-bit key mask) pairs. Screen hashes taken every
+so often on the way serve as checkpoints, so a replay both reproduces the session and proves it
+did, headless and as fast as the core runs.
+
+Recording hooks the input queue (on_apply) to see each key change at the cycle
+it reached the guest, and chip8_movie_record_step is called between frames for
+the checkpoints. Replay turns the masks back into key events and runs them
+through the same queue and frame loop as a live session.
+
+File layout, little-endian:
+    0      magic "C8MV"
+    4      u16 version
+    6      u16 quirk profile (quirks.h), 0 in movies from before profiles existed
+    8      u32 instructions per frame
+    12     u32 number of inputs
+    16     u32 number of checkpoints
+    20     u32 reserved
+    24     u64 rom hash (FNV-1a of the rom image)
+    32     u64 rng seed
+    40     u64 end cycle
+    48     inputs: varint cycle delta from the previous input, u16 key mask
+    ...    checkpoints: varint cycle delta from the previous one, u64 screen hash
+
+Checkpoints are taken at frame boundaries, after the timer tick.
+*/
+#define CHIP8_MOVIE_MAGIC "C8MV"
+#define CHIP8_MOVIE_VERSION 1
+#define CHIP8_MOVIE_HEADER_SIZE 48
+#define MOVIE_CHECKPOINT_FRAMES 60       // frames between screen hash checkpoints when recording
+
+typedef struct {
+    uint64_t cycle;                  // cycle_count the mask took effect at
+    uint16_t keys;                   // bit n = key n down
+} Chip8_MovieInput;
+
+typedef struct {
+    uint64_t cycle;
+    uint64_t screen_hash;
+} Chip8_MovieCheckpoint;
+
+typedef struct {
+    uint64_t rom_hash;
+    uint64_t seed;
+    uint32_t instructions_per_frame;
+    uint8_t quirks;                  // quirk profile the session ran (Chip8_QuirkProfile)
+    uint64_t end_cycle;              // cycle_count the session stopped at
+
+    Chip8_MovieInput* inputs;
+    size_t num_inputs;
+    size_t inputs_capacity;
+    Chip8_MovieCheckpoint* checkpoints;
+    size_t num_checkpoints;
+    size_t checkpoints_capacity;
+
+    // recording
+    uint16_t keys;                   // mask last recorded
+    uint64_t next_checkpoint;        // cycle_count the next checkpoint is due at
+} Chip8_Movie;
+
+typedef struct {
+    uint64_t frames;
+    uint64_t cycles;
+    uint64_t checkpoints_passed;
+    uint8_t mismatch;                // a checkpoint's screen hash differed, or it was never reached
+    uint64_t mismatch_cycle;
+} Chip8_MovieResult;
+
+uint64_t chip8_rom_hash(const uint8_t* rom, size_t size) {
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= rom[i];
+        hash *= 0x100000001B3ull;
+    }
+    return hash;
+}
+
+static inline uint16_t chip8_key_mask(const Chip8* chip8) {
+    uint16_t keys = 0;
+    for (int i = 0; i < NUM_KEYS; i++) {
+        keys |= (chip8->keyboard[i] != FALSE) << i;
+    }
+    return keys;
+}
+
+/*
+Starts an empty movie for a session of rom with the given seed and quirk profile
+*/
+void chip8_movie_init(Chip8_Movie* movie, const uint8_t* rom, size_t size, uint64_t seed, uint8_t quirks,
+                      uint32_t instructions_per_frame) {
+    memset(movie, 0, sizeof(*movie));
+    movie->rom_hash = chip8_rom_hash(rom, size);
+    movie->seed = seed;
+    movie->quirks = quirks;
+    movie->instructions_per_frame = instructions_per_frame;
+    movie->next_checkpoint = (uint64_t)MOVIE_CHECKPOINT_FRAMES * instructions_per_frame;
+}
+
+void chip8_movie_free(Chip8_Movie* movie) {
+    free(movie->inputs);
+    free(movie->checkpoints);
+    movie->inputs = NULL;
+    movie->checkpoints = NULL;
+    movie->num_inputs = 0;
+    movie->num_checkpoints = 0;
+}
+
+/*
+Grows a movie array to hold one more item, FALSE if out of memory
+*/
+static int movie_reserve(void** items, size_t* capacity, size_t count, size_t item_size) {
+    if (count < *capacity) {
+        return TRUE;
+    }
+    size_t grown = *capacity ? *capacity * 2 : 256;
+    void* p = realloc(*items, grown * item_size);
+    if (p == NULL) {
+        return FALSE;
+    }
+    *items = p;
+    *capacity = grown;
+    return TRUE;
+}
+
+/*
+Records the keyboard if it changed since the last call. FALSE if out of memory.
+*/
+int chip8_movie_record_keys(Chip8_Movie* movie, const Chip8* chip8) {
+    uint16_t keys = chip8_key_mask(chip8);
+    if (keys == movie->keys) {
+        return TRUE;
+    }
+    if (!movie_reserve((void**)&movie->inputs, &movie->inputs_capacity, movie->num_inputs, sizeof(Chip8_MovieInput))) {
+        return FALSE;
+    }
+    Chip8_MovieInput input = { chip8->cycle_count, keys };
+    movie->inputs[movie->num_inputs++] = input;
+    movie->keys = keys;
+    return TRUE;
+}
+
+/*
+Input queue on_apply hook, ctx is the movie
+*/
+void chip8_movie_on_apply(void* ctx, const Chip8* chip8) {
+    chip8_movie_record_keys(ctx, chip8);
+}
+
+/*
+Call at frame boundaries while recording: takes a checkpoint when one is due
+and moves the end of the movie. FALSE if out of memory.
+*/
+int chip8_movie_record_step(Chip8_Movie* movie, const Chip8* chip8) {
+    movie->end_cycle = chip8->cycle_count;
+    if (chip8->cycle_count < movie->next_checkpoint) {
+        return TRUE;
+    }
+    if (!movie_reserve((void**)&movie->checkpoints, &movie->checkpoints_capacity, movie->num_checkpoints,
+                       sizeof(Chip8_MovieCheckpoint))) {
+        return FALSE;
+    }
+    Chip8_MovieCheckpoint checkpoint = { chip8->cycle_count, screen_hash(chip8) };
+    movie->checkpoints[movie->num_checkpoints++] = checkpoint;
+    movie->next_checkpoint = chip8->cycle_count + (uint64_t)MOVIE_CHECKPOINT_FRAMES * movie->instructions_per_frame;
+    return TRUE;
+}
+
+static size_t put_varint(uint8_t* p, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (v & 0x7F) | 0x80;
+        v >>= 7;
+    }
+    p[n++] = (uint8_t)v;
+    return n;
+}
+
+/*
+Reads a varint at *pos, FALSE if it runs past end
+*/
+static int get_varint(const uint8_t* data, size_t end, size_t* pos, uint64_t* v) {
+    *v = 0;
+    for (int shift = 0; shift < 64 && *pos < end; shift += 7) {
+        uint8_t b = data[(*pos)++];
+        *v |= (uint64_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/*
+Writes the movie to path. Returns FALSE on failure.
+*/
+int chip8_movie_save(const Chip8_Movie* movie, const char* path) {
+    size_t max_size = CHIP8_MOVIE_HEADER_SIZE + movie->num_inputs * (10 + 2) + movie->num_checkpoints * (10 + 8);
+    uint8_t* buf = malloc(max_size);
+    if (buf == NULL) {
+        return FALSE;
+    }
+
+    memcpy(buf, CHIP8_MOVIE_MAGIC, 4);
+    put_u16(buf + 4, CHIP8_MOVIE_VERSION);
+    put_u16(buf + 6, movie->quirks);
+    put_u32(buf + 8, movie->instructions_per_frame);
+    put_u32(buf + 12, (uint32_t)movie->num_inputs);
+    put_u32(buf + 16, (uint32_t)movie->num_checkpoints);
+    put_u32(buf + 20, 0);
+    put_u64(buf + 24, movie->rom_hash);
+    put_u64(buf + 32, movie->seed);
+    put_u64(buf + 40, movie->end_cycle);
+
+    size_t pos = CHIP8_MOVIE_HEADER_SIZE;
+    uint64_t last = 0;
+    for (size_t i = 0; i < movie->num_inputs; i++) {
+        pos += put_varint(buf + pos, movie->inputs[i].cycle - last);
+        put_u16(buf + pos, movie->inputs[i].keys);
+        pos += 2;
+        last = movie->inputs[i].cycle;
+    }
+    last = 0;
+    for (size_t i = 0; i < movie->num_checkpoints; i++) {
+        pos += put_varint(buf + pos, movie->checkpoints[i].cycle - last);
+        put_u64(buf + pos, movie->checkpoints[i].screen_hash);
+        pos += 8;
+        last = movie->checkpoints[i].cycle;
+    }
+
+    FILE* file = fopen(path, "wb");
+    int failed = file == NULL;
+    if (!failed) {
+        failed = fwrite(buf, 1, pos, file) != pos;
+        failed |= fclose(file) != 0;
+    }
+    free(buf);
+    return !failed;
+}
+
+/*
+Reads a movie file. Returns FALSE if it can't be read or is malformed.
+*/
+int chip8_movie_load(Chip8_Movie* movie, const char* path) {
+    memset(movie, 0, sizeof(*movie));
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return FALSE;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    uint8_t* buf = (size >= CHIP8_MOVIE_HEADER_SIZE) ? malloc(size) : NULL;
+    int ok = buf != NULL && fread(buf, 1, size, file) == (size_t)size;
+    fclose(file);
+
+    ok = ok && memcmp(buf, CHIP8_MOVIE_MAGIC, 4) == 0 && get_u16(buf + 4) == CHIP8_MOVIE_VERSION;
+    if (ok) {
+        movie->quirks = (uint8_t)get_u16(buf + 6);
+        movie->instructions_per_frame = get_u32(buf + 8);
+        movie->num_inputs = get_u32(buf + 12);
+        movie->num_checkpoints = get_u32(buf + 16);
+        movie->rom_hash = get_u64(buf + 24);
+        movie->seed = get_u64(buf + 32);
+        movie->end_cycle = get_u64(buf + 40);
+        movie->inputs_capacity = movie->num_inputs;
+        movie->checkpoints_capacity = movie->num_checkpoints;
+        movie->inputs = malloc((movie->num_inputs + 1) * sizeof(Chip8_MovieInput));
+        movie->checkpoints = malloc((movie->num_checkpoints + 1) * sizeof(Chip8_MovieCheckpoint));
+        ok = movie->inputs != NULL && movie->checkpoints != NULL && movie->instructions_per_frame != 0 &&
+             get_u16(buf + 6) < QUIRK_PROFILE_COUNT;
+    }
+
+    size_t pos = CHIP8_MOVIE_HEADER_SIZE;
+    uint64_t cycle = 0, delta;
+    for (size_t i = 0; ok && i < movie->num_inputs; i++) {
+        ok = get_varint(buf, size, &pos, &delta) && pos + 2 <= (size_t)size;
+        if (ok) {
+            cycle += delta;
+            movie->inputs[i].cycle = cycle;
+            movie->inputs[i].keys = get_u16(buf + pos);
+            pos += 2;
+        }
+    }
+    cycle = 0;
+    for (size_t i = 0; ok && i < movie->num_checkpoints; i++) {
+        ok = get_varint(buf, size, &pos, &delta) && pos + 8 <= (size_t)size;
+        if (ok) {
+            cycle += delta;
+            movie->checkpoints[i].cycle = cycle;
+            movie->checkpoints[i].screen_hash = get_u64(buf + pos);
+            pos += 8;
+        }
+    }
+
+    free(buf);
+    if (!ok) {
+        chip8_movie_free(movie);
+    }
+    return ok;
+}
+
+/*
+The movie's key masks as key events, one per key that changed. Returns the
+number of events, stored in a malloc'ed array at *events, or -1 if out of memory.
+*/
+long chip8_movie_key_events(const Chip8_Movie* movie, Chip8_KeyEvent** events) {
+    size_t count = 0;
+    uint16_t keys = 0;
+    *events = malloc((movie->num_inputs * NUM_KEYS + 1) * sizeof(Chip8_KeyEvent));
+    if (*events == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < movie->num_inputs; i++) {
+        uint16_t changed = keys ^ movie->inputs[i].keys;
+        for (int k = 0; k < NUM_KEYS; k++) {
+            if (changed & (1 << k)) {
+                Chip8_KeyEvent event = { movie->inputs[i].cycle, 0, (uint8_t)k, (movie->inputs[i].keys >> k) & 1 };
+                (*events)[count++] = event;
+            }
+        }
+        keys = movie->inputs[i].keys;
+    }
+    return (long)count;
+}
+
+/*
+Replays the movie on chip8, which must hold the movie's rom freshly loaded and
+seeded with its seed. Runs frames until the end cycle (or the rom halts) and
+compares the screen at every checkpoint, stopping at the first mismatch.
+Returns FALSE if replay failed: out of memory, or a checkpoint mismatched.
+*/
+int chip8_movie_replay(const Chip8_Movie* movie, Chip8* chip8, Chip8_MovieResult* result) {
+    Chip8_KeyEvent* events;
+    long num_events = chip8_movie_key_events(movie, &events);
+    memset(result, 0, sizeof(*result));
+    if (num_events < 0) {
+        return FALSE;
+    }
+
+    Chip8_InputQueue input;
+    chip8_input_init(&input);
+    size_t next_event = 0;
+    size_t next_checkpoint = 0;
+    uint32_t ipf = movie->instructions_per_frame;
+    uint64_t start = chip8->cycle_count;
+
+    while (chip8->cycle_count < movie->end_cycle && chip8->is_running_flag) {
+        chip8_input_feed(&input, events, num_events, &next_event, chip8->cycle_count + ipf + 1);
+        chip8_input_run_frame(chip8, &input, ipf);
+        result->frames++;
+
+        // checkpoints passed by without landing on a frame boundary are missed
+        while (next_checkpoint < movie->num_checkpoints &&
+               movie->checkpoints[next_checkpoint].cycle <= chip8->cycle_count) {
+            const Chip8_MovieCheckpoint* checkpoint = &movie->checkpoints[next_checkpoint++];
+            if (checkpoint->cycle != chip8->cycle_count || checkpoint->screen_hash != screen_hash(chip8)) {
+                result->mismatch = TRUE;
+                result->mismatch_cycle = checkpoint->cycle;
+                break;
+            }
+            result->checkpoints_passed++;
+        }
+        if (result->mismatch) {
+            break;
+        }
+    }
+
+    // a halted rom never reaches the checkpoints after the halt
+    if (!result->mismatch && next_checkpoint < movie->num_checkpoints) {
+        result->mismatch = TRUE;
+        result->mismatch_cycle = movie->checkpoints[next_checkpoint].cycle;
+    }
+    result->cycles = chip8->cycle_count - start;
+    free(events);
+    return !result->mismatch;
+}
+
+#endif
@@ -0,0 +1,308 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "chip8_def.h"
+
+/*
+Execution profiler, compiled in only with CHIP8_PROFILE (make PROFILE=1).
+Without it CHIP8_PROFILE_OP and CHIP8_PROFILE_PAUSE expand to nothing and
+Chip8 has no profile field, so the dispatch loops are exactly what they are
+in a normal build.
+
+With it, every instruction the interpreter or the block compiler runs goes
+through chip8_profile_op before its handler. The host time between two such
+calls is charged to the earlier instruction: to its op, its address and the
+call stack it ran in. Time spent outside run_cycles (frontend, sleeping) is
+not charged, CHIP8_PROFILE_PAUSE at the end of each run stops the clock.
+
+The call stack is shadowed from call_addr and ret: the list of subroutine
+entry addresses from the rom's start down to the current one. Each distinct
+stack gets a slot with per-op totals, which is what the collapsed output is
+made of, one line per (stack, op):
+
+    main;sub_2A4;sub_31C;drw 18230
+
+the number being nanoseconds, ready for flamegraph.pl or speedscope.
+*/
+#ifdef CHIP8_PROFILE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "decode.h"
+#include "memory.h"
+#include "clock.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define profile_ticks() __rdtsc()          // converted to ns at dump time against chip8_now_ns
+#else
+#define profile_ticks() chip8_now_ns()
+#endif
+
+#define PROFILE_MAX_STACKS 1024            // distinct call stacks tracked, later ones are lumped together
+#define PROFILE_MAX_DEPTH STACK_SIZE
+#define PROFILE_TOP_PCS 20                 // addresses listed in the hot-spot table
+#define PROFILE_COLLAPSED_PATH "chip8-profile.folded" // where frontends write the collapsed stacks
+
+// Ops are reported by handler name, unique where mnemonics aren't
+#define CHIP8_OP_HANDLER_NAME(id, handler, name) [id] = #handler,
+static const char* const PROFILE_OP_NAMES[OP_COUNT] = { CHIP8_OPCODES(CHIP8_OP_HANDLER_NAME) };
+#undef CHIP8_OP_HANDLER_NAME
+
+typedef struct {
+    uint16_t depth;
+    uint16_t frames[PROFILE_MAX_DEPTH];    // subroutine entry addresses, outermost first
+    uint8_t used;
+    uint64_t op_count[OP_COUNT];
+    uint64_t op_ticks[OP_COUNT];
+} Chip8_ProfileStack;
+
+struct Chip8_Profile_t {
+    uint64_t op_count[OP_COUNT];
+    uint64_t op_ticks[OP_COUNT];
+    uint64_t pc_count[TOTAL_RAM];
+    uint64_t pc_ticks[TOTAL_RAM];
+    Chip8_ProfileStack stacks[PROFILE_MAX_STACKS];
+    uint32_t stacks_used;
+    uint32_t stacks_overflowed;            // stacks that found no free slot, charged to the top level
+    uint32_t root;                         // slot of the top level (empty) stack
+
+    // shadow call stack and the slot it maps to
+    uint16_t calls[PROFILE_MAX_DEPTH];
+    uint16_t depth;
+    uint32_t stack;
+
+    // the instruction the clock is running for
+    uint8_t timing;
+    uint8_t last_op;
+    uint16_t last_pc;
+    uint32_t last_stack;
+    uint64_t last_ticks;
+
+    // for converting ticks to ns
+    uint64_t start_ticks;
+    uint64_t start_ns;
+};
+
+static uint32_t profile_stack_hash(const uint16_t* calls, uint16_t depth) {
+    uint32_t hash = 2166136261u;
+    for (uint16_t i = 0; i < depth; i++) {
+        hash = (hash ^ calls[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/*
+Slot of the current shadow stack, added if it's new
+*/
+static uint32_t profile_find_stack(Chip8_Profile* p) {
+    uint32_t hash = profile_stack_hash(p->calls, p->depth);
+    for (uint32_t probe = 0; probe < PROFILE_MAX_STACKS; probe++) {
+        uint32_t i = (hash + probe) % PROFILE_MAX_STACKS;
+        Chip8_ProfileStack* s = &p->stacks[i];
+        if (!s->used) {
+            s->used = TRUE;
+            s->depth = p->depth;
+            memcpy(s->frames, p->calls, p->depth * sizeof(uint16_t));
+            p->stacks_used++;
+            return i;
+        }
+        if (s->depth == p->depth && memcmp(s->frames, p->calls, p->depth * sizeof(uint16_t)) == 0) {
+            return i;
+        }
+    }
+    p->stacks_overflowed++;
+    return p->root;
+}
+
+/*
+Starts collecting. Returns FALSE if the profile can't be allocated.
+*/
+int chip8_profile_enable(Chip8* chip8) {
+    Chip8_Profile* p = calloc(1, sizeof(Chip8_Profile));
+    if (p == NULL) {
+        return FALSE;
+    }
+    p->root = profile_find_stack(p);
+    p->stack = p->root;
+    p->start_ticks = profile_ticks();
+    p->start_ns = chip8_now_ns();
+    chip8->profile = p;
+    return TRUE;
+}
+
+void chip8_profile_disable(Chip8* chip8) {
+    free(chip8->profile);
+    chip8->profile = NULL;
+}
+
+/*
+Called before instr runs at pc_reg: charges the time since the last call to the
+instruction that ran then, and follows calls and returns
+*/
+static inline void chip8_profile_op(Chip8* chip8, Chip8_Instr instr) {
+    Chip8_Profile* p = chip8->profile;
+    if (p == NULL) {
+        return;
+    }
+    uint64_t now = profile_ticks();
+    if (p->timing) {
+        uint64_t elapsed = now - p->last_ticks;
+        p->op_ticks[p->last_op] += elapsed;
+        p->pc_ticks[p->last_pc] += elapsed;
+        p->stacks[p->last_stack].op_ticks[p->last_op] += elapsed;
+    }
+
+    uint16_t pc = chip8->pc_reg & chip8->ram_mask;
+    p->op_count[instr.id]++;
+    p->pc_count[pc]++;
+    p->stacks[p->stack].op_count[instr.id]++;
+    p->timing = TRUE;
+    p->last_op = instr.id;
+    p->last_pc = pc;
+    p->last_stack = p->stack;
+
+    // the call or ret itself belongs to the caller's stack, what follows doesn't
+    if (instr.id == OP_CALL_ADDR && p->depth < PROFILE_MAX_DEPTH) {
+        p->calls[p->depth++] = instr.nnn;
+        p->stack = profile_find_stack(p);
+    } else if (instr.id == OP_RET && p->depth > 0) {
+        p->depth--;
+        p->stack = profile_find_stack(p);
+    }
+    p->last_ticks = profile_ticks();
+}
+
+/*
+Stops the clock at the end of a run, time until the next instruction isn't charged
+*/
+static inline void chip8_profile_pause(Chip8* chip8) {
+    Chip8_Profile* p = chip8->profile;
+    if (p == NULL || !p->timing) {
+        return;
+    }
+    uint64_t elapsed = profile_ticks() - p->last_ticks;
+    p->op_ticks[p->last_op] += elapsed;
+    p->pc_ticks[p->last_pc] += elapsed;
+    p->stacks[p->last_stack].op_ticks[p->last_op] += elapsed;
+    p->timing = FALSE;
+}
+
+#define CHIP8_PROFILE_OP(chip8, instr) chip8_profile_op(chip8, instr)
+#define CHIP8_PROFILE_PAUSE(chip8) chip8_profile_pause(chip8)
+
+static double profile_ns_per_tick(const Chip8_Profile* p) {
+    uint64_t ticks = profile_ticks() - p->start_ticks;
+    return ticks ? (double)(chip8_now_ns() - p->start_ns) / ticks : 1.0;
+}
+
+static const Chip8_Profile* profile_sort_by;
+
+static int profile_cmp_op(const void* a, const void* b) {
+    uint64_t ta = profile_sort_by->op_ticks[*(const uint8_t*)a];
+    uint64_t tb = profile_sort_by->op_ticks[*(const uint8_t*)b];
+    return (ta < tb) - (ta > tb);
+}
+
+static int profile_cmp_pc(const void* a, const void* b) {
+    uint64_t ta = profile_sort_by->pc_ticks[*(const uint16_t*)a];
+    uint64_t tb = profile_sort_by->pc_ticks[*(const uint16_t*)b];
+    return (ta < tb) - (ta > tb);
+}
+
+/*
+Writes the hot-spot tables to out: every op and the PROFILE_TOP_PCS hottest
+addresses, by time spent
+*/
+void chip8_profile_report(const Chip8* chip8, FILE* out) {
+    const Chip8_Profile* p = chip8->profile;
+    double ns_per_tick = profile_ns_per_tick(p);
+    uint64_t total_count = 0, total_ticks = 0;
+    for (int op = 0; op < OP_COUNT; op++) {
+        total_count += p->op_count[op];
+        total_ticks += p->op_ticks[op];
+    }
+    if (total_count == 0) {
+        fprintf(out, "profile: nothing ran\n");
+        return;
+    }
+    double total_ns = total_ticks * ns_per_tick;
+
+    uint8_t ops[OP_COUNT];
+    for (int op = 0; op < OP_COUNT; op++) {
+        ops[op] = op;
+    }
+    profile_sort_by = p;
+    qsort(ops, OP_COUNT, sizeof(ops[0]), profile_cmp_op);
+
+    fprintf(out, "%-14s %14s %7s %14s %7s %9s\n", "op", "count", "count%", "ns", "time%", "ns/op");
+    for (int i = 0; i < OP_COUNT && p->op_count[ops[i]] != 0; i++) {
+        int op = ops[i];
+        double ns = p->op_ticks[op] * ns_per_tick;
+        fprintf(out, "%-14s %14llu %6.2f%% %14.0f %6.2f%% %9.2f\n", PROFILE_OP_NAMES[op],
+                (unsigned long long)p->op_count[op], 100.0 * p->op_count[op] / total_count,
+                ns, 100.0 * ns / total_ns, ns / p->op_count[op]);
+    }
+
+    static uint16_t pcs[TOTAL_RAM];
+    for (int pc = 0; pc < TOTAL_RAM; pc++) {
+        pcs[pc] = pc;
+    }
+    qsort(pcs, TOTAL_RAM, sizeof(pcs[0]), profile_cmp_pc);
+
+    fprintf(out, "\n%-6s %-6s %-14s %14s %14s %7s\n", "addr", "opcode", "op", "count", "ns", "time%");
+    for (int i = 0; i < PROFILE_TOP_PCS && p->pc_count[pcs[i]] != 0; i++) {
+        uint16_t pc = pcs[i];
+        Chip8_Instr instr = chip8_decode((chip8_read_ram(chip8, pc) << 8) | chip8_read_ram(chip8, pc + 1));
+        double ns = p->pc_ticks[pc] * ns_per_tick;
+        fprintf(out, "%03X    %04X   %-14s %14llu %14.0f %6.2f%%\n", pc, instr.opcode, PROFILE_OP_NAMES[instr.id],
+                (unsigned long long)p->pc_count[pc], ns, 100.0 * ns / total_ns);
+    }
+    if (p->stacks_overflowed != 0) {
+        fprintf(out, "\n%u call stacks past the first %d were charged to the top level\n",
+                p->stacks_overflowed, PROFILE_MAX_STACKS);
+    }
+}
+
+/*
+Writes collapsed stacks (one "frame;frame;OP ns" line per stack and op) to
+path. Returns FALSE if the file can't be written.
+*/
+int chip8_profile_write_collapsed(const Chip8* chip8, const char* path) {
+    const Chip8_Profile* p = chip8->profile;
+    double ns_per_tick = profile_ns_per_tick(p);
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        return FALSE;
+    }
+
+    for (int i = 0; i < PROFILE_MAX_STACKS; i++) {
+        const Chip8_ProfileStack* s = &p->stacks[i];
+        if (!s->used) {
+            continue;
+        }
+        for (int op = 0; op < OP_COUNT; op++) {
+            uint64_t ns = (uint64_t)(s->op_ticks[op] * ns_per_tick);
+            if (s->op_count[op] == 0 || ns == 0) {
+                continue;
+            }
+            fprintf(file, "main");
+            for (int d = 0; d < s->depth; d++) {
+                fprintf(file, ";sub_%03X", s->frames[d]);
+            }
+            fprintf(file, ";%s %llu\n", PROFILE_OP_NAMES[op], (unsigned long long)ns);
+        }
+    }
+    return fclose(file) == 0;
+}
+
+#else
+
+#define CHIP8_PROFILE_OP(chip8, instr) ((void)0)
+#define CHIP8_PROFILE_PAUSE(chip8) ((void)0)
+
+#endif
+
+#endif
@@ -0,0 +1,292 @@
+#ifndef QUIRKS_H
+#define QUIRKS_H
+
+#include <string.h>
+#include "chip8_def.h"
+#include "decode.h"
+#include "memory.h"
+#include "screen.h"
+#include "instructions.h"
+
+/*
+Quirk profiles. A few instructions were never pinned down and the interpreters
+that shaped the platform disagree on them:
+
+    vf_reset    8xy1/8xy2/8xy3 also clear VF (COSMAC VIP)
+    shift_vy    8xy6/8xyE shift Vy into Vx instead of shifting Vx in place
+    i_after     what Fx55/Fx65 leave in I: unchanged, I + x or I + x + 1
+    jump_vx     Bnnn jumps to xnn + Vx (CHIP-48's BXNN) instead of nnn + V0
+    clip        Dxyn drops sprite pixels past the screen edges instead of wrapping
+                them (the start position wraps either way)
+
+Each profile also names the machine it is: which instruction set and how much
+ram. The SCHIP and XO-CHIP instructions are always decoded (decode.h), a
+machine that doesn't have them gets what CHIP-8 did with those opcodes instead.
+
+    chip8       4k, 64x32, CHIP-8 only
+    schip       4k, adds the 128x64 mode, scrolls, 16x16 sprites, the big font
+                and the flag registers
+    xochip      64k, adds the second plane, 00Dn, 5xy2/5xy3, F000 nnnn, the
+                audio pattern and pitch; skips step over F000 nnnn whole
+
+QUIRKS_DEFAULT is what this emulator always did, the plain handlers in
+instructions.h on a chip8 machine, so existing saves, movies and results stay
+valid. Every other profile gets its own copies of the handlers above with the
+quirks as constants, its own handler table (QUIRK_HANDLERS) and its own
+dispatch loop (cpu.h), so the choice is made once per chip8_run_cycles call and
+never inside a handler.
+
+The profile is part of an instance's configuration like the block compiler:
+call chip8_set_quirks right after initialize(), before loading the rom and
+enabling the block compiler.
+*/
+#define QUIRK_I_UNCHANGED 0              // Fx55/Fx65 leave I alone
+#define QUIRK_I_PLUS_X 1                 // I += x
+#define QUIRK_I_PLUS_X1 2                // I += x + 1
+
+#define QUIRK_RAM_MASK_chip8 (CHIP8_RAM_SIZE - 1)
+#define QUIRK_RAM_MASK_schip (CHIP8_RAM_SIZE - 1)
+#define QUIRK_RAM_MASK_xochip (TOTAL_RAM - 1)
+
+//      profile          suffix  name       machine  vf_reset shift_vy  i_after           jump_vx  clip
+#define CHIP8_QUIRK_PROFILES(X)                                                                                \
+    X(QUIRKS_VIP,      vip,    "vip",     chip8,   TRUE,    TRUE,     QUIRK_I_PLUS_X1,   FALSE,   TRUE)   \
+    X(QUIRKS_CHIP48,   chip48, "chip48",  chip8,   FALSE,   FALSE,    QUIRK_I_PLUS_X,    TRUE,    TRUE)   \
+    X(QUIRKS_SCHIP,    schip,  "schip",   schip,   FALSE,   FALSE,    QUIRK_I_UNCHANGED, TRUE,    TRUE)   \
+    X(QUIRKS_XOCHIP,   xochip, "xochip",  xochip,  FALSE,   TRUE,     QUIRK_I_PLUS_X1,   FALSE,   FALSE)
+
+#define QUIRK_ENUM(profile, suffix, name, machine, vf_reset, shift_vy, i_after, jump_vx, clip) profile,
+typedef enum {
+    QUIRKS_DEFAULT,
+    CHIP8_QUIRK_PROFILES(QUIRK_ENUM)
+    QUIRK_PROFILE_COUNT
+} Chip8_QuirkProfile;
+#undef QUIRK_ENUM
+
+#define QUIRK_NAME(profile, suffix, name, machine, vf_reset, shift_vy, i_after, jump_vx, clip) [profile] = name,
+static const char* const QUIRK_NAMES[QUIRK_PROFILE_COUNT] = {
+    [QUIRKS_DEFAULT] = "default",
+    CHIP8_QUIRK_PROFILES(QUIRK_NAME)
+};
+#undef QUIRK_NAME
+
+/*
+The profile called name, -1 if there is none
+*/
+int chip8_quirks_by_name(const char* name) {
+    for (int p = 0; p < QUIRK_PROFILE_COUNT; p++) {
+        if (strcmp(name, QUIRK_NAMES[p]) == 0) {
+            return p;
+        }
+    }
+    return -1;
+}
+
+// Handler bodies with the quirks as parameters. They are only ever called with
+// constants, so every profile's copy compiles down to straight-line code.
+
+/*
+8xy1/8xy2/8xy3 with the result already computed
+*/
+static inline void quirk_logic(Chip8* chip8, uint8_t result, const int vf_reset) {
+    chip8->V[chip8->op.x] = result;
+    if (vf_reset) {
+        chip8->V[0xF] = 0;
+    }
+    chip8->pc_reg += 2;
+}
+
+/*
+8xy6: the flag is written last, so it wins when x is F
+*/
+static inline void quirk_shr(Chip8* chip8, const int shift_vy) {
+    uint8_t source = chip8->V[shift_vy ? chip8->op.y : chip8->op.x];
+
+    chip8->V[chip8->op.x] = source >> 1;
+    chip8->V[0xF] = source & 0x1;
+    chip8->pc_reg += 2;
+}
+
+/*
+8xyE, see quirk_shr
+*/
+static inline void quirk_shl(Chip8* chip8, const int shift_vy) {
+    uint8_t source = chip8->V[shift_vy ? chip8->op.y : chip8->op.x];
+
+    chip8->V[chip8->op.x] = (uint8_t)(source << 1);
+    chip8->V[0xF] = source >> 7;
+    chip8->pc_reg += 2;
+}
+
+/*
+Bnnn
+*/
+static inline void quirk_jp_offset(Chip8* chip8, const int jump_vx) {
+    chip8->pc_reg = chip8->op.nnn + chip8->V[jump_vx ? chip8->op.x : 0];
+}
+
+/*
+Fx55
+*/
+static inline void quirk_st_regs(Chip8* chip8, const int i_after) {
+    uint8_t end_ld_v_reg = chip8->op.x;
+
+    for (int i = 0; i <= end_ld_v_reg; i++) {
+        chip8_write_ram(chip8, chip8->I_reg + i, chip8->V[i]);
+    }
+    if (i_after != QUIRK_I_UNCHANGED) {
+        chip8->I_reg += end_ld_v_reg + (i_after == QUIRK_I_PLUS_X1);
+    }
+    chip8->pc_reg += 2;
+}
+
+/*
+Fx65
+*/
+static inline void quirk_ld_regs(Chip8* chip8, const int i_after) {
+    uint8_t end_ld_v_reg = chip8->op.x;
+
+    for (int i = 0; i <= end_ld_v_reg; i++) {
+        chip8->V[i] = chip8_read_ram(chip8, chip8->I_reg + i);
+    }
+    if (i_after != QUIRK_I_UNCHANGED) {
+        chip8->I_reg += end_ld_v_reg + (i_after == QUIRK_I_PLUS_X1);
+    }
+    chip8->pc_reg += 2;
+}
+
+/*
+Skips of an XO-CHIP machine: the instruction skipped over may be F000 nnnn,
+which is 4 bytes
+*/
+static inline void quirk_skip_long(Chip8* chip8, int skip) {
+    chip8->pc_reg += 2;
+    if (skip) {
+        uint16_t next = (chip8_read_ram(chip8, chip8->pc_reg) << 8) | chip8_read_ram(chip8, chip8->pc_reg + 1);
+        chip8->pc_reg += (next == 0xF000) ? 4 : 2;
+    }
+}
+
+/*
+Dxyn on a chip8 machine, clipped at the screen edges or wrapped around them
+like drw. The other machines draw through draw_sprite.
+*/
+static inline void quirk_drw(Chip8* chip8, const int clip) {
+    uint8_t x_location = chip8->V[chip8->op.x] % SCREEN_WIDTH;
+    uint8_t y_location = chip8->V[chip8->op.y] % SCREEN_HEIGHT;
+    uint8_t sprite_height = chip8->op.n;
+    uint8_t collision = FALSE;
+    uint64_t mask[SCREEN_ROW_WORDS];
+
+    if (clip && sprite_height > SCREEN_HEIGHT - y_location) {
+        sprite_height = SCREEN_HEIGHT - y_location;
+    }
+    for (int y_coordinate = 0; y_coordinate < sprite_height; y_coordinate++) {
+        uint8_t pixel = chip8_read_ram(chip8, chip8->I_reg + y_coordinate);
+        uint8_t row = (y_location + y_coordinate) % SCREEN_HEIGHT;
+        screen_sprite_mask(mask, (uint64_t)pixel << 56, 8, x_location, 1, clip);
+        collision |= screen_xor_row(chip8->screen[0][row], mask, 1);
+        screen_mark_dirty(chip8, row, mask, 1);
+    }
+
+    chip8->V[0xF] = collision;
+    chip8->draw_screen_flag = TRUE;
+    chip8->pc_reg += 2;
+}
+
+// Handlers a machine has on top of CHIP-8's or in place of them, e.g. drw_xochip
+#define QUIRK_MACHINE_HANDLERS_chip8(suffix, clip)                                                           \
+    void drw_##suffix(Chip8* chip8) { quirk_drw(chip8, clip); }
+#define QUIRK_MACHINE_HANDLERS_schip(suffix, clip)                                                           \
+    void drw_##suffix(Chip8* chip8) { draw_sprite(chip8, chip8->op.n, FALSE, clip); }                        \
+    void drw_16_##suffix(Chip8* chip8) { draw_sprite(chip8, 16, TRUE, clip); }
+#define QUIRK_MACHINE_HANDLERS_xochip(suffix, clip)                                                          \
+    QUIRK_MACHINE_HANDLERS_schip(suffix, clip)                                                               \
+    void se_vx_byte_##suffix(Chip8* chip8) { quirk_skip_long(chip8, chip8->V[chip8->op.x] == chip8->op.kk); } \
+    void sne_vx_byte_##suffix(Chip8* chip8) { quirk_skip_long(chip8, chip8->V[chip8->op.x] != chip8->op.kk); } \
+    void se_vx_vy_##suffix(Chip8* chip8) { quirk_skip_long(chip8, chip8->V[chip8->op.x] == chip8->V[chip8->op.y]); } \
+    void sne_vx_vy_##suffix(Chip8* chip8) { quirk_skip_long(chip8, chip8->V[chip8->op.x] != chip8->V[chip8->op.y]); } \
+    void skp_vx_##suffix(Chip8* chip8) { quirk_skip_long(chip8, chip8->keyboard[chip8->V[chip8->op.x] & 0xF] == TRUE); } \
+    void sknp_vx_##suffix(Chip8* chip8) { quirk_skip_long(chip8, chip8->keyboard[chip8->V[chip8->op.x] & 0xF] == FALSE); }
+
+// One copy of every quirk handler per profile, e.g. shr_vx_vy_vip
+#define QUIRK_HANDLERS_FOR(profile, suffix, name, machine, vf_reset, shift_vy, i_after, jump_vx, clip)             \
+    void or_vx_vy_##suffix(Chip8* chip8) { quirk_logic(chip8, chip8->V[chip8->op.x] | chip8->V[chip8->op.y], vf_reset); } \
+    void and_vx_vy_##suffix(Chip8* chip8) { quirk_logic(chip8, chip8->V[chip8->op.x] & chip8->V[chip8->op.y], vf_reset); } \
+    void xor_vx_vy_##suffix(Chip8* chip8) { quirk_logic(chip8, chip8->V[chip8->op.x] ^ chip8->V[chip8->op.y], vf_reset); } \
+    void shr_vx_vy_##suffix(Chip8* chip8) { quirk_shr(chip8, shift_vy); }                                          \
+    void shl_vx_vy_##suffix(Chip8* chip8) { quirk_shl(chip8, shift_vy); }                                          \
+    void jp_v0_addr_##suffix(Chip8* chip8) { quirk_jp_offset(chip8, jump_vx); }                                    \
+    void st_V_regs_##suffix(Chip8* chip8) { quirk_st_regs(chip8, i_after); }                                       \
+    void ld_V_regs_##suffix(Chip8* chip8) { quirk_ld_regs(chip8, i_after); }                                       \
+    QUIRK_MACHINE_HANDLERS_##machine(suffix, clip)
+CHIP8_QUIRK_PROFILES(QUIRK_HANDLERS_FOR)
+#undef QUIRK_HANDLERS_FOR
+
+// Handler table entries of a machine, on top of the full CHIP8_OPCODES list
+#define QUIRK_OP_INVALID(id, handler, name) [id] = op_invalid,
+#define QUIRK_MACHINE_TABLE_chip8(suffix)                                                \
+    CHIP8_SCHIP_OPCODES(QUIRK_OP_INVALID) CHIP8_XOCHIP_OPCODES(QUIRK_OP_INVALID)         \
+    [OP_DRW] = drw_##suffix, [OP_DRW_16] = drw_##suffix,
+#define QUIRK_MACHINE_TABLE_schip(suffix)                                                \
+    CHIP8_XOCHIP_OPCODES(QUIRK_OP_INVALID)                                               \
+    [OP_DRW] = drw_##suffix, [OP_DRW_16] = drw_16_##suffix,
+#define QUIRK_MACHINE_TABLE_xochip(suffix)                                               \
+    [OP_DRW] = drw_##suffix, [OP_DRW_16] = drw_16_##suffix,                              \
+    [OP_SE_VX_BYTE] = se_vx_byte_##suffix, [OP_SNE_VX_BYTE] = sne_vx_byte_##suffix,      \
+    [OP_SE_VX_VY] = se_vx_vy_##suffix,     [OP_SNE_VX_VY] = sne_vx_vy_##suffix,          \
+    [OP_SKP_VX] = skp_vx_##suffix,         [OP_SKNP_VX] = sknp_vx_##suffix,
+
+// Handler table of every profile: OP_HANDLERS with the quirk handlers swapped in.
+// The later designated initializers replacing the earlier ones is the point here.
+// The default profile is a chip8 machine: Dxy0 is an 8-wide sprite of height 0.
+#define QUIRK_OP_HANDLER(id, handler, name) [id] = handler,
+#define QUIRK_TABLE(profile, suffix, name, machine, vf_reset, shift_vy, i_after, jump_vx, clip) \
+    [profile] = {                                                                     \
+        CHIP8_OPCODES(QUIRK_OP_HANDLER)                                               \
+        [OP_OR_VX_VY] = or_vx_vy_##suffix,   [OP_AND_VX_VY] = and_vx_vy_##suffix,     \
+        [OP_XOR_VX_VY] = xor_vx_vy_##suffix, [OP_SHR_VX_VY] = shr_vx_vy_##suffix,     \
+        [OP_SHL_VX_VY] = shl_vx_vy_##suffix, [OP_JP_V0_ADDR] = jp_v0_addr_##suffix,   \
+        [OP_ST_V_REGS] = st_V_regs_##suffix, [OP_LD_V_REGS] = ld_V_regs_##suffix,     \
+        QUIRK_MACHINE_TABLE_##machine(suffix)                                         \
+    },
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverride-init"
+static const Chip8_Handler QUIRK_HANDLERS[QUIRK_PROFILE_COUNT][OP_COUNT] = {
+    [QUIRKS_DEFAULT] = {
+        CHIP8_OPCODES(QUIRK_OP_HANDLER)
+        CHIP8_SCHIP_OPCODES(QUIRK_OP_INVALID) CHIP8_XOCHIP_OPCODES(QUIRK_OP_INVALID)
+        [OP_DRW_16] = drw,
+    },
+    CHIP8_QUIRK_PROFILES(QUIRK_TABLE)
+};
+#pragma GCC diagnostic pop
+#undef QUIRK_TABLE
+#undef QUIRK_OP_HANDLER
+#undef QUIRK_OP_INVALID
+
+// Ram size - 1 of every profile's machine
+#define QUIRK_RAM_MASK(profile, suffix, name, machine, vf_reset, shift_vy, i_after, jump_vx, clip) \
+    [profile] = QUIRK_RAM_MASK_##machine,
+static const uint16_t QUIRK_RAM_MASKS[QUIRK_PROFILE_COUNT] = {
+    [QUIRKS_DEFAULT] = QUIRK_RAM_MASK_chip8,
+    CHIP8_QUIRK_PROFILES(QUIRK_RAM_MASK)
+};
+#undef QUIRK_RAM_MASK
+
+/*
+TRUE if the instruction runs differently under profile than under the default
+*/
+static inline uint8_t chip8_quirk_op(uint8_t profile, uint8_t id) {
+    return QUIRK_HANDLERS[profile][id] != QUIRK_HANDLERS[QUIRKS_DEFAULT][id];
+}
+
+/*
+Makes chip8 the machine of profile
+*/
+void chip8_set_quirks(Chip8* chip8, uint8_t profile) {
+    chip8->quirks = profile;
+    chip8->ram_mask = QUIRK_RAM_MASKS[profile];
+}
+
+#endif
@@ -0,0 +1,296 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chip8_def.h"
+#include "memory.h"
+#include "snapshot.h"
+#include "jit.h"
+
+/*
+Rewind history. Once per frame the frontend calls chip8_rewind_push, which
+records how to undo that frame: the bytes of the previous frame's state (in the
+snapshot record layout, see snapshot.h) wherever they differ from the new one.
+
+Registers and screen are compared byte for byte, so only the screen rows drw and
+cls actually changed end up in the delta. Ram is only compared on pages written
+since the previous push, and copy-on-write makes those free to find: the history
+holds a reference to the previous frame's pages, so a page written since has
+been copied and its pointer differs.
+
+A delta is a list of runs (u32 record offset, u8 length - 1, the old bytes)
+framed by its u32 size on both ends, so the ring can be walked from either side.
+Deltas live in a byte ring of fixed capacity and the oldest are dropped to make
+room: memory stays at the capacity plus one frame of pages however long the
+session runs. Rewinding N frames applies N - 1 deltas, a few hundred bytes each,
+instead of replaying the rom from initialize().
+*/
+#define REWIND_DEFAULT_CAPACITY (4 << 20)   // over a minute of 60 Hz frames for typical roms
+#define REWIND_RUN_HEADER 5                 // u32 offset, u8 length - 1
+#define REWIND_MAX_DELTA(state_size) ((state_size) * 2 + 8) // every byte changed, runs and framing included
+
+typedef struct {
+    uint8_t* ring;
+    size_t capacity;
+    size_t head;                     // where the next delta is written
+    size_t used;                     // bytes held, the oldest delta starts at head - used
+    uint32_t deltas;                 // deltas held
+    uint8_t has_frame;               // a frame was pushed since init or clear
+
+    // the latest pushed frame, what the next delta is taken against
+    Chip8_RamPage* pages[RAM_PAGE_COUNT];
+    uint8_t regs[CHIP8_STATE_RAM_OFFSET];
+
+    uint8_t* scratch;                // REWIND_MAX_DELTA of the largest record pushed
+    size_t scratch_size;
+
+    // statistics
+    uint64_t frames_pushed;
+    uint64_t bytes_pushed;           // delta bytes, framing included
+    uint64_t frames_dropped;         // oldest deltas dropped to make room
+} Chip8_Rewind;
+
+/*
+Sets up an empty history of capacity bytes. Returns FALSE if it can't be allocated.
+*/
+int chip8_rewind_init(Chip8_Rewind* rw, size_t capacity) {
+    memset(rw, 0, sizeof(*rw));
+    rw->ring = malloc(capacity);
+    if (rw->ring == NULL) {
+        return FALSE;
+    }
+    rw->capacity = capacity;
+    for (int p = 0; p < RAM_PAGE_COUNT; p++) {
+        rw->pages[p] = &RAM_ZERO_PAGE;
+    }
+    return TRUE;
+}
+
+/*
+Forgets every frame, e.g. after loading another rom or a snapshot
+*/
+void chip8_rewind_clear(Chip8_Rewind* rw) {
+    for (int p = 0; p < RAM_PAGE_COUNT; p++) {
+        chip8_page_release(rw->pages[p]);
+        rw->pages[p] = &RAM_ZERO_PAGE;
+    }
+    rw->head = 0;
+    rw->used = 0;
+    rw->deltas = 0;
+    rw->has_frame = FALSE;
+}
+
+void chip8_rewind_free(Chip8_Rewind* rw) {
+    chip8_rewind_clear(rw);
+    free(rw->ring);
+    free(rw->scratch);
+    rw->ring = NULL;
+    rw->capacity = 0;
+    rw->scratch = NULL;
+    rw->scratch_size = 0;
+}
+
+/*
+Number of frames chip8_rewind can go back
+*/
+uint32_t chip8_rewind_frames(const Chip8_Rewind* rw) {
+    return rw->has_frame ? rw->deltas + 1 : 0;
+}
+
+static void rewind_ring_write(Chip8_Rewind* rw, size_t pos, const uint8_t* src, size_t len) {
+    size_t first = rw->capacity - pos;
+    if (first > len) {
+        first = len;
+    }
+    memcpy(rw->ring + pos, src, first);
+    memcpy(rw->ring, src + first, len - first);
+}
+
+static void rewind_ring_read(const Chip8_Rewind* rw, size_t pos, uint8_t* dst, size_t len) {
+    size_t first = rw->capacity - pos;
+    if (first > len) {
+        first = len;
+    }
+    memcpy(dst, rw->ring + pos, first);
+    memcpy(dst + first, rw->ring, len - first);
+}
+
+static uint32_t rewind_ring_size_at(const Chip8_Rewind* rw, size_t pos) {
+    uint8_t size[4];
+    rewind_ring_read(rw, pos % rw->capacity, size, sizeof(size));
+    return get_u32(size);
+}
+
+/*
+Appends runs for the bytes where old and cur differ to out at pos, recording the
+old bytes. Equal stretches shorter than a run header are kept inside the run.
+offset is the record offset of old[0]. Returns the new end of out.
+*/
+static size_t rewind_diff(uint8_t* out, size_t pos, const uint8_t* old, const uint8_t* cur, size_t len, uint32_t offset) {
+    size_t i = 0;
+    while (i < len) {
+        if (old[i] == cur[i]) {
+            i++;
+            continue;
+        }
+
+        size_t start = i;
+        size_t last_diff = i;
+        for (size_t end = i + 1; end < len && end - start < 256; end++) {
+            if (old[end] != cur[end]) {
+                last_diff = end;
+            } else if (end - last_diff > REWIND_RUN_HEADER) {
+                break;
+            }
+        }
+
+        size_t run = last_diff + 1 - start;
+        put_u32(out + pos, offset + start);
+        out[pos + 4] = run - 1;
+        memcpy(out + pos + REWIND_RUN_HEADER, old + start, run);
+        pos += REWIND_RUN_HEADER + run;
+        i = last_diff + 1;
+    }
+    return pos;
+}
+
+/*
+Makes the history reference the pages chip8 has now
+*/
+static void rewind_hold_pages(Chip8_Rewind* rw, const Chip8* chip8) {
+    for (int p = 0; p < RAM_PAGE_COUNT; p++) {
+        if (rw->pages[p] != chip8->ram[p]) {
+            chip8_page_acquire(chip8->ram[p]);
+            chip8_page_release(rw->pages[p]);
+            rw->pages[p] = chip8->ram[p];
+        }
+    }
+}
+
+static void rewind_drop_oldest(Chip8_Rewind* rw) {
+    size_t tail = (rw->head + rw->capacity - rw->used) % rw->capacity;
+    rw->used -= rewind_ring_size_at(rw, tail) + 8;
+    rw->deltas--;
+    rw->frames_dropped++;
+}
+
+/*
+Records the frame chip8 just finished. Call once per frame, at the frame boundary.
+*/
+void chip8_rewind_push(Chip8_Rewind* rw, const Chip8* chip8) {
+    uint8_t regs[CHIP8_STATE_RAM_OFFSET];
+    chip8_save_regs(chip8, regs);
+
+    // room for a delta of the whole record, sized by the machine's ram
+    size_t max_delta = REWIND_MAX_DELTA(chip8_state_size(chip8));
+    if (rw->scratch_size < max_delta) {
+        uint8_t* scratch = realloc(rw->scratch, max_delta);
+        if (scratch == NULL) {
+            fprintf(stderr, "out of memory growing the rewind buffer\n");
+            abort();
+        }
+        rw->scratch = scratch;
+        rw->scratch_size = max_delta;
+    }
+
+    if (rw->has_frame) {
+        size_t size = rewind_diff(rw->scratch, 4, rw->regs, regs, sizeof(regs), 0);
+        for (int p = 0; p < RAM_PAGE_COUNT; p++) {
+            if (rw->pages[p] != chip8->ram[p]) {
+                size = rewind_diff(rw->scratch, size, rw->pages[p]->bytes, chip8->ram[p]->bytes,
+                                   RAM_PAGE_SIZE, CHIP8_STATE_RAM_OFFSET + p * RAM_PAGE_SIZE);
+            }
+        }
+        put_u32(rw->scratch, size - 4);
+        put_u32(rw->scratch + size, size - 4);
+        size += 4;
+
+        if (size > rw->capacity) {
+            // can't hold even this one frame: history restarts here
+            rw->frames_dropped += rw->deltas;
+            rw->head = 0;
+            rw->used = 0;
+            rw->deltas = 0;
+        } else {
+            while (rw->capacity - rw->used < size) {
+                rewind_drop_oldest(rw);
+            }
+            rewind_ring_write(rw, rw->head, rw->scratch, size);
+            rw->head = (rw->head + size) % rw->capacity;
+            rw->used += size;
+            rw->deltas++;
+        }
+        rw->bytes_pushed += size;
+    }
+
+    memcpy(rw->regs, regs, sizeof(regs));
+    rewind_hold_pages(rw, chip8);
+    rw->has_frame = TRUE;
+    rw->frames_pushed++;
+}
+
+/*
+Puts chip8 back to the state of `frames` pushes ago, 1 being the latest push.
+frames is clamped to chip8_rewind_frames. The restored frame becomes the latest
+push, so emulation carries on from it. Returns the number of frames gone back.
+*/
+uint32_t chip8_rewind(Chip8_Rewind* rw, Chip8* chip8, uint32_t frames) {
+    if (frames > chip8_rewind_frames(rw)) {
+        frames = chip8_rewind_frames(rw);
+    }
+    if (frames == 0) {
+        return 0;
+    }
+
+    // ram is swapped page by page below, compiled blocks may cover any of it
+    if (chip8->jit != NULL) {
+        chip8_jit_flush(chip8);
+    }
+
+    // the latest push: its pages are held as they were
+    for (int p = 0; p < RAM_PAGE_COUNT; p++) {
+        if (chip8->ram[p] != rw->pages[p]) {
+            chip8_page_acquire(rw->pages[p]);
+            chip8_page_release(chip8->ram[p]);
+            chip8->ram[p] = rw->pages[p];
+        }
+    }
+    CHIP8_TRACE_RAM_LOADED(chip8);
+
+    // every older frame is one delta further back, newest first
+    for (uint32_t f = 1; f < frames; f++) {
+        uint32_t size = rewind_ring_size_at(rw, rw->head + rw->capacity - 4);
+        size_t start = (rw->head + rw->capacity - 4 - size) % rw->capacity;
+        rewind_ring_read(rw, start, rw->scratch, size);
+        rw->head = (start + rw->capacity - 4) % rw->capacity;
+        rw->used -= size + 8;
+        rw->deltas--;
+
+        for (uint32_t pos = 0; pos < size; ) {
+            uint32_t offset = get_u32(rw->scratch + pos);
+            uint16_t len = rw->scratch[pos + 4] + 1;
+            const uint8_t* bytes = rw->scratch + pos + REWIND_RUN_HEADER;
+            if (offset < CHIP8_STATE_RAM_OFFSET) {
+                memcpy(rw->regs + offset, bytes, len);
+            } else {
+                chip8_load_ram(chip8, offset - CHIP8_STATE_RAM_OFFSET, bytes, len);
+            }
+            pos += REWIND_RUN_HEADER + len;
+        }
+    }
+    chip8_load_regs(chip8, rw->regs);
+
+    // back on another machine: the block compiler's tables are sized for the old one
+    if (chip8->jit != NULL && chip8->jit->ram_size != (uint32_t)chip8->ram_mask + 1) {
+        chip8_jit_flush(chip8);
+    }
+
+    // what chip8 holds now is the latest push
+    rewind_hold_pages(rw, chip8);
+    return frames;
+}
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+#include "chip8_def.h"
+
+/*
+Per-instance random numbers for Cxkk: xoshiro128** seeded through splitmix64.
+The state lives in the Chip8 itself, so runs are reproducible from their seed and
+instances on different threads share nothing.
+*/
+
+static inline uint32_t rng_rotl(uint32_t x, int k) {
+    return (x << k) | (x >> (32 - k));
+}
+
+/*
+Seeds the generator, the same seed always gives the same sequence
+*/
+void chip8_seed_rng(Chip8* chip8, uint64_t seed) {
+    chip8->rng_seed = seed;
+    for (int i = 0; i < 4; i += 2) {
+        // splitmix64 spreads the seed over the whole state and never leaves it all zero
+        uint64_t z = (seed += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        z = z ^ (z >> 31);
+        chip8->rng_state[i] = (uint32_t)z;
+        chip8->rng_state[i + 1] = (uint32_t)(z >> 32);
+    }
+}
+
+/*
+Next 32 random bits
+*/
+static inline uint32_t chip8_rng_next(Chip8* chip8) {
+    uint32_t* s = chip8->rng_state;
+    uint32_t result = rng_rotl(s[1] * 5, 7) * 9;
+    uint32_t t = s[1] << 9;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rng_rotl(s[3], 11);
+    return result;
+}
+
+#endif
@@ -0,0 +1,230 @@
+#ifndef ROMCACHE_H
+#define ROMCACHE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "chip8_def.h"
+#include "memory.h"
+#include "movie.h"
+#include "quirks.h"
+#include "analyze.h"
+#include "helperMethods.h"
+
+/*
+Rom images shared by every instance that runs them. A rom file is mmap'ed
+read-only once, and its program area is built once into decoded ram pages
+(memory.h) that the cache holds a reference to. Loading the rom into an
+instance points the instance's pages at those and bumps their refcounts, so
+starting an instance copies and decodes nothing. The first store into a page
+copies it for that instance alone, as with forks.
+
+Images are deduplicated by content (chip8_rom_hash, then the bytes), so the
+same rom opened under different paths is mapped and built once. Roms larger
+than MAX_ROM_SIZE are refused when opened, roms too large for an instance's
+machine when loaded into it.
+
+The static analysis the block compiler is prewarmed from (analyze.h) depends on
+the rom and quirk profile alone, so it is done once per image and profile too
+(chip8_rom_cache_analyze) and every instance compiles its blocks from that
+list (chip8_rom_prewarm) instead of analyzing the rom again.
+*/
+#define ROM_FIRST_PAGE (PROGRAM_START_ADDR / RAM_PAGE_SIZE)
+#define ROM_MAX_PAGES (RAM_PAGE_COUNT - ROM_FIRST_PAGE)
+
+typedef struct {
+    uint64_t hash;                   // chip8_rom_hash of the bytes
+    size_t size;
+    const uint8_t* bytes;            // the file, mapped read-only (NULL if empty)
+    Chip8_RamPage* pages[ROM_MAX_PAGES]; // program area from PROGRAM_START_ADDR, one reference held here
+    int num_pages;
+    uint16_t* prewarm[QUIRK_PROFILE_COUNT]; // chip8_prewarm_order under each profile, NULL until analyzed
+    uint32_t prewarm_count[QUIRK_PROFILE_COUNT];
+} Chip8_RomImage;
+
+typedef struct {
+    Chip8_RomImage** images;
+    size_t count;
+    size_t capacity;
+} Chip8_RomCache;
+
+void chip8_rom_cache_init(Chip8_RomCache* cache) {
+    cache->images = NULL;
+    cache->count = 0;
+    cache->capacity = 0;
+}
+
+static void rom_image_free(Chip8_RomImage* image) {
+    for (int k = 0; k < image->num_pages; k++) {
+        chip8_page_release(image->pages[k]);
+    }
+    for (int q = 0; q < QUIRK_PROFILE_COUNT; q++) {
+        free(image->prewarm[q]);
+    }
+    if (image->bytes != NULL) {
+        munmap((void*)image->bytes, image->size);
+    }
+    free(image);
+}
+
+/*
+Builds the decoded pages of image from its bytes. Returns FALSE if out of memory.
+*/
+static int rom_image_build(Chip8_RomImage* image) {
+    image->num_pages = (int)((image->size + RAM_PAGE_SIZE - 1) / RAM_PAGE_SIZE);
+    for (int k = 0; k < image->num_pages; k++) {
+        size_t offset = (size_t)k * RAM_PAGE_SIZE;
+        size_t len = (image->size - offset < RAM_PAGE_SIZE) ? image->size - offset : RAM_PAGE_SIZE;
+        image->pages[k] = chip8_page_new(image->bytes + offset, len);
+        if (image->pages[k] == NULL) {
+            image->num_pages = k;
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/*
+The image of the rom file at path, mapped and built on first use. Returns NULL
+if the file can't be read, is larger than MAX_ROM_SIZE, or memory runs out.
+*/
+const Chip8_RomImage* chip8_rom_cache_open(Chip8_RomCache* cache, const char* path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size > MAX_ROM_SIZE) {
+        close(fd);
+        return NULL;
+    }
+    size_t size = (size_t)st.st_size;
+    const uint8_t* bytes = NULL;
+    if (size > 0) {
+        void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            return NULL;
+        }
+        bytes = data;
+    }
+    close(fd);
+
+    uint64_t hash = chip8_rom_hash(bytes, size);
+    for (size_t i = 0; i < cache->count; i++) {
+        const Chip8_RomImage* image = cache->images[i];
+        if (image->hash == hash && image->size == size && (size == 0 || memcmp(image->bytes, bytes, size) == 0)) {
+            if (bytes != NULL) {
+                munmap((void*)bytes, size);
+            }
+            return image;
+        }
+    }
+
+    if (cache->count == cache->capacity) {
+        size_t capacity = cache->capacity ? cache->capacity * 2 : 16;
+        Chip8_RomImage** images = realloc(cache->images, capacity * sizeof(*images));
+        if (images == NULL) {
+            if (bytes != NULL) {
+                munmap((void*)bytes, size);
+            }
+            return NULL;
+        }
+        cache->images = images;
+        cache->capacity = capacity;
+    }
+    Chip8_RomImage* image = calloc(1, sizeof(Chip8_RomImage));
+    if (image == NULL) {
+        if (bytes != NULL) {
+            munmap((void*)bytes, size);
+        }
+        return NULL;
+    }
+    image->hash = hash;
+    image->size = size;
+    image->bytes = bytes;
+    if (!rom_image_build(image)) {
+        rom_image_free(image);
+        return NULL;
+    }
+    cache->images[cache->count++] = image;
+    return image;
+}
+
+/*
+Unmaps every image and drops the cache's page references. Instances still
+running a rom keep its pages.
+*/
+void chip8_rom_cache_free(Chip8_RomCache* cache) {
+    for (size_t i = 0; i < cache->count; i++) {
+        rom_image_free(cache->images[i]);
+    }
+    free(cache->images);
+    chip8_rom_cache_init(cache);
+}
+
+/*
+load_rom_image for a fresh instance from a cached image: shares its pages
+instead of copying the bytes in. Returns FALSE, loading nothing, if the rom
+doesn't fit in the ram of chip8's machine (quirks.h).
+*/
+int chip8_load_rom(Chip8* chip8, const Chip8_RomImage* image) {
+    if (image->size > (size_t)chip8->ram_mask + 1 - PROGRAM_START_ADDR) {
+        return FALSE;
+    }
+    chip8_share_pages(chip8, ROM_FIRST_PAGE, image->pages, image->num_pages);
+    return TRUE;
+}
+
+/*
+Builds the prewarm list of every image in the cache under quirks that doesn't
+have one yet, on a scratch instance. Images too large for the profile's machine
+get none. Not thread-safe: call before instances start on other threads.
+Returns FALSE if out of memory.
+*/
+int chip8_rom_cache_analyze(Chip8_RomCache* cache, uint8_t quirks) {
+    Chip8* chip8 = malloc(sizeof(Chip8));
+    if (chip8 == NULL) {
+        return FALSE;
+    }
+
+    int ok = TRUE;
+    for (size_t i = 0; i < cache->count && ok; i++) {
+        Chip8_RomImage* image = cache->images[i];
+        if (image->prewarm[quirks] != NULL) {
+            continue;
+        }
+        initialize(chip8);
+        chip8_set_quirks(chip8, quirks);
+        if (chip8_load_rom(chip8, image)) {
+            long count = chip8_prewarm_order(chip8, &image->prewarm[quirks]);
+            image->prewarm_count[quirks] = (count > 0) ? (uint32_t)count : 0;
+            ok = count >= 0;
+        }
+        chip8_release(chip8);
+    }
+    free(chip8);
+    return ok;
+}
+
+/*
+chip8_jit_prewarm for an instance of a cached image: compiles the blocks of
+the image's prewarm list for chip8's profile, analyzing the rom on the spot
+only if the list wasn't built. Returns how many were compiled, -1 if out of
+memory.
+*/
+int chip8_rom_prewarm(Chip8* chip8, const Chip8_RomImage* image) {
+    if (chip8->jit == NULL) {
+        return -1;
+    }
+    if (image->prewarm[chip8->quirks] == NULL) {
+        return chip8_jit_prewarm(chip8);
+    }
+    return chip8_jit_prewarm_blocks(chip8, image->prewarm[chip8->quirks], image->prewarm_count[chip8->quirks]);
+}
+
+#endif
@@ -0,0 +1,138 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+#include "chip8_def.h"
+#include "cpu.h"
+#include "clock.h"
+#include "input.h"
+
+/*
+Frame scheduler. Emulation advances in 60 Hz frames (chip8_run_frame: a fixed
+number of instructions, then one timer tick), and the scheduler decides when
+frames run:
+
+    realtime    frames follow the monotonic clock, 60 per second. Between frames
+                the thread sleeps until the next one is due. After a stall, up
+                to max_catchup overdue frames run back to back, shown as one,
+                and any beyond that are dropped so the game slows down instead
+                of fast-forwarding.
+    turbo       no sleeping: each step runs as many frames as fit in 1/60 s of
+                wall-clock time, so the frontend still gets to present and poll
+                input 60 times a second.
+    fixed-step  exactly one frame per step, the clock is never read. Runs are
+                reproducible and nothing waits on wall-clock time (headless).
+*/
+#define SCHED_FRAME_NS (1000000000ull / FRAME_RATE)
+#define SCHED_MAX_CATCHUP 5          // overdue frames run back to back before the rest are dropped
+#define SCHED_TURBO_BATCH 16         // turbo frames between clock reads
+
+typedef enum {
+    SCHED_REALTIME,
+    SCHED_TURBO,
+    SCHED_FIXED_STEP
+} Chip8_SchedMode;
+
+typedef struct {
+    Chip8_SchedMode mode;
+    uint32_t instructions_per_frame;
+    uint32_t max_catchup;
+    uint64_t next_frame_ns;          // when the next frame is due (realtime)
+    Chip8_InputQueue* input;         // key events applied while frames run, NULL if none
+
+    // statistics
+    uint64_t frames;                 // frames emulated
+    uint64_t frames_skipped;         // emulated but not presented (catch-up, turbo)
+    uint64_t frames_dropped;         // due but never emulated, after a stall
+} Chip8_Scheduler;
+
+void chip8_sched_init(Chip8_Scheduler* sched, Chip8_SchedMode mode, uint32_t instructions_per_frame) {
+    sched->mode = mode;
+    sched->instructions_per_frame = instructions_per_frame;
+    sched->max_catchup = SCHED_MAX_CATCHUP;
+    sched->input = NULL;
+    sched->next_frame_ns = (mode == SCHED_FIXED_STEP) ? 0 : chip8_now_ns();
+    sched->frames = 0;
+    sched->frames_skipped = 0;
+    sched->frames_dropped = 0;
+}
+
+/*
+Realtime step: waits for the next frame to be due, then runs every due frame
+*/
+uint32_t sched_step_realtime(Chip8_Scheduler* sched, Chip8* chip8) {
+    uint64_t now = chip8_now_ns();
+    while (now < sched->next_frame_ns) {
+        chip8_sleep_ns(sched->next_frame_ns - now);
+        now = chip8_now_ns();
+    }
+
+    uint64_t due = (now - sched->next_frame_ns) / SCHED_FRAME_NS + 1;
+    if (due > sched->max_catchup) {
+        // too far behind to catch up: drop the rest and resync to the clock
+        sched->frames_dropped += due - sched->max_catchup;
+        due = sched->max_catchup;
+        sched->next_frame_ns = now + SCHED_FRAME_NS;
+    } else {
+        sched->next_frame_ns += due * SCHED_FRAME_NS;
+    }
+
+    for (uint64_t f = 0; f < due; f++) {
+        chip8_input_run_frame(chip8, sched->input, sched->instructions_per_frame);
+    }
+    sched->frames_skipped += due - 1;
+    return (uint32_t)due;
+}
+
+/*
+Turbo step: as many frames as fit in one frame of wall-clock time
+*/
+uint32_t sched_step_turbo(Chip8_Scheduler* sched, Chip8* chip8) {
+    uint64_t start = chip8_now_ns();
+    uint32_t ran = 0;
+
+    do {
+        for (int f = 0; f < SCHED_TURBO_BATCH; f++) {
+            chip8_input_run_frame(chip8, sched->input, sched->instructions_per_frame);
+        }
+        ran += SCHED_TURBO_BATCH;
+    } while (chip8->is_running_flag && chip8_now_ns() - start < SCHED_FRAME_NS);
+
+    sched->frames_skipped += ran - 1;
+    return ran;
+}
+
+/*
+Runs the frames that are due under the scheduler's mode and returns how many
+ran; the frontend presents once after each step that ran any. Nothing runs while
+chip8 is paused or halted.
+*/
+uint32_t chip8_sched_step(Chip8_Scheduler* sched, Chip8* chip8) {
+    uint32_t ran = 0;
+
+    if (!chip8->is_running_flag || chip8->is_paused_flag) {
+        // keep the clock from piling up overdue frames while nothing runs
+        if (sched->mode != SCHED_FIXED_STEP) {
+            chip8_sleep_ns(SCHED_FRAME_NS);
+            sched->next_frame_ns = chip8_now_ns();
+        }
+        return 0;
+    }
+
+    switch (sched->mode) {
+        case SCHED_REALTIME:
+            ran = sched_step_realtime(sched, chip8);
+            break;
+        case SCHED_TURBO:
+            ran = sched_step_turbo(sched, chip8);
+            break;
+        case SCHED_FIXED_STEP:
+            chip8_input_run_frame(chip8, sched->input, sched->instructions_per_frame);
+            ran = 1;
+            break;
+    }
+    sched->frames += ran;
+    return ran;
+}
+
+#endif
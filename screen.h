@@ -0,0 +1,210 @@
+#ifndef SCREEN_H
+#define SCREEN_H
+
+#include <stdint.h>
+#include <string.h>
+#include "chip8_def.h"
+
+/*
+The screen is stored one bit per pixel, each row as SCREEN_ROW_WORDS 64-bit words.
+Pixel x of a row is bit (63 - x % 64) of word x / 64, so the leftmost pixel is
+the most significant bit, same order as sprite bytes in ram.
+
+The arrays are sized for the 128x64 mode. In 64x32 only the first 32 rows and
+the first word of each are in use, so a row is one word and low-res drawing
+costs what it always did. Functions taking `words` work on that many words of a
+row, 1 in low-res and 2 in high-res (screen_words); callers that know the mode
+at compile time pass a constant and the loops unroll away.
+
+XO-CHIP draws on SCREEN_PLANES planes, a pixel's color is the bits it has on
+each. CHIP-8 and SCHIP only ever touch plane 0.
+*/
+#define SCREEN_ROW_BYTES (SCREEN_ROW_WORDS * sizeof(uint64_t))
+
+static inline int screen_words(const Chip8* chip8) {
+    return 1 << chip8->hires;
+}
+
+static inline int screen_width(const Chip8* chip8) {
+    return SCREEN_WIDTH << chip8->hires;
+}
+
+static inline int screen_height(const Chip8* chip8) {
+    return SCREEN_HEIGHT << chip8->hires;
+}
+
+/*
+Builds the row mask for a sprite row drawn at column x (x < 64 * words). sprite
+holds the row's width pixels left aligned, pixel 0 in the top bit. Pixels past
+the right edge wrap around to the left, or are dropped if clip.
+*/
+static inline void screen_sprite_mask(uint64_t mask[SCREEN_ROW_WORDS], uint64_t sprite, const int width,
+                                      uint8_t x, const int words, const int clip) {
+    uint8_t word = x / 64;
+    uint8_t shift = x % 64;
+
+    memset(mask, 0, SCREEN_ROW_WORDS * sizeof(uint64_t));
+    mask[word] = sprite >> shift;
+    if (shift > 64 - width) {
+        if (!clip) {
+            mask[(word + 1) % words] |= sprite << (64 - shift);
+        } else if (word + 1 < words) {
+            mask[word + 1] = sprite << (64 - shift);
+        }
+    }
+}
+
+/*
+XORs the first words words of mask into row, returns TRUE if any pixel that was
+on got turned off
+*/
+static inline uint8_t screen_xor_row(uint64_t row[SCREEN_ROW_WORDS], const uint64_t mask[SCREEN_ROW_WORDS], const int words) {
+    uint64_t collision = 0;
+    for (int w = 0; w < words; w++) {
+        collision |= row[w] & mask[w];
+        row[w] ^= mask[w];
+    }
+    return collision != 0;
+}
+
+/*
+Value (0 or 1) of the pixel at x, y of plane 0
+*/
+static inline uint8_t screen_pixel(const Chip8* chip8, int x, int y) {
+    return (chip8->screen[0][y][x / 64] >> (63 - x % 64)) & 1;
+}
+
+static inline uint8_t screen_plane_blank(const Chip8* chip8, int plane) {
+    uint64_t any = 0;
+    for (int y = 0; y < SCREEN_HIRES_HEIGHT; y++) {
+        for (int w = 0; w < SCREEN_ROW_WORDS; w++) {
+            any |= chip8->screen[plane][y][w];
+        }
+    }
+    return any == 0;
+}
+
+/*
+64-bit FNV-1a hash of the visible screen, used to compare framebuffers across
+runs: the rows and words of the current mode, plane by plane. A blank plane
+past the first is left out, so CHIP-8 screens hash the same as they always did.
+*/
+uint64_t screen_hash(const Chip8* chip8) {
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for (int p = 0; p < SCREEN_PLANES; p++) {
+        if (p > 0 && screen_plane_blank(chip8, p)) {
+            continue;
+        }
+        for (int y = 0; y < screen_height(chip8); y++) {
+            const uint8_t* bytes = (const uint8_t*)chip8->screen[p][y];
+            for (size_t i = 0; i < screen_words(chip8) * sizeof(uint64_t); i++) {
+                hash ^= bytes[i];
+                hash *= 0x100000001B3ull;
+            }
+        }
+    }
+    return hash;
+}
+
+/*
+Records that the pixels of mask changed on row y, for frontends redrawing only
+what changed (dirty_rows / dirty_cols)
+*/
+static inline void screen_mark_dirty(Chip8* chip8, int y, const uint64_t mask[SCREEN_ROW_WORDS], const int words) {
+    uint64_t any = 0;
+    for (int w = 0; w < words; w++) {
+        chip8->dirty_cols[w] |= mask[w];
+        any |= mask[w];
+    }
+    chip8->dirty_rows |= (uint64_t)(any != 0) << y;
+}
+
+/*
+The whole screen needs redrawing (cleared, scrolled, or replaced by a snapshot)
+*/
+static inline void screen_mark_all_dirty(Chip8* chip8) {
+    chip8->dirty_rows = ~0ull;
+    memset(chip8->dirty_cols, 0xFF, sizeof(chip8->dirty_cols));
+}
+
+static inline void screen_clear(Chip8* chip8) {
+    memset(chip8->screen, 0, sizeof(chip8->screen));
+    screen_mark_all_dirty(chip8);
+}
+
+/*
+Clears the planes in mask (bit p: plane p)
+*/
+static inline void screen_clear_planes(Chip8* chip8, uint8_t planes) {
+    for (int p = 0; p < SCREEN_PLANES; p++) {
+        if (planes & (1 << p)) {
+            memset(chip8->screen[p], 0, sizeof(chip8->screen[p]));
+        }
+    }
+    screen_mark_all_dirty(chip8);
+}
+
+// Scrolls of the planes in mask by whole pixels of the current mode: rows move
+// with one memmove per plane, columns with a shift per word carrying the bits
+// that cross into the neighbouring word. What scrolls off is lost, what scrolls
+// in is blank.
+
+static inline void screen_scroll_down(Chip8* chip8, uint8_t planes, int n) {
+    int height = screen_height(chip8);
+    n = (n < height) ? n : height;
+    for (int p = 0; p < SCREEN_PLANES; p++) {
+        if (planes & (1 << p)) {
+            memmove(chip8->screen[p][n], chip8->screen[p][0], (height - n) * SCREEN_ROW_BYTES);
+            memset(chip8->screen[p][0], 0, n * SCREEN_ROW_BYTES);
+        }
+    }
+    screen_mark_all_dirty(chip8);
+}
+
+static inline void screen_scroll_up(Chip8* chip8, uint8_t planes, int n) {
+    int height = screen_height(chip8);
+    n = (n < height) ? n : height;
+    for (int p = 0; p < SCREEN_PLANES; p++) {
+        if (planes & (1 << p)) {
+            memmove(chip8->screen[p][0], chip8->screen[p][n], (height - n) * SCREEN_ROW_BYTES);
+            memset(chip8->screen[p][height - n], 0, n * SCREEN_ROW_BYTES);
+        }
+    }
+    screen_mark_all_dirty(chip8);
+}
+
+/*
+0 < n < 64
+*/
+static inline void screen_scroll_right(Chip8* chip8, uint8_t planes, int n) {
+    int words = screen_words(chip8);
+    for (int p = 0; p < SCREEN_PLANES; p++) {
+        for (int y = 0; y < screen_height(chip8) && (planes & (1 << p)); y++) {
+            uint64_t* row = chip8->screen[p][y];
+            for (int w = words - 1; w > 0; w--) {
+                row[w] = (row[w] >> n) | (row[w - 1] << (64 - n));
+            }
+            row[0] >>= n;
+        }
+    }
+    screen_mark_all_dirty(chip8);
+}
+
+/*
+0 < n < 64
+*/
+static inline void screen_scroll_left(Chip8* chip8, uint8_t planes, int n) {
+    int words = screen_words(chip8);
+    for (int p = 0; p < SCREEN_PLANES; p++) {
+        for (int y = 0; y < screen_height(chip8) && (planes & (1 << p)); y++) {
+            uint64_t* row = chip8->screen[p][y];
+            for (int w = 0; w < words - 1; w++) {
+                row[w] = (row[w] << n) | (row[w + 1] >> (64 - n));
+            }
+            row[words - 1] <<= n;
+        }
+    }
+    screen_mark_all_dirty(chip8);
+}
+
+#endif
@@ -0,0 +1,323 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "chip8_def.h"
+#include "memory.h"
+#include "screen.h"
+#include "jit.h"
+#include "quirks.h"
+
+/*
+Snapshots: the whole machine state (ram, registers, stack, timers, screen,
+keyboard, rng) as one little-endian record. Every field is at a fixed offset and
+a record holds only the machine's own ram, so records of one machine all have
+the same size, chip8_state_size: 6k for a 4k CHIP-8 or SCHIP machine, 66k for
+XO-CHIP. A snapshot file is just records of one machine back to back: it can be
+appended to, indexed in O(1), and mmap'ed and restored straight from the mapping
+with no read() or parsing buffer in between.
+
+Record layout (CHIP8_STATE_RAM_OFFSET + ram size bytes):
+    0      magic "C8ST"
+    4      u16 version
+    6      u16 flags (is_running, draw_screen, is_paused, was_key_pressed)
+    8      u16 pc, u16 I, u16 sp, u16 current_op
+    16     u8 delay timer, u8 sound timer, u16 keyboard (bit n = key n down)
+    20     u8 V[16]
+    36     u16 stack[16]
+    68     u32 rng_state[4], u64 rng_seed
+    92     u64 cycle_count
+    100    u8 quirk profile, u8 hires, u8 planes, u8 audio pitch
+    104    u8 rpl[16]
+    120    u8 audio_pattern[16]
+    136    u32 ram size (ram_mask + 1, the quirk profile's)
+    140    u64 screen[SCREEN_PLANES][SCREEN_HIRES_HEIGHT][SCREEN_ROW_WORDS]
+    ...    u8 ram[ram size]
+
+Version 1 records (64x32 screen, 4k ram) predate SCHIP and XO-CHIP, version 2
+ones carry 64k of ram whatever the machine; neither is read anymore.
+*/
+#define CHIP8_STATE_MAGIC "C8ST"
+#define CHIP8_STATE_VERSION 3
+#define CHIP8_STATE_RAM_SIZE_OFFSET 136
+#define CHIP8_STATE_SCREEN_OFFSET 140
+#define CHIP8_STATE_SCREEN_WORDS (SCREEN_PLANES * SCREEN_HIRES_HEIGHT * SCREEN_ROW_WORDS)
+#define CHIP8_STATE_RAM_OFFSET (CHIP8_STATE_SCREEN_OFFSET + CHIP8_STATE_SCREEN_WORDS * 8)
+#define CHIP8_STATE_RECORD_SIZE(ram_size) (CHIP8_STATE_RAM_OFFSET + (size_t)(ram_size))
+#define CHIP8_STATE_MAX_SIZE CHIP8_STATE_RECORD_SIZE(TOTAL_RAM) // an XO-CHIP record, the largest
+
+static inline void put_u16(uint8_t* p, uint16_t v) {
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+}
+
+static inline void put_u32(uint8_t* p, uint32_t v) {
+    put_u16(p, v & 0xFFFF);
+    put_u16(p + 2, v >> 16);
+}
+
+static inline void put_u64(uint8_t* p, uint64_t v) {
+    put_u32(p, v & 0xFFFFFFFF);
+    put_u32(p + 4, v >> 32);
+}
+
+static inline uint16_t get_u16(const uint8_t* p) {
+    return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t get_u32(const uint8_t* p) {
+    return get_u16(p) | ((uint32_t)get_u16(p + 2) << 16);
+}
+
+static inline uint64_t get_u64(const uint8_t* p) {
+    return get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+// Size of chip8's record, its machine's ram included
+static inline size_t chip8_state_size(const Chip8* chip8) {
+    return CHIP8_STATE_RECORD_SIZE((uint32_t)chip8->ram_mask + 1);
+}
+
+/*
+Size of the record buf starts with, read from its header, or 0 if size bytes
+don't hold a record of this version whose ram size is its machine's
+*/
+size_t chip8_state_record_size(const uint8_t* buf, size_t size) {
+    if (size < CHIP8_STATE_RAM_OFFSET || memcmp(buf, CHIP8_STATE_MAGIC, 4) != 0 ||
+        get_u16(buf + 4) != CHIP8_STATE_VERSION) {
+        return 0;
+    }
+    uint32_t ram_size = get_u32(buf + CHIP8_STATE_RAM_SIZE_OFFSET);
+    if (ram_size != (uint32_t)QUIRK_RAM_MASKS[buf[100] % QUIRK_PROFILE_COUNT] + 1) {
+        return 0;
+    }
+    return CHIP8_STATE_RECORD_SIZE(ram_size);
+}
+
+/*
+Writes everything in the record before ram (header, registers, screen) into
+buf, CHIP8_STATE_RAM_OFFSET bytes
+*/
+void chip8_save_regs(const Chip8* chip8, uint8_t* buf) {
+    uint16_t keys = 0;
+    for (int i = 0; i < NUM_KEYS; i++) {
+        keys |= (chip8->keyboard[i] != FALSE) << i;
+    }
+    uint16_t flags = (chip8->is_running_flag != FALSE)
+                   | (chip8->draw_screen_flag != FALSE) << 1
+                   | (chip8->is_paused_flag != FALSE) << 2
+                   | (chip8->was_key_pressed != FALSE) << 3;
+
+    memcpy(buf, CHIP8_STATE_MAGIC, 4);
+    put_u16(buf + 4, CHIP8_STATE_VERSION);
+    put_u16(buf + 6, flags);
+    put_u16(buf + 8, chip8->pc_reg);
+    put_u16(buf + 10, chip8->I_reg);
+    put_u16(buf + 12, chip8->sp_reg);
+    put_u16(buf + 14, chip8->current_op);
+    buf[16] = chip8->delay_timer;
+    buf[17] = chip8->sound_timer;
+    put_u16(buf + 18, keys);
+    memcpy(buf + 20, chip8->V, NUM_V_REGISTERS);
+    for (int i = 0; i < STACK_SIZE; i++) {
+        put_u16(buf + 36 + i * 2, chip8->stack[i]);
+    }
+    for (int i = 0; i < 4; i++) {
+        put_u32(buf + 68 + i * 4, chip8->rng_state[i]);
+    }
+    put_u64(buf + 84, chip8->rng_seed);
+    put_u64(buf + 92, chip8->cycle_count);
+    buf[100] = chip8->quirks;
+    buf[101] = chip8->hires;
+    buf[102] = chip8->planes;
+    buf[103] = chip8->audio_pitch;
+    memcpy(buf + 104, chip8->rpl, NUM_RPL_FLAGS);
+    memcpy(buf + 120, chip8->audio_pattern, AUDIO_PATTERN_SIZE);
+    put_u32(buf + CHIP8_STATE_RAM_SIZE_OFFSET, (uint32_t)chip8->ram_mask + 1);
+    const uint64_t* screen = &chip8->screen[0][0][0];
+    for (int i = 0; i < CHIP8_STATE_SCREEN_WORDS; i++) {
+        put_u64(buf + CHIP8_STATE_SCREEN_OFFSET + i * 8, screen[i]);
+    }
+}
+
+/*
+Writes the state of chip8 into buf. Returns the number of bytes written
+(chip8_state_size), or 0 if buf is too small.
+*/
+size_t chip8_save_state(const Chip8* chip8, uint8_t* buf, size_t size) {
+    size_t state_size = chip8_state_size(chip8);
+    if (size < state_size) {
+        return 0;
+    }
+
+    chip8_save_regs(chip8, buf);
+    for (uint32_t p = 0; p < ((uint32_t)chip8->ram_mask + 1) / RAM_PAGE_SIZE; p++) {
+        memcpy(buf + CHIP8_STATE_RAM_OFFSET + p * RAM_PAGE_SIZE, chip8->ram[p]->bytes, RAM_PAGE_SIZE);
+    }
+    return state_size;
+}
+
+/*
+Restores what chip8_save_regs wrote, buf is not checked
+*/
+void chip8_load_regs(Chip8* chip8, const uint8_t* buf) {
+    uint16_t flags = get_u16(buf + 6);
+    uint16_t keys = get_u16(buf + 18);
+
+    chip8->is_running_flag = (flags & 0x1) ? TRUE : FALSE;
+    chip8->draw_screen_flag = (flags & 0x2) ? TRUE : FALSE;
+    chip8->is_paused_flag = (flags & 0x4) ? TRUE : FALSE;
+    chip8->was_key_pressed = (flags & 0x8) ? TRUE : FALSE;
+    chip8->pc_reg = get_u16(buf + 8);
+    chip8->I_reg = get_u16(buf + 10);
+    chip8->sp_reg = get_u16(buf + 12) % (STACK_SIZE + 1); // STACK_SIZE: full
+    chip8->current_op = get_u16(buf + 14);
+    chip8->op = chip8_decode(chip8->current_op);
+    chip8->delay_timer = buf[16];
+    chip8->sound_timer = buf[17];
+    for (int i = 0; i < NUM_KEYS; i++) {
+        chip8->keyboard[i] = (keys >> i) & 1;
+    }
+    memcpy(chip8->V, buf + 20, NUM_V_REGISTERS);
+    for (int i = 0; i < STACK_SIZE; i++) {
+        chip8->stack[i] = get_u16(buf + 36 + i * 2);
+    }
+    for (int i = 0; i < 4; i++) {
+        chip8->rng_state[i] = get_u32(buf + 68 + i * 4);
+    }
+    chip8->rng_seed = get_u64(buf + 84);
+    chip8->cycle_count = get_u64(buf + 92);
+    chip8_set_quirks(chip8, buf[100] % QUIRK_PROFILE_COUNT);
+    chip8->hires = buf[101] ? TRUE : FALSE;
+    chip8->planes = buf[102] & ((1 << SCREEN_PLANES) - 1);
+    chip8->audio_pitch = buf[103];
+    memcpy(chip8->rpl, buf + 104, NUM_RPL_FLAGS);
+    memcpy(chip8->audio_pattern, buf + 120, AUDIO_PATTERN_SIZE);
+    uint64_t* screen = &chip8->screen[0][0][0];
+    for (int i = 0; i < CHIP8_STATE_SCREEN_WORDS; i++) {
+        screen[i] = get_u64(buf + CHIP8_STATE_SCREEN_OFFSET + i * 8);
+    }
+    screen_mark_all_dirty(chip8);
+}
+
+/*
+Restores chip8 from a record written by chip8_save_state (buf may point into an
+mmap'ed snapshot file), switching it to the record's machine. Returns FALSE,
+leaving chip8 untouched, if buf does not hold a whole record of this version.
+*/
+int chip8_load_state(Chip8* chip8, const uint8_t* buf, size_t size) {
+    size_t state_size = chip8_state_record_size(buf, size);
+    if (state_size == 0 || size < state_size) {
+        return FALSE;
+    }
+
+    chip8_load_regs(chip8, buf);
+
+    // all of ram changed: compiled blocks are stale (and sized for the old
+    // machine), pages the record leaves unchanged stay shared, pages past the
+    // machine's ram go back to zero
+    if (chip8->jit != NULL) {
+        chip8_jit_flush(chip8);
+    }
+    uint32_t ram_size = (uint32_t)(state_size - CHIP8_STATE_RAM_OFFSET);
+    chip8_load_ram(chip8, 0, buf + CHIP8_STATE_RAM_OFFSET, ram_size);
+    if (ram_size < TOTAL_RAM) {
+        chip8_load_ram(chip8, (uint16_t)ram_size, NULL, TOTAL_RAM - ram_size);
+    }
+    return TRUE;
+}
+
+/*
+Appends the state of chip8 to a snapshot file. Returns FALSE on failure, or if
+the file holds records of another machine.
+*/
+int chip8_append_state_file(const Chip8* chip8, const char* path) {
+    uint8_t header[CHIP8_STATE_RAM_OFFSET];
+    size_t state_size = chip8_state_size(chip8);
+    uint8_t* record = malloc(state_size);
+    if (record == NULL) {
+        return FALSE;
+    }
+    FILE* file = fopen(path, "ab+");
+    if (file == NULL) {
+        free(record);
+        return FALSE;
+    }
+
+    // records of one size only, or the file can't be indexed
+    chip8_save_state(chip8, record, state_size);
+    size_t have = fread(header, 1, sizeof(header), file);
+    int failed = have > 0 && chip8_state_record_size(header, have) != state_size;
+    if (!failed) {
+        failed = fwrite(record, 1, state_size, file) != state_size;
+    }
+    failed |= fclose(file) != 0;
+    free(record);
+    return !failed;
+}
+
+// A snapshot file mapped read-only into memory
+typedef struct {
+    const uint8_t* data;
+    size_t size;
+    size_t record_size;              // of the first record, which all of them share
+} Chip8_SnapshotFile;
+
+void chip8_snapshot_unmap(Chip8_SnapshotFile* file) {
+    munmap((void*)file->data, file->size);
+    file->data = NULL;
+    file->size = 0;
+}
+
+/*
+Maps a snapshot file. Returns FALSE if it can't be opened or doesn't start with
+a record.
+*/
+int chip8_snapshot_map(Chip8_SnapshotFile* file, const char* path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return FALSE;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < CHIP8_STATE_RAM_OFFSET) {
+        close(fd);
+        return FALSE;
+    }
+
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return FALSE;
+    }
+    file->data = data;
+    file->size = st.st_size;
+    file->record_size = chip8_state_record_size(file->data, file->size);
+    if (file->record_size == 0 || file->size < file->record_size) {
+        chip8_snapshot_unmap(file);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+size_t chip8_snapshot_count(const Chip8_SnapshotFile* file) {
+    return file->size / file->record_size;
+}
+
+/*
+Restores record i of a mapped snapshot file into chip8
+*/
+int chip8_snapshot_load(Chip8* chip8, const Chip8_SnapshotFile* file, size_t i) {
+    if (i >= chip8_snapshot_count(file)) {
+        return FALSE;
+    }
+    return chip8_load_state(chip8, file->data + i * file->record_size, file->record_size);
+}
+
+#endif
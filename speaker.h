@@ -0,0 +1,68 @@
+#ifndef SPEAKER_H
+#define SPEAKER_H
+
+#include <SDL.h>
+#include <stdint.h>
+#include <string.h>
+#include "chip8_def.h"
+#include "audio.h"
+
+/*
+SDL sound output. The device pulls samples on SDL's audio thread, rendering
+them from the frame ring (audio.h) the emulation thread pushes into; the
+callback never locks or waits, and the emulator never waits on it. A small
+device buffer keeps latency down: a buzzer change is heard within a frame plus
+SPEAKER_SAMPLES samples, under 20 ms at 48 kHz. In turbo the emulator runs
+ahead of the sound, whose frames then mostly go skipped.
+*/
+#define SPEAKER_SAMPLES 128              // device buffer, 2.7 ms at 48 kHz
+
+typedef struct {
+    SDL_AudioDeviceID device;            // 0 when closed
+    Chip8_AudioRing ring;                // point the Chip8's audio at ring.sink
+} Chip8_Speaker;
+
+static void speaker_callback(void* userdata, Uint8* stream, int len) {
+    Chip8_Speaker* speaker = userdata;
+    chip8_audio_ring_render(&speaker->ring, (int16_t*)stream, (uint32_t)len / sizeof(int16_t));
+}
+
+/*
+Opens the default output device and starts it playing from the ring. Returns
+FALSE, leaving the speaker closed, if there is no device to open.
+*/
+int speaker_open(Chip8_Speaker* speaker) {
+    SDL_AudioSpec want, have;
+    memset(&want, 0, sizeof(want));
+    want.freq = AUDIO_SAMPLE_RATE;
+    want.format = AUDIO_S16SYS;
+    want.channels = 1;
+    want.samples = SPEAKER_SAMPLES;
+    want.callback = speaker_callback;
+    want.userdata = speaker;
+
+    speaker->device = 0;
+    if (SDL_InitSubSystem(SDL_INIT_AUDIO) != 0) {
+        return FALSE;
+    }
+    // the device's own rate if it differs, the synth follows it
+    speaker->device = SDL_OpenAudioDevice(NULL, 0, &want, &have, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+    if (speaker->device == 0) {
+        SDL_QuitSubSystem(SDL_INIT_AUDIO);
+        return FALSE;
+    }
+    // opened paused, so the callback can't see the ring before it is set up
+    chip8_audio_ring_init(&speaker->ring, (uint32_t)have.freq);
+    SDL_PauseAudioDevice(speaker->device, 0);
+    return TRUE;
+}
+
+void speaker_close(Chip8_Speaker* speaker) {
+    if (speaker->device != 0) {
+        SDL_CloseAudioDevice(speaker->device);
+        SDL_QuitSubSystem(SDL_INIT_AUDIO);
+        speaker->device = 0;
+    }
+}
+
+#endif
@@ -0,0 +1,40 @@
+#!/bin/sh
+# ahead-of-time compiled code against the interpreter: the bundled roms and a
+# few random ones are compiled with chip8-aot into chip8-batch, and every
+# instance must end in the same state, at the same cycle, as without --aot
+AOT=${AOT:-./chip8-aot}
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--std=c11 -D_POSIX_C_SOURCE=200809L -O2 -pthread}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+# random roms, the same every run: they mostly halt early, on a bad opcode,
+# a ret with nothing to return to or a call with the stack full
+for seed in 1 2 3 4 5 6 7 8; do
+    LC_ALL=C awk -v seed=$seed 'BEGIN { srand(seed); for (i = 0; i < 512; i++) printf "%c", int(rand() * 256) }' \
+        > "$TMP/random$seed.ch8"
+done
+# and one that is sure to: a call into itself that counts in V0 until the
+# stack overflows, which must stop it before another block runs
+printf '\160\001\042\000' > "$TMP/recurse.ch8"
+ROMS="$(ls roms/*.ch8) $(ls "$TMP"/*.ch8)"
+
+fail=0
+if ! $AOT -o "$TMP/aot_roms.h" $ROMS > /dev/null 2>&1 ||
+   ! $CC $CFLAGS -I. -DCHIP8_AOT_FILE="\"$TMP/aot_roms.h\"" chip8_batch.c -o "$TMP/chip8-batch-aot"; then
+    echo "FAIL couldn't build chip8-batch with the roms compiled in"
+    exit 1
+fi
+
+for mode in "" "--ipf 1000"; do
+    "$TMP/chip8-batch-aot" $mode --seeds 3 --cycles 200000 $ROMS 2>/dev/null | sort > "$TMP/plain"
+    "$TMP/chip8-batch-aot" $mode --aot --seeds 3 --cycles 200000 $ROMS 2>/dev/null | sort > "$TMP/aot"
+    if [ ! -s "$TMP/plain" ] || ! diff "$TMP/plain" "$TMP/aot" > "$TMP/diff"; then
+        echo "FAIL ($mode) --aot differs from the interpreter:"
+        cat "$TMP/diff"
+        fail=1
+    fi
+done
+
+[ $fail -eq 0 ] && echo "aot_test: ok"
+exit $fail
@@ -0,0 +1,48 @@
+#!/bin/sh
+# ret and call at the stack's bounds, run through chip8-batch in every engine:
+# underflow and overflow halt the instance, nesting within bounds keeps running
+BATCH=${BATCH:-./chip8-batch}
+AOT=${AOT:-./chip8-aot}
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--std=c11 -D_POSIX_C_SOURCE=200809L -O2 -pthread}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+printf '\000\356' > "$TMP/ret.ch8"                 # 00EE: ret on an empty stack
+printf '\042\000' > "$TMP/call.ch8"                # 2200: calls itself until the stack is full
+printf '\042\004\022\000\000\356' > "$TMP/nest.ch8" # 2204 1200 00EE: call and ret forever
+
+fail=0
+# --aot runs a chip8-batch with the three roms compiled in
+if ! $AOT -o "$TMP/aot_roms.h" "$TMP/ret.ch8" "$TMP/call.ch8" "$TMP/nest.ch8" > /dev/null 2>&1 ||
+   ! $CC $CFLAGS -I. -DCHIP8_AOT_FILE="\"$TMP/aot_roms.h\"" chip8_batch.c -o "$TMP/chip8-batch-aot"; then
+    echo "FAIL couldn't build chip8-batch with the roms compiled in"
+    exit 1
+fi
+
+expect() {
+    # expect ROM CYCLES HALTED: the line chip8-batch prints for ROM has them
+    line=$(grep "^$TMP/$1 " "$TMP/out")
+    case "$line" in
+        *" cycles=$2 halted=$3 "*) ;;
+        *) echo "FAIL ($mode) $1: wanted cycles=$2 halted=$3, got: $line"; fail=1 ;;
+    esac
+}
+
+for mode in "" "--jit" "--lockstep 4" "--aot"; do
+    batch=$BATCH
+    [ "$mode" = "--aot" ] && batch=$TMP/chip8-batch-aot
+    status=0
+    $batch $mode --seeds 4 --cycles 1000 "$TMP/ret.ch8" "$TMP/call.ch8" "$TMP/nest.ch8" > "$TMP/out" 2>/dev/null || status=$?
+    if [ $status -ne 0 ]; then
+        echo "FAIL ($mode) chip8-batch exited with status $status"
+        fail=1
+        continue
+    fi
+    expect ret.ch8 1 1
+    expect call.ch8 17 1
+    expect nest.ch8 1000 0
+done
+
+[ $fail -eq 0 ] && echo "stack_test: ok"
+exit $fail
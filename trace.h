@@ -0,0 +1,815 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include "chip8_def.h"
+#include "decode.h"
+
+/*
+Execution trace, compiled in only with CHIP8_TRACE (make TRACE=1). Without it
+the CHIP8_TRACE_* hooks expand to nothing and Chip8 has no trace field, so
+nothing about a normal build changes.
+
+With it, every instruction the interpreter runs is appended to a
+per-instance ring buffer as it starts, along with what the one before it
+changed: the registers below and every byte it stored. The block compiler and
+compiled rom code record each block they enter and every store, but look at
+the registers only where a run ends or the interpreter takes over: looking
+after every block would cost more than most blocks take to run, and tracing
+has to keep every engine at over half its untraced speed (make bench-trace
+checks, with idle loops run rather than skipped). A writer thread drains the
+ring into the file, taking what was recorded whenever a run pauses; the
+emulation thread only waits for it when the ring is full. chip8-trace prints a
+trace file or diffs two of them (chip8_trace.c).
+
+File layout, little-endian: a TRACE_HEADER_SIZE header
+    0      magic "C8TR"
+    4      u16 version
+    6      u8 quirk profile, u8 unused
+    8      u64 cycle of the first instruction
+    16     u8 V[16], u16 I, u8 sp, u8 delay timer, u8 sound timer, u8 unused[3]
+then records, each a tag byte and its operands. An instruction is its
+TRACE_OP / TRACE_OP_NEXT followed by the TRACE_MEM of its stores and the
+TRACE_V / TRACE_REG of the registers it left changed. A compiled block is its
+TRACE_BLOCK, with its opcodes, followed by the stores of its instructions and
+any registers looked at after it; once the trace has shown a block, it comes
+back as one of the shorter TRACE_BLOCK_AGAIN / _NEXT / _SKIP, its opcodes taken
+from ram as the trace last showed it (the blocks and stores before). A block
+looping on itself, or two on each other, with nothing else recorded, is one
+TRACE_BLOCK_LOOP however long it runs.
+The cycle of an instruction is the one before it plus one, plus the
+TRACE_IDLE in between; TRACE_SYNC / TRACE_RUN mark state that changed between
+runs (timers ticking, keys, a restore), the registers after it being those
+changes.
+
+The interpreter and the block compiler skip idle loops (idle.h) from
+different points, so their traces of the same run only line up step for step
+built with CHIP8_NO_IDLE_SKIP, and their registers only where both looked at
+them. Lockstep lanes are not traced.
+*/
+#define TRACE_MAGIC "C8TR"
+#define TRACE_VERSION 3
+#define TRACE_HEADER_SIZE 40
+#define TRACE_PATH "chip8-trace.c8t"      // where frontends write the trace
+
+#define TRACE_OP      0x01                // u16 pc, u16 opcode
+#define TRACE_OP_NEXT 0x02                // u16 opcode, at the previous instruction's pc + 2
+#define TRACE_REG     0x03                // u8 register, u16 value
+#define TRACE_MEM     0x04                // u16 addr, u8 value
+#define TRACE_IDLE    0x05                // idle loop iterations skipped, 7 bits a byte, low first, high bit = more
+#define TRACE_SYNC    0x06                // u64 cycle
+#define TRACE_BLOCK   0x07                // u16 pc, u8 count, count opcodes as in ram (big-endian)
+#define TRACE_BLOCK_AGAIN 0x08            // u16 pc, the block last shown there by a TRACE_BLOCK
+#define TRACE_BLOCK_NEXT  0x09            // TRACE_BLOCK_AGAIN at the previous instruction's pc + 2
+#define TRACE_BLOCK_SKIP  0x0A            // TRACE_BLOCK_AGAIN at the previous instruction's pc + 4
+#define TRACE_RUN     0x0B                // TRACE_SYNC at the cycle the trace is at
+#define TRACE_BLOCK_LOOP  0x0C            // u8 k, n as TRACE_IDLE's: the last k blocks (1 or 2) again, n blocks in a row
+#define TRACE_V       0x10                // 0x10-0x1F: u8 value of V0-VF
+
+// Registers of TRACE_REG records, past V0-VF
+#define TRACE_REG_I  16
+#define TRACE_REG_SP 17
+#define TRACE_REG_DT 18
+#define TRACE_REG_ST 19
+#define TRACE_NUM_REGS 20
+
+#ifdef CHIP8_TRACE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#define TRACE_RING_SIZE (1u << 22)        // bytes, a power of two
+#define TRACE_OP_RESERVE 384               // most one record adds with what comes after it: sync and 20 registers,
+                                           // a block of JIT_MAX_BLOCK_LEN opcodes, 16 stores
+#define TRACE_WRITER_WAIT_NS 1000000       // longest the writer sleeps with nothing to take
+#define TRACE_NO_LOOP 0xFFFFFFFFu          // Chip8_Trace.loop with no TRACE_BLOCK_LOOP open
+
+// The per-instruction path goes inline into every dispatch site, past the
+// compiler's size limits: a call there costs as much as the recording. What
+// only happens once a run or so stays out of line, or it would weigh down
+// every one of them.
+#if defined(__GNUC__)
+#define TRACE_INLINE static inline __attribute__((always_inline))
+#define TRACE_OUTLINE static __attribute__((noinline))
+#else
+#define TRACE_INLINE static inline
+#define TRACE_OUTLINE static
+#endif
+
+struct Chip8_Trace_t {
+    uint8_t* ring;                         // TRACE_RING_SIZE bytes and TRACE_OP_RESERVE of overrun
+    uint64_t head;                         // bytes written, the emulation thread's
+    uint64_t flushed_seen;                 // last value of flushed it read
+    uint64_t head_limit;                   // flushed_seen + TRACE_RING_SIZE - TRACE_OP_RESERVE, past it records wait
+    _Atomic uint64_t published;            // bytes the writer may take
+    _Atomic uint64_t flushed;              // bytes the writer took
+    _Atomic uint8_t stop;
+    pthread_mutex_t lock;                  // for the two below, the only waits either thread does
+    pthread_cond_t wake;                   // writer's: there is plenty to take, or stop
+    pthread_cond_t drained;                // emulation thread's, when the ring is full: the writer took some
+    FILE* file;
+    pthread_t writer;
+    uint8_t write_failed;                  // the writer's, read after joining it
+
+    // state the last traced instruction is compared against
+    uint8_t V[NUM_V_REGISTERS];
+    uint16_t I;
+    uint16_t sp;
+    uint8_t dt;
+    uint8_t st;
+    uint8_t running;                       // an instruction was traced since the last pause
+    uint16_t last_pc;
+    uint32_t blocks[2];                    // trace_block_key of the last two blocks recorded, the last first
+    uint64_t pure_blocks;                  // block records in a row, with nothing recorded between or after them
+    uint32_t loop;                         // key of the block an open TRACE_BLOCK_LOOP expects next, or TRACE_NO_LOOP
+    uint32_t loop_blocks[2];               // the blocks it cycles through, from the one that opened it
+    uint32_t loop_flip;                    // their keys xored, loop flips between them: 0 for one block
+    uint8_t loop_mask;                     // blocks in the cycle - 1
+    uint64_t loop_runs;                    // blocks run since it opened, its count once closed
+    uint8_t last_x;                        // x of the last instruction
+    uint8_t look;                          // TRACE_LOOK_ of what the next record closes
+    uint8_t after_block;                   // the last record was a block's, in this run and with no idle loop since
+    uint64_t idle;                         // idle loop iterations skipped since the last record, not yet written
+    uint64_t cycle;                        // cycle of the next instruction
+    uint8_t shown[TOTAL_RAM];              // count of the block whose opcodes were last recorded at each pc, 0 = none
+};
+
+/*
+Records are written through a local cursor from ring + head, straight on past
+the end of the ring into its overrun, and trace_commit wraps what went past
+round to the start. Keep ring, head and whatever else is needed in locals read
+before the first record byte: every byte stored may alias them, and they would
+otherwise be loaded again after each one.
+*/
+static inline uint8_t* trace_out(uint8_t* ring, uint64_t head) {
+    return ring + (head & (TRACE_RING_SIZE - 1));
+}
+
+static inline void trace_commit(Chip8_Trace* t, uint8_t* ring, uint64_t head, const uint8_t* out) {
+    size_t end = (size_t)(out - ring);
+    if (end > TRACE_RING_SIZE) {
+        memcpy(ring, ring + TRACE_RING_SIZE, end - TRACE_RING_SIZE);
+    }
+    t->head = head + (end - (head & (TRACE_RING_SIZE - 1)));
+}
+
+static inline uint8_t* trace_put16(uint8_t* out, uint16_t v) {
+    out[0] = v & 0xFF;
+    out[1] = v >> 8;
+    return out + 2;
+}
+
+static inline uint8_t* trace_put64(uint8_t* out, uint64_t v) {
+    for (int i = 0; i < 8; i++) {
+        out[i] = (v >> (8 * i)) & 0xFF;
+    }
+    return out + 8;
+}
+
+static inline uint8_t* trace_put_varint(uint8_t* out, uint64_t v) {
+    while (v >= 0x80) {
+        *out++ = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    *out++ = (uint8_t)v;
+    return out;
+}
+
+static inline uint8_t* trace_v(uint8_t* out, uint8_t x, uint8_t value) {
+    out[0] = TRACE_V + x;
+    out[1] = value;
+    return out + 2;
+}
+
+static inline uint8_t* trace_reg(uint8_t* out, uint8_t reg, uint16_t value) {
+    out[0] = TRACE_REG;
+    out[1] = reg;
+    return trace_put16(out + 2, value);
+}
+
+/*
+Records the registers past V that differ from the last look and takes them as the new state
+*/
+TRACE_OUTLINE uint8_t* trace_other_regs(Chip8_Trace* t, const Chip8* chip8, uint8_t* out) {
+    if (t->I != chip8->I_reg) {
+        out = trace_reg(out, TRACE_REG_I, chip8->I_reg);
+        t->I = chip8->I_reg;
+    }
+    if (t->sp != chip8->sp_reg) {
+        out = trace_reg(out, TRACE_REG_SP, chip8->sp_reg);
+        t->sp = chip8->sp_reg;
+    }
+    if (t->dt != chip8->delay_timer) {
+        out = trace_reg(out, TRACE_REG_DT, chip8->delay_timer);
+        t->dt = chip8->delay_timer;
+    }
+    if (t->st != chip8->sound_timer) {
+        out = trace_reg(out, TRACE_REG_ST, chip8->sound_timer);
+        t->st = chip8->sound_timer;
+    }
+    return out;
+}
+
+/*
+Records every register that differs from the last look and takes them as the
+new state. V is compared eight registers at a time, visiting only the ones
+that differ: after a block, a branch per register would cost more than the
+block ran.
+*/
+TRACE_INLINE uint8_t* trace_regs(Chip8_Trace* t, const Chip8* chip8, uint8_t* out) {
+    for (int h = 0; h < NUM_V_REGISTERS; h += 8) {
+        uint64_t before, after;
+        memcpy(&before, t->V + h, 8);
+        memcpy(&after, chip8->V + h, 8);
+        uint64_t changed = before ^ after;
+        if (changed == 0) {
+            continue;
+        }
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        do {
+            int i = __builtin_ctzll(changed) >> 3;
+            out = trace_v(out, h + i, chip8->V[h + i]);
+            changed &= ~(0xFFull << (i * 8));
+        } while (changed != 0);
+#else
+        for (int i = h; i < h + 8; i++) {
+            if (t->V[i] != chip8->V[i]) {
+                out = trace_v(out, i, chip8->V[i]);
+            }
+        }
+#endif
+        memcpy(t->V + h, &after, 8);
+    }
+    if (t->I != chip8->I_reg || t->sp != chip8->sp_reg || t->dt != chip8->delay_timer ||
+        t->st != chip8->sound_timer) {
+        out = trace_other_regs(t, chip8, out);
+    }
+    return out;
+}
+
+// What an instruction can write, so what is compared after it
+enum {
+    TRACE_LOOK_X,                          // Vx and VF
+    TRACE_LOOK_OTHER,                      // those, I, sp and the timers
+    TRACE_LOOK_ALL                         // every register: a block ran, a range of V was loaded, a run
+                                           // starts or an idle loop was skipped
+};
+
+static const uint8_t TRACE_LOOK[OP_COUNT] = {
+    [OP_INVALID] = TRACE_LOOK_OTHER,
+    [OP_RET] = TRACE_LOOK_OTHER,
+    [OP_CALL_ADDR] = TRACE_LOOK_OTHER,
+    [OP_LD_I_ADDR] = TRACE_LOOK_OTHER,
+    [OP_LD_DT_VX] = TRACE_LOOK_OTHER,
+    [OP_LD_ST_VX] = TRACE_LOOK_OTHER,
+    [OP_ADD_I_VX] = TRACE_LOOK_OTHER,
+    [OP_LD_F_VX] = TRACE_LOOK_OTHER,
+    [OP_ST_V_REGS] = TRACE_LOOK_OTHER,     // I moves past the registers with some quirks
+    [OP_LD_V_REGS] = TRACE_LOOK_ALL,
+    [OP_EXIT] = TRACE_LOOK_OTHER,
+    [OP_LD_HF_VX] = TRACE_LOOK_OTHER,
+    [OP_LD_VX_R] = TRACE_LOOK_ALL,
+    [OP_LD_V_RANGE] = TRACE_LOOK_ALL,
+    [OP_LD_I_LONG] = TRACE_LOOK_OTHER,
+};
+
+/*
+trace_regs for what the last instruction can have changed, by TRACE_LOOK
+short of TRACE_LOOK_ALL: most write only Vx and VF, which keeps the
+per-instruction cost down to a few loads. Anything else a handler wrongly
+writes still shows up, at the latest when the run pauses.
+*/
+TRACE_INLINE uint8_t* trace_written_regs(Chip8_Trace* t, const Chip8* chip8, uint8_t* out, uint8_t look) {
+    uint8_t x = t->last_x;
+    if (t->V[x] != chip8->V[x]) {
+        out = trace_v(out, x, chip8->V[x]);
+        t->V[x] = chip8->V[x];
+    }
+    if (t->V[0xF] != chip8->V[0xF]) {
+        out = trace_v(out, 0xF, chip8->V[0xF]);
+        t->V[0xF] = chip8->V[0xF];
+    }
+    if (look == TRACE_LOOK_OTHER && (t->I != chip8->I_reg || t->sp != chip8->sp_reg ||
+                                     t->dt != chip8->delay_timer || t->st != chip8->sound_timer)) {
+        out = trace_other_regs(t, chip8, out);
+    }
+    return out;
+}
+
+static inline int trace_regs_changed(const Chip8_Trace* t, const Chip8* chip8) {
+    uint64_t before[2], after[2];
+    memcpy(before, t->V, NUM_V_REGISTERS);
+    memcpy(after, chip8->V, NUM_V_REGISTERS);
+    return ((before[0] ^ after[0]) | (before[1] ^ after[1])) != 0 || t->I != chip8->I_reg ||
+           t->sp != chip8->sp_reg || t->dt != chip8->delay_timer || t->st != chip8->sound_timer;
+}
+
+static inline int trace_has_room(Chip8_Trace* t) {
+    t->flushed_seen = atomic_load_explicit(&t->flushed, memory_order_acquire);
+    t->head_limit = t->flushed_seen + TRACE_RING_SIZE - TRACE_OP_RESERVE;
+    return t->head <= t->head_limit;
+}
+
+static inline uint32_t trace_block_key(uint16_t pc, uint8_t count) {
+    return pc | (uint32_t)count << 16;
+}
+
+/*
+Ends an open TRACE_BLOCK_LOOP with its count of blocks, before anything else
+is recorded or the writer is given it, and catches up on the blocks it ran
+*/
+TRACE_OUTLINE void trace_end_loop(Chip8_Trace* t) {
+    uint8_t* ring = t->ring;
+    uint64_t head = t->head;
+    uint64_t runs = t->loop_runs;
+    uint8_t mask = t->loop_mask;
+    trace_commit(t, ring, head, trace_put_varint(trace_out(ring, head), runs));
+
+    // the first block runs every other time round a cycle of two, the second the rest
+    uint32_t first = t->loop_blocks[0], second = t->loop_blocks[1];
+    t->cycle += (first >> 16) * ((runs + mask) >> mask) + (mask ? (second >> 16) * (runs >> 1) : 0);
+    uint32_t last = t->loop_blocks[(runs - 1) & mask];
+    t->blocks[1] = t->loop_blocks[(runs - 2) & mask];
+    t->blocks[0] = last;
+    t->last_pc = (uint16_t)(last + ((last >> 16) - 1) * 2);
+    t->pure_blocks += runs;
+    t->loop = TRACE_NO_LOOP;
+    t->head_limit = t->flushed_seen + TRACE_RING_SIZE - TRACE_OP_RESERVE;
+}
+
+static inline void trace_close_loop(Chip8_Trace* t) {
+    if (t->loop != TRACE_NO_LOOP) {
+        trace_end_loop(t);
+    }
+}
+
+/*
+Waits on the writer until there is room for one record. It sleeps rather
+than spins, so that with a single core the writer gets to run.
+*/
+TRACE_OUTLINE void trace_wait(Chip8_Trace* t) {
+    trace_close_loop(t);
+    atomic_store_explicit(&t->published, t->head, memory_order_release);
+    if (trace_has_room(t)) {
+        return;
+    }
+    pthread_mutex_lock(&t->lock);
+    pthread_cond_signal(&t->wake);
+    while (!trace_has_room(t)) {
+        pthread_cond_wait(&t->drained, &t->lock);
+    }
+    pthread_mutex_unlock(&t->lock);
+}
+
+/*
+First record of a run: whatever changed since the last one, the cycle count
+included (timers ticking, keys, a restore)
+*/
+TRACE_INLINE uint8_t* trace_run_changes(Chip8_Trace* t, const Chip8* chip8, uint8_t* out) {
+    if (t->cycle != chip8->cycle_count) {
+        out[0] = TRACE_SYNC;
+        out = trace_put64(out + 1, chip8->cycle_count);
+        out = trace_regs(t, chip8, out);
+        t->cycle = chip8->cycle_count;
+    } else if (trace_regs_changed(t, chip8)) {
+        *out++ = TRACE_RUN;
+        out = trace_regs(t, chip8, out);
+    }
+    t->running = TRUE;
+    return out;
+}
+
+/*
+Makes room for one instruction's records, waiting on the writer if it must.
+An open TRACE_BLOCK_LOOP drops head_limit, so the next record closes it here.
+*/
+static inline void trace_reserve(Chip8_Trace* t) {
+    if (t->head > t->head_limit) {
+        trace_wait(t);
+    }
+}
+
+/*
+The idle loop iterations skipped since the last record
+*/
+TRACE_INLINE uint8_t* trace_idle_count(Chip8_Trace* t, uint8_t* out) {
+    out[0] = TRACE_IDLE;
+    out = trace_put_varint(out + 1, t->idle);
+    t->cycle += t->idle;
+    t->idle = 0;
+    return out;
+}
+
+/*
+trace_begin's TRACE_LOOK_ALL: every register, or if a run just started, whatever
+changed since the last, then any idle loop skipped since (which changes no
+register)
+*/
+TRACE_OUTLINE uint8_t* trace_begin_all(Chip8_Trace* t, const Chip8* chip8, uint8_t* out) {
+    out = t->running ? trace_regs(t, chip8, out) : trace_run_changes(t, chip8, out);
+    if (t->idle != 0) {
+        out = trace_idle_count(t, out);
+    }
+    return out;
+}
+
+/*
+Closes the previous instruction before something new is recorded at out,
+with what t->look says it needs. Returns where to write next.
+*/
+TRACE_INLINE uint8_t* trace_begin(Chip8_Trace* t, const Chip8* chip8, uint8_t* out) {
+    uint8_t look = t->look;
+    if (look == TRACE_LOOK_ALL) {
+        return trace_begin_all(t, chip8, out);
+    }
+    return trace_written_regs(t, chip8, out, look);
+}
+
+/*
+Called before instr runs at pc_reg
+*/
+TRACE_INLINE void chip8_trace_op(Chip8* chip8, Chip8_Instr instr) {
+    Chip8_Trace* t = chip8->trace;
+    if (t == NULL) {
+        return;
+    }
+    trace_reserve(t);
+    uint8_t* ring = t->ring;
+    uint64_t head = t->head;
+    uint16_t pc = chip8->pc_reg & chip8->ram_mask;
+    uint16_t last_pc = t->last_pc;
+
+    uint8_t* out = trace_begin(t, chip8, trace_out(ring, head));
+    if (pc == (uint16_t)(last_pc + 2)) {
+        *out++ = TRACE_OP_NEXT;
+    } else {
+        out[0] = TRACE_OP;
+        out = trace_put16(out + 1, pc);
+    }
+    out = trace_put16(out, instr.opcode);
+    trace_commit(t, ring, head, out);
+    t->last_pc = pc;
+    t->last_x = instr.x;
+    t->look = TRACE_LOOK[instr.id];
+    t->after_block = FALSE;
+    t->cycle++;
+}
+
+/*
+A block's first record: its opcodes, copied from ram, which a live block still
+matches. Blocks never run past the end of ram, but may cross a page.
+*/
+TRACE_INLINE uint8_t* trace_block_opcodes(Chip8_Trace* t, const Chip8* chip8, uint8_t* out, uint16_t pc,
+                                          uint8_t count) {
+    out[0] = TRACE_BLOCK;
+    out = trace_put16(out + 1, pc);
+    *out++ = count;
+    Chip8_RamPage* const* pages = chip8->ram;
+    for (uint32_t addr = pc, end = pc + count * 2u; addr < end; addr++) {
+        *out++ = pages[addr / RAM_PAGE_SIZE]->bytes[addr % RAM_PAGE_SIZE];
+    }
+    t->shown[pc] = count;
+    return out;
+}
+
+/*
+The record of a block the trace has shown: a byte where it follows on from the
+last instruction or skips it
+*/
+TRACE_INLINE uint8_t* trace_block_again(const Chip8_Trace* t, uint8_t* out, uint16_t pc) {
+    uint16_t last_pc = t->last_pc;
+    if (pc == (uint16_t)(last_pc + 2)) {
+        *out++ = TRACE_BLOCK_NEXT;
+    } else if (pc == (uint16_t)(last_pc + 4)) {
+        *out++ = TRACE_BLOCK_SKIP;
+    } else {
+        out[0] = TRACE_BLOCK_AGAIN;
+        out = trace_put16(out + 1, pc);
+    }
+    return out;
+}
+
+/*
+chip8_trace_block for all but a shown block right after another, out of line:
+the first block of a run, or after an instruction or an idle loop, a block not
+shown yet, and waiting on the writer. The start of a run and the idle loop
+before it are inline here, a halted rom goes through both every frame.
+*/
+TRACE_OUTLINE void trace_block_slow(Chip8* chip8, uint16_t pc, uint8_t count) {
+    Chip8_Trace* t = chip8->trace;
+    trace_reserve(t);
+    uint8_t* ring = t->ring;
+    uint64_t head = t->head;
+
+    uint8_t* out = trace_out(ring, head);
+    if (!t->after_block) {
+        out = trace_begin(t, chip8, out);
+        t->pure_blocks = 0;
+    }
+    if (t->shown[pc] == count) {
+        out = trace_block_again(t, out, pc);
+    } else {
+        out = trace_block_opcodes(t, chip8, out, pc, count);
+    }
+    trace_commit(t, ring, head, out);
+    t->last_pc = pc + (count - 1) * 2;
+    t->blocks[1] = t->blocks[0];
+    t->blocks[0] = trace_block_key(pc, count);
+    t->pure_blocks++;
+    t->look = TRACE_LOOK_ALL;
+    t->after_block = TRUE;
+    t->cycle += count;
+}
+
+/*
+Called before the count instructions of a compiled block starting at pc run.
+One record covers them all, with their stores after it. The registers are
+looked at where the run ends or the interpreter takes over, not after every
+block, which would cost more than most blocks take to run. The opcodes go in
+the first time only: every store since is in the trace, so until ram is loaded
+from outside, the reader's copy still matches. Inline is only what a block
+following another needs, which is most of them. A block running again
+straight after itself, or after the one it ran before, with only the two
+recorded since, opens a TRACE_BLOCK_LOOP that just counts blocks until
+anything else is recorded: a wait loop's two or three instructions run faster
+than any record can be written.
+*/
+TRACE_INLINE void chip8_trace_block(Chip8* chip8, uint16_t pc, uint8_t count) {
+    Chip8_Trace* t = chip8->trace;
+    if (t == NULL) {
+        return;
+    }
+    uint32_t key = trace_block_key(pc, count);
+    if (key == t->loop) {
+        t->loop ^= t->loop_flip;
+        t->loop_runs++;
+        return;
+    }
+    uint64_t head = t->head;
+    if (!t->after_block || t->shown[pc] != count || head > t->head_limit) {
+        trace_block_slow(chip8, pc, count);
+        return;
+    }
+    uint8_t* ring = t->ring;
+    uint8_t* out = trace_out(ring, head);
+    uint32_t last = t->blocks[0];
+    uint64_t pure = t->pure_blocks;
+    if ((key == last && pure >= 1) || (key == t->blocks[1] && pure >= 2)) {
+        // closed, with the blocks it ran, by whatever is recorded next (trace_reserve)
+        uint8_t mask = (key == last) ? 0 : 1;
+        out[0] = TRACE_BLOCK_LOOP;
+        out[1] = mask + 1;
+        trace_commit(t, ring, head, out + 2);
+        t->loop_blocks[0] = key;
+        t->loop_blocks[1] = last;
+        t->loop_flip = key ^ last;
+        t->loop_mask = mask;
+        t->loop_runs = 1;
+        t->loop = last;
+        t->head_limit = 0;
+        return;
+    }
+    out = trace_block_again(t, out, pc);
+    trace_commit(t, ring, head, out);
+    t->last_pc = pc + (count - 1) * 2;
+    t->blocks[1] = last;
+    t->blocks[0] = key;
+    t->pure_blocks = pure + 1;
+    t->cycle += count;
+}
+
+/*
+count iterations of an idle loop at pc_reg were skipped instead of run. The
+instruction at pc_reg runs next, its record carries them.
+*/
+TRACE_INLINE void chip8_trace_idle(Chip8* chip8, uint64_t count) {
+    Chip8_Trace* t = chip8->trace;
+    if (t != NULL && count != 0) {
+        trace_close_loop(t);
+        t->idle += count;
+        t->look = TRACE_LOOK_ALL;
+        t->after_block = FALSE;
+    }
+}
+
+/*
+The running instruction stored value at addr (chip8_write_ram)
+*/
+static inline void chip8_trace_store(Chip8* chip8, uint16_t addr, uint8_t value) {
+    Chip8_Trace* t = chip8->trace;
+    if (t == NULL) {
+        return;
+    }
+    trace_close_loop(t);
+    t->pure_blocks = 0;
+    uint8_t* ring = t->ring;
+    uint64_t head = t->head;
+    uint8_t* out = trace_out(ring, head);
+    out[0] = TRACE_MEM;
+    out = trace_put16(out + 1, addr);
+    out[0] = value;
+    trace_commit(t, ring, head, out + 1);
+}
+
+/*
+Ram changed other than by a store of an instruction (a load, a rewind): the
+blocks recorded so far get their opcodes again
+*/
+static inline void chip8_trace_ram_loaded(Chip8* chip8) {
+    if (chip8->trace != NULL) {
+        trace_close_loop(chip8->trace);
+        memset(chip8->trace->shown, 0, sizeof(chip8->trace->shown));
+    }
+}
+
+/*
+End of a run: the last instruction's changes are recorded now, before anything
+outside the instruction stream (timers, keys) touches the registers
+*/
+static inline void chip8_trace_pause(Chip8* chip8) {
+    Chip8_Trace* t = chip8->trace;
+    if (t == NULL || !t->running) {
+        return;
+    }
+    trace_close_loop(t);
+    // usually nothing, a halted rom comes through here every frame
+    if (t->idle != 0 || trace_regs_changed(t, chip8)) {
+        uint8_t* ring = t->ring;
+        uint64_t head = t->head;
+        uint8_t* out = trace_regs(t, chip8, trace_out(ring, head));
+        if (t->idle != 0) {
+            out = trace_idle_count(t, out);
+        }
+        trace_commit(t, ring, head, out);
+    }
+    t->running = FALSE;
+    t->look = TRACE_LOOK_ALL;
+    t->after_block = FALSE;
+    atomic_store_explicit(&t->published, t->head, memory_order_release);
+
+    // past half full, the writer is woken instead of left to its next look
+    if (t->head - t->flushed_seen >= TRACE_RING_SIZE / 2 &&
+        t->head - atomic_load_explicit(&t->flushed, memory_order_relaxed) >= TRACE_RING_SIZE / 2) {
+        pthread_mutex_lock(&t->lock);
+        pthread_cond_signal(&t->wake);
+        pthread_mutex_unlock(&t->lock);
+    }
+}
+
+#define CHIP8_TRACE_OP(chip8, instr) chip8_trace_op(chip8, instr)
+#define CHIP8_TRACE_BLOCK(chip8, pc, count) chip8_trace_block(chip8, pc, count)
+#define CHIP8_TRACE_IDLE(chip8, count) chip8_trace_idle(chip8, count)
+#define CHIP8_TRACE_STORE(chip8, addr, value) chip8_trace_store(chip8, addr, value)
+#define CHIP8_TRACE_PAUSE(chip8) chip8_trace_pause(chip8)
+#define CHIP8_TRACE_RAM_LOADED(chip8) chip8_trace_ram_loaded(chip8)
+
+static void* trace_writer(void* arg) {
+    Chip8_Trace* t = arg;
+    uint64_t flushed = 0;
+
+    for (;;) {
+        uint8_t stop = atomic_load_explicit(&t->stop, memory_order_acquire);
+        uint64_t published = atomic_load_explicit(&t->published, memory_order_acquire);
+        if (published == flushed) {
+            if (stop) {
+                break;
+            }
+            // woken early by a full or half full ring, or stop; looked at again either way
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_nsec += TRACE_WRITER_WAIT_NS;
+            if (until.tv_nsec >= 1000000000) {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000;
+            }
+            pthread_mutex_lock(&t->lock);
+            if (atomic_load_explicit(&t->published, memory_order_acquire) == flushed &&
+                !atomic_load_explicit(&t->stop, memory_order_acquire)) {
+                pthread_cond_timedwait(&t->wake, &t->lock, &until);
+            }
+            pthread_mutex_unlock(&t->lock);
+            continue;
+        }
+        // up to the end of the ring, the rest next time round
+        size_t start = flushed & (TRACE_RING_SIZE - 1);
+        size_t len = published - flushed;
+        if (start + len > TRACE_RING_SIZE) {
+            len = TRACE_RING_SIZE - start;
+        }
+        if (fwrite(t->ring + start, 1, len, t->file) != len) {
+            t->write_failed = TRUE;
+        }
+        flushed += len;
+        atomic_store_explicit(&t->flushed, flushed, memory_order_release);
+        pthread_mutex_lock(&t->lock);
+        pthread_cond_signal(&t->drained);
+        pthread_mutex_unlock(&t->lock);
+    }
+    return NULL;
+}
+
+/*
+Starts tracing chip8 from its current state into the file at path. Returns
+FALSE if the file can't be created or the trace can't be allocated.
+*/
+int chip8_trace_enable(Chip8* chip8, const char* path) {
+    Chip8_Trace* t = calloc(1, sizeof(Chip8_Trace));
+    if (t == NULL) {
+        return FALSE;
+    }
+    t->ring = malloc(TRACE_RING_SIZE + TRACE_OP_RESERVE);
+    t->file = fopen(path, "wb");
+    if (t->ring == NULL || t->file == NULL) {
+        if (t->file != NULL) {
+            fclose(t->file);
+        }
+        free(t->ring);
+        free(t);
+        return FALSE;
+    }
+
+    memcpy(t->V, chip8->V, NUM_V_REGISTERS);
+    t->I = chip8->I_reg;
+    t->sp = chip8->sp_reg;
+    t->dt = chip8->delay_timer;
+    t->st = chip8->sound_timer;
+    t->cycle = chip8->cycle_count;
+    t->last_pc = chip8->pc_reg;        // so the first instruction gets its pc
+    t->head_limit = TRACE_RING_SIZE - TRACE_OP_RESERVE;
+    t->loop = TRACE_NO_LOOP;
+    t->look = TRACE_LOOK_ALL;
+
+    uint8_t header[TRACE_HEADER_SIZE] = {0};
+    memcpy(header, TRACE_MAGIC, 4);
+    header[4] = TRACE_VERSION & 0xFF;
+    header[5] = TRACE_VERSION >> 8;
+    header[6] = chip8->quirks;
+    for (int i = 0; i < 8; i++) {
+        header[8 + i] = (t->cycle >> (8 * i)) & 0xFF;
+    }
+    memcpy(header + 16, t->V, NUM_V_REGISTERS);
+    header[32] = t->I & 0xFF;
+    header[33] = t->I >> 8;
+    header[34] = (uint8_t)t->sp;
+    header[35] = t->dt;
+    header[36] = t->st;
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->wake, NULL);
+    pthread_cond_init(&t->drained, NULL);
+    if (fwrite(header, 1, sizeof(header), t->file) != sizeof(header) ||
+        pthread_create(&t->writer, NULL, trace_writer, t) != 0) {
+        pthread_cond_destroy(&t->drained);
+        pthread_cond_destroy(&t->wake);
+        pthread_mutex_destroy(&t->lock);
+        fclose(t->file);
+        free(t->ring);
+        free(t);
+        return FALSE;
+    }
+    chip8->trace = t;
+    return TRUE;
+}
+
+/*
+Stops tracing, waits for the writer to drain the ring and closes the file.
+Returns FALSE if any of the trace failed to be written.
+*/
+int chip8_trace_disable(Chip8* chip8) {
+    Chip8_Trace* t = chip8->trace;
+    if (t == NULL) {
+        return TRUE;
+    }
+    chip8_trace_pause(chip8);
+    pthread_mutex_lock(&t->lock);
+    atomic_store_explicit(&t->stop, TRUE, memory_order_release);
+    pthread_cond_signal(&t->wake);
+    pthread_mutex_unlock(&t->lock);
+    pthread_join(t->writer, NULL);
+
+    int ok = !t->write_failed;
+    ok = (fclose(t->file) == 0) && ok;
+    pthread_cond_destroy(&t->drained);
+    pthread_cond_destroy(&t->wake);
+    pthread_mutex_destroy(&t->lock);
+    free(t->ring);
+    free(t);
+    chip8->trace = NULL;
+    return ok;
+}
+
+#else
+
+#define CHIP8_TRACE_OP(chip8, instr) ((void)0)
+#define CHIP8_TRACE_BLOCK(chip8, pc, count) ((void)0)
+#define CHIP8_TRACE_IDLE(chip8, count) ((void)0)
+#define CHIP8_TRACE_STORE(chip8, addr, value) ((void)0)
+#define CHIP8_TRACE_PAUSE(chip8) ((void)0)
+#define CHIP8_TRACE_RAM_LOADED(chip8) ((void)0)
+
+#endif
+
+#endif